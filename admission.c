@@ -0,0 +1,253 @@
+/*
+ * admission.c - Global admission control and load shedding
+ *
+ * Only the accept loop calls admission_paused and admission_overloaded, so
+ * the memory sample is owned by that thread. The in-flight count is shared
+ * with every handler. While the accept loop is paused at the cap it polls
+ * an eventfd instead of its listeners, alongside the control signals, and
+ * a handler that ends writes to the eventfd. The queueing delay is an
+ * exponentially weighted moving average updated racily by the handlers,
+ * which is precise enough for a threshold.
+ */
+
+#include <sys/eventfd.h>
+#include "csapp.h"
+#include "diag.h"
+#include "stats.h"
+#include "budget.h"
+#include "admission.h"
+
+static int maxInflight = ADMISSION_MAX_INFLIGHT;
+static size_t maxMemory;
+static int inflight;
+static int paused;
+static int wakeFD = -1;
+static uint64_t queueDelay;
+static uint64_t queueDelayTime;
+static size_t residentMemory;
+static uint64_t residentTime;
+static uint64_t pauses;
+
+
+/* admission_setLimits
+
+DESCRIPTION
+Set the cap on requests in flight (0 keeps the default) and the resident
+memory limit in bytes (0 for none). Must be called before accepting.
+*/
+
+void admission_setLimits(int newMaxInflight, size_t newMaxMemory)
+{
+    if (newMaxInflight > 0)
+    {
+        maxInflight = newMaxInflight;
+    }
+    maxMemory = newMaxMemory;
+}
+
+/* admission_wakeFD
+
+DESCRIPTION
+The eventfd that becomes readable when a request ends while accept is
+paused. Created on first use, by the accept loop of each process.
+
+RETURN VALUE
+The descriptor, -1 if it cannot be created.
+*/
+
+int admission_wakeFD(void)
+{
+    int fd;
+
+    if (wakeFD == -1)
+    {
+        if ((fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+        {
+            DIAG_ERRNO(DIAG_LEVEL_ERROR, "eventfd");
+            return -1;
+        }
+        __atomic_store_n(&wakeFD, fd, __ATOMIC_RELEASE);
+    }
+    return wakeFD;
+}
+
+/* admission_paused
+
+DESCRIPTION
+Called by the accept loop before each wait: consume pending wakeups and
+decide whether to leave the listeners out of the wait because the
+in-flight cap is reached. The accept loop keeps servicing control signals
+while paused.
+
+RETURN VALUE
+1 while the cap is reached, 0 otherwise.
+*/
+
+int admission_paused(void)
+{
+    uint64_t count;
+
+    if (wakeFD != -1 && read(wakeFD, &count, sizeof(count)) == -1 && errno != EAGAIN)
+    {
+        DIAG_ERRNO(DIAG_LEVEL_WARN, "read eventfd");
+    }
+    if (__atomic_load_n(&inflight, __ATOMIC_ACQUIRE) < maxInflight)
+    {
+        __atomic_store_n(&paused, 0, __ATOMIC_RELAXED);
+        return 0;
+    }
+    if (!__atomic_load_n(&paused, __ATOMIC_RELAXED))
+    {
+        pauses++;
+        DIAG_NOTICE("%d requests in flight, accept paused", inflight);
+    }
+
+    /* announce the pause before the final check, so admission_leave cannot miss it */
+    __atomic_store_n(&paused, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&inflight, __ATOMIC_SEQ_CST) < maxInflight)
+    {
+        __atomic_store_n(&paused, 0, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1;
+}
+
+/* sampleMemory
+
+DESCRIPTION
+Refresh residentMemory from /proc/self/statm, at most every ADMISSION_MEMORY_POLL.
+*/
+
+static void sampleMemory(uint64_t now)
+{
+    unsigned long long size, resident;
+    FILE *statm;
+
+    if (now - residentTime < ADMISSION_MEMORY_POLL)
+    {
+        return;
+    }
+    residentTime = now;
+    if ((statm = fopen("/proc/self/statm", "r")) == NULL)
+    {
+        return;
+    }
+    if (fscanf(statm, "%llu %llu", &size, &resident) == 2)
+    {
+        __atomic_store_n(&residentMemory, (size_t)resident * sysconf(_SC_PAGESIZE), __ATOMIC_RELAXED);
+    }
+    fclose(statm);
+}
+
+/* admission_overloaded
+
+DESCRIPTION
+Whether a freshly accepted connection should be shed.
+
+RETURN VALUE
+1 if the buffer budget is exhausted, resident memory is over its limit or
+the smoothed queueing delay from a recent sample is over
+ADMISSION_QUEUE_DELAY, 0 otherwise.
+*/
+
+int admission_overloaded(void)
+{
+    uint64_t now = stats_now();
+
+    if (budget_pressure() == BUDGET_FULL)
+    {
+        return 1;
+    }
+
+    if (maxMemory != 0)
+    {
+        sampleMemory(now);
+        if (residentMemory > maxMemory)
+        {
+            return 1;
+        }
+    }
+    return now - __atomic_load_n(&queueDelayTime, __ATOMIC_RELAXED) < ADMISSION_DELAY_TTL
+        && __atomic_load_n(&queueDelay, __ATOMIC_RELAXED) > ADMISSION_QUEUE_DELAY;
+}
+
+/* admission_enter / admission_started / admission_leave
+
+DESCRIPTION
+Track a request from accept, through its handler starting, to its end.
+admission_started folds the time since acceptTime into the queueing delay
+(weight 1/8); admission_leave wakes the accept loop if it is paused.
+*/
+
+void admission_enter(void)
+{
+    __atomic_fetch_add(&inflight, 1, __ATOMIC_RELAXED);
+}
+
+void admission_started(uint64_t acceptTime)
+{
+    uint64_t now = stats_now();
+    uint64_t average = __atomic_load_n(&queueDelay, __ATOMIC_RELAXED);
+
+    average = average - average / 8 + (now - acceptTime) / 8;
+    __atomic_store_n(&queueDelay, average, __ATOMIC_RELAXED);
+    __atomic_store_n(&queueDelayTime, now, __ATOMIC_RELAXED);
+}
+
+void admission_leave(void)
+{
+    uint64_t one = 1;
+
+    __atomic_fetch_sub(&inflight, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&paused, __ATOMIC_SEQ_CST)
+            && write(__atomic_load_n(&wakeFD, __ATOMIC_ACQUIRE), &one, sizeof(one)) == -1)
+    {
+        DIAG_ERRNO(DIAG_LEVEL_WARN, "write eventfd");
+    }
+}
+
+int admission_inflight(void)
+{
+    return __atomic_load_n(&inflight, __ATOMIC_ACQUIRE);
+}
+
+/* admission_room
+
+RETURN VALUE
+How many more requests may be accepted before the in-flight cap, at least 1.
+*/
+
+int admission_room(void)
+{
+    int room = maxInflight - __atomic_load_n(&inflight, __ATOMIC_ACQUIRE);
+
+    return (room > 1) ? room : 1;
+}
+
+/* admission_report
+
+DESCRIPTION
+Render the overload controller state as plain text into buf.
+
+RETURN VALUE
+Length of the rendered text.
+*/
+
+int admission_report(char *buf, size_t size)
+{
+    int n;
+
+    n = snprintf(buf, size,
+            "admission inflight=%d max_inflight=%d accept_paused=%d pauses=%llu"
+            " queue_delay_us=%llu rss_mb=%llu max_rss_mb=%llu\n",
+            __atomic_load_n(&inflight, __ATOMIC_RELAXED), maxInflight,
+            __atomic_load_n(&paused, __ATOMIC_RELAXED), (unsigned long long)pauses,
+            (unsigned long long)__atomic_load_n(&queueDelay, __ATOMIC_RELAXED),
+            (unsigned long long)(__atomic_load_n(&residentMemory, __ATOMIC_RELAXED) >> 20),
+            (unsigned long long)(maxMemory >> 20));
+    if (n < 0)
+    {
+        return 0;
+    }
+    return ((size_t)n < size) ? n : (int)size - 1;
+}
@@ -0,0 +1,35 @@
+/*
+ * admission.h - Global admission control and load shedding
+ *
+ * The accept loop consults the overload controller before taking on work.
+ * At the cap on requests in flight it stops accepting, so bursts queue in
+ * the kernel backlog instead of as threads. Connections accepted while
+ * resident memory is over its limit or the buffer budget is exhausted, or
+ * while requests wait longer than the queueing delay threshold between
+ * accept and their handler starting, are shed with an immediate 503.
+ */
+
+#ifndef __ADMISSION_H__
+#define __ADMISSION_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ADMISSION_MAX_INFLIGHT  1024                /* default cap on requests in flight */
+#define ADMISSION_QUEUE_DELAY   (200*1000)          /* microseconds, smoothed */
+#define ADMISSION_DELAY_TTL     (1000*1000)         /* a delay sample older than this is ignored */
+#define ADMISSION_MEMORY_POLL   (100*1000)          /* resident memory is sampled this often */
+#define ADMISSION_RETRY_AFTER   (1000*1000)
+
+void admission_setLimits(int maxInflight, size_t maxMemory);
+int admission_paused(void);
+int admission_wakeFD(void);
+int admission_overloaded(void);
+void admission_enter(void);
+void admission_started(uint64_t acceptTime);
+void admission_leave(void);
+int admission_inflight(void);
+int admission_room(void);
+int admission_report(char *buf, size_t size);
+
+#endif /* __ADMISSION_H__ */
@@ -0,0 +1,399 @@
+/*
+ * backend.c - Backend pools for reverse-proxy mode
+ *
+ * Pools and routes are set up from the command line before any handler
+ * runs and are immutable afterwards; only the per-backend counters change,
+ * and those are updated with atomics so picking and releasing a backend
+ * takes no lock.
+ */
+
+#include "csapp.h"
+#include "diag.h"
+#include "stats.h"
+#include "backend.h"
+
+typedef struct backendRoute
+{
+    char host[BACKEND_NAME_MAX];        /* "*" matches any host */
+    backendPool_t *pool;
+}
+backendRoute_t;
+
+static backendPool_t pools[BACKEND_MAX_POOLS];
+static int poolCount;
+static backendRoute_t routes[BACKEND_MAX_ROUTES];
+static int routeCount;
+static backendPolicy_t policy = BACKEND_LEAST_OUTSTANDING;
+static __thread uint32_t randomState;
+
+
+/* randomNext
+
+DESCRIPTION
+Per-thread xorshift32, good enough to spread picks and cheap enough for every request.
+*/
+
+static uint32_t randomNext(void)
+{
+    uint32_t x = randomState;
+
+    if (x == 0)
+    {
+        x = (uint32_t)stats_now() ^ (uint32_t)(uintptr_t)&randomState;
+        x = x ? x : 0x9e3779b9;
+    }
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return randomState = x;
+}
+
+/* resolve
+
+DESCRIPTION
+Fill addr from "host:port".
+
+RETURN VALUE
+0 on success, -1 if the address is malformed or cannot be resolved.
+*/
+
+static int resolve(const char *spec, struct sockaddr_in *addr)
+{
+    char host[BACKEND_NAME_MAX];
+    struct addrinfo hints, *result;
+    char *colon;
+    int status;
+
+    if (strlen(spec) >= sizeof(host))
+    {
+        return -1;
+    }
+    strcpy(host, spec);
+    if ((colon = strrchr(host, ':')) == NULL || atoi(colon + 1) <= 0)
+    {
+        DIAG_ERROR("backend %s: expected host:port", spec);
+        return -1;
+    }
+    *colon = '\0';
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((status = getaddrinfo(host, colon + 1, &hints, &result)) != 0)
+    {
+        DIAG_ERROR("backend %s: %s", spec, gai_strerror(status));
+        return -1;
+    }
+    memcpy(addr, result->ai_addr, sizeof(*addr));
+    freeaddrinfo(result);
+    return 0;
+}
+
+/* backend_addPool
+
+DESCRIPTION
+Define a pool from "name=host:port[,host:port]...". Backends are resolved once, here.
+The pool is built aside and added only when complete.
+
+RETURN VALUE
+0 on success, -1 on a malformed or unresolvable specification or when out of memory.
+*/
+
+int backend_addPool(const char *spec)
+{
+    backendPool_t pool;
+    backend_t *grown;
+    char *copy, *list, *item, *save;
+    const char *equals;
+
+    if ((equals = strchr(spec, '=')) == NULL || equals == spec
+            || equals - spec >= BACKEND_NAME_MAX || poolCount == BACKEND_MAX_POOLS)
+    {
+        DIAG_ERROR("pool %s: expected name=host:port[,host:port]...", spec);
+        return -1;
+    }
+    memset(&pool, 0, sizeof(pool));
+    memcpy(pool.name, spec, equals - spec);
+    pool.name[equals - spec] = '\0';
+
+    if ((copy = strdup(equals + 1)) == NULL)
+    {
+        DIAG_ERRNO(DIAG_LEVEL_ERROR, "strdup");
+        return -1;
+    }
+    for (list = copy; (item = strtok_r(list, ",", &save)) != NULL; list = NULL)
+    {
+        if ((grown = realloc(pool.backends, (pool.count + 1) * sizeof(backend_t))) == NULL)
+        {
+            DIAG_ERRNO(DIAG_LEVEL_ERROR, "realloc");
+            break;
+        }
+        pool.backends = grown;
+        memset(&pool.backends[pool.count], 0, sizeof(backend_t));
+        snprintf(pool.backends[pool.count].name, BACKEND_NAME_MAX, "%s", item);
+        if (resolve(item, &pool.backends[pool.count].addr) == -1)
+        {
+            break;
+        }
+        pool.count++;
+    }
+    free(copy);
+
+    if (item != NULL || pool.count == 0)
+    {
+        if (item == NULL)
+        {
+            DIAG_ERROR("pool %s has no backends", pool.name);
+        }
+        free(pool.backends);
+        return -1;
+    }
+    pools[poolCount++] = pool;
+    return 0;
+}
+
+/* backend_addRoute
+
+DESCRIPTION
+Route requests for a host to a pool, from "host=pool". Host "*" is the default route.
+
+RETURN VALUE
+0 on success, -1 if the pool is unknown or the specification is malformed.
+*/
+
+int backend_addRoute(const char *spec)
+{
+    const char *equals;
+    int i;
+
+    if ((equals = strchr(spec, '=')) == NULL || equals == spec
+            || equals - spec >= BACKEND_NAME_MAX || routeCount == BACKEND_MAX_ROUTES)
+    {
+        DIAG_ERROR("route %s: expected host=pool", spec);
+        return -1;
+    }
+    for (i = 0; i < poolCount; i++)
+    {
+        if (strcmp(pools[i].name, equals + 1) == 0)
+        {
+            memcpy(routes[routeCount].host, spec, equals - spec);
+            routes[routeCount].host[equals - spec] = '\0';
+            routes[routeCount].pool = &pools[i];
+            routeCount++;
+            return 0;
+        }
+    }
+    DIAG_ERROR("route %s: no pool named %s", spec, equals + 1);
+    return -1;
+}
+
+void backend_setPolicy(backendPolicy_t newPolicy)
+{
+    policy = newPolicy;
+}
+
+int backend_enabled(void)
+{
+    return routeCount > 0;
+}
+
+/* backend_route
+
+DESCRIPTION
+Find the pool serving host (an optional :port suffix is ignored).
+
+RETURN VALUE
+The pool of the first matching route, else of the "*" route, else NULL.
+*/
+
+backendPool_t *backend_route(const char *host)
+{
+    backendPool_t *fallback = NULL;
+    size_t length = strcspn(host, ":");
+    int i;
+
+    for (i = 0; i < routeCount; i++)
+    {
+        if (strcmp(routes[i].host, "*") == 0)
+        {
+            if (fallback == NULL)
+            {
+                fallback = routes[i].pool;
+            }
+        }
+        else if (strlen(routes[i].host) == length && strncasecmp(routes[i].host, host, length) == 0)
+        {
+            return routes[i].pool;
+        }
+    }
+    return fallback;
+}
+
+static int ejected(backend_t *backend, uint64_t now)
+{
+    return __atomic_load_n(&backend->ejectedUntil, __ATOMIC_RELAXED) > now;
+}
+
+/* usable
+
+DESCRIPTION
+Whether backend is a candidate for backend_pick: not ejected and not the one to avoid.
+*/
+
+static int usable(backend_t *backend, const backend_t *avoid, uint64_t now)
+{
+    return backend != avoid && !ejected(backend, now);
+}
+
+static int inflight(backend_t *backend)
+{
+    return __atomic_load_n(&backend->inflight, __ATOMIC_RELAXED);
+}
+
+/* backend_pick
+
+DESCRIPTION
+Choose a backend of pool and count a request against it.
+With BACKEND_POWER_OF_TWO, two distinct healthy backends are sampled and the
+one with fewer requests in flight wins; otherwise, or when sampling keeps
+hitting ejected backends, all healthy backends are scanned from a random
+start for the fewest in flight. If every backend is ejected, the one whose
+ejection ends first is used rather than failing the request.
+
+ARGUMENTS
+const backend_t *avoid
+    A backend not to pick unless it is the only one left, or NULL.
+
+RETURN VALUE
+The backend, to be handed back with backend_release.
+*/
+
+backend_t *backend_pick(backendPool_t *pool, const backend_t *avoid)
+{
+    uint64_t now = stats_now();
+    backend_t *best = NULL, *a, *b;
+    int i, start, attempt;
+
+    if (policy == BACKEND_POWER_OF_TWO && pool->count >= 2)
+    {
+        for (attempt = 0; attempt < 4 && best == NULL; attempt++)
+        {
+            i = randomNext() % pool->count;
+            start = randomNext() % (pool->count - 1);
+            a = &pool->backends[i];
+            b = &pool->backends[(start >= i) ? start + 1 : start];
+            if (!usable(a, avoid, now))
+            {
+                best = usable(b, avoid, now) ? b : NULL;
+            }
+            else
+            {
+                best = (usable(b, avoid, now) && inflight(b) < inflight(a)) ? b : a;
+            }
+        }
+    }
+
+    if (best == NULL)
+    {
+        start = randomNext() % pool->count;
+        for (i = 0; i < pool->count; i++)
+        {
+            a = &pool->backends[(start + i) % pool->count];
+            if (usable(a, avoid, now) && (best == NULL || inflight(a) < inflight(best)))
+            {
+                best = a;
+            }
+        }
+    }
+
+    if (best == NULL)
+    {
+        best = &pool->backends[0];
+        for (i = 1; i < pool->count; i++)
+        {
+            if (pool->backends[i].ejectedUntil < best->ejectedUntil)
+            {
+                best = &pool->backends[i];
+            }
+        }
+    }
+
+    __atomic_fetch_add(&best->inflight, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&best->requests, 1, __ATOMIC_RELAXED);
+    return best;
+}
+
+/* backend_release
+
+DESCRIPTION
+Finish a request picked with backend_pick and feed its outcome to passive health checking.
+A success clears the failure streak and the ejection backoff; a run of
+BACKEND_EJECT_FAILURES failures ejects the backend.
+*/
+
+void backend_release(backend_t *backend, int success)
+{
+    uint64_t backoff;
+    int failures, ejections;
+
+    __atomic_fetch_sub(&backend->inflight, 1, __ATOMIC_RELAXED);
+    if (success)
+    {
+        __atomic_store_n(&backend->consecutiveFailures, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&backend->ejections, 0, __ATOMIC_RELAXED);
+        return;
+    }
+
+    __atomic_fetch_add(&backend->failures, 1, __ATOMIC_RELAXED);
+    failures = __atomic_add_fetch(&backend->consecutiveFailures, 1, __ATOMIC_RELAXED);
+    if (failures < BACKEND_EJECT_FAILURES
+            || !__atomic_compare_exchange_n(&backend->consecutiveFailures, &failures, 0, 0,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+
+    ejections = __atomic_fetch_add(&backend->ejections, 1, __ATOMIC_RELAXED);
+    backoff = (uint64_t)BACKEND_EJECT_BASE << (ejections < 6 ? ejections : 6);
+    if (backoff > BACKEND_EJECT_MAX)
+    {
+        backoff = BACKEND_EJECT_MAX;
+    }
+    __atomic_store_n(&backend->ejectedUntil, stats_now() + backoff, __ATOMIC_RELAXED);
+    DIAG_WARN("backend %s ejected for %llu ms after %d consecutive failures",
+            backend->name, (unsigned long long)(backoff / 1000), failures);
+}
+
+/* backend_report
+
+DESCRIPTION
+Render the state of every pool and backend as plain text into buf.
+
+RETURN VALUE
+Length of the rendered text.
+*/
+
+int backend_report(char *buf, size_t size)
+{
+    uint64_t now = stats_now(), until;
+    size_t length = 0;
+    int i, j, n;
+
+    for (i = 0; i < poolCount && length < size; i++)
+    {
+        for (j = 0; j < pools[i].count && length < size; j++)
+        {
+            backend_t *backend = &pools[i].backends[j];
+
+            until = __atomic_load_n(&backend->ejectedUntil, __ATOMIC_RELAXED);
+            n = snprintf(buf + length, size - length,
+                    "backend %s %s inflight=%d requests=%llu failures=%llu ejected_ms=%llu\n",
+                    pools[i].name, backend->name, inflight(backend),
+                    (unsigned long long)__atomic_load_n(&backend->requests, __ATOMIC_RELAXED),
+                    (unsigned long long)__atomic_load_n(&backend->failures, __ATOMIC_RELAXED),
+                    (unsigned long long)((until > now) ? (until - now) / 1000 : 0));
+            length += (n > 0) ? (size_t)n : 0;
+        }
+    }
+    return (length < size) ? (int)length : (int)size - 1;
+}
@@ -0,0 +1,61 @@
+/*
+ * backend.h - Backend pools for reverse-proxy mode
+ *
+ * Requests are routed by host name to a pool of pre-resolved backends and
+ * balanced on live in-flight counts. A backend that fails
+ * BACKEND_EJECT_FAILURES times in a row is ejected for a backoff period
+ * that doubles with every consecutive ejection.
+ */
+
+#ifndef __BACKEND_H__
+#define __BACKEND_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+#define BACKEND_MAX_POOLS       32
+#define BACKEND_MAX_ROUTES      64
+#define BACKEND_NAME_MAX        64
+#define BACKEND_EJECT_FAILURES  5
+#define BACKEND_EJECT_BASE      (1000*1000)         /* microseconds */
+#define BACKEND_EJECT_MAX       (60*1000*1000)
+
+typedef enum backendPolicy
+{
+    BACKEND_LEAST_OUTSTANDING,
+    BACKEND_POWER_OF_TWO
+}
+backendPolicy_t;
+
+typedef struct backend
+{
+    char name[BACKEND_NAME_MAX];        /* host:port as configured */
+    struct sockaddr_in addr;
+    int inflight;
+    int consecutiveFailures;
+    int ejections;
+    uint64_t ejectedUntil;
+    uint64_t requests;
+    uint64_t failures;
+}
+backend_t;
+
+typedef struct backendPool
+{
+    char name[BACKEND_NAME_MAX];
+    backend_t *backends;
+    int count;
+}
+backendPool_t;
+
+int backend_addPool(const char *spec);
+int backend_addRoute(const char *spec);
+void backend_setPolicy(backendPolicy_t policy);
+int backend_enabled(void);
+backendPool_t *backend_route(const char *host);
+backend_t *backend_pick(backendPool_t *pool, const backend_t *avoid);
+void backend_release(backend_t *backend, int success);
+int backend_report(char *buf, size_t size);
+
+#endif /* __BACKEND_H__ */
@@ -0,0 +1,449 @@
+/*
+ * loadgen.c - HTTP load generator for proxy benchmarks
+ *
+ * Drives a proxy with absolute-URI requests from a number of threads, each
+ * using a fresh connection per request like a HTTP/1.0 browser would.
+ *
+ *  - closed loop (default): every thread issues its next request as soon
+ *    as the previous one completes
+ *  - open loop (-r): requests are scheduled at a fixed aggregate rate and
+ *    latency is measured from the scheduled start, so a stalled proxy is
+ *    charged for the queueing it causes (no coordinated omission)
+ *
+ * Optionally holds idle connections open for the whole run, and samples
+ * CPU time and RSS of the proxy process from /proc. One JSON object per
+ * run is appended to the output file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#define RECV_BUFSIZE    (64*1024)
+
+typedef struct worker
+{
+    pthread_t thread;
+    int index;
+    uint32_t *latencies;        /* microseconds */
+    size_t count;
+    size_t capacity;
+    uint64_t errors;
+    uint64_t bytes;
+}
+worker_t;
+
+typedef struct procSample
+{
+    uint64_t cpuTicks;
+    long rssKB;
+    long peakKB;
+}
+procSample_t;
+
+/* run parameters */
+static struct sockaddr_in proxyAddr;
+static const char *url = "http://127.0.0.1:8080/bytes/1024";
+static int connections = 8;
+static double rate = 0;
+static double duration = 10;
+static int idleConnections = 0;
+static int timeoutMs = 30000;
+static const char *scenario = "default";
+static const char *outputPath = NULL;
+static pid_t proxyPid = 0;
+
+static char request[4096];
+static int requestLength;
+static uint64_t startTime, endTime;
+
+
+static uint64_t now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleepUntil(uint64_t when)
+{
+    uint64_t current = now();
+    struct timespec pause;
+
+    if (when <= current)
+    {
+        return;
+    }
+    pause.tv_sec = (when - current) / 1000000;
+    pause.tv_nsec = ((when - current) % 1000000) * 1000;
+    nanosleep(&pause, NULL);
+}
+
+static int connectProxy(void)
+{
+    struct timeval timeout;
+    int fd, optval;
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+    {
+        return -1;
+    }
+    timeout.tv_sec = timeoutMs / 1000;
+    timeout.tv_usec = (timeoutMs % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    optval = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    if (connect(fd, (struct sockaddr*)&proxyAddr, sizeof(proxyAddr)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* doRequest
+
+DESCRIPTION
+Issue one request on a new connection and read the response to end of stream.
+
+RETURN VALUE
+Number of bytes received, -1 on failure or a non-2xx status.
+*/
+
+static long long doRequest(char *buf)
+{
+    long long total = 0;
+    ssize_t n;
+    int fd, status = 0;
+    const char *cursor;
+    int left;
+
+    if ((fd = connectProxy()) == -1)
+    {
+        return -1;
+    }
+    for (cursor = request, left = requestLength; left > 0; cursor += n, left -= n)
+    {
+        if ((n = write(fd, cursor, left)) <= 0)
+        {
+            close(fd);
+            return -1;
+        }
+    }
+    while ((n = read(fd, buf, RECV_BUFSIZE)) != 0)
+    {
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            close(fd);
+            return -1;
+        }
+        if (total == 0 && (n < 12 || sscanf(buf, "HTTP/%*d.%*d %d", &status) != 1))
+        {
+            status = 0;
+        }
+        total += n;
+    }
+    close(fd);
+    return (status >= 200 && status < 300) ? total : -1;
+}
+
+static void record(worker_t *worker, uint64_t latency)
+{
+    if (worker->count == worker->capacity)
+    {
+        worker->capacity = worker->capacity ? worker->capacity * 2 : 4096;
+        worker->latencies = realloc(worker->latencies, worker->capacity * sizeof(uint32_t));
+        if (worker->latencies == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    worker->latencies[worker->count++] = (latency > UINT32_MAX) ? UINT32_MAX : latency;
+}
+
+static void *workerMain(void *arg)
+{
+    worker_t *worker = arg;
+    char *buf = malloc(RECV_BUFSIZE);
+    uint64_t interval = 0, scheduled, issued;
+    long long result;
+
+    if (rate > 0)
+    {
+        interval = (uint64_t)(1e6 * connections / rate);
+        scheduled = startTime + interval * worker->index / connections;
+    }
+    else
+    {
+        scheduled = startTime;
+    }
+
+    while (scheduled < endTime)
+    {
+        if (rate > 0)
+        {
+            sleepUntil(scheduled);
+        }
+        issued = (rate > 0) ? scheduled : now();
+        if ((result = doRequest(buf)) == -1)
+        {
+            worker->errors++;
+        }
+        else
+        {
+            worker->bytes += result;
+            record(worker, now() - issued);
+        }
+        scheduled = (rate > 0) ? scheduled + interval : now();
+    }
+    free(buf);
+    return NULL;
+}
+
+/* sampleProcess
+
+DESCRIPTION
+Read user+system CPU ticks and current/peak RSS of proxyPid from /proc.
+*/
+
+static void sampleProcess(procSample_t *sample)
+{
+    char path[64], line[1024];
+    unsigned long long utime, stime;
+    char *fields;
+    FILE *file;
+
+    memset(sample, 0, sizeof(*sample));
+    if (proxyPid == 0)
+    {
+        return;
+    }
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)proxyPid);
+    if ((file = fopen(path, "r")) != NULL)
+    {
+        if (fgets(line, sizeof(line), file) != NULL && (fields = strrchr(line, ')')) != NULL
+                && sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+                    &utime, &stime) == 2)
+        {
+            sample->cpuTicks = utime + stime;
+        }
+        fclose(file);
+    }
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)proxyPid);
+    if ((file = fopen(path, "r")) != NULL)
+    {
+        while (fgets(line, sizeof(line), file) != NULL)
+        {
+            sscanf(line, "VmRSS: %ld", &sample->rssKB);
+            sscanf(line, "VmHWM: %ld", &sample->peakKB);
+        }
+        fclose(file);
+    }
+}
+
+static int compareLatency(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+
+    return (x > y) - (x < y);
+}
+
+static uint32_t percentile(const uint32_t *sorted, size_t count, double p)
+{
+    size_t rank;
+
+    if (count == 0)
+    {
+        return 0;
+    }
+    rank = (size_t)(p / 100.0 * count);
+    return sorted[(rank < count) ? rank : count - 1];
+}
+
+/* prepare
+
+DESCRIPTION
+Resolve the proxy address and build the request sent for url.
+*/
+
+static void prepare(const char *proxy)
+{
+    char host[256], *colon;
+    const char *hostStart, *hostEnd;
+    struct addrinfo hints, *result;
+
+    snprintf(host, sizeof(host), "%s", proxy);
+    if ((colon = strrchr(host, ':')) == NULL)
+    {
+        fprintf(stderr, "proxy address must be host:port\n");
+        exit(EXIT_FAILURE);
+    }
+    *colon = '\0';
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, colon + 1, &hints, &result) != 0)
+    {
+        fprintf(stderr, "cannot resolve %s\n", proxy);
+        exit(EXIT_FAILURE);
+    }
+    memcpy(&proxyAddr, result->ai_addr, sizeof(proxyAddr));
+    freeaddrinfo(result);
+
+    hostStart = strstr(url, "://");
+    hostStart = hostStart ? hostStart + 3 : url;
+    hostEnd = hostStart + strcspn(hostStart, "/");
+    requestLength = snprintf(request, sizeof(request),
+            "GET %s HTTP/1.0\r\nHost: %.*s\r\nUser-Agent: proxy-loadgen\r\n\r\n",
+            url, (int)(hostEnd - hostStart), hostStart);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-x proxy host:port] [-u url] [-c connections] [-r requests/s]\n"
+            "          [-d seconds] [-i idle connections] [-t timeout ms]\n"
+            "          [-n scenario] [-o output file] [-p proxy pid]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    const char *proxy = "127.0.0.1:15213";
+    worker_t *workers;
+    int *idleFDs;
+    uint32_t *all;
+    size_t total, i;
+    uint64_t errors = 0, bytes = 0;
+    procSample_t before, after;
+    double elapsed, cpuPerRequest;
+    FILE *output;
+    int opt, j;
+
+    while ((opt = getopt(argc, argv, "x:u:c:r:d:i:t:n:o:p:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'x': proxy = optarg; break;
+        case 'u': url = optarg; break;
+        case 'c': connections = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'i': idleConnections = atoi(optarg); break;
+        case 't': timeoutMs = atoi(optarg); break;
+        case 'n': scenario = optarg; break;
+        case 'o': outputPath = optarg; break;
+        case 'p': proxyPid = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (connections < 1 || duration <= 0)
+    {
+        usage(argv[0]);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    prepare(proxy);
+
+    /* idle clients: a request line that never completes */
+    idleFDs = calloc(idleConnections > 0 ? idleConnections : 1, sizeof(int));
+    for (j = 0; j < idleConnections; j++)
+    {
+        if ((idleFDs[j] = connectProxy()) != -1 && write(idleFDs[j], "GET ", 4) != 4)
+        {
+            close(idleFDs[j]);
+            idleFDs[j] = -1;
+        }
+    }
+
+    workers = calloc(connections, sizeof(worker_t));
+    sampleProcess(&before);
+    startTime = now();
+    endTime = startTime + (uint64_t)(duration * 1e6);
+    for (j = 0; j < connections; j++)
+    {
+        workers[j].index = j;
+        if (pthread_create(&workers[j].thread, NULL, workerMain, &workers[j]) != 0)
+        {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    total = 0;
+    for (j = 0; j < connections; j++)
+    {
+        pthread_join(workers[j].thread, NULL);
+        total += workers[j].count;
+        errors += workers[j].errors;
+        bytes += workers[j].bytes;
+    }
+    elapsed = (now() - startTime) / 1e6;
+    sampleProcess(&after);
+
+    for (j = 0; j < idleConnections; j++)
+    {
+        if (idleFDs[j] != -1)
+        {
+            close(idleFDs[j]);
+        }
+    }
+
+    all = malloc((total ? total : 1) * sizeof(uint32_t));
+    for (i = 0, j = 0; j < connections; j++)
+    {
+        memcpy(all + i, workers[j].latencies, workers[j].count * sizeof(uint32_t));
+        i += workers[j].count;
+        free(workers[j].latencies);
+    }
+    qsort(all, total, sizeof(uint32_t), compareLatency);
+    cpuPerRequest = total ? (after.cpuTicks - before.cpuTicks) * 1e6
+        / sysconf(_SC_CLK_TCK) / total : 0;
+
+    output = outputPath ? fopen(outputPath, "a") : stdout;
+    if (output == NULL)
+    {
+        perror(outputPath);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(output,
+            "{\"scenario\":\"%s\",\"url\":\"%s\",\"connections\":%d,\"rate\":%.0f,"
+            "\"idle\":%d,\"seconds\":%.3f,\"requests\":%zu,\"errors\":%llu,"
+            "\"rps\":%.1f,\"mbytes_per_s\":%.2f,\"p50_us\":%u,\"p99_us\":%u,"
+            "\"p999_us\":%u,\"max_us\":%u,\"cpu_us_per_req\":%.1f,"
+            "\"rss_kb\":%ld,\"rss_peak_kb\":%ld}\n",
+            scenario, url, connections, rate, idleConnections, elapsed, total,
+            (unsigned long long)errors, total / elapsed, bytes / elapsed / 1e6,
+            percentile(all, total, 50), percentile(all, total, 99),
+            percentile(all, total, 99.9), total ? all[total - 1] : 0,
+            cpuPerRequest, after.rssKB, after.peakKB);
+    if (output != stdout)
+    {
+        fclose(output);
+    }
+
+    free(all);
+    free(workers);
+    free(idleFDs);
+    return (total > 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,402 @@
+/*
+ * microbench.c - Microbenchmarks for the proxy's inner routines
+ *
+ * Links against proxy.c built with -DPROXY_NO_MAIN and times parse_uri,
+ * iobuf_readUntil, rewriteRequest, writeAll, pump and format_log_entry in
+ * isolation.
+ *
+ * Each case is calibrated so one repetition runs for about the target time,
+ * warmed up once, then repeated; the median, min and max ns/op over the
+ * repetitions are reported together with the median absolute deviation
+ * and, for byte-moving cases, the median throughput.
+ */
+
+#include "../csapp.h"
+#include "../proxy.h"
+#include <stdint.h>
+
+#define PUMP_BYTES      (4*1024*1024)
+#define PAYLOAD_BYTES   (1024*1024)
+#define MAX_REPS        100
+
+typedef struct benchCase
+{
+    const char *name;
+    void (*run)(struct benchCase *c, long iterations);
+    size_t param;               /* case specific: chunk or header size */
+    size_t bytesPerOp;          /* 0 for cases that do not move data */
+    int useSocketpair;
+}
+benchCase_t;
+
+/* run parameters */
+static int repetitions = 15;
+static double targetMs = 50;
+static const char *filter = NULL;
+static const char *outputPath = NULL;
+
+static int devNull;
+static char *payload;
+static volatile long sink;
+
+
+static uint64_t nowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * parse_uri
+ */
+
+static void runParseUri(benchCase_t *c, long iterations)
+{
+    static char *uris[] =
+    {
+        "http://www.example.com/index.html HTTP/1.0\r\n",
+        "http://localhost:8080/a/b/c?x=y&z=w HTTP/1.1\r\n"
+    };
+    char hostname[MAXLINE];
+    in_port_t port;
+    long i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        parse_uri(uris[c->param], hostname, &port);
+        sink += port;
+    }
+}
+
+/*
+ * format_log_entry
+ */
+
+static void runFormatLogEntry(benchCase_t *c, long iterations)
+{
+    char logEntry[MAXLINE];
+    struct sockaddr_in addr;
+    long i;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(0x7f000001);
+    for (i = 0; i < iterations; i++)
+    {
+        format_log_entry(logEntry, (struct sockaddr*)&addr, "http://www.example.com/index.html", 12345);
+        sink += logEntry[0];
+    }
+}
+
+/*
+ * iobuf_readUntil - a complete request header of c->param bytes is waiting
+ * in a pipe, so the cost is one read(2) plus the terminator search
+ */
+
+static void runReadUntil(benchCase_t *c, long iterations)
+{
+    char *header = malloc(c->param);
+    iobuf_t chain;
+    int fds[2];
+    size_t i;
+    long n;
+
+    memset(header, 'x', c->param);
+    memcpy(header, "GET http://www.example.com/ HTTP/1.0\r\n", 38);
+    for (i = 64; i + 2 < c->param - 4; i += 64)
+    {
+        header[i] = '\r';
+        header[i + 1] = '\n';
+    }
+    memcpy(header + c->param - 4, "\r\n\r\n", 4);
+
+    if (pipe(fds) == -1)
+    {
+        unix_error("pipe");
+    }
+    iobuf_init(&chain);
+    for (n = 0; n < iterations; n++)
+    {
+        if (writeAll(fds[1], header, c->param) == -1)
+        {
+            unix_error("write");
+        }
+        sink += iobuf_readUntil(&chain, fds[0], "\r\n\r\n", REQUEST_HEADER_MAX);
+        iobuf_consume(&chain, iobuf_length(&chain));
+    }
+    close(fds[0]);
+    close(fds[1]);
+    iobuf_clear(&chain);
+    free(header);
+}
+
+/*
+ * rewriteRequest - a typical browser request through a forward proxy,
+ * rewritten into a fresh chain that is then dropped
+ */
+
+static void runRewriteRequest(benchCase_t *c, long iterations)
+{
+    static const char header[] =
+        "GET http://www.example.com/a/b/c?x=y HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+        "Accept-Language: en-US,en;q=0.5\r\n"
+        "Accept-Encoding: gzip, deflate\r\n"
+        "Proxy-Connection: keep-alive\r\n"
+        "Cookie: session=0123456789abcdef\r\n"
+        "Upgrade-Insecure-Requests: 1\r\n\r\n";
+    iobuf_t request, out;
+    long i;
+
+    iobuf_init(&request);
+    iobuf_append(&request, header, sizeof(header) - 1);
+    for (i = 0; i < iterations; i++)
+    {
+        iobuf_init(&out);
+        sink += rewriteRequest(header, sizeof(header) - 1, "www.example.com", 80, &request, 0, &out);
+        sink += iobuf_length(&out);
+        iobuf_clear(&out);
+    }
+    iobuf_clear(&request);
+}
+
+/*
+ * writeAll - c->param bytes per call into a pipe emptied by a drain thread
+ */
+
+static void *drain(void *arg)
+{
+    int fd = (int)(long)arg;
+    char buf[65536];
+
+    while (read(fd, buf, sizeof(buf)) > 0)
+    {
+        /* discard */
+    }
+    return NULL;
+}
+
+static void runWriteAll(benchCase_t *c, long iterations)
+{
+    pthread_t drainer;
+    int fds[2];
+    long i;
+
+    if (pipe(fds) == -1)
+    {
+        unix_error("pipe");
+    }
+    Pthread_create(&drainer, NULL, drain, (void*)(long)fds[0]);
+    for (i = 0; i < iterations; i++)
+    {
+        writeAll(fds[1], payload, c->param);
+    }
+    close(fds[1]);
+    Pthread_join(drainer, NULL);
+    close(fds[0]);
+}
+
+/*
+ * pump - a producer thread writes PUMP_BYTES in c->param sized chunks into a
+ * fresh pipe or socketpair and closes it; pump forwards to /dev/null.
+ * Pair and thread setup are part of each operation.
+ */
+
+typedef struct producer
+{
+    int fd;
+    size_t chunk;
+}
+producer_t;
+
+static void *produce(void *arg)
+{
+    producer_t *producer = arg;
+    size_t sent, chunk;
+
+    for (sent = 0; sent < PUMP_BYTES; sent += chunk)
+    {
+        chunk = (PUMP_BYTES - sent < producer->chunk) ? PUMP_BYTES - sent : producer->chunk;
+        if (writeAll(producer->fd, payload, chunk) == -1)
+        {
+            break;
+        }
+    }
+    close(producer->fd);
+    return NULL;
+}
+
+static void runPump(benchCase_t *c, long iterations)
+{
+    producer_t producer;
+    pthread_t thread;
+    int fds[2];
+    long i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        if ((c->useSocketpair ? socketpair(AF_UNIX, SOCK_STREAM, 0, fds) : pipe(fds)) == -1)
+        {
+            unix_error("socketpair/pipe");
+        }
+        producer.fd = fds[1];
+        producer.chunk = c->param;
+        Pthread_create(&thread, NULL, produce, &producer);
+        sink += pump(fds[0], devNull, NULL);
+        Pthread_join(thread, NULL);
+        close(fds[0]);
+    }
+}
+
+static benchCase_t cases[] =
+{
+    { "parse_uri/plain",            runParseUri,        0,          0,          0 },
+    { "parse_uri/port+query",       runParseUri,        1,          0,          0 },
+    { "format_log_entry",           runFormatLogEntry,  0,          0,          0 },
+    { "readUntil/256",              runReadUntil,       256,        256,        0 },
+    { "readUntil/2048",             runReadUntil,       2048,       2048,       0 },
+    { "readUntil/16384",            runReadUntil,       16384,      16384,      0 },
+    { "rewriteRequest",             runRewriteRequest,  0,          0,          0 },
+    { "writeAll/64",                runWriteAll,        64,         64,         0 },
+    { "writeAll/4096",              runWriteAll,        4096,       4096,       0 },
+    { "writeAll/65536",             runWriteAll,        65536,      65536,      0 },
+    { "writeAll/1048576",           runWriteAll,        1048576,    1048576,    0 },
+    { "pump/pipe/1460",             runPump,            1460,       PUMP_BYTES, 0 },
+    { "pump/pipe/16384",            runPump,            16384,      PUMP_BYTES, 0 },
+    { "pump/pipe/262144",           runPump,            262144,     PUMP_BYTES, 0 },
+    { "pump/socketpair/1460",       runPump,            1460,       PUMP_BYTES, 1 },
+    { "pump/socketpair/16384",      runPump,            16384,      PUMP_BYTES, 1 },
+    { "pump/socketpair/262144",     runPump,            262144,     PUMP_BYTES, 1 },
+};
+
+static int compareDouble(const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+
+    return (x > y) - (x < y);
+}
+
+/* measure
+
+DESCRIPTION
+Calibrate, warm up and time one case, then print and optionally record its result.
+*/
+
+static void measure(benchCase_t *c, FILE *output)
+{
+    double samples[MAX_REPS], deviations[MAX_REPS];
+    double median, mad, throughput;
+    uint64_t start, elapsed;
+    long iterations;
+    int i;
+
+    /* calibrate: grow until one batch takes a tenth of the target */
+    for (iterations = 1; ; iterations *= 2)
+    {
+        start = nowNs();
+        c->run(c, iterations);
+        elapsed = nowNs() - start;
+        if (elapsed >= targetMs * 1e5 || iterations >= (1L << 30))
+        {
+            break;
+        }
+    }
+    iterations = (long)(iterations * (targetMs * 1e6 / (elapsed ? elapsed : 1)));
+    if (iterations < 1)
+    {
+        iterations = 1;
+    }
+
+    /* warmup */
+    c->run(c, iterations);
+
+    for (i = 0; i < repetitions; i++)
+    {
+        start = nowNs();
+        c->run(c, iterations);
+        samples[i] = (double)(nowNs() - start) / iterations;
+    }
+    qsort(samples, repetitions, sizeof(double), compareDouble);
+    median = samples[repetitions / 2];
+    for (i = 0; i < repetitions; i++)
+    {
+        deviations[i] = fabs(samples[i] - median);
+    }
+    qsort(deviations, repetitions, sizeof(double), compareDouble);
+    mad = deviations[repetitions / 2];
+    throughput = c->bytesPerOp ? c->bytesPerOp / median * 1e9 / 1e6 : 0;
+
+    printf("%-28s %12.1f %12.1f %12.1f %7.1f%% %10.1f %10ld\n",
+            c->name, median, samples[0], samples[repetitions - 1],
+            median ? 100.0 * mad / median : 0, throughput, iterations);
+    if (output != NULL)
+    {
+        fprintf(output,
+                "{\"benchmark\":\"%s\",\"ns_per_op\":%.1f,\"min_ns\":%.1f,\"max_ns\":%.1f,"
+                "\"mad_ns\":%.1f,\"mbytes_per_s\":%.1f,\"iterations\":%ld,\"repetitions\":%d}\n",
+                c->name, median, samples[0], samples[repetitions - 1], mad, throughput,
+                iterations, repetitions);
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-r repetitions] [-t target ms per repetition] "
+            "[-f name filter] [-o output file]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    FILE *output = NULL;
+    size_t i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:t:f:o:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r': repetitions = atoi(optarg); break;
+        case 't': targetMs = atof(optarg); break;
+        case 'f': filter = optarg; break;
+        case 'o': outputPath = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (repetitions < 1 || repetitions > MAX_REPS || targetMs <= 0)
+    {
+        usage(argv[0]);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    if ((devNull = open("/dev/null", O_WRONLY)) == -1)
+    {
+        unix_error("/dev/null");
+    }
+    payload = Malloc(PAYLOAD_BYTES);
+    memset(payload, 'p', PAYLOAD_BYTES);
+    if (outputPath != NULL && (output = fopen(outputPath, "a")) == NULL)
+    {
+        unix_error((char*)outputPath);
+    }
+
+    printf("%-28s %12s %12s %12s %8s %10s %10s\n",
+            "benchmark", "ns/op", "min", "max", "mad", "MB/s", "iters");
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        if (filter == NULL || strstr(cases[i].name, filter) != NULL)
+        {
+            measure(&cases[i], output);
+        }
+    }
+
+    if (output != NULL)
+    {
+        fclose(output);
+    }
+    return 0;
+}
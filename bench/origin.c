@@ -0,0 +1,273 @@
+/*
+ * origin.c - Local origin stand-in for proxy benchmarks
+ *
+ * A minimal thread-per-connection HTTP/1.0 server whose responses are
+ * fully described by the request path, so benchmark scenarios need no
+ * content on disk:
+ *
+ *     /bytes/<n>              n bytes of text
+ *     /slow/<ms>/<n>          n bytes of text after a delay of ms milliseconds
+ *     /replay/<n>/<anything>  a response of n bytes in total, header included,
+ *                             as recorded in a capture trace (see replay.c)
+ *
+ * Every response carries Content-Length and the connection is closed after it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define PATTERN_SIZE    (1024*1024)
+#define HEADER_MAX      (16*1024)
+
+static char pattern[PATTERN_SIZE];
+
+
+/* writeAll
+
+DESCRIPTION
+Write count bytes of buf to fd.
+
+RETURN VALUE
+0 on success, -1 on write(2) failure.
+*/
+
+static int writeAll(int fd, const char *buf, size_t count)
+{
+    ssize_t n;
+
+    while (count > 0)
+    {
+        if ((n = write(fd, buf, count)) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        count -= n;
+    }
+    return 0;
+}
+
+/* readRequest
+
+DESCRIPTION
+Read from fd until the end of the request header.
+
+RETURN VALUE
+Length of the header read, -1 on failure or premature end of stream.
+*/
+
+static int readRequest(int fd, char *buf, size_t size)
+{
+    size_t used = 0;
+    ssize_t n;
+
+    while (used < size - 1)
+    {
+        if ((n = read(fd, buf + used, size - 1 - used)) <= 0)
+        {
+            if (n == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        used += n;
+        buf[used] = '\0';
+        if (strstr(buf, "\r\n\r\n") != NULL)
+        {
+            return (int)used;
+        }
+    }
+    return -1;
+}
+
+static int formatHeader(char *header, size_t length, const char *status, long long size)
+{
+    return snprintf(header, length,
+            "HTTP/1.0 %s\r\n"
+            "Content-Type: text/plain\r\n"
+            "Content-Length: %lld\r\n"
+            "Connection: close\r\n\r\n", status, size);
+}
+
+/* respond
+
+DESCRIPTION
+Send a response of size bytes taken from the repeating text pattern.
+If total is set, size is adjusted so header and body add up to size bytes.
+*/
+
+static int respond(int fd, const char *status, long long size, int total)
+{
+    char header[256];
+    int headerLength;
+    long long chunk;
+
+    headerLength = formatHeader(header, sizeof(header), status, size);
+    if (total)
+    {
+        long long body = size - headerLength;
+
+        /* the Content-Length digits count too, so settle it in a second pass */
+        body = (body > 0) ? body : 0;
+        headerLength = formatHeader(header, sizeof(header), status, body);
+        body = (size - headerLength > 0) ? size - headerLength : 0;
+        headerLength = formatHeader(header, sizeof(header), status, body);
+        size = body;
+    }
+    if (writeAll(fd, header, headerLength) == -1)
+    {
+        return -1;
+    }
+    while (size > 0)
+    {
+        chunk = (size < PATTERN_SIZE) ? size : PATTERN_SIZE;
+        if (writeAll(fd, pattern, chunk) == -1)
+        {
+            return -1;
+        }
+        size -= chunk;
+    }
+    return 0;
+}
+
+/* route
+
+DESCRIPTION
+Decode the response parameters from the request path and send the response.
+Absolute URIs are accepted as well, so the server can be hit directly or
+through a proxy that forwards the request line verbatim.
+*/
+
+static void route(int fd, char *request)
+{
+    char *path, *end;
+    long long size;
+    long delay;
+
+    if ((path = strchr(request, ' ')) == NULL)
+    {
+        respond(fd, "400 Bad Request", 0, 0);
+        return;
+    }
+    path++;
+    if (strncmp(path, "http://", 7) == 0 && (path = strchr(path + 7, '/')) == NULL)
+    {
+        respond(fd, "400 Bad Request", 0, 0);
+        return;
+    }
+
+    if (strncmp(path, "/bytes/", 7) == 0)
+    {
+        size = strtoll(path + 7, &end, 10);
+        respond(fd, "200 OK", size, 0);
+    }
+    else if (strncmp(path, "/replay/", 8) == 0)
+    {
+        size = strtoll(path + 8, &end, 10);
+        respond(fd, "200 OK", size, 1);
+    }
+    else if (strncmp(path, "/slow/", 6) == 0)
+    {
+        struct timespec pause;
+
+        delay = strtol(path + 6, &end, 10);
+        size = (*end == '/') ? strtoll(end + 1, &end, 10) : 0;
+        pause.tv_sec = delay / 1000;
+        pause.tv_nsec = (delay % 1000) * 1000000L;
+        while (nanosleep(&pause, &pause) == -1 && errno == EINTR)
+        {
+            /* continue sleeping */
+        }
+        respond(fd, "200 OK", size, 0);
+    }
+    else
+    {
+        respond(fd, "404 Not Found", 0, 0);
+    }
+}
+
+static void *serve(void *arg)
+{
+    int fd = (int)(long)arg;
+    char request[HEADER_MAX];
+
+    if (readRequest(fd, request, sizeof(request)) != -1)
+    {
+        route(fd, request);
+    }
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_in addr;
+    pthread_attr_t threadAttr;
+    pthread_t thread;
+    int listenFD, clientFD, optval, i;
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s <port number>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    for (i = 0; i < PATTERN_SIZE; i++)
+    {
+        pattern[i] = (i % 64 == 63) ? '\n' : 'a' + (i % 26);
+    }
+
+    if ((listenFD = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+    {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+    optval = 1;
+    setsockopt(listenFD, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(atoi(argv[1]));
+    if (bind(listenFD, (struct sockaddr*)&addr, sizeof(addr)) == -1
+            || listen(listenFD, 4096) == -1)
+    {
+        perror("bind/listen");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_attr_init(&threadAttr);
+    pthread_attr_setdetachstate(&threadAttr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&threadAttr, 64 * 1024);
+
+    for (;;)
+    {
+        if ((clientFD = accept(listenFD, NULL, NULL)) == -1)
+        {
+            continue;
+        }
+        optval = 1;
+        setsockopt(clientFD, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+        if (pthread_create(&thread, &threadAttr, serve, (void*)(long)clientFD) != 0)
+        {
+            close(clientFD);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,459 @@
+/*
+ * replay.c - Replay a captured trace through the proxy
+ *
+ * Reads a trace written by "proxy -t", and re-issues every served request
+ * through the proxy at its original arrival offset divided by the speed
+ * factor (or as fast as the workers allow with -s 0). Request lines are
+ * rewritten to target the origin stand-in as
+ *
+ *     http://<origin>/replay/<recorded response size>/<original host><path>
+ *
+ * so the replayed response has the recorded size and the original URL stays
+ * visible for cache keys; all other request header lines are sent verbatim.
+ * Latency is measured from the scheduled time, and responses whose size
+ * differs from the recording are counted as mismatches.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include "../capture.h"
+
+#define RECV_BUFSIZE    (64*1024)
+
+typedef struct replayRecord
+{
+    const captureRecordHeader_t *header;
+    const char *request;
+    uint64_t due;               /* absolute schedule, microseconds */
+    uint32_t latency;           /* microseconds, measured from due */
+    int outcome;                /* 0 ok, 1 size mismatch, -1 failed */
+}
+replayRecord_t;
+
+/* run parameters */
+static struct sockaddr_in proxyAddr;
+static const char *origin = NULL;
+static double speed = 1.0;
+static int workers = 64;
+static int timeoutMs = 30000;
+static const char *scenario = "replay";
+static const char *outputPath = NULL;
+
+static replayRecord_t *records;
+static size_t recordCount;
+static size_t released;         /* records whose due time has passed */
+static size_t taken;            /* records picked up by workers */
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueCond = PTHREAD_COND_INITIALIZER;
+
+
+static uint64_t now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleepUntil(uint64_t when)
+{
+    uint64_t current = now();
+    struct timespec pause;
+
+    if (when <= current)
+    {
+        return;
+    }
+    pause.tv_sec = (when - current) / 1000000;
+    pause.tv_nsec = ((when - current) % 1000000) * 1000;
+    nanosleep(&pause, NULL);
+}
+
+static int writeAll(int fd, const char *buf, size_t count)
+{
+    ssize_t n;
+
+    while (count > 0)
+    {
+        if ((n = write(fd, buf, count)) <= 0)
+        {
+            if (n == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        count -= n;
+    }
+    return 0;
+}
+
+/* rewrite
+
+DESCRIPTION
+Build the replayed request for record into out.
+
+RETURN VALUE
+Length of the request, -1 if the record has no absolute http:// request line.
+*/
+
+static int rewrite(const replayRecord_t *record, char *out, size_t size)
+{
+    const char *request = record->request;
+    const char *end = request + record->header->requestLength;
+    const char *method, *target, *lineEnd;
+    int length;
+
+    method = request;
+    if ((target = memchr(request, ' ', end - request)) == NULL
+            || end - target < 8 || strncmp(target + 1, "http://", 7) != 0)
+    {
+        return -1;
+    }
+    target += 8;
+    if ((lineEnd = memchr(target, '\n', end - target)) == NULL)
+    {
+        return -1;
+    }
+    lineEnd++;
+
+    length = snprintf(out, size, "%.*s http://%s/replay/%llu/%.*s",
+            (int)(target - 8 - method), method, origin,
+            (unsigned long long)record->header->responseSize,
+            (int)(lineEnd - target), target);
+    if (length < 0 || (size_t)length + (end - lineEnd) > size)
+    {
+        return -1;
+    }
+    memcpy(out + length, lineEnd, end - lineEnd);
+    return length + (end - lineEnd);
+}
+
+static int connectProxy(void)
+{
+    struct timeval timeout;
+    int fd, optval;
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+    {
+        return -1;
+    }
+    timeout.tv_sec = timeoutMs / 1000;
+    timeout.tv_usec = (timeoutMs % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    optval = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    if (connect(fd, (struct sockaddr*)&proxyAddr, sizeof(proxyAddr)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* replayOne
+
+DESCRIPTION
+Issue one rewritten request and classify the response.
+*/
+
+static void replayOne(replayRecord_t *record, char *request, size_t requestSize, char *buf)
+{
+    long long total = 0;
+    ssize_t n;
+    int fd, length;
+
+    record->outcome = -1;
+    if ((length = rewrite(record, request, requestSize)) == -1 || (fd = connectProxy()) == -1)
+    {
+        return;
+    }
+    if (writeAll(fd, request, length) == -1)
+    {
+        close(fd);
+        return;
+    }
+    while ((n = read(fd, buf, RECV_BUFSIZE)) != 0)
+    {
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            close(fd);
+            return;
+        }
+        total += n;
+    }
+    close(fd);
+
+    record->latency = now() - record->due;
+    record->outcome = ((uint64_t)total == record->header->responseSize) ? 0 : 1;
+}
+
+static void *workerMain(void *arg)
+{
+    size_t requestSize = 2 * RECV_BUFSIZE;
+    char *request = malloc(requestSize);
+    char *buf = malloc(RECV_BUFSIZE);
+    size_t index;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&queueLock);
+        while (taken == released && released < recordCount)
+        {
+            pthread_cond_wait(&queueCond, &queueLock);
+        }
+        if (taken == recordCount)
+        {
+            pthread_mutex_unlock(&queueLock);
+            break;
+        }
+        index = taken++;
+        pthread_mutex_unlock(&queueLock);
+
+        replayOne(&records[index], request, requestSize, buf);
+    }
+    free(request);
+    free(buf);
+    return NULL;
+}
+
+static int compareOffset(const void *a, const void *b)
+{
+    uint64_t x = ((const replayRecord_t*)a)->header->arrivalOffset;
+    uint64_t y = ((const replayRecord_t*)b)->header->arrivalOffset;
+
+    return (x > y) - (x < y);
+}
+
+static int compareLatency(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+
+    return (x > y) - (x < y);
+}
+
+static uint32_t percentile(const uint32_t *sorted, size_t count, double p)
+{
+    size_t rank;
+
+    if (count == 0)
+    {
+        return 0;
+    }
+    rank = (size_t)(p / 100.0 * count);
+    return sorted[(rank < count) ? rank : count - 1];
+}
+
+/* loadTrace
+
+DESCRIPTION
+Read the whole trace into memory and index the records of served requests.
+
+RETURN VALUE
+Number of records skipped because the request had been aborted when captured.
+*/
+
+static size_t loadTrace(const char *path, char **data)
+{
+    FILE *file;
+    long size;
+    size_t offset, skipped = 0, capacity = 1024;
+    const captureRecordHeader_t *header;
+
+    if ((file = fopen(path, "rb")) == NULL || fseek(file, 0, SEEK_END) == -1
+            || (size = ftell(file)) < (long)sizeof(captureFileHeader_t))
+    {
+        fprintf(stderr, "cannot read trace %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    rewind(file);
+    *data = malloc(size);
+    if (fread(*data, 1, size, file) != (size_t)size
+            || memcmp(*data, CAPTURE_MAGIC, 8) != 0)
+    {
+        fprintf(stderr, "%s is not a proxy trace\n", path);
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+
+    records = malloc(capacity * sizeof(replayRecord_t));
+    for (offset = sizeof(captureFileHeader_t); offset + sizeof(*header) <= (size_t)size;
+            offset += header->recordLength)
+    {
+        header = (const captureRecordHeader_t*)(*data + offset);
+        if (header->recordLength < sizeof(*header) || offset + header->recordLength > (size_t)size)
+        {
+            fprintf(stderr, "truncated record at offset %zu, ignoring the rest\n", offset);
+            break;
+        }
+        if (header->result != 0)
+        {
+            skipped++;
+            continue;
+        }
+        if (recordCount == capacity)
+        {
+            capacity *= 2;
+            records = realloc(records, capacity * sizeof(replayRecord_t));
+        }
+        records[recordCount].header = header;
+        records[recordCount].request = (const char*)(header + 1);
+        recordCount++;
+    }
+    qsort(records, recordCount, sizeof(replayRecord_t), compareOffset);
+    return skipped;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s -O origin host:port [-x proxy host:port] [-s speed, 0 = unpaced]\n"
+            "          [-c workers] [-t timeout ms] [-n scenario] [-o output file] trace\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    const char *proxy = "127.0.0.1:15213";
+    char host[256], *colon, *data;
+    struct addrinfo hints, *result;
+    pthread_t *threads;
+    uint32_t *latencies;
+    size_t skipped, i, ok = 0, mismatched = 0, failed = 0;
+    uint64_t start, first;
+    double elapsed;
+    FILE *output;
+    int opt, j;
+
+    while ((opt = getopt(argc, argv, "x:O:s:c:t:n:o:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'x': proxy = optarg; break;
+        case 'O': origin = optarg; break;
+        case 's': speed = atof(optarg); break;
+        case 'c': workers = atoi(optarg); break;
+        case 't': timeoutMs = atoi(optarg); break;
+        case 'n': scenario = optarg; break;
+        case 'o': outputPath = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (origin == NULL || optind != argc - 1 || workers < 1 || speed < 0)
+    {
+        usage(argv[0]);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    snprintf(host, sizeof(host), "%s", proxy);
+    if ((colon = strrchr(host, ':')) == NULL)
+    {
+        usage(argv[0]);
+    }
+    *colon = '\0';
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, colon + 1, &hints, &result) != 0)
+    {
+        fprintf(stderr, "cannot resolve %s\n", proxy);
+        exit(EXIT_FAILURE);
+    }
+    memcpy(&proxyAddr, result->ai_addr, sizeof(proxyAddr));
+    freeaddrinfo(result);
+
+    skipped = loadTrace(argv[optind], &data);
+    if (recordCount == 0)
+    {
+        fprintf(stderr, "no replayable records\n");
+        exit(EXIT_FAILURE);
+    }
+
+    threads = malloc(workers * sizeof(pthread_t));
+    for (j = 0; j < workers; j++)
+    {
+        pthread_create(&threads[j], NULL, workerMain, NULL);
+    }
+
+    /* dispatch in arrival order */
+    start = now();
+    first = records[0].header->arrivalOffset;
+    for (i = 0; i < recordCount; i++)
+    {
+        records[i].due = (speed > 0)
+            ? start + (uint64_t)((records[i].header->arrivalOffset - first) / speed)
+            : start;
+        if (speed > 0)
+        {
+            sleepUntil(records[i].due);
+        }
+        pthread_mutex_lock(&queueLock);
+        released = i + 1;
+        pthread_cond_broadcast(&queueCond);
+        pthread_mutex_unlock(&queueLock);
+    }
+
+    for (j = 0; j < workers; j++)
+    {
+        pthread_join(threads[j], NULL);
+    }
+    elapsed = (now() - start) / 1e6;
+
+    latencies = malloc(recordCount * sizeof(uint32_t));
+    for (i = 0; i < recordCount; i++)
+    {
+        if (records[i].outcome == -1)
+        {
+            failed++;
+            continue;
+        }
+        mismatched += records[i].outcome;
+        latencies[ok++] = records[i].latency;
+    }
+    qsort(latencies, ok, sizeof(uint32_t), compareLatency);
+
+    output = outputPath ? fopen(outputPath, "a") : stdout;
+    if (output == NULL)
+    {
+        perror(outputPath);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(output,
+            "{\"scenario\":\"%s\",\"trace\":\"%s\",\"speed\":%.2f,\"workers\":%d,"
+            "\"records\":%zu,\"skipped\":%zu,\"completed\":%zu,\"errors\":%zu,"
+            "\"size_mismatches\":%zu,\"seconds\":%.3f,\"rps\":%.1f,\"p50_us\":%u,"
+            "\"p99_us\":%u,\"p999_us\":%u,\"max_us\":%u}\n",
+            scenario, argv[optind], speed, workers, recordCount, skipped, ok, failed,
+            mismatched, elapsed, ok / elapsed, percentile(latencies, ok, 50),
+            percentile(latencies, ok, 99), percentile(latencies, ok, 99.9),
+            ok ? latencies[ok - 1] : 0);
+    if (output != stdout)
+    {
+        fclose(output);
+    }
+
+    free(latencies);
+    free(threads);
+    free(records);
+    free(data);
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
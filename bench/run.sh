@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# run.sh - Run the proxy benchmark scenarios on loopback
+#
+# Starts the origin stand-in and the proxy, runs every scenario with
+# loadgen and appends one JSON line per scenario to $BENCH_OUT.
+#
+# Environment:
+#     BENCH_OUT        result file (default bench-results.json)
+#     BENCH_DURATION   seconds per scenario (default 10)
+#     BENCH_SCENARIOS  space separated subset of scenarios to run
+#     PROXY_PORT, ORIGIN_PORT
+#
+
+set -e
+cd "$(dirname "$0")/.."
+
+OUT=${BENCH_OUT:-bench-results.json}
+DURATION=${BENCH_DURATION:-10}
+SCENARIOS=${BENCH_SCENARIOS:-"small large idle slow churn"}
+PROXY_PORT=${PROXY_PORT:-15213}
+ORIGIN_PORT=${ORIGIN_PORT:-15280}
+ORIGIN="http://127.0.0.1:$ORIGIN_PORT"
+
+./bench/origin "$ORIGIN_PORT" &
+ORIGIN_PID=$!
+./proxy -q "$PROXY_PORT" > /dev/null &
+PROXY_PID=$!
+trap 'kill $PROXY_PID $ORIGIN_PID 2>/dev/null' EXIT INT TERM
+sleep 1
+
+load() {
+    ./bench/loadgen -x "127.0.0.1:$PROXY_PORT" -p "$PROXY_PID" -o "$OUT" -d "$DURATION" "$@"
+}
+
+for scenario in $SCENARIOS; do
+    echo "bench: $scenario"
+    case $scenario in
+    small)  load -n small -u "$ORIGIN/bytes/1024" -c 32 ;;
+    large)  load -n large -u "$ORIGIN/bytes/104857600" -c 4 -t 120000 ;;
+    idle)   load -n idle -u "$ORIGIN/bytes/1024" -c 16 -i 1000 ;;
+    slow)   load -n slow -u "$ORIGIN/slow/200/4096" -c 64 ;;
+    churn)  load -n churn -u "$ORIGIN/bytes/512" -c 64 -r 2000 ;;
+    *)      echo "bench: unknown scenario $scenario" >&2; exit 1 ;;
+    esac
+done
+
+echo "bench: results appended to $OUT"
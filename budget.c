@@ -0,0 +1,104 @@
+/*
+ * budget.c - Global memory budget for buffers
+ *
+ * The account is one atomic counter; charging it is as cheap as the
+ * allocation it accompanies. The average drain rate that decides which
+ * responses pause is a moving average updated without a lock, so
+ * concurrent updates may lose a sample now and then.
+ */
+
+#include "csapp.h"
+#include "stats.h"
+#include "coro.h"
+#include "budget.h"
+
+static size_t limit;
+static size_t used;
+static size_t peak;
+static uint64_t meanRate;       /* bytes/s, moving average over reads */
+
+
+/* budget_setLimit
+
+DESCRIPTION
+Set the budget in bytes, 0 for none. May be changed at any time.
+*/
+
+void budget_setLimit(size_t bytes)
+{
+    __atomic_store_n(&limit, bytes, __ATOMIC_RELAXED);
+}
+
+void budget_charge(size_t bytes)
+{
+    size_t now = __atomic_add_fetch(&used, bytes, __ATOMIC_RELAXED);
+
+    if (now > __atomic_load_n(&peak, __ATOMIC_RELAXED))
+    {
+        __atomic_store_n(&peak, now, __ATOMIC_RELAXED);
+    }
+}
+
+void budget_credit(size_t bytes)
+{
+    __atomic_sub_fetch(&used, bytes, __ATOMIC_RELAXED);
+}
+
+budgetPressure_t budget_pressure(void)
+{
+    size_t budget = __atomic_load_n(&limit, __ATOMIC_RELAXED);
+    size_t now = __atomic_load_n(&used, __ATOMIC_RELAXED);
+
+    if (budget == 0 || now < budget / 100 * BUDGET_TIGHT_PERCENT)
+    {
+        return BUDGET_OK;
+    }
+    return (now < budget) ? BUDGET_TIGHT : BUDGET_FULL;
+}
+
+/* budget_pace
+
+DESCRIPTION
+Called before every read of a response after the first, for a client that
+has been taking rate bytes per second, so the average is already known
+when the budget runs out. While the budget is exhausted, a response
+slower than the average waits here, holding no buffers, until memory is
+released or BUDGET_PAUSE_MAX has passed.
+*/
+
+void budget_pace(uint64_t rate)
+{
+    uint64_t mean = __atomic_load_n(&meanRate, __ATOMIC_RELAXED);
+    uint64_t waited;
+
+    __atomic_store_n(&meanRate, (mean == 0) ? rate : mean - mean / 16 + rate / 16, __ATOMIC_RELAXED);
+    if (budget_pressure() != BUDGET_FULL || rate >= mean)
+    {
+        return;
+    }
+    stats_add(STATS_BUDGET_PAUSES, 1);
+    for (waited = 0; waited < BUDGET_PAUSE_MAX && budget_pressure() == BUDGET_FULL;
+            waited += BUDGET_PAUSE_STEP)
+    {
+        coro_sleep(BUDGET_PAUSE_STEP);
+    }
+}
+
+int budget_report(char *buf, size_t size)
+{
+    static const char *levels[] = { "ok", "tight", "full" };
+    int n;
+
+    n = snprintf(buf, size,
+            "budget used_kb=%llu peak_kb=%llu budget_mb=%llu pressure=%s mean_rate_kbps=%llu\n",
+            (unsigned long long)(__atomic_load_n(&used, __ATOMIC_RELAXED) >> 10),
+            (unsigned long long)(__atomic_load_n(&peak, __ATOMIC_RELAXED) >> 10),
+            (unsigned long long)(__atomic_load_n(&limit, __ATOMIC_RELAXED) >> 20),
+            levels[budget_pressure()],
+            (unsigned long long)(__atomic_load_n(&meanRate, __ATOMIC_RELAXED) >> 10));
+    if (n < 0)
+    {
+        return 0;
+    }
+    return ((size_t)n < size) ? n : (int)size - 1;
+}
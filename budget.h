@@ -0,0 +1,50 @@
+/*
+ * budget.h - Global memory budget for buffers
+ *
+ * Every buffer the proxy allocates for a connection is charged to one
+ * process-wide account: buffer chain slabs (request headers, forwarded and
+ * compressed data), deflate states, tunnel copy buffers, capture records
+ * and handler jobs. The shared cache and the object store are sized
+ * separately and are not charged.
+ *
+ * Measured against memory_budget_mb, the account sets a pressure level:
+ *
+ *   BUDGET_OK      below BUDGET_TIGHT_PERCENT of the budget
+ *   BUDGET_TIGHT   buffers shrink: new slabs are IOBUF_SLAB_MIN bytes,
+ *                  chains and the deflate free list keep nothing spare
+ *   BUDGET_FULL    at or over the budget: new connections are shed, no
+ *                  new compression starts, and responses whose client
+ *                  drains slower than average stop reading from upstream
+ *                  until memory is released (BUDGET_PAUSE_MAX at most)
+ *
+ * A paused response holds no buffers, since pump() drains its chain after
+ * every read, so pausing the slowest ones frees memory for the fastest.
+ * Without a budget the account is still kept, for the stats page.
+ */
+
+#ifndef __BUDGET_H__
+#define __BUDGET_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BUDGET_TIGHT_PERCENT    75
+#define BUDGET_PAUSE_STEP       (10*1000)           /* microseconds between checks while paused */
+#define BUDGET_PAUSE_MAX        (2*1000*1000)       /* a paused read goes ahead after this long */
+
+typedef enum budgetPressure
+{
+    BUDGET_OK,
+    BUDGET_TIGHT,
+    BUDGET_FULL
+}
+budgetPressure_t;
+
+void budget_setLimit(size_t bytes);
+void budget_charge(size_t bytes);
+void budget_credit(size_t bytes);
+budgetPressure_t budget_pressure(void);
+void budget_pace(uint64_t rate);
+int budget_report(char *buf, size_t size);
+
+#endif /* __BUDGET_H__ */
@@ -0,0 +1,221 @@
+/*
+ * capture.c - Traffic capture for offline replay
+ *
+ * Each handler builds its record in a private buffer and appends it with a
+ * single write(2) on an O_APPEND descriptor, so concurrent records never
+ * interleave and no lock is taken on the request path.
+ */
+
+#include "csapp.h"
+#include "diag.h"
+#include "budget.h"
+#include "capture.h"
+
+#define CAPTURE_INITIAL_BODY    (64*1024)
+#define CAPTURE_ALIGN           8
+
+struct captureRecord
+{
+    char *buf;                  /* record header, request, body */
+    size_t used;
+    size_t capacity;
+};
+
+static int traceFD = -1;
+static int captureBodies;
+static uint64_t captureStart;
+
+
+/* capture_open
+
+DESCRIPTION
+Start capturing to path. A file header is written if the file is empty,
+otherwise records are appended to the existing trace.
+
+ARGUMENTS
+int withBodies
+    If not 0, up to CAPTURE_BODY_MAX bytes of every response are recorded too.
+
+RETURN VALUE
+0 on success, -1 on failure with errno set.
+*/
+
+int capture_open(const char *path, int withBodies)
+{
+    captureFileHeader_t fileHeader;
+    struct timeval now;
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, DEF_MODE)) == -1)
+    {
+        return -1;
+    }
+    if (fstat(fd, &st) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    gettimeofday(&now, NULL);
+    if (st.st_size == 0)
+    {
+        memcpy(fileHeader.magic, CAPTURE_MAGIC, sizeof(fileHeader.magic));
+        fileHeader.startTime = (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+        if (write(fd, &fileHeader, sizeof(fileHeader)) != sizeof(fileHeader))
+        {
+            close(fd);
+            return -1;
+        }
+    }
+
+    captureStart = stats_now();
+    captureBodies = withBodies;
+    traceFD = fd;
+    return 0;
+}
+
+int capture_enabled(void)
+{
+    return traceFD != -1;
+}
+
+/* capture_begin
+
+DESCRIPTION
+Start a record for a request whose header has just been read, with any
+body bytes that arrived along with it.
+
+RETURN VALUE
+The record, to be completed by capture_end.
+NULL if capture is disabled or memory is short; other capture calls accept NULL.
+*/
+
+captureRecord_t *capture_begin(uint64_t acceptTime, const struct sockaddr *clientAddr,
+        const iobuf_t *request)
+{
+    captureRecord_t *record;
+    captureRecordHeader_t *header;
+    size_t length = iobuf_length(request);
+
+    if (traceFD == -1 || (record = malloc(sizeof(*record))) == NULL)
+    {
+        return NULL;
+    }
+    record->capacity = sizeof(*header) + length + (captureBodies ? CAPTURE_INITIAL_BODY : 0)
+        + CAPTURE_ALIGN;
+    if ((record->buf = malloc(record->capacity)) == NULL)
+    {
+        free(record);
+        return NULL;
+    }
+    budget_charge(sizeof(*record) + record->capacity);
+
+    header = (captureRecordHeader_t*)record->buf;
+    memset(header, 0, sizeof(*header));
+    header->requestLength = length;
+    header->arrivalOffset = (acceptTime > captureStart) ? acceptTime - captureStart : 0;
+    if (clientAddr->sa_family == AF_INET)
+    {
+        header->clientAddr = ((const struct sockaddr_in*)clientAddr)->sin_addr.s_addr;
+    }
+    iobuf_copy(request, 0, record->buf + sizeof(*header), length);
+    record->used = sizeof(*header) + length;
+    return record;
+}
+
+/* capture_body
+
+DESCRIPTION
+Append response bytes to the record, up to CAPTURE_BODY_MAX in total.
+Does nothing unless bodies are being captured.
+*/
+
+void capture_body(captureRecord_t *record, const char *data, size_t length)
+{
+    captureRecordHeader_t *header;
+    size_t room;
+    char *grown;
+
+    if (record == NULL || !captureBodies)
+    {
+        return;
+    }
+    header = (captureRecordHeader_t*)record->buf;
+    room = CAPTURE_BODY_MAX - header->bodyLength;
+    if (length > room)
+    {
+        length = room;
+    }
+    if (length == 0)
+    {
+        return;
+    }
+
+    if (record->used + length + CAPTURE_ALIGN > record->capacity)
+    {
+        size_t capacity = record->capacity * 2;
+
+        if (capacity < record->used + length + CAPTURE_ALIGN)
+        {
+            capacity = record->used + length + CAPTURE_ALIGN;
+        }
+        if ((grown = realloc(record->buf, capacity)) == NULL)
+        {
+            return;
+        }
+        budget_charge(capacity - record->capacity);
+        record->buf = grown;
+        record->capacity = capacity;
+        header = (captureRecordHeader_t*)record->buf;
+    }
+    memcpy(record->buf + record->used, data, length);
+    record->used += length;
+    header->bodyLength += length;
+}
+
+/* capture_end
+
+DESCRIPTION
+Complete the record with the outcome and phase durations, append it to the
+trace and release it.
+*/
+
+void capture_end(captureRecord_t *record, int result, uint64_t responseSize,
+        const uint64_t *phaseTime)
+{
+    captureRecordHeader_t *header;
+    ssize_t written;
+    int i;
+
+    if (record == NULL)
+    {
+        return;
+    }
+    /* pad so the next record header is aligned for readers that map the file */
+    while (record->used % CAPTURE_ALIGN != 0)
+    {
+        record->buf[record->used++] = '\0';
+    }
+    header = (captureRecordHeader_t*)record->buf;
+    header->recordLength = record->used;
+    header->result = result;
+    header->responseSize = responseSize;
+    for (i = 0; i < STATS_PHASE_COUNT; i++)
+    {
+        header->phaseTime[i] = (phaseTime[i] > UINT32_MAX) ? UINT32_MAX : phaseTime[i];
+    }
+
+    while ((written = write(traceFD, record->buf, record->used)) == -1 && errno == EINTR)
+    {
+        /* retry */
+    }
+    if (written != (ssize_t)record->used)
+    {
+        DIAG_ERRNO(DIAG_LEVEL_WARN, "capture write");
+    }
+
+    budget_credit(sizeof(*record) + record->capacity);
+    free(record->buf);
+    free(record);
+}
@@ -0,0 +1,56 @@
+/*
+ * capture.h - Traffic capture for offline replay
+ *
+ * Trace file layout (host byte order):
+ *
+ *     captureFileHeader_t
+ *     { captureRecordHeader_t, request header bytes, response body bytes,
+ *       zero padding to a multiple of 8 bytes }...
+ *
+ * Records are appended when a request finishes, so they are ordered by
+ * completion; arrivalOffset gives the order requests came in.
+ */
+
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include "stats.h"
+#include "iobuf.h"
+
+#define CAPTURE_MAGIC       "PXTRACE1"
+#define CAPTURE_BODY_MAX    (1024*1024)     /* response bytes kept per record */
+
+typedef struct captureFileHeader
+{
+    char magic[8];
+    uint64_t startTime;                     /* wall clock, microseconds since the epoch */
+}
+captureFileHeader_t;
+
+typedef struct captureRecordHeader
+{
+    uint32_t recordLength;                  /* including this header and padding */
+    uint32_t requestLength;                 /* request header bytes that follow */
+    uint32_t bodyLength;                    /* response bytes that follow */
+    int32_t result;                         /* 0 served, -1 aborted */
+    uint64_t arrivalOffset;                 /* microseconds since capture start */
+    uint64_t responseSize;                  /* bytes sent to the client */
+    uint32_t clientAddr;                    /* IPv4, network byte order; 0 for IPv6 */
+    uint32_t phaseTime[STATS_PHASE_COUNT];  /* microseconds, 0 if not reached */
+}
+captureRecordHeader_t;
+
+typedef struct captureRecord captureRecord_t;
+
+int capture_open(const char *path, int withBodies);
+int capture_enabled(void);
+captureRecord_t *capture_begin(uint64_t acceptTime, const struct sockaddr *clientAddr,
+        const iobuf_t *request);
+void capture_body(captureRecord_t *record, const char *data, size_t length);
+void capture_end(captureRecord_t *record, int result, uint64_t responseSize,
+        const uint64_t *phaseTime);
+
+#endif /* __CAPTURE_H__ */
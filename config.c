@@ -0,0 +1,474 @@
+/*
+ * config.c - Runtime configuration with live reload
+ *
+ * Each key is described once in the table below, with its command-line
+ * option, how its value is parsed and where it is stored, so the option
+ * string, the file parser and the reload checks all follow from it.
+ */
+
+#include "csapp.h"
+#include "diag.h"
+#include "backend.h"
+#include "listener.h"
+#include "gzip.h"
+#include "store.h"
+#include "config.h"
+#include <stddef.h>
+
+typedef enum configType
+{
+    CONFIG_INT,
+    CONFIG_MEGABYTES,           /* stored in bytes */
+    CONFIG_PERCENT,             /* 0 for off, else below 100 */
+    CONFIG_STRING,
+    CONFIG_FLAG,                /* on the command line, without a value */
+    CONFIG_LEVEL,               /* diagnostics level by name or number */
+    CONFIG_RATE,                /* "rate[:burst]", empty for off */
+    CONFIG_LIST                 /* repeatable, handed to add() at startup */
+}
+configType_t;
+
+typedef struct configKey
+{
+    const char *name;
+    char option;                /* command-line short form, 0 if none */
+    configType_t type;
+    size_t offset;
+    int reloadable;
+    int (*add)(const char *value);
+}
+configKey_t;
+
+#define FIELD(member)   offsetof(config_t, member)
+
+static const configKey_t keys[] =
+{
+    { "port",                0,   CONFIG_INT,       FIELD(port),            0, NULL },
+    { "listen",              'l', CONFIG_LIST,      0,                      0, listener_add },
+    { "defer_accept",        0,   CONFIG_INT,       FIELD(deferAccept),     0, NULL },
+    { "fastopen_queue",      0,   CONFIG_INT,       FIELD(fastOpenQueue),   0, NULL },
+    { "workers",             'W', CONFIG_INT,       FIELD(workers),         0, NULL },
+    { "coroutine_threads",   'T', CONFIG_INT,       FIELD(coroutineThreads), 0, NULL },
+    { "cache_mb",            'c', CONFIG_MEGABYTES, FIELD(cacheSize),       0, NULL },
+    { "store_dir",           'O', CONFIG_STRING,    FIELD(storeDir),        0, NULL },
+    { "store_mb",            0,   CONFIG_MEGABYTES, FIELD(storeSize),       0, NULL },
+    { "listen_backlog",      0,   CONFIG_INT,       FIELD(listenBacklog),   0, NULL },
+    { "trace",               't', CONFIG_STRING,    FIELD(tracePath),       0, NULL },
+    { "trace_bodies",        'b', CONFIG_FLAG,      FIELD(traceBodies),     0, NULL },
+    { "pool",                'P', CONFIG_LIST,      0,                      0, backend_addPool },
+    { "route",               'R', CONFIG_LIST,      0,                      0, backend_addRoute },
+    { "balance",             'L', CONFIG_STRING,    FIELD(balance),         0, NULL },
+    { "origin_limit",        'C', CONFIG_INT,       FIELD(originLimit),     0, NULL },
+    { "verbosity",           0,   CONFIG_LEVEL,     FIELD(verbosity),       1, NULL },
+    { "log_file",            0,   CONFIG_STRING,    FIELD(logPath),         1, NULL },
+    { "client_timeout_ms",   0,   CONFIG_INT,       FIELD(clientTimeout),   1, NULL },
+    { "upstream_timeout_ms", 0,   CONFIG_INT,       FIELD(upstreamTimeout), 1, NULL },
+    { "socket_buffer",       0,   CONFIG_INT,       FIELD(socketBuffer),    1, NULL },
+    { "max_inflight",        'A', CONFIG_INT,       FIELD(maxInflight),     1, NULL },
+    { "memory_limit_mb",     'm', CONFIG_MEGABYTES, FIELD(maxMemory),       1, NULL },
+    { "memory_budget_mb",    'M', CONFIG_MEGABYTES, FIELD(memoryBudget),    1, NULL },
+    { "hedge_percentile",    'H', CONFIG_PERCENT,   FIELD(hedgePercentile), 1, NULL },
+    { "client_requests",     'r', CONFIG_RATE,      FIELD(clientRequests),  1, NULL },
+    { "client_bandwidth",    'w', CONFIG_RATE,      FIELD(clientBandwidth), 1, NULL },
+    { "client_prefix",       's', CONFIG_INT,       FIELD(clientPrefix),    1, NULL },
+    { "connection_rate",     'B', CONFIG_RATE,      FIELD(connectionRate),  1, NULL },
+    { "aggregate_rate",      'G', CONFIG_RATE,      FIELD(aggregateRate),   1, NULL },
+    { "gzip_level",          'z', CONFIG_INT,       FIELD(gzipLevel),       1, NULL },
+    { "gzip_min_size",       0,   CONFIG_INT,       FIELD(gzipMinSize),     1, NULL },
+    { "prefetch",            'p', CONFIG_FLAG,      FIELD(prefetch),        1, NULL },
+};
+
+#define KEY_COUNT       ((int)(sizeof(keys) / sizeof(keys[0])))
+
+static const char *levelNames[] = { "error", "warn", "notice", "info", "debug" };
+
+static const char *overrideKeys[CONFIG_OVERRIDES_MAX];
+static const char *overrideValues[CONFIG_OVERRIDES_MAX];
+static int overrideCount;
+
+static config_t *current;
+
+
+static void setDefaults(config_t *config)
+{
+    memset(config, 0, sizeof(*config));
+    config->listenBacklog = LISTENQ;
+    config->deferAccept = 1;
+    config->verbosity = DIAG_LEVEL_NOTICE;
+    config->clientPrefix = 32;
+    config->gzipMinSize = GZIP_MIN_SIZE;
+    config->storeSize = STORE_DEFAULT_LIMIT;
+    strcpy(config->balance, "lor");
+    strcpy(config->logPath, "proxy.log");
+}
+
+static const configKey_t *findKey(const char *name)
+{
+    int i;
+
+    for (i = 0; i < KEY_COUNT; i++)
+    {
+        if (strcmp(keys[i].name, name) == 0)
+        {
+            return &keys[i];
+        }
+    }
+    return NULL;
+}
+
+/* config_options
+
+RETURN VALUE
+The getopt(3) option string: -v, -q and -f (configuration file) plus the
+short form of every key.
+*/
+
+const char *config_options(void)
+{
+    static char options[2 * KEY_COUNT + 8];
+    size_t length;
+    int i;
+
+    if (options[0] != '\0')
+    {
+        return options;
+    }
+    strcpy(options, "vqf:");
+    length = strlen(options);
+    for (i = 0; i < KEY_COUNT; i++)
+    {
+        if (keys[i].option != 0)
+        {
+            options[length++] = keys[i].option;
+            if (keys[i].type != CONFIG_FLAG)
+            {
+                options[length++] = ':';
+            }
+        }
+    }
+    options[length] = '\0';
+    return options;
+}
+
+/* config_option
+
+DESCRIPTION
+Record a command-line option as an override of its key.
+
+RETURN VALUE
+0 on success, -1 if option is not the short form of any key.
+*/
+
+int config_option(int option, const char *value)
+{
+    int i;
+
+    for (i = 0; i < KEY_COUNT; i++)
+    {
+        if (keys[i].option == option)
+        {
+            config_override(keys[i].name, (keys[i].type == CONFIG_FLAG) ? "1" : value);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* config_override
+
+DESCRIPTION
+Set key to value on top of the configuration file, at every load. Both
+strings must stay valid for the life of the process, as argv does.
+*/
+
+void config_override(const char *key, const char *value)
+{
+    if (overrideCount < CONFIG_OVERRIDES_MAX)
+    {
+        overrideKeys[overrideCount] = key;
+        overrideValues[overrideCount] = value;
+        overrideCount++;
+    }
+}
+
+static int validRate(const char *value)
+{
+    char *end;
+
+    if (value[0] == '\0')
+    {
+        return 1;
+    }
+    if (strtod(value, &end) <= 0.0)
+    {
+        return 0;
+    }
+    return *end == '\0' || (*end == ':' && strtod(end + 1, &end) >= 0.0 && *end == '\0');
+}
+
+/* setValue
+
+DESCRIPTION
+Parse value for the key called name into config. List values are handed to
+the key's add function on the initial load and ignored on reloads.
+
+RETURN VALUE
+0 on success, -1 on an unknown key or a malformed value (reported as coming from where).
+*/
+
+static int setValue(config_t *config, const char *name, const char *value, int initial, const char *where)
+{
+    const configKey_t *key = findKey(name);
+    char *field, *end;
+    long long number;
+    double percent;
+    int i;
+
+    if (key == NULL)
+    {
+        DIAG_ERROR("%s: unknown key %s", where, name);
+        return -1;
+    }
+    field = (char*)config + key->offset;
+
+    switch (key->type)
+    {
+    case CONFIG_INT:
+    case CONFIG_MEGABYTES:
+    case CONFIG_FLAG:
+        number = strtoll(value, &end, 10);
+        if (value[0] == '\0' || *end != '\0' || number < 0 || number > INT32_MAX)
+        {
+            break;
+        }
+        if (key->type == CONFIG_MEGABYTES)
+        {
+            *(size_t*)field = (size_t)number << 20;
+        }
+        else
+        {
+            *(int*)field = (int)number;
+        }
+        return 0;
+    case CONFIG_PERCENT:
+        percent = strtod(value, &end);
+        if (value[0] == '\0' || *end != '\0' || percent < 0.0 || percent >= 100.0)
+        {
+            break;
+        }
+        *(double*)field = percent;
+        return 0;
+    case CONFIG_LEVEL:
+        for (i = 0; i <= DIAG_LEVEL_DEBUG; i++)
+        {
+            if (strcasecmp(value, levelNames[i]) == 0)
+            {
+                *(int*)field = i;
+                return 0;
+            }
+        }
+        number = strtoll(value, &end, 10);
+        if (value[0] == '\0' || *end != '\0')
+        {
+            break;
+        }
+        *(int*)field = (int)number;
+        return 0;
+    case CONFIG_RATE:
+        if (!validRate(value))
+        {
+            break;
+        }
+        /* fall through */
+    case CONFIG_STRING:
+        if (strlen(value) >= CONFIG_VALUE_MAX)
+        {
+            break;
+        }
+        strcpy(field, value);
+        return 0;
+    case CONFIG_LIST:
+        if (initial && key->add(value) == -1)
+        {
+            DIAG_ERROR("%s: bad %s %s", where, name, value);
+            return -1;
+        }
+        return 0;
+    }
+    DIAG_ERROR("%s: bad value for %s: %s", where, name, value);
+    return -1;
+}
+
+/* readFile
+
+DESCRIPTION
+Apply every "key value" line of the file at path to config.
+
+RETURN VALUE
+0 on success, -1 if the file cannot be read or has an error.
+*/
+
+static int readFile(config_t *config, const char *path, int initial)
+{
+    char line[MAXLINE], where[MAXLINE + 32];
+    char *key, *value, *end;
+    int lineNumber = 0, result = 0;
+    FILE *file;
+
+    if ((file = fopen(path, "r")) == NULL)
+    {
+        DIAG_ERRNO(DIAG_LEVEL_ERROR, path);
+        return -1;
+    }
+    while (result == 0 && fgets(line, sizeof(line), file) != NULL)
+    {
+        lineNumber++;
+        line[strcspn(line, "#\r\n")] = '\0';
+        key = line + strspn(line, " \t");
+        if (*key == '\0')
+        {
+            continue;
+        }
+        value = key + strcspn(key, " \t");
+        if (*value != '\0')
+        {
+            *value++ = '\0';
+        }
+        value += strspn(value, " \t");
+        for (end = value + strlen(value); end > value && (end[-1] == ' ' || end[-1] == '\t'); end--)
+        {
+        }
+        *end = '\0';
+        snprintf(where, sizeof(where), "%s:%d", path, lineNumber);
+        result = setValue(config, key, value, initial, where);
+    }
+    fclose(file);
+    return result;
+}
+
+/* keepStartupValues
+
+DESCRIPTION
+Carry the startup-only settings of the running configuration over into a
+reloaded one, warning about any the reload tried to change.
+*/
+
+static void keepStartupValues(config_t *config, const config_t *running)
+{
+    size_t size;
+    int i;
+
+    for (i = 0; i < KEY_COUNT; i++)
+    {
+        if (keys[i].reloadable || keys[i].type == CONFIG_LIST)
+        {
+            continue;
+        }
+        size = (keys[i].type == CONFIG_STRING) ? CONFIG_VALUE_MAX
+            : (keys[i].type == CONFIG_MEGABYTES) ? sizeof(size_t) : sizeof(int);
+        if (memcmp((char*)config + keys[i].offset, (char*)running + keys[i].offset, size) != 0)
+        {
+            DIAG_WARN("%s cannot change on reload; restart or upgrade (SIGUSR2) to apply", keys[i].name);
+            memcpy((char*)config + keys[i].offset, (char*)running + keys[i].offset, size);
+        }
+    }
+}
+
+/* config_load
+
+DESCRIPTION
+Build a configuration from the defaults, the file at path (if not NULL) and
+the command-line overrides. On a reload (initial 0), list keys are ignored
+and startup-only keys keep their running values.
+
+RETURN VALUE
+The new configuration, to be installed with config_publish; NULL if it has
+an error, which has been reported.
+*/
+
+config_t *config_load(const char *path, int initial)
+{
+    config_t *config;
+    int i;
+
+    if ((config = malloc(sizeof(config_t))) == NULL)
+    {
+        return NULL;
+    }
+    setDefaults(config);
+    if (path != NULL && readFile(config, path, initial) == -1)
+    {
+        free(config);
+        return NULL;
+    }
+    for (i = 0; i < overrideCount; i++)
+    {
+        if (setValue(config, overrideKeys[i], overrideValues[i], initial, "command line") == -1)
+        {
+            free(config);
+            return NULL;
+        }
+    }
+    if (config->port < 0 || config->port > 65535)
+    {
+        DIAG_ERROR("port %d out of range", config->port);
+        free(config);
+        return NULL;
+    }
+    if (config->gzipLevel > 9)
+    {
+        DIAG_ERROR("gzip level %d out of range", config->gzipLevel);
+        free(config);
+        return NULL;
+    }
+    if (!initial && current != NULL)
+    {
+        keepStartupValues(config, current);
+    }
+    config->references = 1;
+    return config;
+}
+
+/* config_publish
+
+DESCRIPTION
+Make config the active configuration. The one it replaces is freed once
+the handlers still using it are done.
+*/
+
+void config_publish(config_t *config)
+{
+    config_t *old = current;
+
+    __atomic_store_n(&current, config, __ATOMIC_RELEASE);
+    if (old != NULL)
+    {
+        config_release(old);
+    }
+}
+
+const config_t *config_current(void)
+{
+    return __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+}
+
+/* config_acquire / config_release
+
+DESCRIPTION
+Take and drop a reference to the active configuration. Only the thread that
+calls config_publish may acquire; any thread may release.
+*/
+
+config_t *config_acquire(void)
+{
+    __atomic_add_fetch(&current->references, 1, __ATOMIC_RELAXED);
+    return current;
+}
+
+void config_release(config_t *config)
+{
+    if (__atomic_sub_fetch(&config->references, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free(config);
+    }
+}
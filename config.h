@@ -0,0 +1,79 @@
+/*
+ * config.h - Runtime configuration with live reload
+ *
+ * Settings come from built-in defaults, then the configuration file, then
+ * the command line, so a command-line option always wins. The file has one
+ * "key value" pair per line; '#' starts a comment, and pool and route may
+ * be repeated. Every command-line option is the short form of a key.
+ *
+ * The active configuration is an immutable config_t behind one pointer. A
+ * reload builds a complete new one and swaps the pointer; readers never
+ * lock. Handlers hold a reference to the configuration they were accepted
+ * under, and a replaced configuration is freed when its last reference is
+ * dropped. References are only taken by the thread that swaps, so taking
+ * one never races with the swap.
+ *
+ * Keys marked startup-only in config.c (listening sockets, workers, cache
+ * size, object store, capture, backends, origin concurrency cap) keep their values on
+ * reload; changing them takes a restart or an upgrade (SIGUSR2).
+ */
+
+#ifndef __CONFIG_H__
+#define __CONFIG_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CONFIG_VALUE_MAX        256
+#define CONFIG_OVERRIDES_MAX    64
+
+typedef struct config
+{
+    /* startup-only */
+    int port;
+    int deferAccept;            /* seconds, 0 for off */
+    int fastOpenQueue;          /* 0 for off */
+    int workers;
+    int coroutineThreads;       /* schedulers per process, 0 for a thread per connection */
+    size_t cacheSize;           /* bytes of shared response cache, 0 for none */
+    char storeDir[CONFIG_VALUE_MAX];    /* object store for range requests, empty for none */
+    size_t storeSize;           /* bytes of stored objects */
+    int listenBacklog;
+    char tracePath[CONFIG_VALUE_MAX];
+    int traceBodies;
+    char balance[CONFIG_VALUE_MAX];
+    int originLimit;
+
+    /* reloadable */
+    int verbosity;
+    char logPath[CONFIG_VALUE_MAX];
+    int clientTimeout;          /* milliseconds of client inactivity, 0 for none */
+    int upstreamTimeout;        /* milliseconds of upstream inactivity, 0 for none */
+    int socketBuffer;           /* SO_SNDBUF/SO_RCVBUF bytes, 0 for the kernel default */
+    int maxInflight;
+    size_t maxMemory;
+    size_t memoryBudget;        /* bytes of connection buffers, 0 for no budget */
+    double hedgePercentile;
+    char clientRequests[CONFIG_VALUE_MAX];
+    char clientBandwidth[CONFIG_VALUE_MAX];
+    int clientPrefix;
+    char connectionRate[CONFIG_VALUE_MAX];
+    char aggregateRate[CONFIG_VALUE_MAX];
+    int gzipLevel;              /* 1-9, 0 for no compression */
+    int gzipMinSize;            /* bytes */
+    int prefetch;               /* prefetch subresources of pages into the shared cache */
+
+    int references;
+}
+config_t;
+
+const char *config_options(void);
+int config_option(int option, const char *value);
+void config_override(const char *key, const char *value);
+config_t *config_load(const char *path, int initial);
+void config_publish(config_t *config);
+const config_t *config_current(void);
+config_t *config_acquire(void);
+void config_release(config_t *config);
+
+#endif /* __CONFIG_H__ */
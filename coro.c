@@ -0,0 +1,1216 @@
+/*
+ * coro.c - Stackful coroutines on a few scheduler threads
+ *
+ * A scheduler's ready queue, timer heap and epoll set belong to its thread.
+ * Other threads reach it only through two inboxes under its lock, one for
+ * new coroutines and one for wakeups, an eventfd that interrupts its
+ * epoll_wait, and the top of its deque of new coroutines, which follows
+ * Le, Pop, Cohen and Zappa Nardelli's C11 formulation of the Chase-Lev
+ * deque. Arrays the deque has outgrown are kept, since a thief may still
+ * be reading one; each is half the size of its successor.
+ *
+ * A wait adds its descriptors to the epoll set and removes them when it
+ * ends, so the same descriptor can later be waited on from another
+ * scheduler, or with poll(2) from a plain thread.
+ */
+
+#include "csapp.h"
+#include "stats.h"
+#include "coro.h"
+#include <ucontext.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+typedef enum coroState
+{
+    CORO_NEW,                   /* not started, may be stolen */
+    CORO_READY,
+    CORO_RUNNING,
+    CORO_YIELDED,
+    CORO_WAITING,               /* for descriptors or a timer */
+    CORO_PARKED,                /* for coro_wake() or a timer */
+    CORO_DEAD
+}
+coroState_t;
+
+typedef struct scheduler scheduler_t;
+
+struct coro
+{
+    ucontext_t context;
+    void *(*fn)(void *arg);
+    void *arg;
+    char *stack;                /* guard page first */
+    scheduler_t *scheduler;
+    coroState_t state;
+    int queued;                 /* on the ready queue */
+    int inbox;                  /* on the wakeup inbox, under the scheduler's lock */
+    int woken;                  /* set by a wakeup, taken by coro_park() */
+    uint64_t deadline;
+    int timer;                  /* index in the timer heap, -1 if none */
+    coro_t *next;               /* ready queue, new, yielded or dead list */
+    coro_t *nextWoken;
+};
+
+/* one descriptor of a wait, on the waiting coroutine's stack */
+typedef struct waitRecord
+{
+    coro_t *coro;
+    uint32_t events;            /* reported by epoll */
+}
+waitRecord_t;
+
+typedef struct dequeArray
+{
+    int64_t size;               /* a power of two */
+    struct dequeArray *retired;
+    coro_t *slots[];
+}
+dequeArray_t;
+
+typedef struct deque
+{
+    int64_t top;                /* thieves take here */
+    int64_t bottom;             /* the owner pushes and takes here */
+    dequeArray_t *array;
+}
+deque_t;
+
+struct scheduler
+{
+    deque_t fresh;              /* new coroutines */
+    int sleeping;               /* in epoll_wait with nothing to run */
+    uint64_t roundStart;
+    coro_t *yieldedHead, *yieldedTail;
+    int epollFD;
+    int eventFD;                /* written when an inbox becomes non-empty */
+    ucontext_t loop;
+    coro_t *running;
+    coro_t *readyHead, *readyTail;
+    coro_t **timers;            /* binary heap by deadline */
+    int timerCount, timerCapacity;
+    coro_t *dead;               /* freed once the inboxes cannot name them */
+    pthread_mutex_t lock;
+    coro_t *spawned;
+    coro_t *woken;
+    uint64_t switches;
+    uint64_t steals;
+};
+
+/* a blocking call run by a helper thread, on the waiting coroutine's stack */
+typedef struct offloadJob
+{
+    void (*fn)(void *arg);
+    void *arg;
+    coro_t *coro;
+    int done;
+    struct offloadJob *next;
+}
+offloadJob_t;
+
+typedef struct lookup
+{
+    const char *node, *service;
+    const struct addrinfo *hints;
+    struct addrinfo **result;
+    int status;
+}
+lookup_t;
+
+static scheduler_t *schedulers;
+static int schedulerCount;
+static unsigned int nextScheduler;
+static __thread scheduler_t *self;
+static int idleCount;
+
+static char *stackCache[CORO_STACK_CACHE];
+static int stackCount;
+static pthread_mutex_t stackLock = PTHREAD_MUTEX_INITIALIZER;
+
+static offloadJob_t *offloadHead, *offloadTail;
+static pthread_mutex_t offloadLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t offloadReady = PTHREAD_COND_INITIALIZER;
+
+static uint64_t liveCount, spawnCount, offloadCount;
+
+
+static void timerSwap(scheduler_t *s, int a, int b)
+{
+    coro_t *swapped = s->timers[a];
+
+    s->timers[a] = s->timers[b];
+    s->timers[b] = swapped;
+    s->timers[a]->timer = a;
+    s->timers[b]->timer = b;
+}
+
+static void timerUp(scheduler_t *s, int i)
+{
+    while (i > 0 && s->timers[(i - 1) / 2]->deadline > s->timers[i]->deadline)
+    {
+        timerSwap(s, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void timerDown(scheduler_t *s, int i)
+{
+    int child;
+
+    while ((child = 2 * i + 1) < s->timerCount)
+    {
+        if (child + 1 < s->timerCount && s->timers[child + 1]->deadline < s->timers[child]->deadline)
+        {
+            child++;
+        }
+        if (s->timers[i]->deadline <= s->timers[child]->deadline)
+        {
+            break;
+        }
+        timerSwap(s, i, child);
+        i = child;
+    }
+}
+
+static int timerAdd(scheduler_t *s, coro_t *coro, uint64_t deadline)
+{
+    coro_t **grown;
+    int capacity;
+
+    if (s->timerCount == s->timerCapacity)
+    {
+        capacity = s->timerCapacity ? s->timerCapacity * 2 : 64;
+        if ((grown = realloc(s->timers, capacity * sizeof(coro_t*))) == NULL)
+        {
+            return -1;
+        }
+        s->timers = grown;
+        s->timerCapacity = capacity;
+    }
+    coro->deadline = deadline;
+    coro->timer = s->timerCount;
+    s->timers[s->timerCount++] = coro;
+    timerUp(s, coro->timer);
+    return 0;
+}
+
+static void timerRemove(scheduler_t *s, coro_t *coro)
+{
+    coro_t *moved;
+    int i = coro->timer;
+
+    if (i < 0)
+    {
+        return;
+    }
+    coro->timer = -1;
+    if (i != --s->timerCount)
+    {
+        moved = s->timers[i] = s->timers[s->timerCount];
+        moved->timer = i;
+        timerUp(s, i);
+        timerDown(s, moved->timer);
+    }
+}
+
+static int dequeInit(deque_t *d)
+{
+    if ((d->array = calloc(1, sizeof(dequeArray_t) + CORO_DEQUE_INITIAL * sizeof(coro_t*))) == NULL)
+    {
+        return -1;
+    }
+    d->array->size = CORO_DEQUE_INITIAL;
+    return 0;
+}
+
+static dequeArray_t *dequeGrow(deque_t *d, dequeArray_t *old, int64_t top, int64_t bottom)
+{
+    dequeArray_t *array;
+    int64_t i;
+
+    if ((array = malloc(sizeof(dequeArray_t) + 2 * old->size * sizeof(coro_t*))) == NULL)
+    {
+        return NULL;
+    }
+    array->size = 2 * old->size;
+    array->retired = old;
+    for (i = top; i < bottom; i++)
+    {
+        array->slots[i & (array->size - 1)] = old->slots[i & (old->size - 1)];
+    }
+    __atomic_store_n(&d->array, array, __ATOMIC_RELEASE);
+    return array;
+}
+
+/* dequePush
+
+DESCRIPTION
+Owner only: add coro at the bottom.
+
+RETURN VALUE
+0 on success, -1 if the deque was full and could not grow.
+*/
+
+static int dequePush(deque_t *d, coro_t *coro)
+{
+    int64_t bottom = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    int64_t top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    dequeArray_t *array = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+
+    if (bottom - top > array->size - 1 && (array = dequeGrow(d, array, top, bottom)) == NULL)
+    {
+        return -1;
+    }
+    __atomic_store_n(&array->slots[bottom & (array->size - 1)], coro, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&d->bottom, bottom + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* dequeTake
+
+DESCRIPTION
+Owner only: remove the coroutine at the bottom, the newest.
+
+RETURN VALUE
+The coroutine, NULL if the deque is empty or a thief took the last one.
+*/
+
+static coro_t *dequeTake(deque_t *d)
+{
+    int64_t bottom = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    dequeArray_t *array = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+    coro_t *coro = NULL;
+    int64_t top;
+
+    __atomic_store_n(&d->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    top = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+    if (top <= bottom)
+    {
+        coro = __atomic_load_n(&array->slots[bottom & (array->size - 1)], __ATOMIC_RELAXED);
+        if (top == bottom)
+        {
+            /* the last one: race the thieves for it */
+            if (!__atomic_compare_exchange_n(&d->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            {
+                coro = NULL;
+            }
+            __atomic_store_n(&d->bottom, bottom + 1, __ATOMIC_RELAXED);
+        }
+    }
+    else
+    {
+        __atomic_store_n(&d->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return coro;
+}
+
+/* dequeSteal
+
+DESCRIPTION
+Any thread: remove the coroutine at the top, the oldest.
+
+RETURN VALUE
+1 with the coroutine in coro, 0 if the deque is empty, -1 if another
+thread took it first.
+*/
+
+static int dequeSteal(deque_t *d, coro_t **coro)
+{
+    int64_t top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    dequeArray_t *array;
+    int64_t bottom;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    bottom = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if (top >= bottom)
+    {
+        return 0;
+    }
+    array = __atomic_load_n(&d->array, __ATOMIC_ACQUIRE);
+    *coro = __atomic_load_n(&array->slots[top & (array->size - 1)], __ATOMIC_RELAXED);
+    return __atomic_compare_exchange_n(&d->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED) ? 1 : -1;
+}
+
+static int64_t dequeSize(deque_t *d)
+{
+    return __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+}
+
+/* allocateStack
+
+RETURN VALUE
+A CORO_STACK_SIZE stack whose lowest page is inaccessible, NULL if none
+could be mapped.
+*/
+
+static char *allocateStack(void)
+{
+    char *stack = NULL;
+
+    pthread_mutex_lock(&stackLock);
+    if (stackCount > 0)
+    {
+        stack = stackCache[--stackCount];
+    }
+    pthread_mutex_unlock(&stackLock);
+    if (stack != NULL)
+    {
+        return stack;
+    }
+
+    stack = mmap(NULL, CORO_STACK_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED)
+    {
+        return NULL;
+    }
+    if (mprotect(stack, sysconf(_SC_PAGESIZE), PROT_NONE) == -1)
+    {
+        munmap(stack, CORO_STACK_SIZE);
+        return NULL;
+    }
+    return stack;
+}
+
+static void releaseStack(char *stack)
+{
+    pthread_mutex_lock(&stackLock);
+    if (stackCount < CORO_STACK_CACHE)
+    {
+        stackCache[stackCount++] = stack;
+        stack = NULL;
+    }
+    pthread_mutex_unlock(&stackLock);
+    if (stack != NULL)
+    {
+        munmap(stack, CORO_STACK_SIZE);
+    }
+}
+
+static void notify(scheduler_t *s)
+{
+    uint64_t one = 1;
+
+    if (write(s->eventFD, &one, sizeof(one)) == -1)
+    {
+        /* EAGAIN: the counter is far from zero, the loop wakes anyway */
+    }
+}
+
+static void makeReady(scheduler_t *s, coro_t *coro)
+{
+    if (coro->queued)
+    {
+        return;
+    }
+    coro->queued = 1;
+    coro->next = NULL;
+    if (s->readyTail != NULL)
+    {
+        s->readyTail->next = coro;
+    }
+    else
+    {
+        s->readyHead = coro;
+    }
+    s->readyTail = coro;
+}
+
+/* suspend
+
+DESCRIPTION
+Switch from the running coroutine back to its scheduler's loop, which
+resumes it once something made it ready again.
+*/
+
+static void suspend(coro_t *coro, coroState_t state)
+{
+    coro->state = state;
+    swapcontext(&coro->context, &coro->scheduler->loop);
+}
+
+/* returns to the loop through uc_link */
+static void trampoline(void)
+{
+    coro_t *coro = self->running;
+
+    coro->fn(coro->arg);
+    coro->state = CORO_DEAD;
+}
+
+static void resume(scheduler_t *s, coro_t *coro)
+{
+    /* a new coroutine's context is made by the scheduler that runs it, for uc_link */
+    if (coro->state == CORO_NEW)
+    {
+        getcontext(&coro->context);
+        coro->context.uc_stack.ss_sp = coro->stack;
+        coro->context.uc_stack.ss_size = CORO_STACK_SIZE;
+        coro->context.uc_link = &s->loop;
+        makecontext(&coro->context, trampoline, 0);
+        coro->scheduler = s;
+    }
+    coro->queued = 0;
+    timerRemove(s, coro);
+    coro->state = CORO_RUNNING;
+    s->running = coro;
+    __atomic_add_fetch(&s->switches, 1, __ATOMIC_RELAXED);
+    swapcontext(&s->loop, &coro->context);
+    s->running = NULL;
+    if (coro->state == CORO_DEAD)
+    {
+        coro->next = s->dead;
+        s->dead = coro;
+    }
+    else if (coro->state == CORO_YIELDED)
+    {
+        coro->next = NULL;
+        if (s->yieldedTail != NULL)
+        {
+            s->yieldedTail->next = coro;
+        }
+        else
+        {
+            s->yieldedHead = coro;
+        }
+        s->yieldedTail = coro;
+    }
+}
+
+/* wakeSleeper
+
+DESCRIPTION
+Called when this scheduler has more work than it can start at once: wake
+a sleeping scheduler, if any, to steal some. The fence pairs with the one
+in dequeSteal(), so either the sleeper is seen here or the work is seen
+by its last look before sleeping.
+*/
+
+static void wakeSleeper(scheduler_t *s)
+{
+    int i;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&idleCount, __ATOMIC_RELAXED) == 0)
+    {
+        return;
+    }
+    for (i = 0; i < schedulerCount; i++)
+    {
+        if (&schedulers[i] != s && __atomic_load_n(&schedulers[i].sleeping, __ATOMIC_RELAXED))
+        {
+            notify(&schedulers[i]);
+            return;
+        }
+    }
+}
+
+/* steal
+
+RETURN VALUE
+A new coroutine taken from another scheduler's deque, NULL if none has one.
+*/
+
+static coro_t *steal(scheduler_t *s)
+{
+    scheduler_t *victim;
+    coro_t *coro;
+    int i, result;
+
+    for (i = 1; i < schedulerCount; i++)
+    {
+        victim = &schedulers[(s - schedulers + i) % schedulerCount];
+        while ((result = dequeSteal(&victim->fresh, &coro)) == -1)
+        {
+        }
+        if (result == 1)
+        {
+            __atomic_add_fetch(&s->steals, 1, __ATOMIC_RELAXED);
+            return coro;
+        }
+    }
+    return NULL;
+}
+
+/* drainInbox
+
+DESCRIPTION
+Move new coroutines to the deque, where other schedulers can steal them,
+and queue the parked ones that were woken. A wakeup for a coroutine that
+is not parked stays in its woken flag, for its next coro_park() to take.
+*/
+
+static void drainInbox(scheduler_t *s)
+{
+    coro_t *coro, *next;
+    int spawned = 0;
+
+    pthread_mutex_lock(&s->lock);
+    for (coro = s->spawned; coro != NULL; coro = next)
+    {
+        next = coro->next;
+        if (dequePush(&s->fresh, coro) == -1)
+        {
+            makeReady(s, coro);
+        }
+        spawned = 1;
+    }
+    s->spawned = NULL;
+    for (coro = s->woken; coro != NULL; coro = coro->nextWoken)
+    {
+        coro->inbox = 0;
+        if (coro->state == CORO_PARKED && __atomic_load_n(&coro->woken, __ATOMIC_ACQUIRE))
+        {
+            makeReady(s, coro);
+        }
+    }
+    s->woken = NULL;
+    pthread_mutex_unlock(&s->lock);
+
+    if (spawned && dequeSize(&s->fresh) + (s->readyHead != NULL) > 1)
+    {
+        wakeSleeper(s);
+    }
+}
+
+static void freeDead(scheduler_t *s)
+{
+    coro_t *coro;
+
+    while ((coro = s->dead) != NULL)
+    {
+        s->dead = coro->next;
+        releaseStack(coro->stack);
+        free(coro);
+        __atomic_sub_fetch(&liveCount, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* loop
+
+DESCRIPTION
+Scheduler thread: run every ready coroutine until it waits, yields or
+ends, then start new ones for what is left of CORO_SLICE, or steal one if
+there was nothing to do. Then wait in epoll for descriptors, the eventfd
+or the earliest timer; after a round of work epoll is only polled. A
+scheduler about to sleep says so and looks for work to steal once more,
+so wakeSleeper() cannot miss it.
+*/
+
+static void *loop(void *arg)
+{
+    scheduler_t *s = arg;
+    struct epoll_event events[CORO_EVENTS];
+    waitRecord_t *record;
+    coro_t *coro;
+    uint64_t now, counter;
+    int count, timeout, ran, i;
+
+    self = s;
+    for (;;)
+    {
+        drainInbox(s);
+        freeDead(s);
+        s->roundStart = stats_now();
+        for (ran = 0; (coro = s->readyHead) != NULL; ran = 1)
+        {
+            if ((s->readyHead = coro->next) == NULL)
+            {
+                s->readyTail = NULL;
+            }
+            resume(s, coro);
+        }
+        while (stats_now() - s->roundStart < CORO_SLICE && (coro = dequeTake(&s->fresh)) != NULL)
+        {
+            resume(s, coro);
+            ran = 1;
+        }
+        if (!ran && (coro = steal(s)) != NULL)
+        {
+            resume(s, coro);
+            ran = 1;
+        }
+        while ((coro = s->yieldedHead) != NULL)
+        {
+            s->yieldedHead = coro->next;
+            makeReady(s, coro);
+        }
+        s->yieldedTail = NULL;
+
+        timeout = -1;
+        if (ran || s->readyHead != NULL || dequeSize(&s->fresh) > 0)
+        {
+            timeout = 0;
+        }
+        else if (s->timerCount > 0)
+        {
+            now = stats_now();
+            timeout = (s->timers[0]->deadline <= now) ? 0 : (int)((s->timers[0]->deadline - now + 999) / 1000);
+        }
+        if (timeout != 0)
+        {
+            __atomic_store_n(&s->sleeping, 1, __ATOMIC_SEQ_CST);
+            __atomic_add_fetch(&idleCount, 1, __ATOMIC_SEQ_CST);
+            if ((coro = steal(s)) != NULL)
+            {
+                timeout = 0;
+                makeReady(s, coro);
+            }
+        }
+        if ((count = epoll_wait(s->epollFD, events, CORO_EVENTS, timeout)) == -1)
+        {
+            count = 0;
+        }
+        if (__atomic_load_n(&s->sleeping, __ATOMIC_RELAXED))
+        {
+            __atomic_store_n(&s->sleeping, 0, __ATOMIC_RELAXED);
+            __atomic_sub_fetch(&idleCount, 1, __ATOMIC_SEQ_CST);
+        }
+        for (i = 0; i < count; i++)
+        {
+            if ((record = events[i].data.ptr) == NULL)
+            {
+                while (read(s->eventFD, &counter, sizeof(counter)) == -1 && errno == EINTR)
+                {
+                }
+                continue;
+            }
+            record->events |= events[i].events;
+            makeReady(s, record->coro);
+        }
+
+        now = stats_now();
+        while (s->timerCount > 0 && s->timers[0]->deadline <= now)
+        {
+            coro = s->timers[0];
+            timerRemove(s, coro);
+            makeReady(s, coro);
+        }
+    }
+    return NULL;
+}
+
+/* wake
+
+DESCRIPTION
+Queue a wakeup for coro. A done flag, if given, is set under the same lock:
+once the coroutine sees it, the wakeup is in the inbox, which is drained
+before the coroutine can be freed.
+*/
+
+static void wake(coro_t *coro, int *done)
+{
+    scheduler_t *s = coro->scheduler;
+    int signal = 0;
+
+    pthread_mutex_lock(&s->lock);
+    if (done != NULL)
+    {
+        __atomic_store_n(done, 1, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&coro->woken, 1, __ATOMIC_RELEASE);
+    if (!coro->inbox)
+    {
+        signal = (s->spawned == NULL && s->woken == NULL);
+        coro->inbox = 1;
+        coro->nextWoken = s->woken;
+        s->woken = coro;
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (signal)
+    {
+        notify(s);
+    }
+}
+
+static void *offloadLoop(void *arg)
+{
+    offloadJob_t *job;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&offloadLock);
+        while (offloadHead == NULL)
+        {
+            pthread_cond_wait(&offloadReady, &offloadLock);
+        }
+        job = offloadHead;
+        if ((offloadHead = job->next) == NULL)
+        {
+            offloadTail = NULL;
+        }
+        pthread_mutex_unlock(&offloadLock);
+
+        job->fn(job->arg);
+        wake(job->coro, &job->done);
+    }
+    return NULL;
+}
+
+/* coro_start
+
+DESCRIPTION
+Start threads scheduler threads and the helper threads for blocking calls.
+Called once, in the process that will spawn the coroutines.
+
+RETURN VALUE
+0 on success, -1 if a thread or its epoll set could not be created.
+*/
+
+int coro_start(int threads)
+{
+    struct epoll_event event;
+    pthread_attr_t threadAttr;
+    pthread_t thread;
+    scheduler_t *s;
+    int i;
+
+    if ((schedulers = calloc(threads, sizeof(scheduler_t))) == NULL)
+    {
+        return -1;
+    }
+    pthread_attr_init(&threadAttr);
+    pthread_attr_setdetachstate(&threadAttr, PTHREAD_CREATE_DETACHED);
+    for (i = 0; i < threads; i++)
+    {
+        s = &schedulers[i];
+        pthread_mutex_init(&s->lock, NULL);
+        if (dequeInit(&s->fresh) == -1)
+        {
+            pthread_attr_destroy(&threadAttr);
+            return -1;
+        }
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        if ((s->epollFD = epoll_create1(EPOLL_CLOEXEC)) == -1
+                || (s->eventFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1
+                || epoll_ctl(s->epollFD, EPOLL_CTL_ADD, s->eventFD, &event) == -1
+                || pthread_create(&thread, &threadAttr, loop, s) != 0)
+        {
+            pthread_attr_destroy(&threadAttr);
+            return -1;
+        }
+    }
+    for (i = 0; i < CORO_OFFLOAD_THREADS; i++)
+    {
+        if (pthread_create(&thread, &threadAttr, offloadLoop, NULL) != 0)
+        {
+            pthread_attr_destroy(&threadAttr);
+            return -1;
+        }
+    }
+    pthread_attr_destroy(&threadAttr);
+    schedulerCount = threads;
+    return 0;
+}
+
+int coro_enabled(void)
+{
+    return schedulerCount > 0;
+}
+
+/* placement
+
+RETURN VALUE
+The scheduler for a new coroutine: a sleeping one, else the next in turn.
+*/
+
+static scheduler_t *placement(void)
+{
+    unsigned int start = __atomic_fetch_add(&nextScheduler, 1, __ATOMIC_RELAXED);
+    int i;
+
+    if (__atomic_load_n(&idleCount, __ATOMIC_RELAXED) > 0)
+    {
+        for (i = 0; i < schedulerCount; i++)
+        {
+            if (__atomic_load_n(&schedulers[(start + i) % schedulerCount].sleeping, __ATOMIC_RELAXED))
+            {
+                return &schedulers[(start + i) % schedulerCount];
+            }
+        }
+    }
+    return &schedulers[start % schedulerCount];
+}
+
+/* coro_spawn
+
+DESCRIPTION
+Run fn(arg) on a new coroutine, placed on a sleeping scheduler if there is
+one; another scheduler may steal it before it starts. What fn returns is
+ignored. May be called from any thread.
+
+RETURN VALUE
+0 on success, -1 if the coroutine or its stack could not be allocated.
+*/
+
+int coro_spawn(void *(*fn)(void *arg), void *arg)
+{
+    scheduler_t *s = placement();
+    coro_t *coro;
+    int signal;
+
+    if ((coro = calloc(1, sizeof(coro_t))) == NULL)
+    {
+        return -1;
+    }
+    if ((coro->stack = allocateStack()) == NULL)
+    {
+        free(coro);
+        return -1;
+    }
+    coro->fn = fn;
+    coro->arg = arg;
+    coro->scheduler = s;
+    coro->state = CORO_NEW;
+    coro->timer = -1;
+    __atomic_add_fetch(&liveCount, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&spawnCount, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&s->lock);
+    signal = (s->spawned == NULL && s->woken == NULL);
+    coro->next = s->spawned;
+    s->spawned = coro;
+    pthread_mutex_unlock(&s->lock);
+    if (signal)
+    {
+        notify(s);
+    }
+    return 0;
+}
+
+/* coro_self
+
+RETURN VALUE
+The running coroutine, NULL when called from a plain thread.
+*/
+
+coro_t *coro_self(void)
+{
+    return (self != NULL) ? self->running : NULL;
+}
+
+/* coro_park
+
+DESCRIPTION
+Suspend the running coroutine until coro_wake() is called for it or the
+deadline (stats_now() microseconds, 0 for none) passes. A wakeup that came
+before the call returns at once. Wakeups may be spurious, so callers wait
+in a loop on their own condition.
+
+RETURN VALUE
+0 when woken, -1 when the deadline passed.
+*/
+
+int coro_park(uint64_t deadline)
+{
+    coro_t *coro = coro_self();
+
+    if (__atomic_exchange_n(&coro->woken, 0, __ATOMIC_ACQ_REL))
+    {
+        return 0;
+    }
+    if (deadline != 0 && timerAdd(coro->scheduler, coro, deadline) == -1)
+    {
+        return -1;
+    }
+    suspend(coro, CORO_PARKED);
+    return __atomic_exchange_n(&coro->woken, 0, __ATOMIC_ACQ_REL) ? 0 : -1;
+}
+
+/* coro_wake
+
+DESCRIPTION
+Make a parked coroutine ready, from any thread. The caller must know the
+coroutine has not ended: typically both sides hold the same lock while
+deciding, as with a condition variable.
+*/
+
+void coro_wake(coro_t *coro)
+{
+    wake(coro, NULL);
+}
+
+static short pollEvents(uint32_t events)
+{
+    return ((events & EPOLLIN) ? POLLIN : 0) | ((events & EPOLLOUT) ? POLLOUT : 0)
+        | ((events & EPOLLERR) ? POLLERR : 0) | ((events & EPOLLHUP) ? POLLHUP : 0);
+}
+
+/* coro_poll
+
+DESCRIPTION
+poll(2) that parks the running coroutine instead of blocking its thread.
+Only POLLIN and POLLOUT are waited for. Outside a coroutine, for a timeout
+of 0 or more than CORO_POLL_MAX descriptors, it is poll(2).
+
+RETURN VALUE
+As poll(2).
+*/
+
+int coro_poll(struct pollfd *fds, nfds_t count, int timeout)
+{
+    coro_t *coro = coro_self();
+    waitRecord_t records[CORO_POLL_MAX];
+    struct epoll_event event;
+    int added[CORO_POLL_MAX];
+    int ready = 0;
+    nfds_t i;
+
+    if (coro == NULL || timeout == 0 || count > CORO_POLL_MAX)
+    {
+        return poll(fds, count, timeout);
+    }
+    for (i = 0; i < count; i++)
+    {
+        fds[i].revents = 0;
+        records[i].coro = coro;
+        records[i].events = 0;
+        added[i] = 0;
+        if (fds[i].fd < 0)
+        {
+            continue;
+        }
+        event.events = ((fds[i].events & POLLIN) ? EPOLLIN : 0) | ((fds[i].events & POLLOUT) ? EPOLLOUT : 0);
+        event.data.ptr = &records[i];
+        if (epoll_ctl(coro->scheduler->epollFD, EPOLL_CTL_ADD, fds[i].fd, &event) == 0)
+        {
+            added[i] = 1;
+        }
+        else
+        {
+            /* regular files are always ready, as with poll(2) */
+            fds[i].revents = (errno == EPERM) ? (fds[i].events & (POLLIN | POLLOUT)) : POLLNVAL;
+            ready++;
+        }
+    }
+
+    if (ready == 0 && (timeout < 0 || timerAdd(coro->scheduler, coro, stats_now() + (uint64_t)timeout * 1000) == 0))
+    {
+        suspend(coro, CORO_WAITING);
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if (added[i])
+        {
+            epoll_ctl(coro->scheduler->epollFD, EPOLL_CTL_DEL, fds[i].fd, NULL);
+            fds[i].revents = pollEvents(records[i].events) & (fds[i].events | POLLERR | POLLHUP);
+            ready += (fds[i].revents != 0);
+        }
+    }
+    return ready;
+}
+
+/* coro_block
+
+DESCRIPTION
+Called where an operation on fd failed with EAGAIN: wait for fd to become
+ready for events (POLLIN or POLLOUT) as long as a blocking socket would,
+that is for its SO_RCVTIMEO or SO_SNDTIMEO, forever if that is unset. On
+a blocking descriptor EAGAIN already meant that timeout, and nothing is
+waited for.
+
+RETURN VALUE
+0 when the operation is worth retrying, -1 with errno EAGAIN on timeout.
+*/
+
+int coro_block(int fd, short events)
+{
+    struct pollfd ready;
+    struct timeval tv;
+    socklen_t length = sizeof(tv);
+    int flags, timeout = -1, result;
+
+    if ((flags = fcntl(fd, F_GETFL)) == -1 || !(flags & O_NONBLOCK))
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (getsockopt(fd, SOL_SOCKET, (events & POLLOUT) ? SO_SNDTIMEO : SO_RCVTIMEO, &tv, &length) == 0
+            && (tv.tv_sec != 0 || tv.tv_usec != 0))
+    {
+        timeout = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+    }
+
+    ready.fd = fd;
+    ready.events = events;
+    while ((result = coro_poll(&ready, 1, timeout)) == -1 && errno == EINTR)
+    {
+    }
+    if (result == 0)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    return (result == -1) ? -1 : 0;
+}
+
+/* coro_connect
+
+DESCRIPTION
+connect(2), waiting for a non-blocking connect to complete like a blocking
+one would.
+
+RETURN VALUE
+0 when connected, -1 with errno set otherwise.
+*/
+
+int coro_connect(int fd, const struct sockaddr *addr, socklen_t length)
+{
+    socklen_t size = sizeof(int);
+    int error;
+
+    if (connect(fd, addr, length) == 0)
+    {
+        return 0;
+    }
+    if (errno != EINPROGRESS || coro_block(fd, POLLOUT) == -1
+            || getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &size) == -1)
+    {
+        return -1;
+    }
+    if (error != 0)
+    {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+void coro_sleep(uint64_t micros)
+{
+    coro_t *coro = coro_self();
+    struct timespec delay;
+
+    if (coro != NULL && timerAdd(coro->scheduler, coro, stats_now() + micros) == 0)
+    {
+        suspend(coro, CORO_WAITING);
+        return;
+    }
+    delay.tv_sec = micros / 1000000;
+    delay.tv_nsec = micros % 1000000 * 1000;
+    while (nanosleep(&delay, &delay) == -1 && errno == EINTR)
+    {
+    }
+}
+
+/* coro_yield
+
+DESCRIPTION
+Between two units of work, let other coroutines of this scheduler run if
+any are ready, or if the scheduler has been working for CORO_SLICE without
+checking epoll. Costs a clock read otherwise; does nothing outside a
+coroutine.
+*/
+
+void coro_yield(void)
+{
+    coro_t *coro = coro_self();
+    scheduler_t *s;
+
+    if (coro == NULL)
+    {
+        return;
+    }
+    s = coro->scheduler;
+    if (s->readyHead == NULL && dequeSize(&s->fresh) == 0 && stats_now() - s->roundStart < CORO_SLICE)
+    {
+        return;
+    }
+    suspend(coro, CORO_YIELDED);
+}
+
+/* coro_offload
+
+DESCRIPTION
+Run fn(arg), a call that blocks, on a helper thread while the running
+coroutine waits for it. Outside a coroutine fn is simply called.
+*/
+
+void coro_offload(void (*fn)(void *arg), void *arg)
+{
+    offloadJob_t job;
+
+    if ((job.coro = coro_self()) == NULL)
+    {
+        fn(arg);
+        return;
+    }
+    job.fn = fn;
+    job.arg = arg;
+    job.done = 0;
+    job.next = NULL;
+
+    pthread_mutex_lock(&offloadLock);
+    if (offloadTail != NULL)
+    {
+        offloadTail->next = &job;
+    }
+    else
+    {
+        offloadHead = &job;
+    }
+    offloadTail = &job;
+    pthread_cond_signal(&offloadReady);
+    pthread_mutex_unlock(&offloadLock);
+    __atomic_add_fetch(&offloadCount, 1, __ATOMIC_RELAXED);
+
+    while (!__atomic_load_n(&job.done, __ATOMIC_ACQUIRE))
+    {
+        coro_park(0);
+    }
+}
+
+static void lookup(void *arg)
+{
+    lookup_t *request = arg;
+
+    request->status = getaddrinfo(request->node, request->service, request->hints, request->result);
+}
+
+/* coro_getaddrinfo
+
+DESCRIPTION
+getaddrinfo(3), run through coro_offload() so a slow DNS server holds up
+only the coroutine asking.
+*/
+
+int coro_getaddrinfo(const char *node, const char *service, const struct addrinfo *hints,
+        struct addrinfo **result)
+{
+    lookup_t request;
+
+    request.node = node;
+    request.service = service;
+    request.hints = hints;
+    request.result = result;
+    coro_offload(lookup, &request);
+    return request.status;
+}
+
+int coro_report(char *buf, size_t size)
+{
+    uint64_t switches = 0, steals = 0;
+    int n, i;
+
+    for (i = 0; i < schedulerCount; i++)
+    {
+        switches += __atomic_load_n(&schedulers[i].switches, __ATOMIC_RELAXED);
+        steals += __atomic_load_n(&schedulers[i].steals, __ATOMIC_RELAXED);
+    }
+    n = snprintf(buf, size, "coroutines schedulers=%d live=%llu spawned=%llu switches=%llu steals=%llu offloaded=%llu\n",
+            schedulerCount,
+            (unsigned long long)__atomic_load_n(&liveCount, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&spawnCount, __ATOMIC_RELAXED),
+            (unsigned long long)switches,
+            (unsigned long long)steals,
+            (unsigned long long)__atomic_load_n(&offloadCount, __ATOMIC_RELAXED));
+    if (n < 0)
+    {
+        return 0;
+    }
+    return ((size_t)n < size) ? n : (int)size - 1;
+}
@@ -0,0 +1,74 @@
+/*
+ * coro.h - Stackful coroutines on a few scheduler threads
+ *
+ * With coroutine_threads set, an accepted connection runs the ordinary
+ * sequential handler on a coroutine instead of a thread of its own. Each
+ * coroutine has a CORO_STACK_SIZE stack mapped with a guard page at its
+ * low end, so an overflow faults instead of running into a neighbour, and
+ * is switched with swapcontext(3). A scheduler thread runs its coroutines
+ * one at a time from an epoll(7) loop.
+ *
+ * New coroutines go to a sleeping scheduler if there is one, round-robin
+ * otherwise, and wait in its Chase-Lev deque: the owner takes from the
+ * bottom, and a scheduler out of work steals from the top of the others',
+ * so connections spread over the threads by themselves. Once started, a
+ * coroutine stays on its scheduler: frames on its stack may hold addresses
+ * of thread-local variables, errno's among them, computed before a switch.
+ * The units of work are the stretches between waits (reading the header,
+ * the lookup, the connect, each forwarded slice), and a long transfer that
+ * never waits gives way with coro_yield() between slices when others are
+ * ready or the scheduler has not looked at epoll for CORO_SLICE.
+ *
+ * The handler code does not change. A coroutine's sockets are non-blocking,
+ * and where read(2), write(2), sendfile(2) or connect(2) return EAGAIN the
+ * caller waits in coro_block(), which parks the coroutine until epoll finds
+ * the descriptor ready or the socket's SO_RCVTIMEO/SO_SNDTIMEO passes: the
+ * same place and the same timeout as a blocking socket. coro_poll() stands
+ * in for poll(2) and coro_sleep() for nanosleep(2); calls that can only
+ * block, such as getaddrinfo(3), run on a helper thread through
+ * coro_offload() while the coroutine waits. Outside a coroutine each of
+ * these does what the blocking call would, so the same code serves
+ * thread-per-connection mode and the proxy's own helper threads.
+ *
+ * A coroutine must not hold a pthread lock across a wait; coro_park() and
+ * coro_wake() take the place of a condition variable. Each stack is two
+ * mappings, so more than about 30k live coroutines need vm.max_map_count
+ * raised.
+ */
+
+#ifndef __CORO_H__
+#define __CORO_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#define CORO_STACK_SIZE         (256*1024)          /* including the guard page */
+#define CORO_STACK_CACHE        256                 /* free stacks kept for reuse */
+#define CORO_OFFLOAD_THREADS    4                   /* blocking calls at once */
+#define CORO_POLL_MAX           8                   /* descriptors per coro_poll() */
+#define CORO_EVENTS             256                 /* epoll events per wakeup */
+#define CORO_DEQUE_INITIAL      256                 /* slots, a power of two; grows */
+#define CORO_SLICE              2000                /* microseconds of work between epoll checks */
+
+typedef struct coro coro_t;
+
+int coro_start(int threads);
+int coro_enabled(void);
+int coro_spawn(void *(*fn)(void *arg), void *arg);
+coro_t *coro_self(void);
+int coro_park(uint64_t deadline);
+void coro_wake(coro_t *coro);
+int coro_poll(struct pollfd *fds, nfds_t count, int timeout);
+int coro_block(int fd, short events);
+int coro_connect(int fd, const struct sockaddr *addr, socklen_t length);
+void coro_sleep(uint64_t micros);
+void coro_yield(void);
+void coro_offload(void (*fn)(void *arg), void *arg);
+int coro_getaddrinfo(const char *node, const char *service, const struct addrinfo *hints,
+        struct addrinfo **result);
+int coro_report(char *buf, size_t size);
+
+#endif /* __CORO_H__ */
@@ -1,5 +1,6 @@
 /* $begin csapp.c */
 #include "csapp.h"
+#include "diag.h"
 
 /************************** 
  * Error-handling functions
@@ -8,26 +9,31 @@
 /* $begin unixerror */
 void unix_error(char *msg) /* unix-style error */
 {
-    fprintf(stderr, "%s: %s\n", msg, strerror(errno));
+    DIAG_ERRNO(DIAG_LEVEL_ERROR, msg);
+    diag_flush();
     exit(0);
 }
 /* $end unixerror */
 
 void posix_error(int code, char *msg) /* posix-style error */
 {
-    fprintf(stderr, "%s: %s\n", msg, strerror(code));
+    errno = code;
+    DIAG_ERRNO(DIAG_LEVEL_ERROR, msg);
+    diag_flush();
     exit(0);
 }
 
 void dns_error(char *msg) /* dns-style error */
 {
-    fprintf(stderr, "%s: DNS error %d\n", msg, h_errno);
+    DIAG_ERROR("%s: DNS error %d", msg, h_errno);
+    diag_flush();
     exit(0);
 }
 
 void app_error(char *msg) /* application error */
 {
-    fprintf(stderr, "%s\n", msg);
+    DIAG_ERROR("%s", msg);
+    diag_flush();
     exit(0);
 }
 /* $end errorfuns */
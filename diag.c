@@ -0,0 +1,452 @@
+/*
+ * diag.c - Leveled, rate-limited diagnostics
+ *
+ * Producers format into a bounded multi-producer ring (one sequence number
+ * per slot, so enqueue is a single compare-and-swap) and never block: when
+ * the ring is full the message is counted as dropped. One writer thread
+ * drains the ring in batches with a single write(2) per batch.
+ *
+ * A call site that suppresses a message puts itself on a lock-free list,
+ * which only the writer thread takes apart. While the list is not empty
+ * the writer also wakes every DIAG_SITE_WINDOW_MS to report the sites
+ * whose windows have passed, so the last burst of a site that goes quiet
+ * is reported too.
+ */
+
+#define _GNU_SOURCE
+#include "csapp.h"
+#include "diag.h"
+#include <stdarg.h>
+
+#define DIAG_BATCH_SIZE     (16*1024)
+
+typedef struct diagSlot
+{
+    uint64_t sequence;
+    int level;
+    int length;
+    char text[DIAG_MESSAGE_MAX];
+}
+diagSlot_t;
+
+int diagLevel = DIAG_LEVEL_NOTICE;
+
+static diagSlot_t ring[DIAG_RING_SLOTS];
+static uint64_t enqueuePos;
+static uint64_t dequeuePos;
+static uint64_t dropped;
+static diagSite_t *suppressing;
+static int started;
+static int colored;
+static sem_t ringSem;
+static pthread_mutex_t drainLock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *levelNames[] = { "error", "warn", "notice", "info", "debug" };
+static const char *levelColors[] = { "\033[31m", "\033[33m", "\033[36m", "\033[32m", "\033[35m" };
+
+static void *writerThread(void *arg);
+
+
+/* formatLine
+
+DESCRIPTION
+Render one message as an output line into out, with terminal colors when stdout is a tty.
+
+RETURN VALUE
+Length of the line, truncated to fit in size.
+*/
+
+static int formatLine(char *out, size_t size, int level, const char *text, int length)
+{
+    int n;
+
+    if (colored)
+    {
+        n = snprintf(out, size, "%s%s: %.*s\033[0m\n", levelColors[level], levelNames[level], length, text);
+    }
+    else
+    {
+        n = snprintf(out, size, "%s: %.*s\n", levelNames[level], length, text);
+    }
+    return ((size_t)n < size) ? n : (int)size - 1;
+}
+
+static void writeOut(const char *buf, size_t count)
+{
+    ssize_t n;
+
+    while (count > 0)
+    {
+        if ((n = write(STDOUT_FILENO, buf, count)) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return;
+        }
+        buf += n;
+        count -= n;
+    }
+}
+
+/* post
+
+DESCRIPTION
+Hand a formatted message to the writer thread, or write it directly if the
+writer has not been started yet. Never blocks once the writer is running.
+*/
+
+static void post(int level, const char *text, int length)
+{
+    uint64_t pos, sequence;
+    diagSlot_t *slot;
+    int64_t diff;
+
+    if (!__atomic_load_n(&started, __ATOMIC_ACQUIRE))
+    {
+        char line[DIAG_MESSAGE_MAX + 32];
+        writeOut(line, formatLine(line, sizeof(line), level, text, length));
+        return;
+    }
+
+    pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        slot = &ring[pos & (DIAG_RING_SLOTS - 1)];
+        sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        diff = (int64_t)(sequence - pos);
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&enqueuePos, &pos, pos + 1, 1,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        else
+        {
+            pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->level = level;
+    slot->length = length;
+    memcpy(slot->text, text, length);
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+    sem_post(&ringSem);
+}
+
+/* drain
+
+DESCRIPTION
+Write out every message published so far. Serialized by drainLock, which is
+only contended between the writer thread and diag_flush.
+*/
+
+static void drain(void)
+{
+    char batch[DIAG_BATCH_SIZE];
+    size_t used = 0;
+    diagSlot_t *slot;
+    uint64_t lost;
+
+    pthread_mutex_lock(&drainLock);
+    for (;;)
+    {
+        slot = &ring[dequeuePos & (DIAG_RING_SLOTS - 1)];
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != dequeuePos + 1)
+        {
+            break;
+        }
+        if (used + DIAG_MESSAGE_MAX + 32 > sizeof(batch))
+        {
+            writeOut(batch, used);
+            used = 0;
+        }
+        used += formatLine(batch + used, sizeof(batch) - used, slot->level, slot->text, slot->length);
+        __atomic_store_n(&slot->sequence, dequeuePos + DIAG_RING_SLOTS, __ATOMIC_RELEASE);
+        dequeuePos++;
+    }
+
+    if ((lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED)) != 0)
+    {
+        char text[DIAG_MESSAGE_MAX];
+        int length = snprintf(text, sizeof(text), "%llu diagnostics dropped, output too slow",
+                (unsigned long long)lost);
+        used += formatLine(batch + used, sizeof(batch) - used, DIAG_LEVEL_WARN, text, length);
+    }
+
+    writeOut(batch, used);
+    pthread_mutex_unlock(&drainLock);
+}
+
+static uint64_t nowMs(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    /* offset by one window so a zeroed site always starts a fresh window */
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000 + DIAG_SITE_WINDOW_MS;
+}
+
+static void postSuppressed(diagSite_t *site, uint32_t suppressed)
+{
+    char text[DIAG_MESSAGE_MAX];
+    int length;
+
+    length = snprintf(text, sizeof(text), "%u more from %s:%d suppressed", suppressed, site->file, site->line);
+    post(site->level, text, ((size_t)length < sizeof(text)) ? length : (int)sizeof(text) - 1);
+}
+
+/* pushSite
+
+RETURN VALUE
+1 if the list of sites with suppressed messages was empty, 0 if not.
+*/
+
+static int pushSite(diagSite_t *site)
+{
+    diagSite_t *head = __atomic_load_n(&suppressing, __ATOMIC_RELAXED);
+
+    do
+    {
+        site->next = head;
+    }
+    while (!__atomic_compare_exchange_n(&suppressing, &head, site, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return head == NULL;
+}
+
+/* listSite
+
+DESCRIPTION
+Put site on the list of sites with suppressed messages, unless it is
+there already, and wake the writer if the list was empty.
+*/
+
+static void listSite(diagSite_t *site)
+{
+    if (__atomic_load_n(&site->listed, __ATOMIC_SEQ_CST) || __atomic_exchange_n(&site->listed, 1, __ATOMIC_SEQ_CST))
+    {
+        return;
+    }
+    if (pushSite(site) && __atomic_load_n(&started, __ATOMIC_ACQUIRE))
+    {
+        sem_post(&ringSem);
+    }
+}
+
+/* reportSuppressed
+
+DESCRIPTION
+Writer thread: report the listed sites whose window has passed and take
+them off the list; the others stay listed for the next round. A site is
+unlisted before its count is taken, so a message suppressed meanwhile
+either is in that count or lists the site again.
+*/
+
+static void reportSuppressed(void)
+{
+    diagSite_t *site, *next;
+    uint32_t suppressed;
+    uint64_t now = nowMs();
+
+    for (site = __atomic_exchange_n(&suppressing, NULL, __ATOMIC_ACQUIRE); site != NULL; site = next)
+    {
+        next = site->next;
+        if (now - __atomic_load_n(&site->windowStart, __ATOMIC_RELAXED) < DIAG_SITE_WINDOW_MS)
+        {
+            pushSite(site);
+            continue;
+        }
+        __atomic_store_n(&site->listed, 0, __ATOMIC_SEQ_CST);
+        if ((suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_SEQ_CST)) != 0)
+        {
+            postSuppressed(site, suppressed);
+        }
+    }
+}
+
+static void *writerThread(void *arg)
+{
+    struct timespec deadline;
+    int result;
+
+    for (;;)
+    {
+        if (__atomic_load_n(&suppressing, __ATOMIC_ACQUIRE) == NULL)
+        {
+            result = sem_wait(&ringSem);
+        }
+        else
+        {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += DIAG_SITE_WINDOW_MS / 1000;
+            deadline.tv_nsec += (DIAG_SITE_WINDOW_MS % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            result = sem_timedwait(&ringSem, &deadline);
+        }
+        if (result == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        reportSuppressed();
+        drain();
+    }
+    return NULL;
+}
+
+static void startWriter(void)
+{
+    pthread_t writer;
+    pthread_attr_t threadAttr;
+
+    if (sem_init(&ringSem, 0, 0) == -1)
+    {
+        return;
+    }
+
+    pthread_attr_init(&threadAttr);
+    pthread_attr_setdetachstate(&threadAttr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&writer, &threadAttr, writerThread, NULL) == 0)
+    {
+        __atomic_store_n(&started, 1, __ATOMIC_RELEASE);
+    }
+    pthread_attr_destroy(&threadAttr);
+}
+
+/* diag_init
+
+DESCRIPTION
+Prepare the ring and start the writer thread. Messages emitted before this
+call are written synchronously.
+*/
+
+void diag_init(void)
+{
+    int i;
+
+    for (i = 0; i < DIAG_RING_SLOTS; i++)
+    {
+        ring[i].sequence = i;
+    }
+    colored = isatty(STDOUT_FILENO);
+    startWriter();
+}
+
+/* diag_afterFork
+
+DESCRIPTION
+Restart the writer in a child created by fork(2), which inherits the ring
+but not the writer thread, and possibly a drain lock held by it.
+Messages still queued at the fork are left to the parent.
+*/
+
+void diag_afterFork(void)
+{
+    if (!__atomic_load_n(&started, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+    __atomic_store_n(&started, 0, __ATOMIC_RELEASE);
+    pthread_mutex_init(&drainLock, NULL);
+    while (__atomic_load_n(&ring[dequeuePos & (DIAG_RING_SLOTS - 1)].sequence, __ATOMIC_ACQUIRE)
+            == dequeuePos + 1)
+    {
+        ring[dequeuePos & (DIAG_RING_SLOTS - 1)].sequence = dequeuePos + DIAG_RING_SLOTS;
+        dequeuePos++;
+    }
+    startWriter();
+}
+
+void diag_setLevel(int level)
+{
+    if (level < DIAG_LEVEL_ERROR)
+    {
+        level = DIAG_LEVEL_ERROR;
+    }
+    if (level > DIAG_LEVEL_DEBUG)
+    {
+        level = DIAG_LEVEL_DEBUG;
+    }
+    diagLevel = level;
+}
+
+/* diag_flush
+
+DESCRIPTION
+Synchronously write out pending messages, e.g. before exit(3).
+*/
+
+void diag_flush(void)
+{
+    if (__atomic_load_n(&started, __ATOMIC_ACQUIRE))
+    {
+        drain();
+    }
+}
+
+/* diag_emit
+
+DESCRIPTION
+Back end of the DIAG macros. Applies the per-site rate limit, formats the
+message (followed by strerror(errnum) if errnum is not 0) and posts it.
+When a new window starts, the number of messages suppressed in the previous
+one is reported first, unless the writer thread already did.
+*/
+
+void diag_emit(diagSite_t *site, int level, int errnum, const char *format, ...)
+{
+    uint64_t now = nowMs(), windowStart;
+    uint32_t suppressed;
+    char text[DIAG_MESSAGE_MAX];
+    char errbuf[128];
+    int length;
+    va_list args;
+
+    windowStart = __atomic_load_n(&site->windowStart, __ATOMIC_RELAXED);
+    if (now - windowStart >= DIAG_SITE_WINDOW_MS
+            && __atomic_compare_exchange_n(&site->windowStart, &windowStart, now, 0,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        __atomic_store_n(&site->emitted, 0, __ATOMIC_RELAXED);
+        if ((suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_SEQ_CST)) != 0)
+        {
+            postSuppressed(site, suppressed);
+        }
+    }
+    if (__atomic_fetch_add(&site->emitted, 1, __ATOMIC_RELAXED) >= DIAG_SITE_BURST)
+    {
+        site->level = level;
+        __atomic_fetch_add(&site->suppressed, 1, __ATOMIC_SEQ_CST);
+        listSite(site);
+        return;
+    }
+
+    va_start(args, format);
+    length = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if ((size_t)length >= sizeof(text))
+    {
+        length = sizeof(text) - 1;
+    }
+    if (errnum != 0 && (size_t)length < sizeof(text) - 1)
+    {
+        length += snprintf(text + length, sizeof(text) - length, ": %s",
+                strerror_r(errnum, errbuf, sizeof(errbuf)));
+        if ((size_t)length >= sizeof(text))
+        {
+            length = sizeof(text) - 1;
+        }
+    }
+    post(level, text, length);
+}
@@ -0,0 +1,85 @@
+/*
+ * diag.h - Leveled, rate-limited diagnostics
+ *
+ * Messages are formatted by the caller into a lock-free ring and written
+ * out by a background thread, so a storm of errors never serializes the
+ * request path on stdout. Each call site is limited to DIAG_SITE_BURST
+ * messages per DIAG_SITE_WINDOW_MS; the rest are counted and reported as
+ * one summary line naming the call site once its window has passed, by
+ * the writer thread if the site stays quiet. Levels above
+ * DIAG_COMPILE_LEVEL are removed at compile time.
+ */
+
+#ifndef __DIAG_H__
+#define __DIAG_H__
+
+#include <stdint.h>
+#include <errno.h>
+
+#define DIAG_LEVEL_ERROR    0
+#define DIAG_LEVEL_WARN     1
+#define DIAG_LEVEL_NOTICE   2
+#define DIAG_LEVEL_INFO     3
+#define DIAG_LEVEL_DEBUG    4
+
+#ifndef DIAG_COMPILE_LEVEL
+#define DIAG_COMPILE_LEVEL  DIAG_LEVEL_INFO
+#endif
+
+#define DIAG_SITE_BURST     10      /* messages per call site per window */
+#define DIAG_SITE_WINDOW_MS 1000
+#define DIAG_RING_SLOTS     1024    /* must be a power of two */
+#define DIAG_MESSAGE_MAX    240
+
+/* rate limiting state, one per call site */
+typedef struct diagSite
+{
+    uint64_t windowStart;
+    uint32_t emitted;
+    uint32_t suppressed;
+    const char *file;
+    int line;
+    int level;                  /* of the suppressed messages */
+    int listed;                 /* on the writer's list of sites with suppressed messages */
+    struct diagSite *next;
+}
+diagSite_t;
+
+extern int diagLevel;
+
+void diag_init(void);
+void diag_afterFork(void);
+void diag_setLevel(int level);
+void diag_flush(void);
+void diag_emit(diagSite_t *site, int level, int errnum, const char *format, ...)
+    __attribute__((format(printf, 4, 5)));
+
+/*
+ * DIAG - emit a message at level from this call site.
+ * DIAG_ERRNO appends strerror(errno) the way perror(3) does.
+ */
+#define DIAG(level, ...) \
+    do { \
+        if ((level) <= DIAG_COMPILE_LEVEL && (level) <= diagLevel) \
+        { \
+            static diagSite_t diagSite_ = { .file = __FILE__, .line = __LINE__ }; \
+            diag_emit(&diagSite_, (level), 0, __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define DIAG_ERRNO(level, what) \
+    do { \
+        if ((level) <= DIAG_COMPILE_LEVEL && (level) <= diagLevel) \
+        { \
+            static diagSite_t diagSite_ = { .file = __FILE__, .line = __LINE__ }; \
+            diag_emit(&diagSite_, (level), errno, "%s", (what)); \
+        } \
+    } while (0)
+
+#define DIAG_ERROR(...)     DIAG(DIAG_LEVEL_ERROR, __VA_ARGS__)
+#define DIAG_WARN(...)      DIAG(DIAG_LEVEL_WARN, __VA_ARGS__)
+#define DIAG_NOTICE(...)    DIAG(DIAG_LEVEL_NOTICE, __VA_ARGS__)
+#define DIAG_INFO(...)      DIAG(DIAG_LEVEL_INFO, __VA_ARGS__)
+#define DIAG_DEBUG(...)     DIAG(DIAG_LEVEL_DEBUG, __VA_ARGS__)
+
+#endif /* __DIAG_H__ */
@@ -0,0 +1,380 @@
+/*
+ * gzip.c - On-the-fly response compression
+ *
+ * Output is deflated straight into space reserved at the end of the output
+ * chain. For chunked output the chunk size is written in front afterwards
+ * as a fixed-width, zero-padded hex number, so the size does not have to be
+ * known before compressing and nothing is copied.
+ */
+
+#include "csapp.h"
+#include "stats.h"
+#include "budget.h"
+#include "gzip.h"
+#include <zlib.h>
+
+#define CHUNK_PREFIX        10          /* "%08x\r\n" */
+#define CHUNK_SUFFIX        2           /* "\r\n" */
+#define OUTPUT_MIN          1024        /* least output space worth a deflate call */
+#define STATE_COST          (sizeof(deflateState_t) + (1 << 17) + (1 << 17))   /* window and hash, per zlib.h */
+
+typedef struct deflateState
+{
+    z_stream z;
+    int level;
+    struct deflateState *next;
+}
+deflateState_t;
+
+static int compressionLevel;
+static int minSize = GZIP_MIN_SIZE;
+
+/* free deflate states by encoding; the gzip and zlib wrappers are fixed at init */
+static deflateState_t *freeStates[GZIP_DEFLATE + 1];
+static int freeCount;
+static pthread_mutex_t freeLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* gzip_setLevel
+
+DESCRIPTION
+Set the zlib compression level, 1 (fastest) to 9 (smallest), or turn
+compression off with 0.
+
+RETURN VALUE
+0 on success, -1 if the level is out of range.
+*/
+
+int gzip_setLevel(int level)
+{
+    if (level < 0 || level > 9)
+    {
+        return -1;
+    }
+    compressionLevel = level;
+    return 0;
+}
+
+/* gzip_setMinSize
+
+DESCRIPTION
+Set the smallest Content-Length worth compressing, in bytes.
+*/
+
+int gzip_setMinSize(int bytes)
+{
+    if (bytes < 0)
+    {
+        return -1;
+    }
+    minSize = bytes;
+    return 0;
+}
+
+int gzip_enabled(void)
+{
+    return compressionLevel > 0;
+}
+
+/* gzip_worthwhile
+
+RETURN VALUE
+Whether a response of contentLength bytes (-1 if unknown) is big enough to compress.
+*/
+
+int gzip_worthwhile(long long contentLength)
+{
+    return contentLength < 0 || contentLength >= minSize;
+}
+
+/* gzip_accepted
+
+DESCRIPTION
+Choose a content coding from the value of a request's Accept-Encoding
+field: gzip if acceptable, else deflate. A coding listed with q=0 is
+refused; "*" stands for gzip.
+*/
+
+gzipEncoding_t gzip_accepted(const char *acceptEncoding)
+{
+    gzipEncoding_t chosen = GZIP_NONE;
+    const char *token, *end, *q;
+    size_t length;
+
+    for (token = acceptEncoding; *token != '\0'; token = end)
+    {
+        token += strspn(token, ", \t");
+        end = token + strcspn(token, ",");
+        length = strcspn(token, ",; \t");
+        if ((q = strstr(token + length, "q=")) != NULL && q < end && atof(q + 2) <= 0.0)
+        {
+            continue;
+        }
+        if ((length == 4 && strncasecmp(token, "gzip", 4) == 0) || (length == 1 && *token == '*'))
+        {
+            return GZIP_GZIP;
+        }
+        if (length == 7 && strncasecmp(token, "deflate", 7) == 0)
+        {
+            chosen = GZIP_DEFLATE;
+        }
+    }
+    return chosen;
+}
+
+/* gzip_compressibleType
+
+DESCRIPTION
+Whether a Content-Type value names text that compresses well. Event
+streams are excluded: they must not be held back by the compressor.
+*/
+
+int gzip_compressibleType(const char *contentType)
+{
+    static const char *types[] = { "application/json", "application/javascript",
+        "application/x-javascript", "application/ecmascript", "application/xml", NULL };
+    size_t length = strcspn(contentType, "; \t");
+    int i;
+
+    if (strncasecmp(contentType, "text/event-stream", 17) == 0)
+    {
+        return 0;
+    }
+    if (strncasecmp(contentType, "text/", 5) == 0)
+    {
+        return 1;
+    }
+    if ((length > 4 && strncasecmp(contentType + length - 4, "+xml", 4) == 0)
+            || (length > 5 && strncasecmp(contentType + length - 5, "+json", 5) == 0))
+    {
+        return 1;
+    }
+    for (i = 0; types[i] != NULL; i++)
+    {
+        if (strlen(types[i]) == length && strncasecmp(contentType, types[i], length) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* take a deflate state from the free list, or set up a new one */
+static deflateState_t *acquireState(gzipEncoding_t encoding, int level)
+{
+    deflateState_t *state;
+
+    pthread_mutex_lock(&freeLock);
+    if ((state = freeStates[encoding]) != NULL)
+    {
+        freeStates[encoding] = state->next;
+        freeCount--;
+    }
+    pthread_mutex_unlock(&freeLock);
+
+    /* a freshly reset state may change level before its first input */
+    if (state != NULL && state->level != level)
+    {
+        if (deflateParams(&state->z, level, Z_DEFAULT_STRATEGY) == Z_OK)
+        {
+            state->level = level;
+        }
+        else
+        {
+            deflateEnd(&state->z);
+            free(state);
+            budget_credit(STATE_COST);
+            state = NULL;
+        }
+    }
+    if (state != NULL)
+    {
+        return state;
+    }
+
+    if ((state = calloc(1, sizeof(deflateState_t))) == NULL)
+    {
+        return NULL;
+    }
+    if (deflateInit2(&state->z, level, Z_DEFLATED, (encoding == GZIP_GZIP) ? 15 + 16 : 15,
+                8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        free(state);
+        return NULL;
+    }
+    budget_charge(STATE_COST);
+    state->level = level;
+    return state;
+}
+
+static void releaseState(deflateState_t *state, gzipEncoding_t encoding)
+{
+    if (deflateReset(&state->z) == Z_OK && budget_pressure() == BUDGET_OK)
+    {
+        pthread_mutex_lock(&freeLock);
+        if (freeCount < GZIP_FREE_MAX)
+        {
+            state->next = freeStates[encoding];
+            freeStates[encoding] = state;
+            freeCount++;
+            state = NULL;
+        }
+        pthread_mutex_unlock(&freeLock);
+    }
+    if (state != NULL)
+    {
+        deflateEnd(&state->z);
+        free(state);
+        budget_credit(STATE_COST);
+    }
+}
+
+/* gzip_begin
+
+DESCRIPTION
+Start compressing a response body with encoding, framed as chunks if chunked.
+
+RETURN VALUE
+0 on success, -1 when memory is short or the memory budget is exhausted;
+the body is then sent as it is.
+*/
+
+int gzip_begin(gzipStream_t *stream, gzipEncoding_t encoding, int chunked)
+{
+    memset(stream, 0, sizeof(*stream));
+    if (budget_pressure() == BUDGET_FULL
+            || (stream->state = acquireState(encoding, compressionLevel)) == NULL)
+    {
+        return -1;
+    }
+    stream->encoding = encoding;
+    stream->chunked = chunked;
+    return 0;
+}
+
+/* deflateInto
+
+DESCRIPTION
+Run deflate with flush over the pending input, appending the output to out,
+one chunk per stretch of reserved space.
+
+RETURN VALUE
+0 on success, -1 on a zlib error or when memory is short.
+*/
+
+static int deflateInto(gzipStream_t *stream, iobuf_t *out, int flush)
+{
+    z_stream *z = &((deflateState_t*)stream->state)->z;
+    size_t framing = stream->chunked ? CHUNK_PREFIX + CHUNK_SUFFIX : 0;
+    char prefix[CHUNK_PREFIX + 1];
+    size_t room, produced;
+    char *space;
+    int result;
+
+    do
+    {
+        if ((space = iobuf_reserve(out, framing + OUTPUT_MIN, &room)) == NULL)
+        {
+            return -1;
+        }
+        z->next_out = (Bytef*)space + (stream->chunked ? CHUNK_PREFIX : 0);
+        z->avail_out = room - framing;
+        if ((result = deflate(z, flush)) == Z_STREAM_ERROR)
+        {
+            return -1;
+        }
+        produced = room - framing - z->avail_out;
+        if (produced == 0)
+        {
+            continue;
+        }
+        if (stream->chunked)
+        {
+            snprintf(prefix, sizeof(prefix), "%08x\r\n", (unsigned int)produced);
+            memcpy(space, prefix, CHUNK_PREFIX);
+            memcpy(space + CHUNK_PREFIX + produced, "\r\n", CHUNK_SUFFIX);
+        }
+        if (iobuf_commit(out, produced + framing) == -1)
+        {
+            return -1;
+        }
+        stream->bytesOut += produced + framing;
+    }
+    while (z->avail_out == 0 || (flush == Z_FINISH && result != Z_STREAM_END));
+    return 0;
+}
+
+/* gzip_compress
+
+DESCRIPTION
+Compress all of in onto the end of out and flush, so the client can decode
+everything received so far. in is left as it was.
+
+RETURN VALUE
+0 on success, -1 on failure; the response cannot be completed then.
+*/
+
+int gzip_compress(gzipStream_t *stream, const iobuf_t *in, iobuf_t *out)
+{
+    z_stream *z = &((deflateState_t*)stream->state)->z;
+    const iobufSegment_t *segment;
+
+    for (segment = in->head; segment != NULL; segment = segment->next)
+    {
+        z->next_in = (Bytef*)segment->start;
+        z->avail_in = segment->end - segment->start;
+        if (deflateInto(stream, out, Z_NO_FLUSH) == -1)
+        {
+            return -1;
+        }
+    }
+    stream->bytesIn += iobuf_length(in);
+    return deflateInto(stream, out, Z_SYNC_FLUSH);
+}
+
+/* gzip_finish
+
+DESCRIPTION
+Append the end of the compressed stream, and the last chunk if chunked, to out.
+
+RETURN VALUE
+0 on success, -1 on failure.
+*/
+
+int gzip_finish(gzipStream_t *stream, iobuf_t *out)
+{
+    z_stream *z = &((deflateState_t*)stream->state)->z;
+
+    z->next_in = NULL;
+    z->avail_in = 0;
+    if (deflateInto(stream, out, Z_FINISH) == -1)
+    {
+        return -1;
+    }
+    if (stream->chunked)
+    {
+        stream->bytesOut += 5;
+        return iobuf_append(out, "0\r\n\r\n", 5);
+    }
+    return 0;
+}
+
+/* gzip_end
+
+DESCRIPTION
+Count the stream and return its deflate state to the free list. Does
+nothing for a stream that was never begun.
+*/
+
+void gzip_end(gzipStream_t *stream)
+{
+    if (stream->state == NULL)
+    {
+        return;
+    }
+    stats_add(STATS_COMPRESSED, 1);
+    stats_add(STATS_COMPRESS_BYTES_IN, stream->bytesIn);
+    stats_add(STATS_COMPRESS_BYTES_OUT, stream->bytesOut);
+    releaseState(stream->state, stream->encoding);
+    stream->state = NULL;
+}
@@ -0,0 +1,53 @@
+/*
+ * gzip.h - On-the-fly response compression
+ *
+ * An uncompressed 200 response of a textual Content-Type, at least
+ * GZIP_MIN_SIZE bytes long (or of unknown length), is compressed on its
+ * way to a client that accepts gzip or deflate. The body is deflated as it
+ * arrives, flushed after every read so nothing waits for the rest of the
+ * response, and sent chunked to HTTP/1.1 clients; HTTP/1.0 clients get it
+ * delimited by the end of the connection. Deflate states are expensive to
+ * set up, so finished ones are reset and kept on a free list for the next
+ * response rather than freed, unless memory is tight.
+ */
+
+#ifndef __GZIP_H__
+#define __GZIP_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "iobuf.h"
+
+#define GZIP_MIN_SIZE       1024        /* bytes; smaller responses are not worth it */
+#define GZIP_FREE_MAX       32          /* deflate states kept for reuse */
+
+typedef enum gzipEncoding
+{
+    GZIP_NONE,
+    GZIP_GZIP,
+    GZIP_DEFLATE
+}
+gzipEncoding_t;
+
+typedef struct gzipStream
+{
+    void *state;                /* pooled deflate state, NULL when not compressing */
+    gzipEncoding_t encoding;
+    int chunked;
+    uint64_t bytesIn;
+    uint64_t bytesOut;
+}
+gzipStream_t;
+
+int gzip_setLevel(int level);
+int gzip_setMinSize(int bytes);
+int gzip_enabled(void);
+int gzip_worthwhile(long long contentLength);
+gzipEncoding_t gzip_accepted(const char *acceptEncoding);
+int gzip_compressibleType(const char *contentType);
+int gzip_begin(gzipStream_t *stream, gzipEncoding_t encoding, int chunked);
+int gzip_compress(gzipStream_t *stream, const iobuf_t *in, iobuf_t *out);
+int gzip_finish(gzipStream_t *stream, iobuf_t *out);
+void gzip_end(gzipStream_t *stream);
+
+#endif /* __GZIP_H__ */
@@ -0,0 +1,120 @@
+/*
+ * hedge.c - Hedged upstream requests for idempotent GETs
+ *
+ * The hedge delay is derived from the merged TTFB histogram, which is too
+ * expensive to fold on every request; it is recomputed at most once per
+ * HEDGE_REFRESH by whichever thread notices it is stale. The budget is two
+ * relaxed counters and may overshoot by a few hedges under contention.
+ */
+
+#include "csapp.h"
+#include "stats.h"
+#include "hedge.h"
+
+static double hedgePercentile;
+static uint64_t cachedDelay;
+static uint64_t refreshedAt;
+static uint64_t eligible;
+static uint64_t issued;
+
+
+/* hedge_setPercentile
+
+DESCRIPTION
+Enable hedging after the given percentile (0-100, exclusive) of time to
+first byte, or disable it with 0.
+
+RETURN VALUE
+0 on success, -1 if the percentile is out of range.
+*/
+
+int hedge_setPercentile(double percentile)
+{
+    if (percentile < 0.0 || percentile >= 100.0)
+    {
+        return -1;
+    }
+    hedgePercentile = percentile;
+    return 0;
+}
+
+int hedge_enabled(void)
+{
+    return hedgePercentile > 0.0;
+}
+
+/* hedge_eligible
+
+DESCRIPTION
+Whether the request may be sent twice, i.e. it is a GET or HEAD, and count it
+towards the hedge budget if so.
+*/
+
+int hedge_eligible(const char *request)
+{
+    if (strncmp(request, "GET ", 4) != 0 && strncmp(request, "HEAD ", 5) != 0)
+    {
+        return 0;
+    }
+    __atomic_fetch_add(&eligible, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/* hedge_delay
+
+RETURN VALUE
+Microseconds to wait for the first response byte before hedging,
+0 while too few samples have been seen to choose one.
+*/
+
+uint64_t hedge_delay(void)
+{
+    uint64_t now = stats_now();
+    uint64_t last = __atomic_load_n(&refreshedAt, __ATOMIC_RELAXED);
+    statsHistogram_t *histogram;
+    uint64_t delay;
+
+    if (now - last < HEDGE_REFRESH
+            || !__atomic_compare_exchange_n(&refreshedAt, &last, now, 0,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        return __atomic_load_n(&cachedDelay, __ATOMIC_RELAXED);
+    }
+
+    if ((histogram = malloc(sizeof(*histogram))) == NULL)
+    {
+        return __atomic_load_n(&cachedDelay, __ATOMIC_RELAXED);
+    }
+    stats_merge(STATS_PHASE_TTFB, histogram);
+    delay = 0;
+    if (histogram->count >= HEDGE_MIN_SAMPLES)
+    {
+        delay = stats_percentile(histogram, hedgePercentile);
+        delay = (delay < HEDGE_MIN_DELAY) ? HEDGE_MIN_DELAY : delay;
+    }
+    free(histogram);
+    __atomic_store_n(&cachedDelay, delay, __ATOMIC_RELAXED);
+    return delay;
+}
+
+/* hedge_admit
+
+DESCRIPTION
+Take one hedge from the budget.
+
+RETURN VALUE
+1 if the hedge may be sent, 0 if the budget is exhausted.
+*/
+
+int hedge_admit(void)
+{
+    uint64_t sent = __atomic_load_n(&issued, __ATOMIC_RELAXED);
+
+    if (sent * 100 >= __atomic_load_n(&eligible, __ATOMIC_RELAXED) * HEDGE_BUDGET_PERCENT)
+    {
+        return 0;
+    }
+    __atomic_fetch_add(&issued, 1, __ATOMIC_RELAXED);
+    stats_add(STATS_HEDGES, 1);
+    return 1;
+}
@@ -0,0 +1,27 @@
+/*
+ * hedge.h - Hedged upstream requests for idempotent GETs
+ *
+ * When enabled, a GET or HEAD whose first response byte has not arrived
+ * after the configured percentile of observed time to first byte is sent a
+ * second time to another upstream, and whichever answers first is used.
+ * Hedges are capped at HEDGE_BUDGET_PERCENT of eligible requests so a slow
+ * origin never sees twice the load.
+ */
+
+#ifndef __HEDGE_H__
+#define __HEDGE_H__
+
+#include <stdint.h>
+
+#define HEDGE_BUDGET_PERCENT    10
+#define HEDGE_MIN_SAMPLES       100                 /* TTFB samples before hedging starts */
+#define HEDGE_MIN_DELAY         1000                /* microseconds */
+#define HEDGE_REFRESH           (1000*1000)         /* delay is recomputed this often */
+
+int hedge_setPercentile(double percentile);
+int hedge_enabled(void);
+int hedge_eligible(const char *request);
+uint64_t hedge_delay(void);
+int hedge_admit(void);
+
+#endif /* __HEDGE_H__ */
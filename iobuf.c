@@ -0,0 +1,655 @@
+/*
+ * iobuf.c - Chained I/O buffers
+ *
+ * A segment may grow into the free end of its slab only while it holds the
+ * slab's sole reference and ends where the slab's data ends; every other
+ * write goes to a new slab. Fully consumed slabs are kept as the chain's
+ * spare, so a chain that is read and drained in turn does not allocate.
+ */
+
+#include "csapp.h"
+#include "budget.h"
+#include "coro.h"
+#include "iobuf.h"
+#include <sys/uio.h>
+
+/* below this much room in the tail, a read also fills the spare slab */
+#define READ_MIN            (IOBUF_SLAB_SIZE / 4)
+
+
+static iobufSlab_t *newSlab(size_t size)
+{
+    iobufSlab_t *slab;
+
+    if ((slab = malloc(sizeof(iobufSlab_t) + size)) == NULL)
+    {
+        return NULL;
+    }
+    budget_charge(sizeof(iobufSlab_t) + size);
+    slab->references = 1;
+    slab->size = size;
+    slab->used = 0;
+    return slab;
+}
+
+static void releaseSlab(iobufSlab_t *slab)
+{
+    if (__atomic_sub_fetch(&slab->references, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        budget_credit(sizeof(iobufSlab_t) + slab->size);
+        free(slab);
+    }
+}
+
+/* size of new slabs: full size unless the memory budget is under pressure */
+static size_t slabSize(void)
+{
+    return (budget_pressure() == BUDGET_OK) ? IOBUF_SLAB_SIZE : IOBUF_SLAB_MIN;
+}
+
+/* keep an unshared slab as the spare instead of freeing it, unless memory is short */
+static void recycleSlab(iobuf_t *chain, iobufSlab_t *slab)
+{
+    if (chain->spare == NULL && slab->size == IOBUF_SLAB_SIZE && budget_pressure() == BUDGET_OK
+            && __atomic_load_n(&slab->references, __ATOMIC_ACQUIRE) == 1)
+    {
+        slab->used = 0;
+        chain->spare = slab;
+        return;
+    }
+    releaseSlab(slab);
+}
+
+/* bytes the tail segment may still grow by in place */
+static size_t tailRoom(const iobuf_t *chain)
+{
+    iobufSegment_t *tail = chain->tail;
+
+    if (tail == NULL || tail->end != tail->slab->data + tail->slab->used
+            || __atomic_load_n(&tail->slab->references, __ATOMIC_ACQUIRE) != 1)
+    {
+        return 0;
+    }
+    return tail->slab->size - tail->slab->used;
+}
+
+/*
+ * appendSegment - append [start, end) of slab to chain, taking over one
+ * reference to slab; merged into the tail segment when they are adjacent
+ */
+static int appendSegment(iobuf_t *chain, iobufSlab_t *slab, char *start, char *end)
+{
+    iobufSegment_t *segment;
+
+    if (chain->tail != NULL && chain->tail->slab == slab && chain->tail->end == start)
+    {
+        chain->tail->end = end;
+        chain->length += end - start;
+        releaseSlab(slab);
+        return 0;
+    }
+    if ((segment = malloc(sizeof(iobufSegment_t))) == NULL)
+    {
+        releaseSlab(slab);
+        return -1;
+    }
+    segment->next = NULL;
+    segment->slab = slab;
+    segment->start = start;
+    segment->end = end;
+    if (chain->tail == NULL)
+    {
+        chain->head = segment;
+    }
+    else
+    {
+        chain->tail->next = segment;
+    }
+    chain->tail = segment;
+    chain->length += end - start;
+    return 0;
+}
+
+/* matchesAt - whether pattern starts at 'at' in segment, possibly continuing in the next ones */
+static int matchesAt(const iobufSegment_t *segment, const char *at, const char *pattern)
+{
+    while (*pattern != '\0')
+    {
+        while (at == segment->end)
+        {
+            if ((segment = segment->next) == NULL)
+            {
+                return 0;
+            }
+            at = segment->start;
+        }
+        if (*at++ != *pattern++)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+void iobuf_init(iobuf_t *chain)
+{
+    memset(chain, 0, sizeof(*chain));
+}
+
+/* iobuf_clear
+
+DESCRIPTION
+Drop all data and the spare slab; the chain is empty and may be reused.
+*/
+
+void iobuf_clear(iobuf_t *chain)
+{
+    iobufSegment_t *segment, *next;
+
+    for (segment = chain->head; segment != NULL; segment = next)
+    {
+        next = segment->next;
+        releaseSlab(segment->slab);
+        free(segment);
+    }
+    if (chain->spare != NULL)
+    {
+        releaseSlab(chain->spare);
+    }
+    iobuf_init(chain);
+}
+
+size_t iobuf_length(const iobuf_t *chain)
+{
+    return chain->length;
+}
+
+/* iobuf_read
+
+DESCRIPTION
+Read once from fd and append the data to chain. The read fills the free end
+of the tail slab, and when that is short, continues into the spare slab in
+the same readv(2).
+
+RETURN VALUE
+Number of bytes appended, 0 at end of file, -1 on failure with errno set.
+*/
+
+ssize_t iobuf_read(iobuf_t *chain, int fd)
+{
+    struct iovec iov[2];
+    size_t room, first;
+    ssize_t result;
+    int count = 0;
+
+    if ((room = tailRoom(chain)) > 0)
+    {
+        iov[count].iov_base = chain->tail->end;
+        iov[count].iov_len = room;
+        count++;
+    }
+    if (room < READ_MIN)
+    {
+        if (chain->spare == NULL && (chain->spare = newSlab(slabSize())) == NULL && count == 0)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        if (chain->spare != NULL)
+        {
+            iov[count].iov_base = chain->spare->data;
+            iov[count].iov_len = chain->spare->size;
+            count++;
+        }
+    }
+
+    while ((result = readv(fd, iov, count)) == -1
+            && (errno == EINTR || (errno == EAGAIN && coro_block(fd, POLLIN) == 0)))
+    {
+    }
+    if (result <= 0)
+    {
+        return result;
+    }
+
+    first = ((size_t)result < room) ? (size_t)result : room;
+    if (first > 0)
+    {
+        chain->tail->end += first;
+        chain->tail->slab->used += first;
+        chain->length += first;
+    }
+    if ((size_t)result > first)
+    {
+        iobufSlab_t *slab = chain->spare;
+
+        chain->spare = NULL;
+        slab->used = result - first;
+        if (appendSegment(chain, slab, slab->data, slab->data + slab->used) == -1)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    return result;
+}
+
+/* iobuf_readUntil
+
+DESCRIPTION
+Read from fd into chain until pattern appears in it, e.g. the blank line
+ending a message header. Data already in chain is searched first.
+
+ARGUMENTS
+size_t max
+    Give up once chain holds this many bytes without the pattern.
+
+RETURN VALUE
+Offset just past the pattern.
+0 is returned at end of file before the pattern.
+-1 is returned when read(2) fails, with errno set.
+-2 is returned when the pattern is not within max bytes.
+*/
+
+ssize_t iobuf_readUntil(iobuf_t *chain, int fd, const char *pattern, size_t max)
+{
+    size_t patternLength = strlen(pattern);
+    size_t from = 0;
+    ssize_t found, result;
+
+    for (;;)
+    {
+        if ((found = iobuf_find(chain, pattern, from)) != -1)
+        {
+            return (found + patternLength <= max) ? found + (ssize_t)patternLength : -2;
+        }
+        if (chain->length >= max)
+        {
+            return -2;
+        }
+        from = (chain->length >= patternLength) ? chain->length - patternLength + 1 : 0;
+        if ((result = iobuf_read(chain, fd)) <= 0)
+        {
+            return result;
+        }
+    }
+}
+
+/* iobuf_find
+
+RETURN VALUE
+Offset of the first occurrence of pattern at or after from, -1 if there is none.
+*/
+
+ssize_t iobuf_find(const iobuf_t *chain, const char *pattern, size_t from)
+{
+    const iobufSegment_t *segment;
+    const char *at;
+    size_t offset = 0, length;
+
+    for (segment = chain->head; segment != NULL; segment = segment->next)
+    {
+        length = segment->end - segment->start;
+        if (offset + length <= from)
+        {
+            offset += length;
+            continue;
+        }
+        at = segment->start + ((from > offset) ? from - offset : 0);
+        while ((at = memchr(at, pattern[0], segment->end - at)) != NULL)
+        {
+            if (matchesAt(segment, at, pattern))
+            {
+                return offset + (at - segment->start);
+            }
+            at++;
+        }
+        offset += length;
+    }
+    return -1;
+}
+
+/* iobuf_append
+
+DESCRIPTION
+Copy length bytes of data to the end of chain.
+
+RETURN VALUE
+0 on success, -1 when memory is short.
+*/
+
+int iobuf_append(iobuf_t *chain, const void *data, size_t length)
+{
+    iobufSlab_t *slab;
+    size_t room, piece;
+
+    if ((room = tailRoom(chain)) > 0)
+    {
+        piece = (length < room) ? length : room;
+        memcpy(chain->tail->end, data, piece);
+        chain->tail->end += piece;
+        chain->tail->slab->used += piece;
+        chain->length += piece;
+        data = (const char*)data + piece;
+        length -= piece;
+    }
+    if (length == 0)
+    {
+        return 0;
+    }
+
+    if (chain->spare != NULL && length <= chain->spare->size)
+    {
+        slab = chain->spare;
+        chain->spare = NULL;
+    }
+    else if ((slab = newSlab((length > slabSize()) ? length : slabSize())) == NULL)
+    {
+        return -1;
+    }
+    memcpy(slab->data, data, length);
+    slab->used = length;
+    return appendSegment(chain, slab, slab->data, slab->data + length);
+}
+
+/* iobuf_reserve
+
+DESCRIPTION
+Get writable space at the end of chain, for producing data in place (e.g.
+compressor output) instead of copying it in with iobuf_append. Nothing is
+added until iobuf_commit.
+
+ARGUMENTS
+size_t min
+    Least number of bytes wanted.
+size_t *room
+    Set to the number of bytes available, at least min.
+
+RETURN VALUE
+The space, NULL when memory is short.
+*/
+
+char *iobuf_reserve(iobuf_t *chain, size_t min, size_t *room)
+{
+    if ((*room = tailRoom(chain)) >= min)
+    {
+        chain->reserved = chain->tail->end;
+        return chain->reserved;
+    }
+    if (chain->spare != NULL && chain->spare->size < min)
+    {
+        releaseSlab(chain->spare);
+        chain->spare = NULL;
+    }
+    if (chain->spare == NULL && (chain->spare = newSlab((min > slabSize()) ? min : slabSize())) == NULL)
+    {
+        return NULL;
+    }
+    *room = chain->spare->size;
+    chain->reserved = chain->spare->data;
+    return chain->reserved;
+}
+
+/* iobuf_commit
+
+DESCRIPTION
+Append the first length bytes of the space returned by the last iobuf_reserve.
+
+RETURN VALUE
+0 on success, -1 when memory is short.
+*/
+
+int iobuf_commit(iobuf_t *chain, size_t length)
+{
+    iobufSlab_t *slab;
+
+    if (length == 0)
+    {
+        return 0;
+    }
+    if (chain->tail != NULL && chain->reserved == chain->tail->end)
+    {
+        chain->tail->end += length;
+        chain->tail->slab->used += length;
+        chain->length += length;
+        return 0;
+    }
+    slab = chain->spare;
+    chain->spare = NULL;
+    slab->used = length;
+    return appendSegment(chain, slab, slab->data, slab->data + length);
+}
+
+/* iobuf_slice
+
+DESCRIPTION
+Append length bytes of from, starting at offset, to the end of to without
+copying them. The range is clipped to the data in from.
+
+RETURN VALUE
+0 on success, -1 when memory is short.
+*/
+
+int iobuf_slice(iobuf_t *to, const iobuf_t *from, size_t offset, size_t length)
+{
+    const iobufSegment_t *segment;
+    char *start, *end;
+
+    for (segment = from->head; segment != NULL && length > 0; segment = segment->next)
+    {
+        if (offset >= (size_t)(segment->end - segment->start))
+        {
+            offset -= segment->end - segment->start;
+            continue;
+        }
+        start = segment->start + offset;
+        end = ((size_t)(segment->end - start) < length) ? segment->end : start + length;
+        offset = 0;
+        length -= end - start;
+        __atomic_add_fetch(&segment->slab->references, 1, __ATOMIC_RELAXED);
+        if (appendSegment(to, segment->slab, start, end) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* iobuf_split
+
+DESCRIPTION
+Move the first length bytes of chain to the end of prefix. Whole segments
+are moved; only a segment straddling the boundary is shared between both.
+
+RETURN VALUE
+0 on success, -1 when memory is short.
+*/
+
+int iobuf_split(iobuf_t *chain, size_t length, iobuf_t *prefix)
+{
+    iobufSegment_t *segment;
+    size_t segmentLength;
+
+    while ((segment = chain->head) != NULL && length > 0)
+    {
+        segmentLength = segment->end - segment->start;
+        if (segmentLength > length)
+        {
+            __atomic_add_fetch(&segment->slab->references, 1, __ATOMIC_RELAXED);
+            if (appendSegment(prefix, segment->slab, segment->start, segment->start + length) == -1)
+            {
+                return -1;
+            }
+            segment->start += length;
+            chain->length -= length;
+            return 0;
+        }
+        chain->head = segment->next;
+        if (chain->head == NULL)
+        {
+            chain->tail = NULL;
+        }
+        chain->length -= segmentLength;
+        length -= segmentLength;
+        /* the segment's reference moves to prefix */
+        if (appendSegment(prefix, segment->slab, segment->start, segment->end) == -1)
+        {
+            free(segment);
+            return -1;
+        }
+        free(segment);
+    }
+    return 0;
+}
+
+/* iobuf_consume
+
+DESCRIPTION
+Drop the first length bytes of chain, or all of them if it is shorter.
+*/
+
+void iobuf_consume(iobuf_t *chain, size_t length)
+{
+    iobufSegment_t *segment;
+    size_t segmentLength;
+
+    while ((segment = chain->head) != NULL && length > 0)
+    {
+        segmentLength = segment->end - segment->start;
+        if (segmentLength > length)
+        {
+            segment->start += length;
+            chain->length -= length;
+            return;
+        }
+        chain->head = segment->next;
+        if (chain->head == NULL)
+        {
+            chain->tail = NULL;
+        }
+        chain->length -= segmentLength;
+        length -= segmentLength;
+        recycleSlab(chain, segment->slab);
+        free(segment);
+    }
+}
+
+/* iobuf_copy
+
+DESCRIPTION
+Copy up to length bytes of chain, starting at offset, into buf.
+
+RETURN VALUE
+Number of bytes copied.
+*/
+
+size_t iobuf_copy(const iobuf_t *chain, size_t offset, void *buf, size_t length)
+{
+    const iobufSegment_t *segment;
+    size_t copied = 0, piece;
+
+    for (segment = chain->head; segment != NULL && copied < length; segment = segment->next)
+    {
+        piece = segment->end - segment->start;
+        if (offset >= piece)
+        {
+            offset -= piece;
+            continue;
+        }
+        piece -= offset;
+        piece = (piece < length - copied) ? piece : length - copied;
+        memcpy((char*)buf + copied, segment->start + offset, piece);
+        copied += piece;
+        offset = 0;
+    }
+    return copied;
+}
+
+/* iobuf_string
+
+DESCRIPTION
+Make the data of chain contiguous and NUL-terminated, for parsing with the
+string functions. This copies only when the data spans segments or the byte
+after it belongs to another slice.
+
+RETURN VALUE
+The data as a string, valid until chain is next changed; NULL when memory is short.
+*/
+
+char *iobuf_string(iobuf_t *chain)
+{
+    iobufSegment_t *head = chain->head;
+    iobufSlab_t *slab;
+    size_t length = chain->length;
+
+    if (head == NULL)
+    {
+        return "";
+    }
+    if (head == chain->tail && tailRoom(chain) > 0)
+    {
+        *head->end = '\0';
+        return head->start;
+    }
+
+    if ((slab = newSlab((length + 1 > slabSize()) ? length + 1 : slabSize())) == NULL)
+    {
+        return NULL;
+    }
+    iobuf_copy(chain, 0, slab->data, length);
+    slab->used = length;
+    slab->data[length] = '\0';
+    iobuf_consume(chain, length);
+    appendSegment(chain, slab, slab->data, slab->data + length);
+    return (chain->head != NULL) ? chain->head->start : NULL;
+}
+
+/* iobuf_write
+
+DESCRIPTION
+Write the first length bytes of chain to fd with writev(2), or all of them
+if it is shorter, and consume them.
+
+RETURN VALUE
+0 on success, -1 when writev(2) fails, with errno set; what was written is consumed.
+*/
+
+int iobuf_write(iobuf_t *chain, int fd, size_t length)
+{
+    struct iovec iov[IOBUF_IOV_MAX];
+    const iobufSegment_t *segment;
+    ssize_t result;
+    size_t gathered;
+    int count;
+
+    length = (length < chain->length) ? length : chain->length;
+    while (length > 0)
+    {
+        gathered = 0;
+        count = 0;
+        for (segment = chain->head; segment != NULL && count < IOBUF_IOV_MAX && gathered < length;
+                segment = segment->next)
+        {
+            iov[count].iov_base = segment->start;
+            iov[count].iov_len = segment->end - segment->start;
+            if (iov[count].iov_len > length - gathered)
+            {
+                iov[count].iov_len = length - gathered;
+            }
+            gathered += iov[count].iov_len;
+            count++;
+        }
+        if ((result = writev(fd, iov, count)) == -1)
+        {
+            if (errno == EINTR || (errno == EAGAIN && coro_block(fd, POLLOUT) == 0))
+            {
+                continue;
+            }
+            return -1;
+        }
+        iobuf_consume(chain, result);
+        length -= result;
+    }
+    return 0;
+}
@@ -0,0 +1,71 @@
+/*
+ * iobuf.h - Chained I/O buffers
+ *
+ * An iobuf_t is a chain of segments, each a window onto a reference-counted
+ * slab. Data is read into slabs once and written out of them with
+ * writev(2); slicing a range into another chain only takes references, so
+ * a request can be forwarded with rewritten header lines spliced between
+ * slices of the original bytes without copying those bytes. A slab is only
+ * written to while one segment refers to it, so slices never change.
+ *
+ * A chain and its segments belong to one thread; only slab reference
+ * counts are atomic, so slices may outlive the chain they were taken from.
+ * Slabs are charged to the memory budget, and allocated smaller while it
+ * is under pressure.
+ */
+
+#ifndef __IOBUF_H__
+#define __IOBUF_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define IOBUF_SLAB_SIZE     (64*1024)       /* bytes per slab, and read(2) size */
+#define IOBUF_SLAB_MIN      (8*1024)        /* ... while memory is tight (see budget.h) */
+#define IOBUF_IOV_MAX       64              /* segments per writev(2) */
+
+typedef struct iobufSlab
+{
+    int references;
+    size_t size;
+    size_t used;                /* bytes at the start of data holding data */
+    char data[];
+}
+iobufSlab_t;
+
+typedef struct iobufSegment
+{
+    struct iobufSegment *next;
+    iobufSlab_t *slab;
+    char *start;                /* read cursor */
+    char *end;                  /* write cursor */
+}
+iobufSegment_t;
+
+typedef struct iobuf
+{
+    iobufSegment_t *head;
+    iobufSegment_t *tail;
+    size_t length;
+    iobufSlab_t *spare;         /* empty slab kept for the next read */
+    char *reserved;             /* space handed out by iobuf_reserve */
+}
+iobuf_t;
+
+void iobuf_init(iobuf_t *chain);
+void iobuf_clear(iobuf_t *chain);
+size_t iobuf_length(const iobuf_t *chain);
+ssize_t iobuf_read(iobuf_t *chain, int fd);
+ssize_t iobuf_readUntil(iobuf_t *chain, int fd, const char *pattern, size_t max);
+ssize_t iobuf_find(const iobuf_t *chain, const char *pattern, size_t from);
+int iobuf_append(iobuf_t *chain, const void *data, size_t length);
+char *iobuf_reserve(iobuf_t *chain, size_t min, size_t *room);
+int iobuf_commit(iobuf_t *chain, size_t length);
+int iobuf_slice(iobuf_t *to, const iobuf_t *from, size_t offset, size_t length);
+int iobuf_split(iobuf_t *chain, size_t length, iobuf_t *prefix);
+void iobuf_consume(iobuf_t *chain, size_t length);
+size_t iobuf_copy(const iobuf_t *chain, size_t offset, void *buf, size_t length);
+char *iobuf_string(iobuf_t *chain);
+int iobuf_write(iobuf_t *chain, int fd, size_t length);
+
+#endif /* __IOBUF_H__ */
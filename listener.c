@@ -0,0 +1,241 @@
+/*
+ * listener.c - Listening sockets
+ *
+ * Addresses are resolved with getaddrinfo(3) when added, so a host name
+ * that resolves to several addresses binds all of them. IPv6 sockets are
+ * IPV6_V6ONLY, so "0.0.0.0:port" and "[::]:port" can be bound side by side.
+ */
+
+#define _GNU_SOURCE
+#include "csapp.h"
+#include "diag.h"
+#include "listener.h"
+#include <netinet/tcp.h>
+
+static struct sockaddr_storage addrs[LISTENER_MAX];
+static socklen_t addrLengths[LISTENER_MAX];
+static int fds[LISTENER_MAX];
+static int count;
+
+
+/* listener_add
+
+DESCRIPTION
+Add the addresses of spec, "host:port", "[address]:port" or "port", to be
+bound by listener_open. An empty host means all IPv4 addresses.
+
+RETURN VALUE
+0 on success, -1 if spec is malformed, does not resolve or there are too many.
+*/
+
+int listener_add(const char *spec)
+{
+    char host[MAXLINE];
+    const char *port, *colon;
+    struct addrinfo hints, *result, *cursor;
+    size_t hostLength;
+    int error;
+
+    if (spec[0] == '[' && (colon = strstr(spec, "]:")) != NULL)
+    {
+        hostLength = colon - spec - 1;
+        port = colon + 2;
+        spec++;
+    }
+    else if ((colon = strrchr(spec, ':')) != NULL)
+    {
+        hostLength = colon - spec;
+        port = colon + 1;
+    }
+    else
+    {
+        hostLength = 0;
+        port = spec;
+    }
+    if (hostLength >= sizeof(host) || atoi(port) <= 0 || atoi(port) > 65535)
+    {
+        DIAG_ERROR("bad listen address %s", spec);
+        return -1;
+    }
+    memcpy(host, spec, hostLength);
+    host[hostLength] = '\0';
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = (hostLength == 0) ? AF_INET : AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+    if ((error = getaddrinfo(hostLength ? host : NULL, port, &hints, &result)) != 0)
+    {
+        DIAG_ERROR("listen address %s: %s", spec, gai_strerror(error));
+        return -1;
+    }
+    for (cursor = result; cursor != NULL; cursor = cursor->ai_next)
+    {
+        if (count == LISTENER_MAX)
+        {
+            DIAG_ERROR("more than %d listen addresses", LISTENER_MAX);
+            freeaddrinfo(result);
+            return -1;
+        }
+        memcpy(&addrs[count], cursor->ai_addr, cursor->ai_addrlen);
+        addrLengths[count] = cursor->ai_addrlen;
+        fds[count] = -1;
+        count++;
+    }
+    freeaddrinfo(result);
+    return 0;
+}
+
+/* listener_open
+
+DESCRIPTION
+Bind and listen on every added address.
+
+ARGUMENTS
+int deferAccept
+    Seconds the kernel may hold a connection waiting for its first bytes, 0 for off.
+int fastOpenQueue
+    Length of the TCP Fast Open queue, 0 for off.
+
+RETURN VALUE
+0 on success, -1 if an address cannot be bound; it has been reported.
+*/
+
+int listener_open(int backlog, int deferAccept, int fastOpenQueue)
+{
+    char name[INET6_ADDRSTRLEN];
+    int i, fd, optval;
+
+    for (i = 0; i < count; i++)
+    {
+        if ((fd = socket(addrs[i].ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+        {
+            DIAG_ERRNO(DIAG_LEVEL_ERROR, "socket");
+            return -1;
+        }
+        fds[i] = fd;
+        optval = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+        if (addrs[i].ss_family == AF_INET6)
+        {
+            setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &optval, sizeof(optval));
+        }
+        if (deferAccept > 0 && setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                    &deferAccept, sizeof(deferAccept)) == -1)
+        {
+            DIAG_ERRNO(DIAG_LEVEL_WARN, "TCP_DEFER_ACCEPT");
+        }
+        if (fastOpenQueue > 0 && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN,
+                    &fastOpenQueue, sizeof(fastOpenQueue)) == -1)
+        {
+            DIAG_ERRNO(DIAG_LEVEL_WARN, "TCP_FASTOPEN");
+        }
+
+        getnameinfo((struct sockaddr*)&addrs[i], addrLengths[i], name, sizeof(name), NULL, 0, NI_NUMERICHOST);
+        if (bind(fd, (struct sockaddr*)&addrs[i], addrLengths[i]) == -1 || listen(fd, backlog) == -1)
+        {
+            DIAG_ERRNO(DIAG_LEVEL_ERROR, name);
+            return -1;
+        }
+        DIAG_INFO("listening on %s port %d", name,
+                ntohs((addrs[i].ss_family == AF_INET6) ? ((struct sockaddr_in6*)&addrs[i])->sin6_port
+                    : ((struct sockaddr_in*)&addrs[i])->sin_port));
+    }
+    return 0;
+}
+
+/* listener_adopt
+
+DESCRIPTION
+Take over sockets that are already listening, e.g. inherited from the
+process being upgraded, in place of the added addresses.
+
+RETURN VALUE
+0 on success, -1 if there are too many.
+*/
+
+int listener_adopt(const int *inherited, int inheritedCount)
+{
+    if (inheritedCount > LISTENER_MAX)
+    {
+        return -1;
+    }
+    for (count = 0; count < inheritedCount; count++)
+    {
+        fds[count] = inherited[count];
+        addrLengths[count] = sizeof(addrs[count]);
+        getsockname(fds[count], (struct sockaddr*)&addrs[count], &addrLengths[count]);
+    }
+    return 0;
+}
+
+int listener_count(void)
+{
+    return count;
+}
+
+const int *listener_fds(void)
+{
+    return fds;
+}
+
+/* listener_accept
+
+DESCRIPTION
+Accept up to max pending connections on listener index without blocking.
+The connections are close-on-exec and blocking.
+
+RETURN VALUE
+Number of connections stored in connections, possibly 0.
+*/
+
+int listener_accept(int index, listenerConnection_t *connections, int max)
+{
+    socklen_t length;
+    int accepted = 0;
+
+    while (accepted < max)
+    {
+        length = sizeof(connections[accepted].addr);
+        connections[accepted].fd = accept4(fds[index], (struct sockaddr*)&connections[accepted].addr,
+                &length, SOCK_CLOEXEC);
+        if (connections[accepted].fd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                DIAG_ERRNO(DIAG_LEVEL_WARN, "accept");
+                if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+                {
+                    usleep(10000);
+                }
+            }
+            break;
+        }
+        accepted++;
+    }
+    return accepted;
+}
+
+/* listener_close
+
+DESCRIPTION
+Close every listening socket, e.g. before draining.
+*/
+
+void listener_close(void)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        if (fds[i] != -1)
+        {
+            close(fds[i]);
+            fds[i] = -1;
+        }
+    }
+}
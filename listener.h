@@ -0,0 +1,35 @@
+/*
+ * listener.h - Listening sockets
+ *
+ * The proxy listens on any number of IPv4 and IPv6 addresses, given as
+ * "host:port", "[v6 address]:port" or a bare port (all IPv4 addresses).
+ * Sockets are non-blocking. With TCP_DEFER_ACCEPT the kernel completes the
+ * accept only once the client has sent its request, so a connection never
+ * wakes the accept loop just to block a handler on an empty socket. Each
+ * wakeup drains up to LISTENER_BATCH pending connections with accept4(2).
+ */
+
+#ifndef __LISTENER_H__
+#define __LISTENER_H__
+
+#include <sys/socket.h>
+
+#define LISTENER_MAX        16
+#define LISTENER_BATCH      64              /* connections accepted per wakeup */
+
+typedef struct listenerConnection
+{
+    int fd;
+    struct sockaddr_storage addr;
+}
+listenerConnection_t;
+
+int listener_add(const char *spec);
+int listener_open(int backlog, int deferAccept, int fastOpenQueue);
+int listener_adopt(const int *fds, int count);
+int listener_count(void);
+const int *listener_fds(void);
+int listener_accept(int index, listenerConnection_t *connections, int max);
+void listener_close(void);
+
+#endif /* __LISTENER_H__ */
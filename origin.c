@@ -0,0 +1,541 @@
+/*
+ * origin.c - Per-origin health state shared by all handler threads
+ *
+ * The table is open-addressed with linear probing and never shrinks.
+ * Lookups are lock-free: a slot is published by setting 'ready' with
+ * release semantics after its key and lock are initialized, and is never
+ * reused. Only inserting a new origin takes the table lock. Breaker
+ * transitions take the lock of the one origin concerned; a closed breaker
+ * admits requests without locking at all unless concurrency is capped.
+ *
+ * Requests waiting for a concurrency slot queue on a list of waiters that
+ * live on their own stacks, each with its own condition variable, so a
+ * released slot wakes exactly the oldest waiter and a waiter that times out
+ * simply unlinks itself.
+ */
+
+#include "csapp.h"
+#include "diag.h"
+#include "stats.h"
+#include "origin.h"
+
+static origin_t origins[ORIGIN_SLOTS];
+static pthread_mutex_t insertLock = PTHREAD_MUTEX_INITIALIZER;
+static int originCount;
+static int limitMax;
+static pthread_condattr_t waiterAttr;
+
+
+/* makeKey
+
+DESCRIPTION
+Build the lower-case "host:port" key and its FNV-1a hash (never 0).
+
+RETURN VALUE
+The hash, 0 if the key does not fit in ORIGIN_KEY_MAX.
+*/
+
+static uint32_t makeKey(const char *host, in_port_t port, char *key)
+{
+    uint32_t hash = 2166136261u;
+    int length, i;
+
+    length = snprintf(key, ORIGIN_KEY_MAX, "%s:%u", host, (unsigned)port);
+    if (length < 0 || length >= ORIGIN_KEY_MAX)
+    {
+        return 0;
+    }
+    for (i = 0; i < length; i++)
+    {
+        key[i] = tolower((unsigned char)key[i]);
+        hash = (hash ^ (unsigned char)key[i]) * 16777619u;
+    }
+    return hash ? hash : 1;
+}
+
+/* lookup
+
+DESCRIPTION
+Probe for key starting at its home slot.
+
+RETURN VALUE
+The published origin, or NULL when a free or not yet published slot ends the probe.
+*/
+
+static origin_t *lookup(const char *key, uint32_t hash)
+{
+    origin_t *origin;
+    uint32_t i;
+
+    for (i = 0; i < ORIGIN_SLOTS; i++)
+    {
+        origin = &origins[(hash + i) & (ORIGIN_SLOTS - 1)];
+        if (!__atomic_load_n(&origin->ready, __ATOMIC_ACQUIRE))
+        {
+            return NULL;
+        }
+        if (origin->hash == hash && strcmp(origin->key, key) == 0)
+        {
+            return origin;
+        }
+    }
+    return NULL;
+}
+
+/* origin_setLimit
+
+DESCRIPTION
+Cap the requests in flight to each origin, 0 for no cap. Must be called before any handler runs.
+*/
+
+void origin_setLimit(int limit)
+{
+    pthread_condattr_init(&waiterAttr);
+    pthread_condattr_setclock(&waiterAttr, CLOCK_MONOTONIC);
+    limitMax = (limit > 0) ? limit : 0;
+}
+
+/* origin_get
+
+DESCRIPTION
+Find or create the entry for host:port.
+
+RETURN VALUE
+The entry, or NULL if the key is too long or the table is full; every
+origin_* function accepts NULL and then behaves as an always-closed breaker.
+*/
+
+origin_t *origin_get(const char *host, in_port_t port)
+{
+    char key[ORIGIN_KEY_MAX];
+    origin_t *origin;
+    uint32_t hash, i;
+
+    if ((hash = makeKey(host, port, key)) == 0)
+    {
+        return NULL;
+    }
+    if ((origin = lookup(key, hash)) != NULL)
+    {
+        return origin;
+    }
+
+    pthread_mutex_lock(&insertLock);
+    if ((origin = lookup(key, hash)) == NULL && originCount < ORIGIN_SLOTS * 3 / 4)
+    {
+        for (i = 0; origins[(hash + i) & (ORIGIN_SLOTS - 1)].ready; i++)
+        {
+        }
+        origin = &origins[(hash + i) & (ORIGIN_SLOTS - 1)];
+        strcpy(origin->key, key);
+        origin->hash = hash;
+        pthread_mutex_init(&origin->lock, NULL);
+        origin->state = ORIGIN_CLOSED;
+        origin->windowStart = stats_now();
+        origin->limit = (limitMax < ORIGIN_LIMIT_INITIAL) ? limitMax : ORIGIN_LIMIT_INITIAL;
+        originCount++;
+        __atomic_store_n(&origin->ready, 1, __ATOMIC_RELEASE);
+    }
+    else if (origin == NULL)
+    {
+        DIAG_WARN("origin table full, %s is not tracked", key);
+    }
+    pthread_mutex_unlock(&insertLock);
+    return origin;
+}
+
+/* grantWaiters
+
+DESCRIPTION
+Hand free slots to the oldest waiters. Called with the origin locked.
+*/
+
+static void grantWaiters(origin_t *origin)
+{
+    originWaiter_t *waiter;
+
+    while ((waiter = origin->head) != NULL && origin->inflight < (int)origin->limit)
+    {
+        if ((origin->head = waiter->next) == NULL)
+        {
+            origin->tail = NULL;
+        }
+        origin->waiting--;
+        origin->inflight++;
+        waiter->granted = 1;
+        if (waiter->coro != NULL)
+        {
+            coro_wake(waiter->coro);
+        }
+        else
+        {
+            pthread_cond_signal(&waiter->wakeup);
+        }
+    }
+}
+
+/* acquireSlot
+
+DESCRIPTION
+Take a concurrency slot, queueing behind earlier waiters for up to
+ORIGIN_QUEUE_TIMEOUT. Called with the origin locked; a coroutine parks
+with it unlocked rather than block its scheduler thread.
+
+RETURN VALUE
+0 when a slot was taken, -1 on timeout.
+*/
+
+static int acquireSlot(origin_t *origin)
+{
+    originWaiter_t waiter, *previous, *cursor;
+    struct timespec deadline;
+    uint64_t giveUp;
+    int status = 0;
+
+    if (origin->head == NULL && origin->inflight < (int)origin->limit)
+    {
+        origin->inflight++;
+        return 0;
+    }
+
+    if ((waiter.coro = coro_self()) == NULL)
+    {
+        pthread_cond_init(&waiter.wakeup, &waiterAttr);
+    }
+    waiter.granted = 0;
+    waiter.next = NULL;
+    if (origin->tail != NULL)
+    {
+        origin->tail->next = &waiter;
+    }
+    else
+    {
+        origin->head = &waiter;
+    }
+    origin->tail = &waiter;
+    origin->waiting++;
+
+    if (waiter.coro != NULL)
+    {
+        giveUp = stats_now() + ORIGIN_QUEUE_TIMEOUT;
+        while (!waiter.granted && status != ETIMEDOUT)
+        {
+            pthread_mutex_unlock(&origin->lock);
+            status = (coro_park(giveUp) == 0) ? 0 : ETIMEDOUT;
+            pthread_mutex_lock(&origin->lock);
+        }
+    }
+    else
+    {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += ORIGIN_QUEUE_TIMEOUT / 1000000;
+        while (!waiter.granted && status != ETIMEDOUT)
+        {
+            status = pthread_cond_timedwait(&waiter.wakeup, &origin->lock, &deadline);
+        }
+    }
+
+    if (!waiter.granted)
+    {
+        previous = NULL;
+        for (cursor = origin->head; cursor != &waiter; cursor = cursor->next)
+        {
+            previous = cursor;
+        }
+        if (previous != NULL)
+        {
+            previous->next = waiter.next;
+        }
+        else
+        {
+            origin->head = waiter.next;
+        }
+        if (origin->tail == &waiter)
+        {
+            origin->tail = previous;
+        }
+        origin->waiting--;
+    }
+    if (waiter.coro == NULL)
+    {
+        pthread_cond_destroy(&waiter.wakeup);
+    }
+    return waiter.granted ? 0 : -1;
+}
+
+/* adapt
+
+DESCRIPTION
+Adjust the concurrency limit after a request finished (AIMD). A response
+within ORIGIN_LATENCY_TOLERANCE of the latency floor while the limit was
+in use grows the limit by 1/limit; a failure or a slower response shrinks
+it, at most once per latency floor so one burst counts once. A latency of
+0 carries no information and only failures are acted on.
+Called with the origin locked.
+*/
+
+static void adapt(origin_t *origin, int success, uint64_t latency, uint64_t now)
+{
+    if (success)
+    {
+        if (latency == 0)
+        {
+            return;
+        }
+        if (origin->minLatency == 0 || latency < origin->minLatency
+                || now - origin->minLatencyTime > ORIGIN_LATENCY_TTL)
+        {
+            origin->minLatency = latency;
+            origin->minLatencyTime = now;
+        }
+        if (latency <= origin->minLatency * ORIGIN_LATENCY_TOLERANCE)
+        {
+            if (origin->waiting > 0 || origin->inflight + 1 >= (int)origin->limit)
+            {
+                origin->limit += 1.0 / origin->limit;
+                origin->limit = (origin->limit > limitMax) ? limitMax : origin->limit;
+            }
+            return;
+        }
+    }
+    if (now - origin->lastDecrease > origin->minLatency)
+    {
+        origin->limit *= ORIGIN_LIMIT_DECREASE;
+        origin->limit = (origin->limit < ORIGIN_LIMIT_MIN) ? ORIGIN_LIMIT_MIN : origin->limit;
+        origin->lastDecrease = now;
+    }
+}
+
+/* origin_admit
+
+DESCRIPTION
+Decide whether a request may be sent to origin, waiting for a concurrency
+slot if the origin is at its limit.
+
+ARGUMENTS
+uint64_t *retryAfter
+    On ORIGIN_REJECT, set to the microseconds until the next probe is due.
+
+RETURN VALUE
+ORIGIN_ALLOW or ORIGIN_PROBE when the request may proceed, to be reported
+with origin_done; ORIGIN_REJECT when it must fail fast.
+*/
+
+originVerdict_t origin_admit(origin_t *origin, uint64_t *retryAfter)
+{
+    originVerdict_t verdict = ORIGIN_ALLOW;
+    uint64_t now;
+
+    if (origin == NULL
+            || (limitMax == 0 && __atomic_load_n(&origin->state, __ATOMIC_RELAXED) == ORIGIN_CLOSED))
+    {
+        return ORIGIN_ALLOW;
+    }
+
+    now = stats_now();
+    pthread_mutex_lock(&origin->lock);
+    if (origin->state == ORIGIN_OPEN && now >= origin->openUntil)
+    {
+        origin->state = ORIGIN_HALF_OPEN;
+        verdict = ORIGIN_PROBE;
+    }
+    else if (origin->state != ORIGIN_CLOSED)
+    {
+        origin->rejected++;
+        *retryAfter = (origin->openUntil > now) ? origin->openUntil - now : ORIGIN_OPEN_BASE;
+        pthread_mutex_unlock(&origin->lock);
+        return ORIGIN_REJECT;
+    }
+
+    if (limitMax > 0 && acquireSlot(origin) == -1)
+    {
+        if (verdict == ORIGIN_PROBE)
+        {
+            /* the probe never ran; let the next request try */
+            origin->state = ORIGIN_OPEN;
+        }
+        origin->queueTimeouts++;
+        stats_add(STATS_QUEUE_TIMEOUTS, 1);
+        *retryAfter = ORIGIN_OPEN_BASE;
+        verdict = ORIGIN_REJECT;
+    }
+    pthread_mutex_unlock(&origin->lock);
+    return verdict;
+}
+
+/* origin_tryAdmit
+
+DESCRIPTION
+Admit an optional extra request, such as a hedge, only if the breaker is
+closed and a concurrency slot is free now; never waits or probes.
+
+RETURN VALUE
+ORIGIN_ALLOW, to be reported with origin_done, or ORIGIN_REJECT.
+*/
+
+originVerdict_t origin_tryAdmit(origin_t *origin)
+{
+    originVerdict_t verdict = ORIGIN_REJECT;
+
+    if (origin == NULL
+            || (limitMax == 0 && __atomic_load_n(&origin->state, __ATOMIC_RELAXED) == ORIGIN_CLOSED))
+    {
+        return ORIGIN_ALLOW;
+    }
+
+    pthread_mutex_lock(&origin->lock);
+    if (origin->state == ORIGIN_CLOSED
+            && (limitMax == 0 || (origin->head == NULL && origin->inflight < (int)origin->limit)))
+    {
+        if (limitMax > 0)
+        {
+            origin->inflight++;
+        }
+        verdict = ORIGIN_ALLOW;
+    }
+    pthread_mutex_unlock(&origin->lock);
+    return verdict;
+}
+
+/* trip
+
+DESCRIPTION
+Open the breaker, backing off exponentially with consecutive trips. Called with the origin locked.
+*/
+
+static void trip(origin_t *origin, const char *why)
+{
+    uint64_t period;
+
+    period = (uint64_t)ORIGIN_OPEN_BASE << (origin->trips < 5 ? origin->trips : 5);
+    if (period > ORIGIN_OPEN_MAX)
+    {
+        period = ORIGIN_OPEN_MAX;
+    }
+    origin->trips++;
+    origin->openUntil = stats_now() + period;
+    origin->consecutiveFailures = 0;
+    origin->windowRequests = origin->windowFailures = 0;
+    __atomic_store_n(&origin->state, ORIGIN_OPEN, __ATOMIC_RELAXED);
+    DIAG_WARN("origin %s unhealthy (%s), failing fast for %llu ms",
+            origin->key, why, (unsigned long long)(period / 1000));
+}
+
+/* origin_done
+
+DESCRIPTION
+Report the outcome of a request admitted by origin_admit and give back its
+concurrency slot. Only failures to reach the origin or to get any response
+from it count as failures.
+
+ARGUMENTS
+uint64_t latency
+    Time to first response byte in microseconds, 0 if unknown.
+*/
+
+void origin_done(origin_t *origin, originVerdict_t verdict, int success, uint64_t latency)
+{
+    uint64_t now;
+
+    if (origin == NULL || verdict == ORIGIN_REJECT)
+    {
+        return;
+    }
+
+    now = stats_now();
+    pthread_mutex_lock(&origin->lock);
+    if (verdict == ORIGIN_PROBE)
+    {
+        if (success)
+        {
+            DIAG_NOTICE("origin %s recovered", origin->key);
+            origin->trips = 0;
+            origin->consecutiveFailures = 0;
+            origin->windowStart = now;
+            origin->windowRequests = origin->windowFailures = 0;
+            __atomic_store_n(&origin->state, ORIGIN_CLOSED, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            trip(origin, "probe failed");
+        }
+    }
+    else if (origin->state == ORIGIN_CLOSED)
+    {
+        /* requests admitted before the breaker opened do not move it again */
+        if (now - origin->windowStart > ORIGIN_WINDOW)
+        {
+            origin->windowStart = now;
+            origin->windowRequests = origin->windowFailures = 0;
+        }
+        origin->windowRequests++;
+        if (success)
+        {
+            origin->consecutiveFailures = 0;
+        }
+        else
+        {
+            origin->windowFailures++;
+            if (++origin->consecutiveFailures >= ORIGIN_TRIP_FAILURES)
+            {
+                trip(origin, "consecutive failures");
+            }
+            else if (origin->windowRequests >= ORIGIN_WINDOW_MIN
+                    && origin->windowFailures * 100 > origin->windowRequests * ORIGIN_TRIP_PERCENT)
+            {
+                trip(origin, "error rate");
+            }
+        }
+    }
+    if (limitMax > 0)
+    {
+        origin->inflight--;
+        adapt(origin, success, latency, now);
+        grantWaiters(origin);
+    }
+    pthread_mutex_unlock(&origin->lock);
+}
+
+/* origin_report
+
+DESCRIPTION
+Render every origin whose breaker is not closed, that has rejected requests
+or that has requests queued, as plain text into buf.
+
+RETURN VALUE
+Length of the rendered text.
+*/
+
+int origin_report(char *buf, size_t size)
+{
+    static const char *stateNames[] = { "closed", "open", "half_open" };
+    uint64_t now = stats_now();
+    size_t length = 0;
+    int i, n;
+
+    for (i = 0; i < ORIGIN_SLOTS && length < size; i++)
+    {
+        origin_t *origin = &origins[i];
+
+        if (!__atomic_load_n(&origin->ready, __ATOMIC_ACQUIRE))
+        {
+            continue;
+        }
+        pthread_mutex_lock(&origin->lock);
+        if (origin->state != ORIGIN_CLOSED || origin->rejected != 0
+                || origin->waiting != 0 || origin->queueTimeouts != 0)
+        {
+            n = snprintf(buf + length, size - length,
+                    "origin %s %s rejected=%llu open_ms=%llu"
+                    " limit=%.1f inflight=%d waiting=%d queue_timeouts=%llu\n",
+                    origin->key, stateNames[origin->state],
+                    (unsigned long long)origin->rejected,
+                    (unsigned long long)((origin->openUntil > now) ? (origin->openUntil - now) / 1000 : 0),
+                    origin->limit, origin->inflight, origin->waiting,
+                    (unsigned long long)origin->queueTimeouts);
+            length += (n > 0) ? (size_t)n : 0;
+        }
+        pthread_mutex_unlock(&origin->lock);
+    }
+    return (length < size) ? (int)length : (int)size - 1;
+}
@@ -0,0 +1,102 @@
+/*
+ * origin.h - Per-origin health state shared by all handler threads
+ *
+ * Every host:port the proxy connects to gets an entry in a fixed-size table
+ * that lives for the life of the process. The entry carries a circuit
+ * breaker: after ORIGIN_TRIP_FAILURES consecutive failures, or when more
+ * than ORIGIN_TRIP_PERCENT of at least ORIGIN_WINDOW_MIN requests in the
+ * current ORIGIN_WINDOW failed, the breaker opens and requests fail fast
+ * without touching the network. Once the open period has passed a single
+ * probe request is let through (half-open); its outcome closes the breaker
+ * or reopens it for twice as long, up to ORIGIN_OPEN_MAX.
+ *
+ * When a concurrency cap is configured, each origin also admits at most
+ * 'limit' requests at a time; the rest wait in FIFO order for up to
+ * ORIGIN_QUEUE_TIMEOUT. The limit adapts between ORIGIN_LIMIT_MIN and the
+ * cap (AIMD): it grows by one per limit's worth of fast responses and
+ * shrinks by ORIGIN_LIMIT_DECREASE when responses fail or take more than
+ * ORIGIN_LATENCY_TOLERANCE times the lowest recently observed latency.
+ */
+
+#ifndef __ORIGIN_H__
+#define __ORIGIN_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include "coro.h"
+
+#define ORIGIN_SLOTS            4096                /* table size, power of two */
+#define ORIGIN_KEY_MAX          256
+#define ORIGIN_TRIP_FAILURES    5
+#define ORIGIN_TRIP_PERCENT     50
+#define ORIGIN_WINDOW           (10*1000*1000)      /* microseconds */
+#define ORIGIN_WINDOW_MIN       20
+#define ORIGIN_OPEN_BASE        (1000*1000)
+#define ORIGIN_OPEN_MAX         (30*1000*1000)
+#define ORIGIN_QUEUE_TIMEOUT    (5*1000*1000)
+#define ORIGIN_LIMIT_MIN        1
+#define ORIGIN_LIMIT_INITIAL    8
+#define ORIGIN_LIMIT_DECREASE   0.8
+#define ORIGIN_LATENCY_TOLERANCE 2
+#define ORIGIN_LATENCY_TTL      (30*1000*1000)      /* the latency floor is re-learned this often */
+
+typedef enum originState
+{
+    ORIGIN_CLOSED,              /* requests flow normally */
+    ORIGIN_OPEN,                /* requests fail fast until openUntil */
+    ORIGIN_HALF_OPEN            /* one probe request is in flight */
+}
+originState_t;
+
+typedef enum originVerdict
+{
+    ORIGIN_ALLOW,
+    ORIGIN_PROBE,               /* allowed as the half-open probe */
+    ORIGIN_REJECT               /* breaker open or no slot within ORIGIN_QUEUE_TIMEOUT */
+}
+originVerdict_t;
+
+typedef struct originWaiter
+{
+    pthread_cond_t wakeup;
+    coro_t *coro;               /* a waiting coroutine is woken instead */
+    int granted;
+    struct originWaiter *next;
+}
+originWaiter_t;
+
+typedef struct origin
+{
+    char key[ORIGIN_KEY_MAX];   /* host:port, lower case */
+    uint32_t hash;              /* 0 while the slot is free */
+    int ready;                  /* key and lock are initialized */
+    pthread_mutex_t lock;       /* guards the breaker fields below */
+    originState_t state;
+    int consecutiveFailures;
+    int trips;                  /* consecutive openings, drives the backoff */
+    uint64_t openUntil;
+    uint64_t windowStart;
+    int windowRequests;
+    int windowFailures;
+    uint64_t rejected;
+    double limit;               /* adaptive concurrency limit, guarded by lock */
+    int inflight;
+    int waiting;
+    originWaiter_t *head, *tail;
+    uint64_t minLatency;
+    uint64_t minLatencyTime;
+    uint64_t lastDecrease;
+    uint64_t queueTimeouts;
+}
+origin_t;
+
+void origin_setLimit(int limit);
+origin_t *origin_get(const char *host, in_port_t port);
+originVerdict_t origin_admit(origin_t *origin, uint64_t *retryAfter);
+originVerdict_t origin_tryAdmit(origin_t *origin);
+void origin_done(origin_t *origin, originVerdict_t verdict, int success, uint64_t latency);
+int origin_report(char *buf, size_t size);
+
+#endif /* __ORIGIN_H__ */
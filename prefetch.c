@@ -0,0 +1,413 @@
+/*
+ * prefetch.c - Prefetching of page subresources
+ *
+ * The tokenizer only knows enough HTML to find attribute values inside
+ * start tags: comments, doctypes and end tags are skipped up to their '>',
+ * and text between tags is ignored. A '<' inside a script may start a
+ * bogus tag; whatever it yields still has to resolve to the page's origin.
+ */
+
+#include "csapp.h"
+#include "stats.h"
+#include "shmcache.h"
+#include "prefetch.h"
+
+typedef enum scanState
+{
+    SCAN_TEXT,
+    SCAN_TAG_NAME,
+    SCAN_SKIP,                  /* comment, declaration or end tag */
+    SCAN_TAG,
+    SCAN_ATTRIBUTE,
+    SCAN_AFTER_ATTRIBUTE,
+    SCAN_BEFORE_VALUE,
+    SCAN_VALUE
+}
+scanState_t;
+
+static int enabled;
+static void (*fetcher)(const char *url);
+
+/* queued URLs in a ring, and those being fetched, under one lock */
+static char queue[PREFETCH_QUEUE_MAX][PREFETCH_URL_MAX];
+static int queueHead, queueCount;
+static char fetching[PREFETCH_THREADS][PREFETCH_URL_MAX];
+static int started;
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueReady = PTHREAD_COND_INITIALIZER;
+
+
+void prefetch_setFetcher(void (*fetch)(const char *url))
+{
+    fetcher = fetch;
+}
+
+void prefetch_setEnabled(int on)
+{
+    enabled = on;
+}
+
+/* prefetch_enabled
+
+RETURN VALUE
+Whether pages are to be scanned: prefetching is on, and there is a shared
+cache to hold what is fetched.
+*/
+
+int prefetch_enabled(void)
+{
+    return enabled && fetcher != NULL && shmcache_enabled();
+}
+
+/* fetchLoop
+
+DESCRIPTION
+Fetcher thread: take URLs off the queue and hand them to the fetcher,
+keeping each in its fetching slot meanwhile so it is not queued again.
+*/
+
+static void *fetchLoop(void *arg)
+{
+    int slot = (int)(intptr_t)arg;
+    char url[PREFETCH_URL_MAX];
+
+    for (;;)
+    {
+        pthread_mutex_lock(&queueLock);
+        fetching[slot][0] = '\0';
+        while (queueCount == 0)
+        {
+            pthread_cond_wait(&queueReady, &queueLock);
+        }
+        strcpy(url, queue[queueHead]);
+        strcpy(fetching[slot], url);
+        queueHead = (queueHead + 1) % PREFETCH_QUEUE_MAX;
+        queueCount--;
+        pthread_mutex_unlock(&queueLock);
+
+        fetcher(url);
+    }
+    return NULL;
+}
+
+/* request
+
+DESCRIPTION
+Queue url unless it is already queued or being fetched, starting the
+fetcher threads the first time. Dropped when the queue is full.
+*/
+
+static void request(const char *url)
+{
+    pthread_attr_t threadAttr;
+    pthread_t thread;
+    int i;
+
+    pthread_mutex_lock(&queueLock);
+    for (i = 0; i < queueCount; i++)
+    {
+        if (strcmp(queue[(queueHead + i) % PREFETCH_QUEUE_MAX], url) == 0)
+        {
+            pthread_mutex_unlock(&queueLock);
+            return;
+        }
+    }
+    for (i = 0; i < PREFETCH_THREADS; i++)
+    {
+        if (strcmp(fetching[i], url) == 0)
+        {
+            pthread_mutex_unlock(&queueLock);
+            return;
+        }
+    }
+    if (queueCount == PREFETCH_QUEUE_MAX)
+    {
+        pthread_mutex_unlock(&queueLock);
+        stats_add(STATS_PREFETCH_DROPPED, 1);
+        return;
+    }
+    strcpy(queue[(queueHead + queueCount) % PREFETCH_QUEUE_MAX], url);
+    queueCount++;
+    pthread_cond_signal(&queueReady);
+
+    if (!started)
+    {
+        pthread_attr_init(&threadAttr);
+        pthread_attr_setdetachstate(&threadAttr, PTHREAD_CREATE_DETACHED);
+        for (i = 0; i < PREFETCH_THREADS; i++)
+        {
+            started += (pthread_create(&thread, &threadAttr, fetchLoop, (void*)(intptr_t)i) == 0);
+        }
+        pthread_attr_destroy(&threadAttr);
+    }
+    pthread_mutex_unlock(&queueLock);
+    stats_add(STATS_PREFETCH_QUEUED, 1);
+}
+
+/* authorityLength
+
+RETURN VALUE
+Length of "http://authority" at the start of url, 0 if it is not an http URL.
+*/
+
+static size_t authorityLength(const char *url)
+{
+    if (strncasecmp(url, "http://", 7) != 0)
+    {
+        return 0;
+    }
+    return 7 + strcspn(url + 7, "/?#");
+}
+
+/* prefetch_resolve
+
+DESCRIPTION
+Resolve reference, an attribute value as found in a page at base, to an
+absolute URL on the page's origin: character references to '&' are
+decoded, the fragment dropped, and dot segments left to the origin.
+
+RETURN VALUE
+0 with the URL in url, -1 if the reference names another origin or scheme,
+is empty, points back at the page itself or does not fit.
+*/
+
+int prefetch_resolve(const char *base, const char *reference, char *url, size_t size)
+{
+    char decoded[PREFETCH_URL_MAX];
+    size_t origin = authorityLength(base), length, i, j;
+    int written;
+
+    /* decode &amp;, drop surrounding space and the fragment */
+    reference += strspn(reference, " \t\r\n");
+    for (i = j = 0; reference[i] != '\0' && reference[i] != '#' && j < sizeof(decoded) - 1; j++)
+    {
+        decoded[j] = reference[i];
+        i += (strncmp(reference + i, "&amp;", 5) == 0) ? 5 : 1;
+    }
+    while (j > 0 && isspace((unsigned char)decoded[j - 1]))
+    {
+        j--;
+    }
+    decoded[j] = '\0';
+    length = strcspn(decoded, ":/?");
+    if (origin == 0 || j == 0 || (reference[i] != '\0' && reference[i] != '#'))
+    {
+        return -1;
+    }
+
+    if (strncmp(decoded, "//", 2) == 0)
+    {
+        written = snprintf(url, size, "http:%s", decoded);
+    }
+    else if (decoded[length] == ':')
+    {
+        written = snprintf(url, size, "%s", decoded);
+    }
+    else if (decoded[0] == '/')
+    {
+        written = snprintf(url, size, "%.*s%s", (int)origin, base, decoded);
+    }
+    else
+    {
+        /* relative to the directory of the page's path */
+        const char *directory = base + origin + strcspn(base + origin, "?#");
+
+        while (directory > base + origin && directory[-1] != '/')
+        {
+            directory--;
+        }
+        written = (directory == base + origin)
+            ? snprintf(url, size, "%.*s/%s", (int)origin, base, decoded)
+            : snprintf(url, size, "%.*s%s", (int)(directory - base), base, decoded);
+    }
+    if (written < 0 || (size_t)written >= size || authorityLength(url) != origin
+            || strncasecmp(url, base, origin) != 0 || strcmp(url, base) == 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/* attribute
+
+DESCRIPTION
+Act on an attribute value just read: src on any element, and href on
+<link>, name subresources the browser is about to ask for.
+*/
+
+static void attribute(prefetchScanner_t *scanner)
+{
+    char url[PREFETCH_URL_MAX];
+
+    if (scanner->valueLength <= 0 || scanner->queued >= PREFETCH_PER_PAGE)
+    {
+        return;
+    }
+    scanner->value[scanner->valueLength] = '\0';
+    if (strcmp(scanner->name, "src") != 0
+            && (strcmp(scanner->name, "href") != 0 || strcmp(scanner->tag, "link") != 0))
+    {
+        return;
+    }
+    if (prefetch_resolve(scanner->base, scanner->value, url, sizeof(url)) == 0)
+    {
+        scanner->queued++;
+        request(url);
+    }
+}
+
+static void appendName(char *name, int *length, int size, char c)
+{
+    if (*length < size - 1)
+    {
+        name[(*length)++] = tolower((unsigned char)c);
+        name[*length] = '\0';
+    }
+}
+
+/* prefetch_begin
+
+DESCRIPTION
+Start scanning the body of the page at base, an absolute URI.
+*/
+
+void prefetch_begin(prefetchScanner_t *scanner, const char *base)
+{
+    memset(scanner, 0, sizeof(*scanner));
+    if (snprintf(scanner->base, sizeof(scanner->base), "%s", base) < (int)sizeof(scanner->base))
+    {
+        scanner->active = 1;
+        scanner->state = SCAN_TEXT;
+    }
+}
+
+/* prefetch_scan
+
+DESCRIPTION
+Feed the next length bytes of the page to the tokenizer, queueing the
+subresources found. Does nothing for a scanner that was not begun.
+*/
+
+void prefetch_scan(prefetchScanner_t *scanner, const char *data, size_t length)
+{
+    const char *end = data + length;
+    char c;
+
+    if (!scanner->active)
+    {
+        return;
+    }
+    for (; data < end; data++)
+    {
+        c = *data;
+        switch (scanner->state)
+        {
+        case SCAN_TEXT:
+            if (c == '<')
+            {
+                scanner->tagLength = 0;
+                scanner->tag[0] = '\0';
+                scanner->state = SCAN_TAG_NAME;
+            }
+            break;
+
+        case SCAN_TAG_NAME:
+            if (isalnum((unsigned char)c))
+            {
+                appendName(scanner->tag, &scanner->tagLength, sizeof(scanner->tag), c);
+            }
+            else if (scanner->tagLength == 0)
+            {
+                scanner->state = (c == '/' || c == '!' || c == '?') ? SCAN_SKIP : SCAN_TEXT;
+            }
+            else
+            {
+                scanner->state = (c == '>') ? SCAN_TEXT : SCAN_TAG;
+            }
+            break;
+
+        case SCAN_SKIP:
+            if (c == '>')
+            {
+                scanner->state = SCAN_TEXT;
+            }
+            break;
+
+        case SCAN_TAG:
+        case SCAN_AFTER_ATTRIBUTE:
+            if (c == '>')
+            {
+                scanner->state = SCAN_TEXT;
+            }
+            else if (c == '=' && scanner->state == SCAN_AFTER_ATTRIBUTE)
+            {
+                scanner->state = SCAN_BEFORE_VALUE;
+            }
+            else if (!isspace((unsigned char)c) && c != '/')
+            {
+                scanner->nameLength = 0;
+                scanner->name[0] = '\0';
+                appendName(scanner->name, &scanner->nameLength, sizeof(scanner->name), c);
+                scanner->state = SCAN_ATTRIBUTE;
+            }
+            break;
+
+        case SCAN_ATTRIBUTE:
+            if (c == '=')
+            {
+                scanner->state = SCAN_BEFORE_VALUE;
+            }
+            else if (c == '>')
+            {
+                scanner->state = SCAN_TEXT;
+            }
+            else if (isspace((unsigned char)c))
+            {
+                scanner->state = SCAN_AFTER_ATTRIBUTE;
+            }
+            else if (c == '/')
+            {
+                scanner->state = SCAN_TAG;
+            }
+            else
+            {
+                appendName(scanner->name, &scanner->nameLength, sizeof(scanner->name), c);
+            }
+            break;
+
+        case SCAN_BEFORE_VALUE:
+            if (c == '>')
+            {
+                scanner->state = SCAN_TEXT;
+            }
+            else if (!isspace((unsigned char)c))
+            {
+                scanner->quote = (c == '"' || c == '\'') ? c : 0;
+                scanner->valueLength = 0;
+                if (scanner->quote == 0)
+                {
+                    scanner->value[scanner->valueLength++] = c;
+                }
+                scanner->state = SCAN_VALUE;
+            }
+            break;
+
+        case SCAN_VALUE:
+            if ((scanner->quote != 0 && c == scanner->quote)
+                    || (scanner->quote == 0 && (isspace((unsigned char)c) || c == '>')))
+            {
+                attribute(scanner);
+                scanner->state = (scanner->quote == 0 && c == '>') ? SCAN_TEXT : SCAN_TAG;
+            }
+            else if (scanner->valueLength >= 0 && scanner->valueLength < (int)sizeof(scanner->value) - 1)
+            {
+                scanner->value[scanner->valueLength++] = c;
+            }
+            else
+            {
+                scanner->valueLength = -1;
+            }
+            break;
+        }
+    }
+}
@@ -0,0 +1,54 @@
+/*
+ * prefetch.h - Prefetching of page subresources
+ *
+ * HTML responses are scanned as they stream through pump() by a small
+ * tokenizer that keeps its state between reads, so no page is ever
+ * buffered. The values of src attributes, and of href on <link>, that
+ * resolve to the page's own origin are queued, and a few fetcher threads
+ * load them into the shared response cache with a TTL of at most
+ * PREFETCH_TTL, where the browser's follow-up requests find them.
+ *
+ * The queue is bounded and drops what does not fit; a URL already queued
+ * or being fetched is not queued again. Prefetch requests carry no cookies
+ * or credentials, so only responses fit for anyone are stored. The
+ * fetcher threads are started on first use, after any fork(2).
+ */
+
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define PREFETCH_URL_MAX        1024
+#define PREFETCH_PER_PAGE       32                  /* references queued from one page */
+#define PREFETCH_QUEUE_MAX      64
+#define PREFETCH_THREADS        4                   /* fetches at once */
+#define PREFETCH_TTL            (30ULL*1000*1000)   /* microseconds */
+#define PREFETCH_TIMEOUT_MS     5000                /* upstream inactivity */
+
+/* tokenizer state for one page */
+typedef struct prefetchScanner
+{
+    int active;
+    int state;
+    char quote;                 /* of the value being read, 0 if unquoted */
+    char tag[8];                /* element name, lowercased and truncated */
+    char name[8];               /* attribute name, likewise */
+    int tagLength;
+    int nameLength;
+    char value[PREFETCH_URL_MAX];
+    int valueLength;            /* -1 once the value is too long to use */
+    int queued;
+    char base[PREFETCH_URL_MAX];    /* absolute URI of the page */
+}
+prefetchScanner_t;
+
+void prefetch_setFetcher(void (*fetch)(const char *url));
+void prefetch_setEnabled(int enabled);
+int prefetch_enabled(void);
+void prefetch_begin(prefetchScanner_t *scanner, const char *base);
+void prefetch_scan(prefetchScanner_t *scanner, const char *data, size_t length);
+int prefetch_resolve(const char *base, const char *reference, char *url, size_t size);
+
+#endif /* __PREFETCH_H__ */
@@ -6,15 +6,38 @@
  *
  * How this concurrent proxy works:
  *  - function main
- *      - parse port number from CLI input
- *      - listen from INADDR_ANY:portnumber
- *      - for each accepted connection (i.e. browser connection), create a thread with handleClientRequest
+ *      - load the configuration file, with CLI options overriding it
+ *      - listen on every configured IPv4 and IPv6 address (INADDR_ANY:port by default),
+ *        with TCP_DEFER_ACCEPT so connections arrive with their request
+ *      - or take over the listening socket of the process being upgraded, and
+ *        let it know once ready
+ *      - in prefork mode, fork worker processes that each run the loop below,
+ *        and respawn any that die
+ *      - on SIGUSR2 hand the listening socket to a newly started binary, then drain
+ *        requests in flight and exit; on SIGQUIT just drain and exit
+ *      - on SIGHUP reload the configuration and reopen the log file
+ *      - stop accepting at the in-flight cap, and shed new connections with 503 while overloaded
+ *      - refuse clients over their request or bandwidth rate with 429
+ *      - on each wakeup accept all pending connections, and for each accepted connection
+ *        (i.e. browser connection), create a thread with handleClientRequest,
+ *        or with coroutine schedulers running, a coroutine on one of them
  *  - function handleClientRequest
- *      - read browser request until blank line encountered, for reading HTTP header
+ *      - read browser request into a buffer chain until blank line encountered, for reading HTTP header
+ *      - CONNECT requests are handed to handleConnect, which tunnels bytes both ways
  *      - from request header extract end server host and port number
+ *      - answer GET requests from the response cache shared by the workers if possible
+ *      - in reverse-proxy mode, pick a backend of the pool routed for the host
+ *      - otherwise fail fast with 503 while the origin's circuit breaker is open,
+ *        and wait for one of the origin's concurrency slots if they are capped
  *      - translate server host to ip address by calling getaddrinfo(3)
- *      - connect to end server and forward the HTTP header which was previously saved
- *      - pump server response to browser by repeatedly calling read(2) and write(2)
+ *      - connect to end server and forward the HTTP header which was previously saved,
+ *        rewritten to origin-form without hop-by-hop fields, in one writev(2)
+ *        that sends the unchanged spans from the buffers they were read into
+ *      - pump server response to browser by repeatedly calling readv(2) and writev(2),
+ *        pacing large responses when bandwidth shaping is configured
+ *      - compress textual responses with gzip or deflate for clients that accept it,
+ *        streaming them chunked to HTTP/1.1 clients
+ *      - store cacheable responses in the shared cache on the way through
  *      - close the server socket
  *      - generate a log entry
  *      - close connection socket
@@ -22,502 +45,2643 @@
  */
 
 #include "csapp.h"
+#include "diag.h"
+#include "stats.h"
+#include "capture.h"
+#include "tunnel.h"
+#include "backend.h"
+#include "origin.h"
+#include "hedge.h"
+#include "admission.h"
+#include "ratelimit.h"
+#include "shape.h"
+#include "shmcache.h"
+#include "upgrade.h"
+#include "config.h"
+#include "listener.h"
+#include "iobuf.h"
+#include "gzip.h"
+#include "proxy.h"
+#include <poll.h>
 
-/* basic configuration */
-#define BUFSIZE         (1024*1024)
-#define LOGFILENAME     ("proxy.log")
+/*
+ * I/O failure diagnostics - peers going away is routine for a proxy,
+ * so those are only reported at debug level
+ */
+#define ioError(what) \
+    do { \
+        if (errno == ECONNRESET || errno == EPIPE || errno == ETIMEDOUT \
+                || errno == EAGAIN || errno == EWOULDBLOCK) \
+            DIAG_ERRNO(DIAG_LEVEL_DEBUG, what); \
+        else \
+            DIAG_ERRNO(DIAG_LEVEL_ERROR, what); \
+    } while (0)
+
+
+/* global variables */
+FILE *logFile;
+sem_t logSem;
+
+
+#ifndef PROXY_NO_MAIN
+static const char *configFile;
+
+/*
+ * main - Main routine for the proxy program
+ */
+int main(int argc, char **argv)
+{
+    static char verbosityValue[16];
+    char portSpec[16];
+    const config_t *config;
+    int listenFDs[UPGRADE_MAX_FDS], inherited, listenerCount;
+    listenerConnection_t connections[LISTENER_BATCH];
+    pthread_attr_t threadAttr;
+    int opt, verbosity, usage;
+    int i, j, room, accepted, paused;
+    struct pollfd ready[LISTENER_MAX + 2];
+
+    /* control signals, blocked before any thread exists */
+    if (upgrade_init(argv) == -1)
+    {
+        fatal("upgrade_init");
+    }
+
+    /* Check arguments: every option but -v, -q and -f overrides a configuration key */
+    verbosity = 0;
+    usage = 0;
+    while ((opt = getopt(argc, argv, config_options())) != -1)
+    {
+        switch (opt)
+        {
+        case 'v':
+            verbosity++;
+            break;
+        case 'q':
+            verbosity--;
+            break;
+        case 'f':
+            configFile = optarg;
+            break;
+        default:
+            usage |= (opt == '?' || config_option(opt, optarg) == -1);
+            break;
+        }
+    }
+    if (optind == argc - 1)
+    {
+        config_override("port", argv[optind]);
+    }
+    if (verbosity != 0)
+    {
+        snprintf(verbosityValue, sizeof(verbosityValue), "%d", DIAG_LEVEL_NOTICE + verbosity);
+        config_override("verbosity", verbosityValue);
+    }
+
+    /* configuration; a port on its own listens on all IPv4 addresses */
+    if (!usage && optind >= argc - 1 && (config = config_load(configFile, 1)) != NULL && config->port != 0)
+    {
+        snprintf(portSpec, sizeof(portSpec), "%d", config->port);
+        usage = (listener_add(portSpec) == -1);
+    }
+    if (usage || optind < argc - 1 || config == NULL || listener_count() == 0)
+    {
+        fprintf(stderr, "Usage: %s [-f config file] [-v|-q]... [-l [host]:port]... [-t trace file [-b]]\n"
+                "          [-P pool=host:port[,host:port]...]... [-R host=pool]... [-L lor|p2c]\n"
+                "          [-H hedge percentile] [-C origin concurrency cap]\n"
+                "          [-A max requests in flight] [-m memory limit MiB] [-M buffer budget MiB]\n"
+                "          [-r client requests/s[:burst]] [-w client bytes/s[:burst]] [-s client prefix bits]\n"
+                "          [-B connection bytes/s] [-G aggregate bytes/s]\n"
+                "          [-W worker processes] [-T coroutine threads] [-c shared cache MiB]\n"
+                "          [-O object store directory] [-z gzip level] [-p (prefetch page subresources)]\n"
+                "          [<port number>]\n"
+                "Listen addresses may also come from the config file; options override it.\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    config_publish((config_t*)config);
+    applyConfig(config);
+    origin_setLimit(config->originLimit);
+    backend_setPolicy(strcmp(config->balance, "p2c") == 0 ? BACKEND_POWER_OF_TWO : BACKEND_LEAST_OUTSTANDING);
+
+    /* diagnostics */
+    diag_init();
+
+    /* ignore SIGPIPE; the control signals are read by the accept loop */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* open the log file */
+    if ((logFile = fopen(config->logPath, "a")) == NULL)
+    {
+        fatal((char*)config->logPath);
+    }
+
+    /* semaphore */
+    if (sem_init(&logSem, 0, 1)  == -1)
+    {
+        fatal("sem_init");
+    }
+
+    /* statistics */
+    stats_init();
+
+    /* response cache, mapped before the workers are forked so they all share it */
+    if (config->cacheSize != 0 && shmcache_init(config->cacheSize) == -1)
+    {
+        fatal("shmcache_init");
+    }
+
+    /* subresources of pages are prefetched into the shared cache */
+    prefetch_setFetcher(prefetchObject);
+    if (config->prefetch && !shmcache_enabled())
+    {
+        DIAG_WARN("prefetching needs a shared cache (-c); it stays off");
+    }
+
+    /* whole large objects for range requests, in a directory the workers share */
+    if (config->storeDir[0] != '\0' && store_init(config->storeDir, config->storeSize) == -1)
+    {
+        fatal((char*)config->storeDir);
+    }
+
+    /* traffic capture */
+    if (config->tracePath[0] != '\0' && capture_open(config->tracePath, config->traceBodies) == -1)
+    {
+        fatal((char*)config->tracePath);
+    }
+
+    /* listening sockets: taken over from the process being upgraded, or bound here */
+    if ((inherited = upgrade_inherit(listenFDs, UPGRADE_MAX_FDS)) == -1)
+    {
+        exit(EXIT_FAILURE);
+    }
+    if (inherited > 0)
+    {
+        listener_adopt(listenFDs, inherited);
+    }
+    else if (listener_open(config->listenBacklog, config->deferAccept, config->fastOpenQueue) == -1)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    /* an old process handing over to this one can stop accepting now */
+    upgrade_ready();
+
+    /* prefork: only workers return from here */
+    if (config->workers > 0)
+    {
+        superviseWorkers(config->workers);
+    }
+
+    /* connections run as coroutines on a few scheduler threads per process */
+    if (config->coroutineThreads > 0 && coro_start(config->coroutineThreads) == -1)
+    {
+        fatal("coro_start");
+    }
+
+    listenerCount = listener_count();
+    for (i = 0; i < listenerCount; i++)
+    {
+        ready[i].fd = listener_fds()[i];
+        ready[i].events = POLLIN;
+    }
+    ready[listenerCount].fd = upgrade_signalFD();
+    ready[listenerCount].events = POLLIN;
+    if ((ready[listenerCount + 1].fd = admission_wakeFD()) == -1)
+    {
+        exit(EXIT_FAILURE);
+    }
+    ready[listenerCount + 1].events = POLLIN;
+
+    /* thread attribute - detached */
+    pthread_attr_init(&threadAttr);
+    pthread_attr_setdetachstate(&threadAttr, PTHREAD_CREATE_DETACHED);
+
+    for(;;)
+    {
+        /* at the in-flight cap, leave new connections in the kernel backlog */
+        paused = admission_paused();
+        for (i = 0; i < listenerCount; i++)
+        {
+            ready[i].fd = paused ? -1 : listener_fds()[i];
+        }
+
+        /* wait for connections, a control signal or, while paused, a request to end */
+        if (poll(ready, listenerCount + 2, -1) == -1)
+        {
+            continue;
+        }
+        if (ready[listenerCount].revents != 0)
+        {
+            handleControlSignals(config_current()->workers == 0);
+        }
+
+        /* accept everything pending, up to the in-flight cap */
+        for (i = 0; i < listenerCount; i++)
+        {
+            if (ready[i].revents == 0)
+            {
+                continue;
+            }
+            stats_add(STATS_ACCEPT_WAKEUPS, 1);
+            room = admission_room();
+            accepted = listener_accept(i, connections, (room < LISTENER_BATCH) ? room : LISTENER_BATCH);
+            if (accepted == 0)
+            {
+                stats_add(STATS_ACCEPT_EMPTY, 1);
+            }
+            for (j = 0; j < accepted; j++)
+            {
+                dispatchConnection(connections[j].fd, &connections[j].addr, &threadAttr);
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* superviseWorkers
+
+DESCRIPTION
+Fork count worker processes sharing the listening sockets and the response
+cache, then stay in the master to respawn workers that exit and to act on
+the control signals: SIGHUP reloads the configuration here and in every
+worker, SIGUSR2 hands the listening sockets to a new binary and drains the workers,
+SIGQUIT drains them, SIGTERM and SIGINT stop them at once. The
+workers' counters, breakers and rate limits are their own; only the cache
+is shared.
+
+RETURN VALUE
+Returns only in a worker, which goes on to run the accept loop.
+*/
+
+void superviseWorkers(int count)
+{
+    struct pollfd control;
+    pid_t *pids, pid;
+    uint64_t *started;
+    int i, status, signum;
+
+    if ((pids = calloc(count, sizeof(pid_t))) == NULL
+            || (started = calloc(count, sizeof(uint64_t))) == NULL)
+    {
+        fatal("calloc");
+    }
+    control.fd = upgrade_signalFD();
+    control.events = POLLIN;
+    DIAG_NOTICE("starting %d worker processes", count);
+
+    for (;;)
+    {
+        for (i = 0; i < count; i++)
+        {
+            if (pids[i] != 0)
+            {
+                continue;
+            }
+            if (started[i] != 0 && stats_now() - started[i] < 1000000)
+            {
+                /* a worker that dies at once would otherwise fork in a tight loop */
+                sleep(1);
+            }
+            diag_flush();
+            if ((pid = fork()) == 0)
+            {
+                diag_afterFork();
+                free(pids);
+                free(started);
+                return;
+            }
+            if (pid == -1)
+            {
+                DIAG_ERRNO(DIAG_LEVEL_ERROR, "fork");
+                sleep(1);
+                continue;
+            }
+            pids[i] = pid;
+            started[i] = stats_now();
+        }
+
+        poll(&control, 1, -1);
+        while ((signum = upgrade_nextSignal()) != 0)
+        {
+            if (signum == SIGHUP)
+            {
+                reloadConfig();
+                for (i = 0; i < count; i++)
+                {
+                    if (pids[i] != 0)
+                    {
+                        kill(pids[i], SIGHUP);
+                    }
+                }
+                continue;
+            }
+            if (signum == SIGUSR2 && upgrade_handoff(listener_fds(), listener_count()) == -1)
+            {
+                continue;
+            }
+            if (signum != SIGCHLD)
+            {
+                stopWorkers(pids, count, (signum == SIGTERM || signum == SIGINT) ? SIGTERM : SIGQUIT);
+            }
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+            {
+                for (i = 0; i < count && pids[i] != pid; i++)
+                {
+                }
+                if (i == count)
+                {
+                    continue;
+                }
+                pids[i] = 0;
+                if (WIFSIGNALED(status))
+                {
+                    DIAG_WARN("worker %d killed by signal %d, respawning", (int)pid, WTERMSIG(status));
+                }
+                else
+                {
+                    DIAG_WARN("worker %d exited with status %d, respawning", (int)pid, WEXITSTATUS(status));
+                }
+            }
+        }
+    }
+}
+
+/* stopWorkers
+
+DESCRIPTION
+Close the master's listening sockets, send signum to the workers and exit
+once they are gone. Workers still running after the drain deadline are killed.
+*/
+
+void stopWorkers(pid_t *pids, int count, int signum)
+{
+    uint64_t deadline = stats_now() + UPGRADE_DRAIN_DEADLINE + 1000000;
+    pid_t pid;
+    int i, remaining;
+
+    listener_close();
+    for (i = 0; i < count; i++)
+    {
+        if (pids[i] != 0)
+        {
+            kill(pids[i], signum);
+        }
+    }
+    do
+    {
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+        {
+            for (i = 0; i < count; i++)
+            {
+                pids[i] = (pids[i] == pid) ? 0 : pids[i];
+            }
+        }
+        for (remaining = 0, i = 0; i < count; i++)
+        {
+            remaining += (pids[i] != 0);
+        }
+        if (remaining > 0 && stats_now() > deadline)
+        {
+            DIAG_WARN("killing %d workers after the drain deadline", remaining);
+            for (i = 0; i < count; i++)
+            {
+                if (pids[i] != 0)
+                {
+                    kill(pids[i], SIGKILL);
+                }
+            }
+            deadline = UINT64_MAX;
+        }
+        usleep(remaining ? 50000 : 0);
+    }
+    while (remaining > 0);
+
+    DIAG_NOTICE("workers stopped");
+    diag_flush();
+    exit(EXIT_SUCCESS);
+}
+
+/* handleControlSignals
+
+DESCRIPTION
+Act on the pending control signals in the process running the accept loop.
+SIGHUP reloads the configuration. SIGUSR2 hands the listening sockets to a new binary (only if upgradable, i.e. not in a
+prefork worker, where the master does it) and drains; SIGQUIT drains;
+SIGTERM and SIGINT exit at once. Draining stops accepting and exits once
+the requests in flight are done or UPGRADE_DRAIN_DEADLINE has passed.
+*/
+
+void handleControlSignals(int upgradable)
+{
+    int signum;
+
+    while ((signum = upgrade_nextSignal()) != 0)
+    {
+        switch (signum)
+        {
+        case SIGCHLD:
+            while (waitpid(-1, NULL, WNOHANG) > 0)
+            {
+            }
+            continue;
+        case SIGHUP:
+            reloadConfig();
+            continue;
+        case SIGUSR2:
+            if (!upgradable || upgrade_handoff(listener_fds(), listener_count()) == -1)
+            {
+                continue;
+            }
+            break;
+        case SIGQUIT:
+            break;
+        default:
+            diag_flush();
+            exit(EXIT_SUCCESS);
+        }
+
+        listener_close();
+        DIAG_NOTICE("draining %d requests in flight", admission_inflight());
+        upgrade_drain(stats_now() + UPGRADE_DRAIN_DEADLINE);
+        diag_flush();
+        exit(EXIT_SUCCESS);
+    }
+}
+/* dispatchConnection
+
+DESCRIPTION
+Hand an accepted connection to a new handler thread, or a new coroutine
+when the coroutine schedulers run, unless the proxy is overloaded or the
+client is over its rate, in which case it is refused.
+*/
+
+void dispatchConnection(int clientFD, const struct sockaddr_storage *clientAddr, pthread_attr_t *threadAttr)
+{
+    handlerJob_t *job;
+    pthread_t dummy;
+    uint64_t retryAfter;
+
+    /* shed before committing a thread to the connection */
+    if (admission_overloaded() || (job = calloc(1, sizeof(handlerJob_t))) == NULL)
+    {
+        stats_add(STATS_SHED, 1);
+        refuseConnection(clientFD, 503, ADMISSION_RETRY_AFTER);
+        return;
+    }
+
+    /* throttle clients over their rate */
+    if (!ratelimit_admit((const struct sockaddr*)clientAddr, &retryAfter))
+    {
+        free(job);
+        stats_add(STATS_RATE_LIMITED, 1);
+        refuseConnection(clientFD, 429, retryAfter);
+        return;
+    }
+    job->clientFD = clientFD;
+    job->clientAddr = *clientAddr;
+    job->acceptTime = stats_now();
+    job->config = config_acquire();
+    budget_charge(sizeof(handlerJob_t));
+
+    /* create thread or coroutine */
+    admission_enter();
+    if ((coro_enabled() ? coro_spawn(handleClientRequest, job)
+                : pthread_create(&dummy, threadAttr, handleClientRequest, job)) != 0)
+    {
+        admission_leave();
+        config_release(job->config);
+        budget_credit(sizeof(handlerJob_t));
+        free(job);
+        stats_add(STATS_SHED, 1);
+        refuseConnection(clientFD, 503, ADMISSION_RETRY_AFTER);
+    }
+}
+
+/* reloadConfig
+
+DESCRIPTION
+Re-read the configuration file, apply the settings that can change at run
+time, reopen the log file and publish the new configuration for the
+requests accepted from now on. A configuration with errors is not applied.
+*/
+
+void reloadConfig(void)
+{
+    config_t *config;
+
+    if ((config = config_load(configFile, 0)) == NULL)
+    {
+        DIAG_ERROR("configuration not reloaded");
+        return;
+    }
+    applyConfig(config);
+    reopenLog(config->logPath);
+    config_publish(config);
+    DIAG_NOTICE("configuration reloaded");
+}
+#endif /* PROXY_NO_MAIN */
+
+/* applyConfig
+
+DESCRIPTION
+Hand the run-time settings of config to the modules that own them. The
+values have been validated by config_load.
+*/
+
+void applyConfig(const config_t *config)
+{
+    diag_setLevel(config->verbosity);
+    admission_setLimits(config->maxInflight, config->maxMemory);
+    hedge_setPercentile(config->hedgePercentile);
+    ratelimit_setRequests(config->clientRequests);
+    ratelimit_setBandwidth(config->clientBandwidth);
+    ratelimit_setPrefix(config->clientPrefix);
+    shape_setConnectionRate(config->connectionRate);
+    shape_setAggregateRate(config->aggregateRate);
+    gzip_setLevel(config->gzipLevel);
+    gzip_setMinSize(config->gzipMinSize);
+    prefetch_setEnabled(config->prefetch);
+    budget_setLimit(config->memoryBudget);
+}
+
+/* reopenLog
+
+DESCRIPTION
+Switch logging to the file at path, e.g. after it was rotated away. The old
+file stays in use if the new one cannot be opened.
+*/
+
+void reopenLog(const char *path)
+{
+    FILE *file, *old;
+
+    if ((file = fopen(path, "a")) == NULL)
+    {
+        DIAG_ERRNO(DIAG_LEVEL_ERROR, path);
+        return;
+    }
+    if (sem_wait(&logSem) == -1)
+    {
+        fatal("sem_wait");
+    }
+    old = logFile;
+    logFile = file;
+    if (sem_post(&logSem) == -1)
+    {
+        fatal("sem_post");
+    }
+    fclose(old);
+}
+
+/* configureSocket
+
+DESCRIPTION
+Apply an inactivity timeout (milliseconds) and socket buffer size (bytes)
+to fd; 0 leaves the kernel default. In a coroutine fd is made non-blocking,
+so that waiting on it yields to the other coroutines (see coro_block).
+*/
+
+void configureSocket(int fd, int timeout, int bufferSize)
+{
+    struct timeval tv;
+    int flags;
+
+    if (timeout > 0)
+    {
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+    if (bufferSize > 0)
+    {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+    }
+    if (coro_self() != NULL && (flags = fcntl(fd, F_GETFL)) != -1 && !(flags & O_NONBLOCK))
+    {
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    }
+}
+
+/* handleClientRequest
+
+DESCRIPTION
+Assumes HTTP header stream from clientFD and acts like a middleman between client and end-server.
+It parses end-server information from clientFD stream and connect accordingly, and forward the response to the client.
+For this function, socket to client and file pointer to log file should be available.
+
+ARGUMENTS
+handlerJob_t *job
+    int clientFD
+        connection file descriptor from accept(2) system call
+    struct sockaddr_storage clientAddr
+        IPv4 or IPv6 address of the client, from accept4(2)
+
+LIMITATIONS
+This function will fail if HTTP header is biggern than REQUEST_HEADER_MAX.
+
+SIDE EFFECTS
+This function can cause termination of the entire program in some cases of system call failure.
+This function reports status through the diag module, and writes a log entry for each request to the log file.
+This function calls subroutines with side effects, such as iobuf_readUntil, iobuf_write and writeAll.
+This function records phase timings and counters through the stats module.
+
+RETURN VALUE (handleClientRequest_internal)
+0 is returned when the request was served, -1 when it was aborted.
+*/
+
+void *handleClientRequest(void *job)
+{
+    int clientFD = ((handlerJob_t*)job)->clientFD;
+    int result;
+
+    admission_started(((handlerJob_t*)job)->acceptTime);
+    stats_connectionOpened();
+    if ((result = handleClientRequest_internal(job)) == -1)
+    {
+        stats_add(STATS_FAILURES, 1);
+    }
+    stats_connectionClosed();
+    capture_end(((handlerJob_t*)job)->capture, result,
+            ((handlerJob_t*)job)->responseSize, ((handlerJob_t*)job)->phaseTime);
+
+    /* finally */
+    ratelimit_charge((struct sockaddr*)&((handlerJob_t*)job)->clientAddr, ((handlerJob_t*)job)->responseSize);
+    config_release(((handlerJob_t*)job)->config);
+    iobuf_clear(&((handlerJob_t*)job)->input);
+    iobuf_clear(&((handlerJob_t*)job)->request);
+    budget_credit(sizeof(handlerJob_t));
+    free(job);
+    close(clientFD);
+    admission_leave();
+    return NULL;
+}
+
+int handleClientRequest_internal(void *job)
+{
+    /* argument */
+    int clientFD = ((handlerJob_t*)job)->clientFD;
+    struct sockaddr *clientAddr = (struct sockaddr*)&((handlerJob_t*)job)->clientAddr;
+    uint64_t acceptTime = ((handlerJob_t*)job)->acceptTime;
+    uint64_t *phaseTime = ((handlerJob_t*)job)->phaseTime;
+    const config_t *config = ((handlerJob_t*)job)->config;
+    iobuf_t *input = &((handlerJob_t*)job)->input;
+    iobuf_t *request = &((handlerJob_t*)job)->request;
+
+    /* for saving and parsing HTTP request from client */
+    const char *headerDelimiter = "\r\n\r\n";
+    char *clientRequestHeader;
+    ssize_t headerLength;
+    iobuf_t forward;
+    char *http, request_host[MAXLINE];
+    char requestURI[MAXLINE * 2];
+    in_port_t request_port;
+    shmcacheHandle_t cached;
+    storeObject_t object;
+    long long rangeSize;
+    int cacheable;
+
+    /* server connection information */
+    backendPool_t *pool;
+    backend_t *backend = NULL;
+    origin_t *origin = NULL;
+    originVerdict_t verdict = ORIGIN_ALLOW;
+    uint64_t retryAfter;
+    int serverFD;
+
+    /* timing */
+    uint64_t connectedTime, doneTime;
+    pumpContext_t pumpContext;
+    shaper_t shaper;
+
+    /* misc. */
+    char logEntry[MAXLINE * 3];
+    int responseSize;
+
+    configureSocket(clientFD, config->clientTimeout, config->socketBuffer);
+
+    /* read HTTP header */
+    headerLength = iobuf_readUntil(input, clientFD, headerDelimiter, REQUEST_HEADER_MAX);
+    if (headerLength == -1)
+    {
+        ioError("read");
+        return -1;
+    }
+    if (headerLength == 0)
+    {
+        return -1;
+    }
+    if (headerLength == -2)
+    {
+        DIAG_WARN("request header larger than %d bytes", REQUEST_HEADER_MAX);
+        return -1;
+    }
+
+    /* the header as a string for parsing, followed by any body bytes read with it */
+    if (iobuf_split(input, headerLength, request) == -1
+            || (clientRequestHeader = iobuf_string(request)) == NULL
+            || iobuf_split(input, iobuf_length(input), request) == -1)
+    {
+        DIAG_WARN("out of memory for request header");
+        return -1;
+    }
+    phaseDone(phaseTime, STATS_PHASE_HEADER, stats_now() - acceptTime);
+
+    /* tunnels are relayed opaquely */
+    if (strncasecmp(clientRequestHeader, "CONNECT ", 8) == 0)
+    {
+        return handleConnect(job, clientRequestHeader, headerLength);
+    }
+
+    /* analyze the request: absolute URI, or origin-form with a Host header */
+    http = strchr(clientRequestHeader, ' ');
+    http = (http != NULL && strncasecmp(http + 1, "http://", 7) == 0) ? http + 1 : NULL;
+    if (http != NULL)
+    {
+        if (parse_uri(http, request_host, &request_port) == -1)
+        {
+            return -1;
+        }
+    }
+    else if (findHeader(clientRequestHeader, "Host", request_host, sizeof(request_host)) == -1)
+    {
+        request_host[0] = '\0';
+    }
+
+    /* requests for the stats pseudo-host never leave the proxy */
+    if (strcasecmp(request_host, STATS_HOST) == 0)
+    {
+        return serveStats(clientFD);
+    }
+
+    /* the absolute URI names the request in the cache and in the log */
+    if (http != NULL)
+    {
+        snprintf(requestURI, sizeof(requestURI), "%.*s", (int)strcspn(http, " \r\n"), http);
+    }
+    else
+    {
+        char *path = strchr(clientRequestHeader, ' ');
+
+        /* a request line without a target */
+        if (path == NULL || path > strstr(clientRequestHeader, "\r\n"))
+        {
+            sendErrorResponse(clientFD, 400, "Bad Request", NULL);
+            return -1;
+        }
+        path++;
+        snprintf(requestURI, sizeof(requestURI), "http://%s%.*s", request_host,
+                (int)strcspn(path, " \r\n"), path);
+    }
+
+    /* plain GETs may be answered from the shared cache */
+    cacheable = shmcache_enabled() && strncmp(clientRequestHeader, "GET ", 4) == 0
+        && findHeader(clientRequestHeader, "Authorization", logEntry, sizeof(logEntry)) == -1;
+    if (cacheable)
+    {
+        if (shmcache_lookup(requestURI, &cached))
+        {
+            responseSize = serveCached(clientFD, &cached);
+            if (responseSize == -1)
+            {
+                return -1;
+            }
+            stats_add(STATS_CACHE_HITS, 1);
+            servedLocally(job, requestURI, responseSize);
+            return 0;
+        }
+        stats_add(STATS_CACHE_MISSES, 1);
+    }
+
+    /* in reverse-proxy mode the host selects a backend pool */
+    pool = backend_enabled() ? backend_route(request_host) : NULL;
+    if (pool == NULL && http == NULL)
+    {
+        if (backend_enabled())
+        {
+            sendErrorResponse(clientFD, 502, "Bad Gateway", NULL);
+        }
+        return -1;
+    }
+
+    /* byte ranges of large objects come from a whole copy, fetched once on the first miss */
+    if (store_enabled() && strncmp(clientRequestHeader, "GET ", 4) == 0
+            && findHeader(clientRequestHeader, "Authorization", logEntry, sizeof(logEntry)) == -1
+            && findHeader(clientRequestHeader, "Range", logEntry, sizeof(logEntry)) != -1)
+    {
+        if (store_open(requestURI, &object))
+        {
+            rangeSize = serveRange(clientFD, clientRequestHeader, &object);
+            store_close(&object);
+            if (rangeSize == -1)
+            {
+                return -1;
+            }
+            if (rangeSize >= 0)
+            {
+                stats_add(STATS_RANGE_HITS, 1);
+                servedLocally(job, requestURI, rangeSize);
+                return 0;
+            }
+        }
+        else
+        {
+            stats_add(STATS_RANGE_MISSES, 1);
+            fetchInBackground(requestURI, clientRequestHeader, headerLength, http != NULL, request_host,
+                    request_port, request, pool, config);
+        }
+    }
+    ((handlerJob_t*)job)->capture = capture_begin(acceptTime, clientAddr, request);
+
+    /* connect to backend or end server */
+    if (pool != NULL)
+    {
+        backend = backend_pick(pool, NULL);
+        if ((serverFD = connectAddress(&backend->addr, phaseTime)) < 0)
+        {
+            backend_release(backend, 0);
+            sendErrorResponse(clientFD, 502, "Bad Gateway", NULL);
+            return -1;
+        }
+    }
+    else
+    {
+        origin = origin_get(request_host, request_port);
+        if ((verdict = origin_admit(origin, &retryAfter)) == ORIGIN_REJECT)
+        {
+            stats_add(STATS_FAST_FAILS, 1);
+            sendRetryLater(clientFD, 503, retryAfter);
+            return -1;
+        }
+        if ((serverFD = connectServer(request_host, request_port, phaseTime)) < 0)
+        {
+            origin_done(origin, verdict, 0, 0);
+            sendErrorResponse(clientFD, 502, "Bad Gateway", NULL);
+            return -1;
+        }
+    }
+    connectedTime = stats_now();
+    configureSocket(serverFD, config->upstreamTimeout, config->socketBuffer);
+
+    /* forward request, rewritten around the spans of the original */
+    iobuf_init(&forward);
+    if (rewriteRequest(clientRequestHeader, headerLength, (http != NULL) ? request_host : NULL,
+                request_port, request, 0, &forward) == -1
+            || sendChain(serverFD, &forward) == -1)
+    {
+        iobuf_clear(&forward);
+        if (backend != NULL)
+        {
+            backend_release(backend, 0);
+        }
+        origin_done(origin, verdict, 0, 0);
+        close(serverFD);
+        return -1;
+    }
+
+    /* hedge slow idempotent requests with a second attempt */
+    if (hedge_enabled() && hedge_eligible(clientRequestHeader))
+    {
+        serverFD = hedgeRequest(serverFD, &forward, pool, &backend, origin, request_host, request_port, config);
+    }
+    iobuf_clear(&forward);
+    if (serverFD == -1)
+    {
+        if (backend != NULL)
+        {
+            backend_release(backend, 0);
+        }
+        origin_done(origin, verdict, 0, 0);
+        sendErrorResponse(clientFD, 504, "Gateway Timeout", NULL);
+        return -1;
+    }
+
+    /* forward response */
+    memset(&pumpContext, 0, sizeof(pumpContext));
+    pumpContext.capture = ((handlerJob_t*)job)->capture;
+    if (shape_enabled())
+    {
+        shape_begin(&shaper, clientFD);
+        pumpContext.shaper = &shaper;
+    }
+    pumpContext.cacheKey = cacheable ? requestURI : NULL;
+    if (prefetch_enabled() && strncmp(clientRequestHeader, "GET ", 4) == 0)
+    {
+        pumpContext.prefetchBase = requestURI;
+    }
+    if (gzip_enabled() && strncmp(clientRequestHeader, "HEAD ", 5) != 0
+            && findHeader(clientRequestHeader, "Accept-Encoding", logEntry, sizeof(logEntry)) != -1)
+    {
+        pumpContext.encoding = gzip_accepted(logEntry);
+        pumpContext.chunked = strncmp(requestVersion(clientRequestHeader), "1.1", 3) == 0;
+    }
+    responseSize = pump(serverFD, clientFD, &pumpContext);
+    if (pumpContext.cacheTTL != 0
+            && shmcache_commit(&pumpContext.cacheFill, (responseSize == -1) ? 0 : pumpContext.cacheTTL) == 0)
+    {
+        stats_add(STATS_CACHE_STORES, 1);
+    }
+
+    /* an upstream that answered is healthy even if the client went away */
+    if (backend != NULL)
+    {
+        backend_release(backend, pumpContext.status > 0 && pumpContext.status < 500);
+    }
+    origin_done(origin, verdict, pumpContext.status > 0,
+            pumpContext.firstByteTime ? pumpContext.firstByteTime - connectedTime : 0);
+    if (responseSize == -1)
+    {
+        close(serverFD);
+        return -1;
+    }
+
+    /* close serverFD */
+    close(serverFD);
+
+    /* timing and counters */
+    doneTime = stats_now();
+    if (pumpContext.firstByteTime != 0)
+    {
+        phaseDone(phaseTime, STATS_PHASE_TTFB, pumpContext.firstByteTime - connectedTime);
+        phaseDone(phaseTime, STATS_PHASE_TRANSFER, doneTime - pumpContext.firstByteTime);
+    }
+    phaseDone(phaseTime, STATS_PHASE_TOTAL, doneTime - acceptTime);
+    ((handlerJob_t*)job)->responseSize = responseSize;
+    stats_add(STATS_REQUESTS, 1);
+    stats_add(STATS_BYTES_OUT, responseSize);
+
+    /* make log */
+    format_log_entry(logEntry, clientAddr, requestURI, responseSize);
+    writeLogEntry(logEntry);
+    return 0;
+}
+
+/* connectServer
+
+DESCRIPTION
+Resolve host and open a TCP connection to it on port, recording the DNS and
+connect phases.
+
+RETURN VALUE
+On success, the connected socket is returned.
+-1 is returned when the connection could not be established.
+-2 is returned when host could not be resolved.
+*/
+
+int connectServer(const char *host, in_port_t port, uint64_t *phaseTime)
+{
+    struct addrinfo hints, *serverAddrInfo;
+    struct sockaddr_in serverAddr;
+    uint64_t phaseStart;
+    int getaddrinfoResult;
+
+    /* DNS lookup & get serverAddr */
+    phaseStart = stats_now();
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((getaddrinfoResult = coro_getaddrinfo(host, NULL, &hints, &serverAddrInfo)) != 0)
+    {
+        DIAG_NOTICE("DNS lookup failure for %s: %s", host, gai_strerror(getaddrinfoResult));
+        return -2;
+    }
+    memcpy(&serverAddr, serverAddrInfo->ai_addr, sizeof(serverAddr));
+    freeaddrinfo(serverAddrInfo);
+    phaseDone(phaseTime, STATS_PHASE_DNS, stats_now() - phaseStart);
+
+    /* prepare serverAddr */
+    serverAddr.sin_port = htons(port);
+
+    return connectAddress(&serverAddr, phaseTime);
+}
+
+/* connectAddress
+
+DESCRIPTION
+Open a TCP connection to serverAddr, recording the connect phase unless phaseTime is NULL.
+The socket of a coroutine is non-blocking.
+
+RETURN VALUE
+On success, the connected socket is returned.
+-1 is returned when the connection could not be established.
+*/
+
+int connectAddress(const struct sockaddr_in *serverAddr, uint64_t *phaseTime)
+{
+    uint64_t phaseStart;
+    int serverFD;
+
+    phaseStart = stats_now();
+    if ((serverFD = socket(serverAddr->sin_family, SOCK_STREAM | (coro_self() ? SOCK_NONBLOCK : 0), 0)) == -1)
+    {
+        DIAG_ERRNO(DIAG_LEVEL_ERROR, "socket");
+        return -1;
+    }
+    if (coro_connect(serverFD, (const struct sockaddr*)serverAddr, sizeof(*serverAddr)) == -1)
+    {
+        DIAG_ERRNO(DIAG_LEVEL_NOTICE, "connect");
+        close(serverFD);
+        return -1;
+    }
+    if (phaseTime != NULL)
+    {
+        phaseDone(phaseTime, STATS_PHASE_CONNECT, stats_now() - phaseStart);
+    }
+    return serverFD;
+}
+
+/* resolveAlternate
+
+DESCRIPTION
+Resolve host and prefer an address other than the peer of connectedFD,
+falling back to the same address when host has only one.
+
+RETURN VALUE
+0 on success, -1 if host cannot be resolved.
+*/
+
+int resolveAlternate(const char *host, in_port_t port, int connectedFD, struct sockaddr_in *addr)
+{
+    struct addrinfo hints, *result, *cursor;
+    struct sockaddr_in peer;
+    socklen_t peerLength = sizeof(peer);
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (coro_getaddrinfo(host, NULL, &hints, &result) != 0)
+    {
+        return -1;
+    }
+    memset(&peer, 0, sizeof(peer));
+    getpeername(connectedFD, (struct sockaddr*)&peer, &peerLength);
+
+    memcpy(addr, result->ai_addr, sizeof(*addr));
+    for (cursor = result; cursor != NULL; cursor = cursor->ai_next)
+    {
+        if (((struct sockaddr_in*)cursor->ai_addr)->sin_addr.s_addr != peer.sin_addr.s_addr)
+        {
+            memcpy(addr, cursor->ai_addr, sizeof(*addr));
+            break;
+        }
+    }
+    freeaddrinfo(result);
+    addr->sin_port = htons(port);
+    return 0;
+}
+
+/* hedgeRequest
+
+DESCRIPTION
+Wait up to the hedge delay for the first response byte on serverFD. If none
+arrives and the hedge budget allows, send the same request to a second
+upstream (another backend of pool, or another address of host, admitted by
+its origin like any request) and keep whichever connection becomes readable
+first; the other one is closed. A hedge that fails is dropped and the wait
+goes on for serverFD alone. Both waits together last at most the upstream
+timeout.
+
+ARGUMENTS
+backend_t **backend
+    In reverse-proxy mode, the backend serving serverFD; updated when the hedge wins.
+origin_t *origin
+    In forward-proxy mode, the origin serverFD was admitted to.
+
+RETURN VALUE
+The descriptor to read the response from, or -1 if neither upstream answered
+within the upstream timeout; serverFD is then closed.
+*/
+
+int hedgeRequest(int serverFD, const iobuf_t *request, backendPool_t *pool, backend_t **backend,
+        origin_t *origin, const char *host, in_port_t port, const config_t *config)
+{
+    struct pollfd fds[2];
+    struct sockaddr_in hedgeAddr;
+    backend_t *hedgeBackend = NULL;
+    originVerdict_t hedgeVerdict = ORIGIN_REJECT;
+    uint64_t delay, start, now, deadline;
+    int hedgeFD = -1, count, ready;
+
+    if ((delay = hedge_delay()) == 0)
+    {
+        return serverFD;
+    }
+    start = stats_now();
+    fds[0].fd = serverFD;
+    fds[0].events = POLLIN;
+    if (coro_poll(fds, 1, (delay + 999) / 1000) != 0 || !hedge_admit())
+    {
+        return serverFD;
+    }
+
+    if (pool != NULL)
+    {
+        hedgeBackend = backend_pick(pool, *backend);
+        hedgeFD = connectAddress(&hedgeBackend->addr, NULL);
+    }
+    else if (resolveAlternate(host, port, serverFD, &hedgeAddr) == 0
+            && (hedgeVerdict = origin_tryAdmit(origin)) != ORIGIN_REJECT)
+    {
+        hedgeFD = connectAddress(&hedgeAddr, NULL);
+    }
+    if (hedgeFD >= 0)
+    {
+        configureSocket(hedgeFD, config->upstreamTimeout, config->socketBuffer);
+    }
+    if (hedgeFD < 0 || sendChain(hedgeFD, request) == -1)
+    {
+        if (hedgeBackend != NULL)
+        {
+            backend_release(hedgeBackend, 0);
+        }
+        origin_done(origin, hedgeVerdict, 0, 0);
+        if (hedgeFD >= 0)
+        {
+            close(hedgeFD);
+        }
+        return serverFD;
+    }
+
+    fds[1].fd = hedgeFD;
+    fds[1].events = POLLIN;
+    deadline = start + (uint64_t)config->upstreamTimeout * 1000;
+    for (count = 2;;)
+    {
+        now = stats_now();
+        if (config->upstreamTimeout > 0 && now >= deadline)
+        {
+            ready = 0;
+        }
+        else if ((ready = coro_poll(fds, count,
+                        (config->upstreamTimeout > 0) ? (int)((deadline - now + 999) / 1000) : -1)) == -1
+                && errno == EINTR)
+        {
+            continue;
+        }
+        if (ready <= 0 || fds[0].revents != 0)
+        {
+            break;
+        }
+
+        /* only a response wins; a refused or reset hedge is dropped */
+        if ((fds[1].revents & POLLIN) && !(fds[1].revents & POLLERR))
+        {
+            break;
+        }
+        close(hedgeFD);
+        if (hedgeBackend != NULL)
+        {
+            backend_release(hedgeBackend, 0);
+            hedgeBackend = NULL;
+        }
+        origin_done(origin, hedgeVerdict, 0, 0);
+        hedgeFD = -1;
+        count = 1;
+    }
+
+    /* the first attempt wins ties; a cancelled loser is slow, not failed */
+    if (ready <= 0 || fds[0].revents != 0)
+    {
+        if (hedgeFD >= 0)
+        {
+            close(hedgeFD);
+            if (hedgeBackend != NULL)
+            {
+                backend_release(hedgeBackend, 1);
+            }
+            origin_done(origin, hedgeVerdict, 1, 0);
+        }
+        if (ready <= 0)
+        {
+            close(serverFD);
+            return -1;
+        }
+        return serverFD;
+    }
+    stats_add(STATS_HEDGES_WON, 1);
+    close(serverFD);
+    if (hedgeBackend != NULL)
+    {
+        backend_release(*backend, 1);
+        *backend = hedgeBackend;
+    }
+    origin_done(origin, hedgeVerdict, 1, 0);
+    return hedgeFD;
+}
+
+/* handleConnect
+
+DESCRIPTION
+Serve a CONNECT request: connect to the requested host:port, confirm to the
+client and relay bytes both ways until both sides are done. Bytes the client
+sent after the request header are forwarded first.
+
+ARGUMENTS
+const char *header, size_t headerLength
+    The request header; job->request holds it followed by any tunneled bytes.
+
+RETURN VALUE
+0 when the tunnel completed, -1 on failure.
+*/
+
+int handleConnect(handlerJob_t *job, const char *header, size_t headerLength)
+{
+    const char *established = "HTTP/1.1 200 Connection established\r\n\r\n";
+    char target[MAXLINE], host[MAXLINE];
+    char uri[MAXLINE + 8], logEntry[MAXLINE * 2];
+    const char *cursor;
+    char *colon, *end;
+    long number;
+    in_port_t port;
+    tunnelResult_t result;
+    origin_t *origin;
+    originVerdict_t verdict;
+    uint64_t retryAfter;
+    int serverFD, status, targetLength;
+    size_t logLength, early;
+
+    /* CONNECT host:port HTTP/1.1 */
+    cursor = header + 8;
+    cursor += strspn(cursor, " ");
+    targetLength = strcspn(cursor, " \r\n");
+    if (targetLength == 0 || targetLength >= MAXLINE)
+    {
+        sendErrorResponse(job->clientFD, 400, "Bad Request", NULL);
+        return -1;
+    }
+    memcpy(target, cursor, targetLength);
+    target[targetLength] = '\0';
+
+    port = 443;
+    strcpy(host, target);
+    if ((colon = strrchr(host, ':')) != NULL && strchr(colon, ']') == NULL)
+    {
+        *colon = '\0';
+        number = isdigit((unsigned char)colon[1]) ? strtol(colon + 1, &end, 10) : 0;
+        if (number < 1 || number > 65535 || *end != '\0' || host[0] == '\0')
+        {
+            sendErrorResponse(job->clientFD, 400, "Bad Request", NULL);
+            return -1;
+        }
+        port = (in_port_t)number;
+    }
+
+    /* upstream connections are IPv4 only */
+    if (host[0] == '[')
+    {
+        DIAG_INFO("CONNECT %s: IPv6 targets are not supported", target);
+        sendErrorResponse(job->clientFD, 502, "Bad Gateway", NULL);
+        return -1;
+    }
+
+    origin = origin_get(host, port);
+    if ((verdict = origin_admit(origin, &retryAfter)) == ORIGIN_REJECT)
+    {
+        stats_add(STATS_FAST_FAILS, 1);
+        sendRetryLater(job->clientFD, 503, retryAfter);
+        return -1;
+    }
+    serverFD = connectServer(host, port, job->phaseTime);
+    origin_done(origin, verdict, serverFD >= 0, 0);
+    if (serverFD < 0)
+    {
+        sendErrorResponse(job->clientFD, 502, "Bad Gateway", NULL);
+        return -1;
+    }
+    if (writeAll(job->clientFD, established, strlen(established)) == -1)
+    {
+        close(serverFD);
+        return -1;
+    }
+    iobuf_consume(&job->request, headerLength);
+    early = iobuf_length(&job->request);
+    if (iobuf_write(&job->request, serverFD, early) == -1)
+    {
+        ioError("write");
+        close(serverFD);
+        return -1;
+    }
+
+    status = tunnel_run(job->clientFD, serverFD, &result);
+    close(serverFD);
+
+    /* counters and log */
+    result.upBytes += early;
+    phaseDone(job->phaseTime, STATS_PHASE_TOTAL, stats_now() - job->acceptTime);
+    stats_add(STATS_TUNNELS, 1);
+    stats_add(STATS_TUNNEL_BYTES_UP, result.upBytes);
+    stats_add(STATS_BYTES_OUT, result.downBytes);
+    job->responseSize = result.downBytes;
+    DIAG_INFO("tunnel to %s closed: %llu bytes up, %llu bytes down, %llu ms%s", target,
+            (unsigned long long)result.upBytes, (unsigned long long)result.downBytes,
+            (unsigned long long)(result.duration / 1000), result.zeroCopy ? ", spliced" : "");
+
+    snprintf(uri, sizeof(uri), "CONNECT %s", target);
+    format_log_entry(logEntry, (struct sockaddr*)&job->clientAddr, uri, result.downBytes);
+    logLength = strlen(logEntry);
+    snprintf(logEntry + logLength, sizeof(logEntry) - logLength, " up=%llu ms=%llu",
+            (unsigned long long)result.upBytes, (unsigned long long)(result.duration / 1000));
+    writeLogEntry(logEntry);
+    return status;
+}
+
+/* findHeader
+
+DESCRIPTION
+Look up a header field by name (case-insensitive) in an HTTP message header.
+
+ARGUMENTS
+char *value, size_t size
+    Receives the field value without surrounding whitespace, truncated to fit.
+
+RETURN VALUE
+Length of the value stored, -1 if the field is not present.
+*/
+
+int findHeader(const char *header, const char *name, char *value, size_t size)
+{
+    const char *line, *end, *colon;
+    size_t nameLength = strlen(name);
+    size_t length;
+
+    for (line = strstr(header, "\r\n"); line != NULL && line[2] != '\r' && line[2] != '\0';
+            line = strstr(line + 2, "\r\n"))
+    {
+        line += 2;
+        colon = line + nameLength;
+        if (strncasecmp(line, name, nameLength) != 0 || *colon != ':')
+        {
+            line -= 2;
+            continue;
+        }
+        colon++;
+        colon += strspn(colon, " \t");
+        end = strstr(colon, "\r\n");
+        length = end ? (size_t)(end - colon) : strlen(colon);
+        while (length > 0 && (colon[length - 1] == ' ' || colon[length - 1] == '\t'))
+        {
+            length--;
+        }
+        if (length >= size)
+        {
+            length = size - 1;
+        }
+        memcpy(value, colon, length);
+        value[length] = '\0';
+        return length;
+    }
+    return -1;
+}
+
+/* requestVersion
+
+RETURN VALUE
+The HTTP version on the request line of header, such as "1.1" (not
+terminated there); "1.0" when the line has none, as in HTTP/0.9.
+*/
+
+const char *requestVersion(const char *header)
+{
+    const char *lineEnd, *target, *targetEnd;
+
+    /* METHOD SP request-target SP HTTP-version CRLF */
+    if ((lineEnd = strstr(header, "\r\n")) == NULL
+            || (target = strchr(header, ' ')) == NULL || target > lineEnd
+            || (targetEnd = strchr(target + 1, ' ')) == NULL || targetEnd > lineEnd
+            || strncmp(targetEnd + 1, "HTTP/", 5) != 0)
+    {
+        return "1.0";
+    }
+    return targetEnd + 6;
+}
+
+/* rewriteRequest
+
+DESCRIPTION
+Build the request to send upstream into out: the request line in
+origin-form, the client's header lines minus hop-by-hop fields, then Host
+(for absolute URIs), "Connection: close" and Via, followed by any body bytes.
+Unchanged spans are slices of request, so only the added fields are copied,
+and the result goes out in one writev(2). Transfer-Encoding is kept, since
+the body is relayed as it was framed.
+
+ARGUMENTS
+const char *header, size_t headerLength
+    The request header as a string; request holds the same bytes at offset 0.
+const char *host, in_port_t port
+    Target of an absolute URI, for the Host field; host is NULL for origin-form
+    requests, whose Host field is kept.
+int whole
+    Ask for the whole object instead: Range, If-Range and Accept-Encoding are
+    left out, and so is any body.
+
+RETURN VALUE
+0 on success, -1 if the request line is malformed or memory is short.
+*/
+
+int rewriteRequest(const char *header, size_t headerLength, const char *host, in_port_t port,
+        const iobuf_t *request, int whole, iobuf_t *out)
+{
+    static const char *hopByHop[] = { "Connection", "Keep-Alive", "Proxy-Connection",
+        "Proxy-Authorization", "Proxy-Authenticate", "TE", "Trailer", "Upgrade", NULL };
+    static const char *partial[] = { "Connection", "Keep-Alive", "Proxy-Connection",
+        "Proxy-Authorization", "Proxy-Authenticate", "TE", "Trailer", "Upgrade",
+        "Range", "If-Range", "Accept-Encoding", NULL };
+    char connection[MAXLINE], added[MAXLINE * 2];
+    const char *target, *targetEnd, *path, *lineEnd, *version;
+    size_t addedLength;
+
+    /* METHOD SP request-target SP HTTP-version CRLF */
+    lineEnd = strstr(header, "\r\n");
+    if ((target = strchr(header, ' ')) == NULL || target > lineEnd
+            || (targetEnd = strchr(target + 1, ' ')) == NULL || targetEnd > lineEnd)
+    {
+        return -1;
+    }
+    target++;
+    version = requestVersion(header);
+    path = target;
+    if (host != NULL)
+    {
+        path = memchr(target + 7, '/', targetEnd - (target + 7));
+        path = (path != NULL) ? path : targetEnd;
+    }
+    if (iobuf_slice(out, request, 0, target - header) == -1
+            || (path == targetEnd && iobuf_append(out, "/", 1) == -1)
+            || iobuf_slice(out, request, path - header, lineEnd + 2 - path) == -1)
+    {
+        return -1;
+    }
+
+    /* header fields, dropping hop-by-hop ones and those the Connection field names */
+    if (findHeader(header, "Connection", connection, sizeof(connection)) == -1)
+    {
+        connection[0] = '\0';
+    }
+    if (sliceFields(header, lineEnd + 2, whole ? partial : hopByHop, (host != NULL) ? "Host" : NULL,
+                connection, request, out) == -1)
+    {
+        return -1;
+    }
+
+    /* fields set by the proxy, the blank line, then the body */
+    addedLength = 0;
+    if (host != NULL)
+    {
+        addedLength = snprintf(added, sizeof(added), (port == 80) ? "Host: %s\r\n" : "Host: %s:%d\r\n",
+                host, (int)port);
+    }
+    addedLength += snprintf(added + addedLength, sizeof(added) - addedLength,
+            "Connection: close\r\nVia: %.3s %s\r\n\r\n", version, PROXY_VIA_NAME);
+    if (addedLength >= sizeof(added) || iobuf_append(out, added, addedLength) == -1
+            || (!whole && iobuf_slice(out, request, headerLength, iobuf_length(request) - headerLength) == -1))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/* sliceFields
+
+DESCRIPTION
+Append the header field lines from fields up to the blank line to out, as
+slices of source, leaving out any field named in drop, named also, or
+listed in connection (a Connection field value, may be empty). Adjacent
+kept lines end up in one segment.
+
+ARGUMENTS
+const char *header
+    The header as a string; source holds the same bytes at offset 0.
+
+RETURN VALUE
+0 on success, -1 when memory is short.
+*/
+
+int sliceFields(const char *header, const char *fields, const char **drop, const char *also,
+        const char *connection, const iobuf_t *source, iobuf_t *out)
+{
+    const char *line, *lineEnd, *colon;
+    size_t nameLength;
+    int i, skip = 0;
+
+    for (line = fields; line[0] != '\r' && (lineEnd = strstr(line, "\r\n")) != NULL; line = lineEnd + 2)
+    {
+        /* obsolete line folding continues the previous field */
+        if (*line != ' ' && *line != '\t')
+        {
+            colon = memchr(line, ':', lineEnd - line);
+            nameLength = (colon != NULL) ? (size_t)(colon - line) : 0;
+            skip = (nameLength == 0) || headerListHas(connection, line, nameLength)
+                || (also != NULL && strlen(also) == nameLength && strncasecmp(line, also, nameLength) == 0);
+            for (i = 0; drop[i] != NULL && !skip; i++)
+            {
+                skip = strlen(drop[i]) == nameLength && strncasecmp(line, drop[i], nameLength) == 0;
+            }
+        }
+        if (!skip && iobuf_slice(out, source, line - header, lineEnd + 2 - line) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* headerListHas
+
+DESCRIPTION
+Whether the comma-separated list, such as a Connection field value,
+contains the token of length bytes at name (case-insensitive).
+*/
+
+int headerListHas(const char *list, const char *name, size_t length)
+{
+    const char *token;
+    size_t tokenLength;
+
+    for (token = list; *token != '\0'; token += tokenLength)
+    {
+        token += strspn(token, ", \t");
+        tokenLength = strcspn(token, ", \t");
+        if (tokenLength == length && length > 0 && strncasecmp(token, name, length) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* sendChain
+
+DESCRIPTION
+Write all of chain to fd, leaving chain as it was, e.g. to send the same
+request twice.
+
+RETURN VALUE
+0 on success, -1 when the data could not be written.
+*/
+
+int sendChain(int fd, const iobuf_t *chain)
+{
+    iobuf_t copy;
+    int result;
+
+    iobuf_init(&copy);
+    if ((result = iobuf_slice(&copy, chain, 0, iobuf_length(chain))) == 0
+            && (result = iobuf_write(&copy, fd, iobuf_length(&copy))) == -1)
+    {
+        ioError("write");
+    }
+    iobuf_clear(&copy);
+    return result;
+}
+
+/* sendErrorResponse
+
+DESCRIPTION
+Send a minimal HTTP error response generated by the proxy itself.
+
+ARGUMENTS
+const char *extraHeaders
+    Additional header lines, each terminated by CRLF, or NULL.
+
+RETURN VALUE
+0 on success, -1 when the response could not be written.
+*/
+
+int sendErrorResponse(int clientFD, int status, const char *reason, const char *extraHeaders)
+{
+    char response[MAXLINE];
+    int length;
+
+    length = snprintf(response, sizeof(response),
+            "HTTP/1.0 %d %s\r\n"
+            "Content-Type: text/plain\r\n"
+            "Content-Length: %d\r\n"
+            "Connection: close\r\n"
+            "%s\r\n"
+            "%d %s\n", status, reason, (int)strlen(reason) + 5, extraHeaders ? extraHeaders : "",
+            status, reason);
+    return writeAll(clientFD, response, length);
+}
+
+/* sendRetryLater
+
+DESCRIPTION
+Fail a request fast with a Retry-After hint.
+
+ARGUMENTS
+int status
+    503 when the proxy or the upstream lacks capacity, 429 when the client is over its rate.
+uint64_t retryAfter
+    Microseconds until a retry is worthwhile, rounded up to whole seconds.
+*/
+
+int sendRetryLater(int clientFD, int status, uint64_t retryAfter)
+{
+    char header[64];
+
+    snprintf(header, sizeof(header), "Retry-After: %llu\r\n",
+            (unsigned long long)((retryAfter + 999999) / 1000000));
+    return sendErrorResponse(clientFD, status,
+            (status == 429) ? "Too Many Requests" : "Service Unavailable", header);
+}
+
+/* refuseConnection
+
+DESCRIPTION
+Refuse a connection from the accept loop with sendRetryLater and close it.
+Whatever the client already sent is discarded first, so the close does not
+reset the connection under the response.
+*/
+
+void refuseConnection(int clientFD, int status, uint64_t retryAfter)
+{
+    char discard[4096];
+
+    sendRetryLater(clientFD, status, retryAfter);
+    while (recv(clientFD, discard, sizeof(discard), MSG_DONTWAIT) > 0)
+    {
+    }
+    close(clientFD);
+}
+
+/* writeLogEntry
+
+DESCRIPTION
+Append one line to the log file, serialized by logSem.
+*/
+
+void writeLogEntry(const char *logEntry)
+{
+    if (sem_wait(&logSem) == -1)
+    {
+        fatal("sem_wait");
+    }
+    fprintf(logFile, "%s\n", logEntry);
+    fflush(logFile);
+    if (sem_post(&logSem) == -1)
+    {
+        fatal("sem_post");
+    }
+}
 
-/* for pretty terminal output */
-#define START_INFO      do {printf("\033[36m"); fflush(stdout);} while (0)
-#define START_SUCCESS   do {printf("\033[32m"); fflush(stdout);} while (0)
-#define START_NOTICE    do {printf("\033[33m"); fflush(stdout);} while (0)
-#define START_ERROR     do {printf("\033[31m"); fflush(stdout);} while (0)
-#define START_QUOTE     do {printf("\033[35m"); fflush(stdout);} while (0)
-#define END_MESSAGE     do {printf("\033[0m"); fflush(stdout);} while (0)
+/* phaseDone
 
+DESCRIPTION
+Record the duration of a request phase in the histograms and in the request's own timings.
+*/
 
-/* typedefs */
-typedef struct handlerJob
+void phaseDone(uint64_t *phaseTime, statsPhase_t phase, uint64_t micros)
 {
-    int clientFD;
-    struct sockaddr_in clientAddr;
+    phaseTime[phase] = micros;
+    stats_recordPhase(phase, micros);
 }
-handlerJob_t;
 
+/* serveStats
+
+DESCRIPTION
+Answer a request for http://STATS_HOST/ with a plain text report of the
+proxy's counters and per-phase latency percentiles.
+
+RETURN VALUE
+0 on success, -1 when the response could not be written.
+*/
+
+int serveStats(int clientFD)
+{
+    char report[MAXBUF * 2];
+    char header[MAXLINE];
+    int reportLength, headerLength;
+
+    reportLength = stats_report(report, sizeof(report));
+    reportLength += backend_report(report + reportLength, sizeof(report) - reportLength);
+    reportLength += origin_report(report + reportLength, sizeof(report) - reportLength);
+    reportLength += admission_report(report + reportLength, sizeof(report) - reportLength);
+    reportLength += budget_report(report + reportLength, sizeof(report) - reportLength);
+    reportLength += coro_report(report + reportLength, sizeof(report) - reportLength);
+    reportLength += shmcache_report(report + reportLength, sizeof(report) - reportLength);
+    headerLength = snprintf(header, sizeof(header),
+            "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain\r\n"
+            "Content-Length: %d\r\n"
+            "Cache-Control: no-store\r\n"
+            "Connection: close\r\n\r\n", reportLength);
+
+    if (writeAll(clientFD, header, headerLength) == -1
+            || writeAll(clientFD, report, reportLength) == -1)
+    {
+        return -1;
+    }
+    return 0;
+}
 
 /*
- * Function prototypes
+ * parse_uri - URI parser
+ *
+ * Given a URI from an HTTP proxy GET request (i.e., a URL), extract
+ * the host name,  and port.  The memory for hostname
+ * must already be allocated and should be at least MAXLINE
+ * bytes. Return -1 if there are any problems.
  */
-void *handleClientRequest(void *job);
-void handleClientRequest_internal(void *job);
-int parse_uri(char *uri, char *target_addr, in_port_t *port);
-void format_log_entry(char *logstring, struct sockaddr_in *sockaddr, char *uri, int size);
-int readAll(int fd, void *buf, const size_t count);
-int readUntil(int fd, void *buf, const size_t count, const char *pattern);
-int writeAll(int fd, const void *buf, const size_t count);
-int pump(int from, int to);
-void fatal(char *message);
-void error(char *message);
 
+int parse_uri(char *uri, char *hostname, in_port_t *port)
+{
+    char *hostbegin;
+    char *hostend;
+    int len;
 
-/* global variables */
-FILE *logFile;
-sem_t logSem;
+    if (strncasecmp(uri, "http://", 7) != 0)
+    {
+        hostname[0] = '\0';
+        return -1;
+    }
+
+    /* Extract the host name */
+    hostbegin = uri + 7;
+    hostend = strpbrk(hostbegin, " :/\r\n\0");
+    len = hostend - hostbegin;
+    strncpy(hostname, hostbegin, len);
+    hostname[len] = '\0';
+
+    /* Extract the port number */
+    *port = 80; /* default */
+    if (*hostend == ':')
+    {
+        *port = atoi(hostend + 1);
+    }
 
+    return 0;
+}
 
 /*
- * main - Main routine for the proxy program
+ * format_log_entry - Create a formatted log entry in logstring.
+ *
+ * The inputs are the socket address of the requesting client
+ * (sockaddr), the URI from the request (uri), and the size in bytes
+ * of the response from the server (size).
  */
-int main(int argc, char **argv)
+
+void format_log_entry(char *logstring, struct sockaddr *sockaddr, char *uri, int size)
+{
+    time_t now;
+    char time_str[MAXLINE];
+    char host[INET6_ADDRSTRLEN];
+
+    /* Get a formatted time string */
+    now = time(NULL);
+    strftime(time_str, MAXLINE, "%a %d %b %Y %H:%M:%S %Z", localtime(&now));
+
+    /*
+     * Convert the IP address to text. inet_ntop writes to our buffer,
+     * unlike inet_ntoa, a Class 3 thread unsafe function that
+     * returns a pointer to a static variable (Ch 13, CS:APP).
+     */
+    if (inet_ntop(sockaddr->sa_family, (sockaddr->sa_family == AF_INET6)
+                ? (void*)&((struct sockaddr_in6*)sockaddr)->sin6_addr
+                : (void*)&((struct sockaddr_in*)sockaddr)->sin_addr, host, sizeof(host)) == NULL)
+    {
+        strcpy(host, "?");
+    }
+
+    /* Return the formatted log entry string */
+    sprintf(logstring, "%s: %s %s %d", time_str, host, uri, size);
+}
+
+/* pump
+
+DESCRIPTION
+Transfer all data available from 'from' file descriptor to 'to' file descriptor.
+Each chunk is forwarded as soon as it is read, so the receiver is not held
+back until a whole buffer has been filled. Chunks are read into a buffer
+chain and written from it; capture and cache copy from the same slabs.
+
+ARGUMENTS
+pumpContext_t *context
+    If not NULL, firstByteTime and the response status are set when the first
+    bytes arrive from 'from', and the data is copied to the capture record if there is one.
+    With a shaper, writes go out in SHAPE_QUANTUM pieces paced by the shape module.
+    With a cacheKey, a cacheable response is also copied into a cache entry
+    reserved in cacheFill, and cacheTTL is set; the caller commits it.
+    With an encoding, a compressible response is compressed on the way,
+    chunked if the client speaks HTTP/1.1; capture and cache get it as received.
+    With a prefetchBase, the body of an HTML page is scanned for
+    subresources to prefetch.
+    Before each read after the first, the memory budget may hold a response
+    back if its client is draining slowly.
+
+RETURN VALUE
+On success, the number of bytes written to 'to' is returned.
+-1 is returned when primitive library call failure occured.
+*/
+
+int pump(int from, int to, pumpContext_t *context)
+{
+    iobuf_t chain, compressed, *out;
+    const iobufSegment_t *segment;
+    gzipStream_t gzip;
+    const char *buf;
+    ssize_t readResult;
+    int total, length, first, skip = 0;
+    size_t written;
+
+    /* drained after every read, so the chains reuse their slabs */
+    iobuf_init(&chain);
+    iobuf_init(&compressed);
+    gzip.state = NULL;
+    total = 0;
+    for (first = 1; ; first = 0)
+    {
+        /* sample the drain rate; with the budget exhausted, slow clients wait while their buffers are empty */
+        if (!first && context != NULL)
+        {
+            uint64_t elapsed = stats_now() - context->firstByteTime;
+
+            budget_pace((elapsed > 0) ? (uint64_t)total * 1000000 / elapsed : 0);
+        }
+        if ((readResult = iobuf_read(&chain, from)) == 0)
+        {
+            break;
+        }
+        if (readResult == -1)
+        {
+            ioError("read");
+            total = -1;
+            break;
+        }
+
+        /* the first read lands in one slab, so the start of the response is contiguous */
+        buf = chain.head->start;
+        length = chain.head->end - chain.head->start;
+        if (context != NULL)
+        {
+            if (first)
+            {
+                context->firstByteTime = stats_now();
+                if (length >= 12 && strncmp(buf, "HTTP/", 5) == 0)
+                {
+                    context->status = atoi(buf + 9);
+                }
+                if (context->cacheKey != NULL)
+                {
+                    size_t size;
+                    uint64_t ttl = responseCacheTTL(buf, length, &size);
+
+                    if (ttl != 0 && shmcache_reserve(context->cacheKey, size, &context->cacheFill) == 0)
+                    {
+                        context->cacheTTL = ttl;
+                    }
+                }
+                if (context->prefetchBase != NULL && (skip = responseIsPage(buf, length)) != -1)
+                {
+                    prefetch_begin(&context->scanner, context->prefetchBase);
+                }
+            }
+            for (segment = chain.head; segment != NULL; segment = segment->next)
+            {
+                capture_body(context->capture, segment->start, segment->end - segment->start);
+                if (context->cacheTTL != 0)
+                {
+                    shmcache_append(&context->cacheFill, segment->start, segment->end - segment->start);
+                }
+                if (context->scanner.active)
+                {
+                    prefetch_scan(&context->scanner, segment->start + skip, segment->end - segment->start - skip);
+                    skip = 0;
+                }
+            }
+
+            /* switch to a compressed body; the raw response above still feeds capture and cache */
+            if (first && context->encoding != GZIP_NONE)
+            {
+                beginCompression(&gzip, context, &chain, &compressed);
+            }
+            if (first && context->shaper != NULL)
+            {
+                shape_declare(context->shaper, (gzip.state != NULL) ? -1 : responseContentLength(buf, length));
+            }
+        }
+
+        out = &chain;
+        if (gzip.state != NULL)
+        {
+            if (gzip_compress(&gzip, &chain, &compressed) == -1)
+            {
+                DIAG_WARN("compression failed");
+                total = -1;
+                break;
+            }
+            iobuf_consume(&chain, iobuf_length(&chain));
+            out = &compressed;
+        }
+        written = iobuf_length(out);
+        if (writeChain(to, out, (context != NULL) ? context->shaper : NULL) == -1)
+        {
+            total = -1;
+            break;
+        }
+        total += written;
+
+        /* each slice is a unit of work; a long response lets other connections run between them */
+        coro_yield();
+    }
+
+    /* the end of the compressed stream */
+    if (total != -1 && gzip.state != NULL)
+    {
+        if (gzip_finish(&gzip, &compressed) == -1)
+        {
+            total = -1;
+        }
+        else
+        {
+            written = iobuf_length(&compressed);
+            total = (writeChain(to, &compressed, context->shaper) == -1) ? -1 : total + (int)written;
+        }
+    }
+    gzip_end(&gzip);
+    iobuf_clear(&chain);
+    iobuf_clear(&compressed);
+    return total;
+}
+
+/* beginCompression
+
+DESCRIPTION
+If the response whose start is in chain may be compressed for the client,
+put its rewritten header in out, drop the original header from chain and
+start stream. Otherwise, or when memory is short, leave everything as it
+was, with stream->state NULL.
+*/
+
+void beginCompression(gzipStream_t *stream, pumpContext_t *context, iobuf_t *chain, iobuf_t *out)
+{
+    char header[MAXBUF];
+    int headerLength, chunked;
+
+    if ((headerLength = responseCompressible(chain->head->start, chain->head->end - chain->head->start,
+                    header, sizeof(header))) == -1)
+    {
+        return;
+    }
+
+    /* chunked only between HTTP/1.1 ends; otherwise the end of the connection delimits the body */
+    chunked = context->chunked && strncmp(header, "HTTP/1.1", 8) == 0;
+    if (gzip_begin(stream, context->encoding, chunked) == -1)
+    {
+        return;
+    }
+    if (rewriteResponseHeader(header, context->encoding, chunked, chain, out) == -1)
+    {
+        gzip_end(stream);
+        iobuf_clear(out);
+        return;
+    }
+    iobuf_consume(chain, headerLength);
+}
+
+/* responseIsPage
+
+DESCRIPTION
+Decide whether the response whose header starts buf is a page the
+prefetcher can read: a 200 of Content-Type text/html without a content coding.
+
+RETURN VALUE
+Length of the header including the blank line, -1 if the body is not to be scanned.
+*/
+
+int responseIsPage(const char *buf, int length)
+{
+    char header[MAXBUF], value[MAXLINE];
+    int headerLength;
+
+    if (length < 12 || strncmp(buf, "HTTP/1.", 7) != 0 || strncmp(buf + 8, " 200", 4) != 0
+            || (headerLength = copyResponseHeader(buf, length, header, sizeof(header))) == -1
+            || findHeader(header, "Content-Type", value, sizeof(value)) == -1
+            || strncasecmp(value, "text/html", 9) != 0
+            || findHeader(header, "Content-Encoding", value, sizeof(value)) != -1)
+    {
+        return -1;
+    }
+    return headerLength;
+}
+
+/* responseCompressible
+
+DESCRIPTION
+Decide whether the response whose header starts buf may be compressed: an
+uncompressed 200 of a compressible Content-Type, without Transfer-Encoding
+or Cache-Control: no-transform, and not known to be too small. The header
+is copied into header as for copyResponseHeader.
+
+RETURN VALUE
+Length of the header including the blank line, -1 if it must be sent as it is.
+*/
+
+int responseCompressible(const char *buf, int length, char *header, size_t size)
+{
+    char value[MAXLINE];
+    int headerLength, i;
+
+    if (length < 12 || strncmp(buf, "HTTP/1.", 7) != 0 || strncmp(buf + 8, " 200", 4) != 0
+            || (headerLength = copyResponseHeader(buf, length, header, size)) == -1
+            || findHeader(header, "Content-Type", value, sizeof(value)) == -1
+            || !gzip_compressibleType(value)
+            || findHeader(header, "Transfer-Encoding", value, sizeof(value)) != -1
+            || (findHeader(header, "Content-Encoding", value, sizeof(value)) != -1
+                && strcasecmp(value, "identity") != 0)
+            || !gzip_worthwhile(responseContentLength(buf, length)))
+    {
+        return -1;
+    }
+    if (findHeader(header, "Cache-Control", value, sizeof(value)) != -1)
+    {
+        for (i = 0; value[i] != '\0'; i++)
+        {
+            value[i] = tolower((unsigned char)value[i]);
+        }
+        if (strstr(value, "no-transform") != NULL)
+        {
+            return -1;
+        }
+    }
+    return headerLength;
+}
+
+/* rewriteResponseHeader
+
+DESCRIPTION
+Append the header of a response about to be compressed to out: the status
+line and fields of the original, as slices of response, without the
+length, range and connection fields, then Content-Encoding, Vary, a weak
+ETag in place of a strong one, Transfer-Encoding if chunked and
+"Connection: close".
+
+ARGUMENTS
+const char *header
+    The header as made by copyResponseHeader; response holds it at offset 0.
+
+RETURN VALUE
+0 on success, -1 when memory is short.
+*/
+
+int rewriteResponseHeader(const char *header, gzipEncoding_t encoding, int chunked,
+        const iobuf_t *response, iobuf_t *out)
+{
+    static const char *replaced[] = { "Content-Length", "Content-Encoding", "Accept-Ranges", "ETag",
+        "Connection", "Keep-Alive", "Proxy-Connection", NULL };
+    char connection[MAXLINE], etag[MAXLINE], added[MAXLINE * 2];
+    const char *fields = strstr(header, "\r\n") + 2;
+    size_t addedLength;
+
+    if (findHeader(header, "Connection", connection, sizeof(connection)) == -1)
+    {
+        connection[0] = '\0';
+    }
+    if (iobuf_slice(out, response, 0, fields - header) == -1
+            || sliceFields(header, fields, replaced, NULL, connection, response, out) == -1)
+    {
+        return -1;
+    }
+
+    /* the compressed body is a different representation, so only weakly the same entity */
+    addedLength = snprintf(added, sizeof(added), "Content-Encoding: %s\r\nVary: Accept-Encoding\r\n",
+            (encoding == GZIP_GZIP) ? "gzip" : "deflate");
+    if (findHeader(header, "ETag", etag, sizeof(etag)) != -1)
+    {
+        addedLength += snprintf(added + addedLength, sizeof(added) - addedLength, "ETag: %s%s\r\n",
+                (strncmp(etag, "W/", 2) == 0) ? "" : "W/", etag);
+    }
+    addedLength += snprintf(added + addedLength, sizeof(added) - addedLength, "%sConnection: close\r\n\r\n",
+            chunked ? "Transfer-Encoding: chunked\r\n" : "");
+    if (addedLength >= sizeof(added))
+    {
+        return -1;
+    }
+    return iobuf_append(out, added, addedLength);
+}
+
+/* writeChain
+
+DESCRIPTION
+Write all of chain to fd and consume it. With a shaper, writes go out in
+SHAPE_QUANTUM pieces paced by the shape module.
+
+RETURN VALUE
+0 on success, -1 when the data could not be written.
+*/
+
+int writeChain(int fd, iobuf_t *chain, shaper_t *shaper)
+{
+    size_t piece;
+
+    while ((piece = iobuf_length(chain)) > 0)
+    {
+        if (shaper != NULL)
+        {
+            piece = (piece < SHAPE_QUANTUM) ? piece : SHAPE_QUANTUM;
+            shape_pace(shaper, piece);
+        }
+        if (iobuf_write(chain, fd, piece) == -1)
+        {
+            ioError("write");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* responseContentLength
+
+DESCRIPTION
+Find the Content-Length of a response whose header starts buf.
+
+RETURN VALUE
+The declared length, -1 if it is absent or the header is not complete within MAXBUF bytes.
+*/
+
+long long responseContentLength(const char *buf, int length)
+{
+    char header[MAXBUF], value[32];
+
+    if (copyResponseHeader(buf, length, header, sizeof(header)) == -1
+            || findHeader(header, "Content-Length", value, sizeof(value)) == -1)
+    {
+        return -1;
+    }
+    return atoll(value);
+}
+
+/* copyResponseHeader
+
+DESCRIPTION
+Copy the header at the start of buf into header as a string for findHeader,
+ending after the CRLF of the last field.
+
+RETURN VALUE
+Length of the header in buf including the blank line, -1 if it is not
+complete within size bytes.
+*/
+
+int copyResponseHeader(const char *buf, int length, char *header, size_t size)
 {
-    uint16_t listenPort;
-    int listenFD;
-    struct sockaddr_in listenAddr;
-    int optval;
+    char *end;
 
-    /* Check arguments */
-    if (argc != 2)
+    length = (length < (int)size - 1) ? length : (int)size - 1;
+    memcpy(header, buf, length);
+    header[length] = '\0';
+    if ((end = strstr(header, "\r\n\r\n")) == NULL)
     {
-        fprintf(stderr, "Usage: %s <port number>\n", argv[0]);
-        exit(EXIT_FAILURE);
+        return -1;
     }
-    listenPort = atoi(argv[1]);
+    end[2] = '\0';
+    return end + 4 - header;
+}
 
-    /* ignore SIGPIPE */
-    signal(SIGPIPE, SIG_IGN);
+/* responseCacheTTL
 
-    /* open the log file */
-    if ((logFile = fopen(LOGFILENAME, "a")) == NULL)
-    {
-        fatal("fopen");
-    }
+DESCRIPTION
+Decide whether the response whose header starts buf may be stored in the
+shared cache: a 200 with a Content-Length, no cookies, no Vary and no
+Cache-Control directive forbidding shared caching.
 
-    /* semaphore */
-    if (sem_init(&logSem, 0, 1)  == -1)
+ARGUMENTS
+size_t *size
+    Set to the length of the whole response when it is cacheable.
+
+RETURN VALUE
+How long to keep the response in microseconds, from max-age or
+SHMCACHE_DEFAULT_TTL; 0 if it must not be cached.
+*/
+
+uint64_t responseCacheTTL(const char *buf, int length, size_t *size)
+{
+    char header[MAXBUF], value[MAXLINE];
+    char *maxAge;
+    long long contentLength;
+    int headerLength, i;
+
+    if (length < 12 || strncmp(buf, "HTTP/1.", 7) != 0 || strncmp(buf + 8, " 200", 4) != 0
+            || (headerLength = copyResponseHeader(buf, length, header, sizeof(header))) == -1
+            || findHeader(header, "Content-Length", value, sizeof(value)) == -1
+            || (contentLength = atoll(value)) < 0
+            || findHeader(header, "Set-Cookie", value, sizeof(value)) != -1
+            || findHeader(header, "Vary", value, sizeof(value)) != -1)
     {
-        fatal("sem_init");
+        return 0;
     }
-
-    /* initalize listen socket */
-    if ((listenFD = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+    *size = headerLength + contentLength;
+    if (findHeader(header, "Cache-Control", value, sizeof(value)) == -1)
     {
-        fatal("socket");
+        return SHMCACHE_DEFAULT_TTL;
     }
-
-    /* option for listen socket */
-    optval = 1;
-    if (setsockopt(listenFD, SOL_SOCKET, SO_REUSEADDR,
-                (const void*) &optval, sizeof(optval)) == -1)
+    for (i = 0; value[i] != '\0'; i++)
     {
-        fatal("setsockopt");
+        value[i] = tolower((unsigned char)value[i]);
     }
-
-    /* prepare address */
-    memset(&listenAddr, 0, sizeof(listenAddr));
-    listenAddr.sin_family = AF_INET;
-    listenAddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    listenAddr.sin_port = htons(listenPort);
-
-    /* bind */
-    if (bind(listenFD, (const struct sockaddr*) &listenAddr, sizeof(listenAddr)) == -1)
+    if (strstr(value, "no-store") != NULL || strstr(value, "no-cache") != NULL
+            || strstr(value, "private") != NULL)
     {
-        fatal("bind");
+        return 0;
     }
-
-    /* listen */
-    if (listen(listenFD, LISTENQ) == -1)
+    if ((maxAge = strstr(value, "s-maxage=")) != NULL)
     {
-        fatal("listen");
+        return (uint64_t)atoll(maxAge + 9) * 1000000;
     }
-
-    for(;;)
+    if ((maxAge = strstr(value, "max-age=")) != NULL)
     {
-        handlerJob_t *job;
-        socklen_t clientAddr_len;
-        pthread_t dummy;
-        pthread_attr_t threadAttr;
+        return (uint64_t)atoll(maxAge + 8) * 1000000;
+    }
+    return SHMCACHE_DEFAULT_TTL;
+}
 
-        /* allocate */
-        job = malloc(sizeof(handlerJob_t));
+/* serveCached
 
-        /* accept */
-        clientAddr_len = sizeof(struct sockaddr);
-        job->clientFD = accept(listenFD, (struct sockaddr*) &(job->clientAddr), &clientAddr_len);
+DESCRIPTION
+Send a response found by shmcache_lookup and release it.
 
-        /* thread attribute - detached */
-        pthread_attr_init(&threadAttr);
-        pthread_attr_setdetachstate(&threadAttr, PTHREAD_CREATE_DETACHED);
+RETURN VALUE
+Number of bytes sent, -1 if the response could not be written.
+*/
 
-        /* create thread */
-        pthread_create(&dummy, &threadAttr, handleClientRequest, job);
-    }
+int serveCached(int clientFD, shmcacheHandle_t *cached)
+{
+    int result = writeAll(clientFD, cached->data, cached->length);
 
-    return 0;
+    shmcache_release(cached);
+    return (result == -1) ? -1 : (int)cached->length;
 }
 
-/* handleClientRequest
+/* servedLocally
 
 DESCRIPTION
-Assumes HTTP header stream from clientFD and acts like a middleman between client and end-server.
-It parses end-server information from clientFD stream and connect accordingly, and forward the response to the client.
-For this function, socket to client and file pointer to log file should be available.
-
-ARGUMENTS
-handlerJob_t *job
-    int clientFD
-        connection file descriptor from accept(2) system call
-    struct sockaddr_in *clientAddr
-        sockaddr descriptor from accept(2) system call
-
-LIMITATIONS
-This function will fail if HTTP header is biggern than BUFSIZE.
-
-SIDE EFFECTS
-This function can cause termination of the entire program in some cases of system call failure.
-This function logs real-time status to STDOUT, and writes a log entry for each request to LOGFILENAME.
-This function calls subroutines with side effects, such as readAll, readUntil and writeAll.
+Count and log a response the proxy answered itself, from the cache or the store.
 */
 
-void *handleClientRequest(void *job)
+void servedLocally(handlerJob_t *job, const char *uri, long long responseSize)
 {
-    int clientFD = ((handlerJob_t*)job)->clientFD;
-    handleClientRequest_internal(job);
-
-    /* finally */
-    free(job);
-    close(clientFD);
-    return NULL;
+    char logEntry[MAXLINE * 3];
+
+    phaseDone(job->phaseTime, STATS_PHASE_TOTAL, stats_now() - job->acceptTime);
+    job->responseSize = responseSize;
+    stats_add(STATS_REQUESTS, 1);
+    stats_add(STATS_BYTES_OUT, responseSize);
+    format_log_entry(logEntry, (struct sockaddr*)&job->clientAddr, (char*)uri, (int)responseSize);
+    writeLogEntry(logEntry);
 }
 
-void handleClientRequest_internal(void *job)
-{
-    /* argument */
-    int clientFD = ((handlerJob_t*)job)->clientFD;
-    struct sockaddr_in* clientAddr = &(((handlerJob_t*)job)->clientAddr);
+/* serveRange
 
-    /* for saving and parsing HTTP request from client */
-    const char *headerDelimiter = "\r\n\r\n";
-    char clientRequestHeader[BUFSIZE];
-    char *http, *request_host;
-    in_port_t request_port;
+DESCRIPTION
+Answer a GET with a Range field from a stored object: 206 with the ranges
+asked for, or 416 when none of them lies within the object.
 
-    /* server connection information */
-    struct addrinfo *serverAddrInfo;
-    struct sockaddr_in serverAddr;
-    int serverFD;
+RETURN VALUE
+Number of bytes sent, -1 if the response could not be written. -2 if the
+object cannot answer the request, because If-Range names another version
+or the Range field is invalid or asks for too many ranges; the request is
+forwarded then.
+*/
 
-    /* misc. */
-    int readResult;
-    int getaddrinfoResult;
-    char logEntry[MAXLINE];
-    int responseSize;
+long long serveRange(int clientFD, const char *header, const storeObject_t *object)
+{
+    byteRange_t ranges[RANGE_MAX];
+    char value[MAXLINE];
+    int count;
 
-    /* read HTTP header */
-    readResult = readUntil(clientFD, clientRequestHeader, sizeof(clientRequestHeader), headerDelimiter);
-    if (readResult == -1)
+    if (findHeader(header, "If-Range", value, sizeof(value)) != -1 && !range_current(value, object))
     {
-        return;
+        return -2;
     }
-    if (readResult == -2)
+    if (findHeader(header, "Range", value, sizeof(value)) == -1
+            || (count = range_parse(value, object->length, ranges, RANGE_MAX)) == -1)
     {
-        START_ERROR;
-        printf("Buffer for clientRequestHeader is full\n");
-        END_MESSAGE;
-        return;
+        return -2;
     }
-
-    /* analyze the request */
-    request_host = malloc(MAXLINE);
-    http = strstr(clientRequestHeader, "http://");
-
-    if (http == NULL || parse_uri(http, request_host, &request_port) == -1)
+    if (count == 0)
     {
-        return;
+        snprintf(value, sizeof(value), "Content-Range: bytes */%lld\r\n", (long long)object->length);
+        return sendErrorResponse(clientFD, 416, "Range Not Satisfiable", value);
     }
+    return range_send(clientFD, object, ranges, count);
+}
 
-    /* DNS lookup & get serverAddr */
-    if ((getaddrinfoResult = getaddrinfo(request_host, NULL, NULL, &serverAddrInfo)) != 0)
-    {
-        free(request_host);
-        START_ERROR;
-        printf("DNS lookup failure\n");
-        END_MESSAGE;
-        return;
-    }
-    else
-    {
-        memcpy(&serverAddr, serverAddrInfo->ai_addr, sizeof(struct sockaddr));
-        freeaddrinfo(serverAddrInfo);
-    }
-    free(request_host);
+/* fetchInBackground
 
-    /* prepare serverAddr */
-    serverAddr.sin_port = htons(request_port);
+DESCRIPTION
+Start fetching the whole object named key into the store on a thread of
+its own, unless it is already being fetched or was recently found not to
+be storable. The request sent is the client's, rewritten without its range.
 
-    /* connect to end server */
-    if ((serverFD = socket(serverAddr.sin_family, SOCK_STREAM, 0)) == -1)
-    {
-        error("socket");
-        return;
-    }
+ARGUMENTS
+int absolute
+    The client's request has an absolute URI, whose target is host.
+const char *host, in_port_t port
+    Where to fetch from when pool is NULL.
+const config_t *config
+    Supplies the upstream timeout and socket buffer size.
+*/
 
-    if (connect(serverFD, (struct sockaddr*)(&serverAddr), sizeof(serverAddr)) == -1)
-    {
-        error("connect");
-        close(serverFD);
-        return;
-    }
+void fetchInBackground(const char *key, const char *header, size_t headerLength, int absolute,
+        const char *host, in_port_t port, const iobuf_t *request, backendPool_t *pool, const config_t *config)
+{
+    fetchJob_t *fetch;
+    pthread_t thread;
 
-    /* forward request */
-    if (writeAll(serverFD, clientRequestHeader, readResult) == -1)
+    if (budget_pressure() != BUDGET_OK || (fetch = calloc(1, sizeof(fetchJob_t))) == NULL)
     {
-        close(serverFD);
         return;
     }
-    if (writeAll(serverFD, headerDelimiter, sizeof(headerDelimiter)) == -1)
+    if (store_begin(key, &fetch->writer) == -1)
     {
-        close(serverFD);
+        free(fetch);
         return;
     }
-
-    /* forward response */
-    responseSize = pump(serverFD, clientFD);
-    if (responseSize == -1)
+    budget_charge(sizeof(fetchJob_t));
+    iobuf_init(&fetch->request);
+    snprintf(fetch->host, sizeof(fetch->host), "%s", host);
+    fetch->port = port;
+    fetch->pool = pool;
+    fetch->timeout = config->upstreamTimeout;
+    fetch->bufferSize = config->socketBuffer;
+    if (rewriteRequest(header, headerLength, absolute ? host : NULL, port, request, 1, &fetch->request) == -1
+            || pthread_create(&thread, NULL, fetchObject, fetch) != 0)
     {
-        close(serverFD);
+        iobuf_clear(&fetch->request);
+        store_abort(&fetch->writer);
+        budget_credit(sizeof(fetchJob_t));
+        free(fetch);
         return;
     }
+    pthread_detach(thread);
+    stats_add(STATS_STORE_FETCHES, 1);
+}
 
-    /* close serverFD */
-    close(serverFD);
+/* connectUpstream
 
-    /* make log */
-    *strstr(http, " ") = '\0';
-    format_log_entry(logEntry, clientAddr, http, responseSize);
-    if (sem_wait(&logSem) == -1)
-    {
-        fatal("sem_wait");
-    }
-    fprintf(logFile, "%s\n", logEntry);
-    fflush(logFile);
-    if (sem_post(&logSem) == -1)
-    {
-        fatal("sem_post");
-    }
-}
+DESCRIPTION
+Connect for a request the proxy makes on its own: to a backend of pool,
+or else to host:port once its origin admits the request. What was taken
+is given back with releaseUpstream, whether or not this succeeded.
 
-/*
- * parse_uri - URI parser
- *
- * Given a URI from an HTTP proxy GET request (i.e., a URL), extract
- * the host name,  and port.  The memory for hostname
- * must already be allocated and should be at least MAXLINE
- * bytes. Return -1 if there are any problems.
- */
+RETURN VALUE
+The connected socket, -1 on failure.
+*/
 
-int parse_uri(char *uri, char *hostname, in_port_t *port)
+int connectUpstream(backendPool_t *pool, const char *host, in_port_t port, uint64_t *phaseTime,
+        backend_t **backend, origin_t **origin, originVerdict_t *verdict)
 {
-    char *hostbegin;
-    char *hostend;
-    int len;
+    uint64_t retryAfter;
+    int serverFD;
 
-    if (strncasecmp(uri, "http://", 7) != 0)
+    *backend = NULL;
+    *origin = NULL;
+    *verdict = ORIGIN_ALLOW;
+    if (pool != NULL)
     {
-        hostname[0] = '\0';
-        return -1;
+        *backend = backend_pick(pool, NULL);
+        serverFD = connectAddress(&(*backend)->addr, phaseTime);
     }
-
-    /* Extract the host name */
-    hostbegin = uri + 7;
-    hostend = strpbrk(hostbegin, " :/\r\n\0");
-    len = hostend - hostbegin;
-    strncpy(hostname, hostbegin, len);
-    hostname[len] = '\0';
-
-    /* Extract the port number */
-    *port = 80; /* default */
-    if (*hostend == ':')
+    else
     {
-        *port = atoi(hostend + 1);
+        *origin = origin_get(host, port);
+        *verdict = origin_admit(*origin, &retryAfter);
+        serverFD = (*verdict == ORIGIN_REJECT) ? -1 : connectServer(host, port, phaseTime);
     }
-
-    return 0;
+    return (serverFD < 0) ? -1 : serverFD;
 }
 
-/*
- * format_log_entry - Create a formatted log entry in logstring.
- *
- * The inputs are the socket address of the requesting client
- * (sockaddr), the URI from the request (uri), and the size in bytes
- * of the response from the server (size).
- */
+/* releaseUpstream
+
+DESCRIPTION
+Report the outcome of a request sent after connectUpstream, by the status
+code of its response (-1 if there was none).
+*/
 
-void format_log_entry(char *logstring, struct sockaddr_in *sockaddr, char *uri, int size)
+void releaseUpstream(backend_t *backend, origin_t *origin, originVerdict_t verdict, int status)
 {
-    time_t now;
-    char time_str[MAXLINE];
-    unsigned long host;
-    unsigned char a, b, c, d;
+    if (backend != NULL)
+    {
+        backend_release(backend, status > 0 && status < 500);
+    }
+    origin_done(origin, verdict, status > 0, 0);
+}
 
-    /* Get a formatted time string */
-    now = time(NULL);
-    strftime(time_str, MAXLINE, "%a %d %b %Y %H:%M:%S %Z", localtime(&now));
+/* fetchObject
 
-    /*
-     * Convert the IP address in network byte order to dotted decimal
-     * form. Note that we could have used inet_ntoa, but chose not to
-     * because inet_ntoa is a Class 3 thread unsafe function that
-     * returns a pointer to a static variable (Ch 13, CS:APP).
-     */
-    host = ntohl(sockaddr->sin_addr.s_addr);
-    a = host >> 24;
-    b = (host >> 16) & 0xff;
-    c = (host >> 8) & 0xff;
-    d = host & 0xff;
+DESCRIPTION
+Thread routine of fetchInBackground: connect the way the client's request
+was forwarded, store the response if it is a whole cacheable object, and
+report the outcome to the backend or origin like any other request.
+*/
 
-    /* Return the formatted log entry string */
-    sprintf(logstring, "%s: %d.%d.%d.%d %s %d", time_str, a, b, c, d, uri, size);
+void *fetchObject(void *job)
+{
+    fetchJob_t *fetch = job;
+    uint64_t phaseTime[STATS_PHASE_COUNT];
+    backend_t *backend;
+    origin_t *origin;
+    originVerdict_t verdict;
+    int serverFD, status = -1;
+
+    serverFD = connectUpstream(fetch->pool, fetch->host, fetch->port, phaseTime, &backend, &origin, &verdict);
+    if (serverFD >= 0)
+    {
+        configureSocket(serverFD, fetch->timeout, fetch->bufferSize);
+        status = receiveObject(serverFD, fetch);
+        close(serverFD);
+    }
+    else
+    {
+        store_abort(&fetch->writer);
+    }
+    releaseUpstream(backend, origin, verdict, status);
+    iobuf_clear(&fetch->request);
+    budget_credit(sizeof(fetchJob_t));
+    free(fetch);
+    return NULL;
 }
 
-/* pump
+/* receiveObject
 
 DESCRIPTION
-Transfer all data available from 'from' file descriptor to 'to' file descriptor.
+Send the fetch request on serverFD and write the response body into the
+store, where it is committed if the response is a cacheable 200 of at
+least STORE_MIN_SIZE bytes without a content coding, and arrived whole.
+The store writer is ended either way.
 
 RETURN VALUE
-On success, the number of bytes transfered is returned.
--1 is returned when primitive library call failure occured.
+The response status code, -1 if no response was received.
 */
 
-int pump(int from, int to)
+int receiveObject(int serverFD, fetchJob_t *fetch)
 {
-    char buf[BUFSIZE];
-    int readResult;
-    int total;
+    storeObject_t object;
+    iobuf_t response, header;
+    char *headerString, value[MAXLINE];
+    ssize_t headerLength;
+    uint64_t ttl;
+    size_t size;
+    int status;
+
+    iobuf_init(&response);
+    iobuf_init(&header);
+    if (sendChain(serverFD, &fetch->request) == -1
+            || (headerLength = iobuf_readUntil(&response, serverFD, "\r\n\r\n", REQUEST_HEADER_MAX)) <= 0
+            || iobuf_split(&response, headerLength, &header) == -1
+            || (headerString = iobuf_string(&header)) == NULL)
+    {
+        iobuf_clear(&response);
+        iobuf_clear(&header);
+        store_abort(&fetch->writer);
+        return -1;
+    }
+    status = (strncmp(headerString, "HTTP/1.", 7) == 0) ? atoi(headerString + 9) : -1;
 
-    total = 0;
-    while ((readResult = readAll(from, buf, sizeof(buf))) == -2)
+    memset(&object, 0, sizeof(object));
+    if ((ttl = responseCacheTTL(headerString, headerLength, &size)) == 0
+            || (object.length = size - headerLength) < STORE_MIN_SIZE
+            || findHeader(headerString, "Content-Encoding", value, sizeof(value)) != -1)
     {
-        if (writeAll(to, buf, sizeof(buf)) == -1)
+        DIAG_INFO("not storing %s: not a whole cacheable object", fetch->writer.key);
+        if (status > 0 && status < 500)
         {
-            return -1;
+            store_reject(fetch->writer.key);
         }
-        total += readResult;
+        iobuf_clear(&response);
+        iobuf_clear(&header);
+        store_abort(&fetch->writer);
+        return status;
     }
-    if (readResult == -1)
+    findHeader(headerString, "Content-Type", object.contentType, sizeof(object.contentType));
+    findHeader(headerString, "ETag", object.etag, sizeof(object.etag));
+    findHeader(headerString, "Last-Modified", object.lastModified, sizeof(object.lastModified));
+    iobuf_clear(&header);
+
+    /* the body bytes read with the header first, then the rest as it arrives */
+    while (store_write(&fetch->writer, &response, object.length - fetch->writer.written) == 0
+            && fetch->writer.written < object.length && iobuf_read(&response, serverFD) > 0)
     {
-        return -1;
     }
-    if (writeAll(to, buf, readResult) == -1)
+    iobuf_clear(&response);
+    if (store_commit(&fetch->writer, &object, ttl) == -1)
     {
-        return -1;
+        DIAG_INFO("not storing %s: body ended early", fetch->writer.key);
     }
-    total += readResult;
-    return total;
+    return status;
 }
 
-/* readAll
+/* prefetchObject
 
 DESCRIPTION
-Tries to read all the data currently available from file descriptor fd,
-but truncates data to fit in size of count.
-Remaining data can be readed by calling read(2) or readAll again.
-
-ARGUMENTS
-int fd
-    File descriptor from which target data is available.
-void *buf
-    Buffer to save data
-const size_t count
-    Maximum size of data, possible the size of buffer.
-
-RETURN VALUE
-On success without truncation, the number of bytes readed is returned.
--1 is returned when read(2) failure occured.
--2 is returned when truncation is occured.
+Fetcher for the prefetch module: GET url, an absolute URI found in a page,
+from where a client's request for it would go, and keep the response in
+the shared cache if it is cacheable. Sent without the client's cookies or
+credentials, so nothing private is stored.
 */
 
-int readAll(int fd, void *buf, const size_t count)
+void prefetchObject(const char *url)
 {
-    char *cursor;
-    int readResult;
-    char * const endOfBuffer = buf + count;
-    cursor = buf;
-
-    *cursor = '\0';
-    while (cursor < endOfBuffer)
+    char copy[PREFETCH_URL_MAX], host[MAXLINE], authority[MAXLINE], request[PREFETCH_URL_MAX + MAXLINE];
+    uint64_t phaseTime[STATS_PHASE_COUNT];
+    shmcacheHandle_t cached;
+    backendPool_t *pool = NULL;
+    backend_t *backend;
+    origin_t *origin;
+    originVerdict_t verdict;
+    const char *path;
+    in_port_t port;
+    int serverFD, length, status = -1;
+
+    /* the browser may have asked first */
+    if (shmcache_lookup(url, &cached))
     {
-        if ((readResult = read(fd, cursor, (endOfBuffer - cursor))) == -1)
-        {
-            error("read");
-            return -1;
-        }
-        if (readResult == 0)
-        {
-            return (cursor - (char*)buf);
-        }
-        cursor += readResult;
+        shmcache_release(&cached);
+        return;
+    }
+    snprintf(copy, sizeof(copy), "%s", url);
+    if (parse_uri(copy, host, &port) == -1)
+    {
+        return;
+    }
+    path = url + 7 + strcspn(url + 7, "/?");
+    snprintf(authority, sizeof(authority), "%.*s", (int)(path - (url + 7)), url + 7);
+    if (backend_enabled() && (pool = backend_route(authority)) == NULL)
+    {
+        return;
+    }
+    length = snprintf(request, sizeof(request), "GET %s%s HTTP/1.1\r\nHost: %s\r\nAccept: */*\r\n"
+            "Connection: close\r\nVia: 1.1 %s\r\n\r\n", (*path == '/') ? "" : "/", path, authority,
+            PROXY_VIA_NAME);
+    if (length >= (int)sizeof(request))
+    {
+        return;
     }
 
-    return -2;
+    serverFD = connectUpstream(pool, host, port, phaseTime, &backend, &origin, &verdict);
+    if (serverFD >= 0)
+    {
+        configureSocket(serverFD, PREFETCH_TIMEOUT_MS, 0);
+        status = receiveCached(serverFD, url, request, length);
+        close(serverFD);
+    }
+    releaseUpstream(backend, origin, verdict, status);
 }
 
-/* readUntil
+/* receiveCached
 
 DESCRIPTION
-Tries to read the data currently available from file descriptor fd,
-stops when pattern is found in data.
-
-ARGUMENTS
-int fd
-    File descriptor from which target data is available.
-void *buf
-    Buffer to save data
-const size_t count
-    Maximum size of data, possible the size of buffer.
-const char *pattern
-    Character pattern to determine stop condition of reading.
+Send request on serverFD and store the response in the shared cache under
+key, for at most PREFETCH_TTL, if it is cacheable and arrives whole.
 
 RETURN VALUE
-On success without truncation, the number of bytes readed is returned.
--1 is returned when read(2) failure occured.
--2 is returned when truncation is occured.
+The response status code, -1 if no response was received.
 */
 
-int readUntil(int fd, void *buf, const size_t count, const char *pattern)
+int receiveCached(int serverFD, const char *key, const char *request, int requestLength)
 {
-    char *cursor;
-    char *endOfBuffer;
-    int readResult;
-    char *substr;
-    cursor = buf;
-    endOfBuffer = buf + count;
+    shmcacheHandle_t fill;
+    const iobufSegment_t *segment;
+    iobuf_t response;
+    ssize_t headerLength;
+    const char *header;
+    uint64_t ttl;
+    size_t size;
+    int status;
+
+    iobuf_init(&response);
+    if (writeAll(serverFD, request, requestLength) == -1
+            || (headerLength = iobuf_readUntil(&response, serverFD, "\r\n\r\n", REQUEST_HEADER_MAX)) <= 0
+            || (header = iobuf_string(&response)) == NULL)
+    {
+        iobuf_clear(&response);
+        return -1;
+    }
+    status = (strncmp(header, "HTTP/1.", 7) == 0) ? atoi(header + 9) : -1;
+    if ((ttl = responseCacheTTL(header, iobuf_length(&response), &size)) == 0
+            || shmcache_reserve(key, size, &fill) == -1)
+    {
+        iobuf_clear(&response);
+        return status;
+    }
 
-    *cursor = '\0';
-    while (cursor < endOfBuffer)
+    /* the cache entry takes the response as it arrives, until it is full */
+    do
     {
-        if ((readResult = read(fd, cursor, (endOfBuffer - cursor))) == -1)
-        {
-            error("read");
-            return -1;
-        }
-        if (readResult == 0)
-        {
-            return (cursor - (char*)buf);
-        }
-        cursor += readResult;
-        if (cursor >= endOfBuffer)
-        {
-            return -2;
-        }
-        *cursor = '\0';
-        if ((substr = strstr(buf, pattern)) != NULL)
+        for (segment = response.head; segment != NULL; segment = segment->next)
         {
-            return (cursor - (char*)buf);
+            shmcache_append(&fill, segment->start, segment->end - segment->start);
         }
+        iobuf_consume(&response, iobuf_length(&response));
     }
-
-    return -2;
+    while (fill.filled < size && iobuf_read(&response, serverFD) > 0);
+    iobuf_clear(&response);
+    if (shmcache_commit(&fill, (ttl < PREFETCH_TTL) ? ttl : PREFETCH_TTL) == 0)
+    {
+        stats_add(STATS_PREFETCH_STORED, 1);
+    }
+    return status;
 }
 
 /* writeAll
@@ -548,9 +2712,13 @@ int writeAll(int fd, const void *buf, const size_t count)
 
     while (cursor < endOfData)
     {
-        if ((writeResult = write(fd, buf, endOfData - cursor)) == -1)
+        if ((writeResult = write(fd, cursor, endOfData - cursor)) == -1)
         {
-            error("write");
+            if (errno == EINTR || (errno == EAGAIN && coro_block(fd, POLLOUT) == 0))
+            {
+                continue;
+            }
+            ioError("write");
             return -1;
         }
         cursor += writeResult;
@@ -562,39 +2730,20 @@ int writeAll(int fd, const void *buf, const size_t count)
 /* fatal
 
 DESCRIPTION
-Print error message to stdout and terminate the program, based on errno.
+Report an error based on errno and terminate the program.
 
 ARGUMENTS
 char *message
     Printed error message is form of 'message: ERROR_STR'
 
 SIDE EFFECTS
-This function prints string to STDOUT.
+This function flushes pending diagnostics to STDOUT.
 This function can causes termination of the entire program.
 */
 
 void fatal(char *message)
 {
-    error(message);
+    DIAG_ERRNO(DIAG_LEVEL_ERROR, message);
+    diag_flush();
     exit(EXIT_FAILURE);
 }
-
-/* error
-
-DESCRIPTION
-Print error message to stdout, based on errno.
-
-ARGUMENTS
-char *message
-    Printed error message is form of 'message: ERROR_STR'
-
-SIDE EFFECTS
-This function prints string to STDOUT.
-*/
-
-void error(char *message)
-{
-    START_ERROR;
-    perror(message);
-    END_MESSAGE;
-}
@@ -0,0 +1,148 @@
+/*
+ * proxy.h - Configuration, types and routines of the CS:APP Web proxy
+ *
+ * proxy.c can be built with -DPROXY_NO_MAIN to link its routines into
+ * other programs, such as the microbenchmarks in bench/.
+ */
+
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include <stdint.h>
+#include "csapp.h"
+#include "stats.h"
+#include "capture.h"
+#include "backend.h"
+#include "origin.h"
+#include "shape.h"
+#include "shmcache.h"
+#include "config.h"
+#include "iobuf.h"
+#include "gzip.h"
+#include "store.h"
+#include "range.h"
+#include "prefetch.h"
+#include "budget.h"
+#include "coro.h"
+
+/* basic configuration */
+#define REQUEST_HEADER_MAX  (64*1024)
+#define PROXY_VIA_NAME      "proxy"         /* pseudonym in the Via field of forwarded requests */
+
+
+/* typedefs */
+typedef struct handlerJob
+{
+    int clientFD;
+    struct sockaddr_storage clientAddr;
+    uint64_t acceptTime;
+    config_t *config;           /* the configuration the connection was accepted under */
+
+    /* client bytes, freed by handleClientRequest */
+    iobuf_t input;              /* read from the client, not yet part of a request */
+    iobuf_t request;            /* the request header, then any body bytes read with it */
+
+    /* per-request outcome, for capture */
+    uint64_t phaseTime[STATS_PHASE_COUNT];
+    uint64_t responseSize;
+    captureRecord_t *capture;
+}
+handlerJob_t;
+
+/* state of a response stream passing through pump */
+typedef struct pumpContext
+{
+    uint64_t firstByteTime;     /* stats_now() of the first byte, 0 if none */
+    captureRecord_t *capture;   /* response bytes are copied here if not NULL */
+    int status;                 /* response status code, 0 until known */
+    shaper_t *shaper;           /* paces the writes to 'to' if not NULL */
+    const char *cacheKey;       /* the response may be stored under this key if not NULL */
+    shmcacheHandle_t cacheFill; /* the cache entry being filled, when caching */
+    uint64_t cacheTTL;          /* microseconds, 0 if the response is not being cached */
+    gzipEncoding_t encoding;    /* coding the client accepts, GZIP_NONE to send as received */
+    int chunked;                /* the client speaks HTTP/1.1 */
+    const char *prefetchBase;   /* URI of the response, to scan it if it is a page; NULL not to */
+    prefetchScanner_t scanner;
+}
+pumpContext_t;
+
+/* a whole object being fetched into the store in the background */
+typedef struct fetchJob
+{
+    storeWriter_t writer;
+    iobuf_t request;            /* GET for the whole object */
+    char host[MAXLINE];
+    in_port_t port;
+    backendPool_t *pool;        /* NULL to connect to host */
+    int timeout;                /* upstream_timeout_ms when the fetch started */
+    int bufferSize;
+}
+fetchJob_t;
+
+
+/*
+ * Function prototypes
+ */
+void *handleClientRequest(void *job);
+int handleClientRequest_internal(void *job);
+int parse_uri(char *uri, char *target_addr, in_port_t *port);
+void format_log_entry(char *logstring, struct sockaddr *sockaddr, char *uri, int size);
+int writeAll(int fd, const void *buf, const size_t count);
+int pump(int from, int to, pumpContext_t *context);
+void beginCompression(gzipStream_t *stream, pumpContext_t *context, iobuf_t *chain, iobuf_t *out);
+int responseCompressible(const char *buf, int length, char *header, size_t size);
+int responseIsPage(const char *buf, int length);
+int rewriteResponseHeader(const char *header, gzipEncoding_t encoding, int chunked,
+        const iobuf_t *response, iobuf_t *out);
+int writeChain(int fd, iobuf_t *chain, shaper_t *shaper);
+int copyResponseHeader(const char *buf, int length, char *header, size_t size);
+long long responseContentLength(const char *buf, int length);
+uint64_t responseCacheTTL(const char *buf, int length, size_t *size);
+int serveCached(int clientFD, shmcacheHandle_t *cached);
+long long serveRange(int clientFD, const char *header, const storeObject_t *object);
+void servedLocally(handlerJob_t *job, const char *uri, long long responseSize);
+void fetchInBackground(const char *key, const char *header, size_t headerLength, int absolute,
+        const char *host, in_port_t port, const iobuf_t *request, backendPool_t *pool, const config_t *config);
+void *fetchObject(void *job);
+int receiveObject(int serverFD, fetchJob_t *fetch);
+void prefetchObject(const char *url);
+int receiveCached(int serverFD, const char *key, const char *request, int requestLength);
+int connectUpstream(backendPool_t *pool, const char *host, in_port_t port, uint64_t *phaseTime,
+        backend_t **backend, origin_t **origin, originVerdict_t *verdict);
+void releaseUpstream(backend_t *backend, origin_t *origin, originVerdict_t verdict, int status);
+void superviseWorkers(int count);
+void stopWorkers(pid_t *pids, int count, int signum);
+void handleControlSignals(int upgradable);
+void dispatchConnection(int clientFD, const struct sockaddr_storage *clientAddr, pthread_attr_t *threadAttr);
+void reloadConfig(void);
+void applyConfig(const config_t *config);
+void reopenLog(const char *path);
+void configureSocket(int fd, int timeout, int bufferSize);
+int serveStats(int clientFD);
+int connectServer(const char *host, in_port_t port, uint64_t *phaseTime);
+int connectAddress(const struct sockaddr_in *serverAddr, uint64_t *phaseTime);
+int resolveAlternate(const char *host, in_port_t port, int connectedFD, struct sockaddr_in *addr);
+int hedgeRequest(int serverFD, const iobuf_t *request, backendPool_t *pool, backend_t **backend,
+        origin_t *origin, const char *host, in_port_t port, const config_t *config);
+int findHeader(const char *header, const char *name, char *value, size_t size);
+const char *requestVersion(const char *header);
+int rewriteRequest(const char *header, size_t headerLength, const char *host, in_port_t port,
+        const iobuf_t *request, int whole, iobuf_t *out);
+int sliceFields(const char *header, const char *fields, const char **drop, const char *also,
+        const char *connection, const iobuf_t *source, iobuf_t *out);
+int headerListHas(const char *list, const char *name, size_t length);
+int sendChain(int fd, const iobuf_t *chain);
+int handleConnect(handlerJob_t *job, const char *header, size_t headerLength);
+int sendErrorResponse(int clientFD, int status, const char *reason, const char *extraHeaders);
+int sendRetryLater(int clientFD, int status, uint64_t retryAfter);
+void refuseConnection(int clientFD, int status, uint64_t retryAfter);
+void writeLogEntry(const char *logEntry);
+void phaseDone(uint64_t *phaseTime, statsPhase_t phase, uint64_t micros);
+void fatal(char *message);
+
+
+/* global variables */
+extern FILE *logFile;
+extern sem_t logSem;
+
+#endif /* __PROXY_H__ */
@@ -0,0 +1,247 @@
+/*
+ * range.c - Byte-range responses from stored objects
+ */
+
+#include "csapp.h"
+#include "stats.h"
+#include "coro.h"
+#include "range.h"
+#include <sys/sendfile.h>
+
+#define SENDFILE_MAX    (1 << 30)       /* bytes per sendfile(2) call */
+
+
+/* range_parse
+
+DESCRIPTION
+Parse a Range field value ("bytes=0-99,200-,-50") against an object of
+length bytes, clamping the ends of the ranges to the object and leaving
+out those that start past it.
+
+RETURN VALUE
+Number of satisfiable ranges stored in ranges; 0 if none is satisfiable
+(a 416). -1 if the value is not a valid bytes range set or has more than
+max ranges, in which case the field is to be ignored.
+*/
+
+int range_parse(const char *value, off_t length, byteRange_t *ranges, int max)
+{
+    const char *cursor;
+    char *end;
+    long long first, last;
+    int count = 0, specs = 0;
+
+    if (strncasecmp(value, "bytes=", 6) != 0)
+    {
+        return -1;
+    }
+    for (cursor = value + 6; ; cursor++)
+    {
+        cursor += strspn(cursor, " \t");
+        if (++specs > max)
+        {
+            return -1;
+        }
+
+        /* suffix range: the last N bytes */
+        if (*cursor == '-')
+        {
+            if (!isdigit((unsigned char)cursor[1]) || (last = strtoll(cursor + 1, &end, 10)) < 0)
+            {
+                return -1;
+            }
+            if (last > 0)
+            {
+                ranges[count].first = (last < length) ? length - last : 0;
+                ranges[count].last = length - 1;
+                count++;
+            }
+        }
+        else
+        {
+            if (!isdigit((unsigned char)*cursor) || (first = strtoll(cursor, &end, 10)) < 0 || *end != '-')
+            {
+                return -1;
+            }
+            last = length - 1;
+            if (isdigit((unsigned char)end[1]))
+            {
+                last = strtoll(end + 1, &end, 10);
+                if (last < first)
+                {
+                    return -1;
+                }
+            }
+            else
+            {
+                end++;
+            }
+            if (first < length)
+            {
+                ranges[count].first = first;
+                ranges[count].last = (last < length) ? last : length - 1;
+                count++;
+            }
+        }
+
+        cursor = end + strspn(end, " \t");
+        if (*cursor == '\0')
+        {
+            return count;
+        }
+        if (*cursor != ',')
+        {
+            return -1;
+        }
+    }
+}
+
+/* range_current
+
+DESCRIPTION
+Whether an If-Range field value names the stored version of the object:
+its strong entity tag, or exactly its Last-Modified date. Ranges of
+another version must not be combined with the client's copy.
+*/
+
+int range_current(const char *ifRange, const storeObject_t *object)
+{
+    if (ifRange[0] == '"')
+    {
+        return object->etag[0] == '"' && strcmp(ifRange, object->etag) == 0;
+    }
+    if (strncmp(ifRange, "W/", 2) == 0)
+    {
+        return 0;
+    }
+    return object->lastModified[0] != '\0' && strcmp(ifRange, object->lastModified) == 0;
+}
+
+static int sendAll(int fd, const char *buf, size_t count, int flags)
+{
+    ssize_t sent;
+
+    while (count > 0)
+    {
+        if ((sent = send(fd, buf, count, flags | MSG_NOSIGNAL)) == -1)
+        {
+            if (errno == EINTR || (errno == EAGAIN && coro_block(fd, POLLOUT) == 0))
+            {
+                continue;
+            }
+            return -1;
+        }
+        buf += sent;
+        count -= sent;
+    }
+    return 0;
+}
+
+static int sendRange(int fd, const storeObject_t *object, const byteRange_t *range)
+{
+    off_t offset = object->offset + range->first;
+    off_t remaining = range->last - range->first + 1;
+    ssize_t sent;
+
+    while (remaining > 0)
+    {
+        sent = sendfile(fd, object->fd, &offset, (remaining < SENDFILE_MAX) ? remaining : SENDFILE_MAX);
+        if (sent == -1 && (errno == EINTR || (errno == EAGAIN && coro_block(fd, POLLOUT) == 0)))
+        {
+            continue;
+        }
+        if (sent <= 0)
+        {
+            return -1;
+        }
+        remaining -= sent;
+    }
+    return 0;
+}
+
+/* range_send
+
+DESCRIPTION
+Send a 206 response with the given ranges of object to fd: a single
+range as the body, several as a multipart/byteranges body.
+
+ARGUMENTS
+int count
+    Number of ranges, at least 1 and at most RANGE_MAX.
+
+RETURN VALUE
+Number of bytes sent, -1 if the response could not be written.
+*/
+
+long long range_send(int fd, const storeObject_t *object, const byteRange_t *ranges, int count)
+{
+    char header[RANGE_PART_MAX * 4], parts[RANGE_MAX][RANGE_PART_MAX], trailer[64];
+    char boundary[32], contentType[STORE_FIELD_MAX + 64], validators[STORE_FIELD_MAX * 2 + 32];
+    int partLength[RANGE_MAX], headerLength, trailerLength = 0, i;
+    long long contentLength = 0;
+
+    validators[0] = '\0';
+    if (object->etag[0] != '\0')
+    {
+        snprintf(validators, sizeof(validators), "ETag: %s\r\n", object->etag);
+    }
+    if (object->lastModified[0] != '\0')
+    {
+        snprintf(validators + strlen(validators), sizeof(validators) - strlen(validators),
+                "Last-Modified: %s\r\n", object->lastModified);
+    }
+
+    if (count == 1)
+    {
+        contentLength = ranges[0].last - ranges[0].first + 1;
+        snprintf(contentType, sizeof(contentType), "%s", object->contentType);
+        headerLength = snprintf(header, sizeof(header),
+                "HTTP/1.1 206 Partial Content\r\n"
+                "Content-Range: bytes %lld-%lld/%lld\r\n",
+                (long long)ranges[0].first, (long long)ranges[0].last, (long long)object->length);
+    }
+    else
+    {
+        /* every part header is formatted first, since they count towards Content-Length */
+        snprintf(boundary, sizeof(boundary), "%016llx",
+                (unsigned long long)(stats_now() * 0x9e3779b97f4a7c15ULL));
+        for (i = 0; i < count; i++)
+        {
+            partLength[i] = snprintf(parts[i], sizeof(parts[i]),
+                    "\r\n--%s\r\n%s%s%sContent-Range: bytes %lld-%lld/%lld\r\n\r\n", boundary,
+                    object->contentType[0] ? "Content-Type: " : "", object->contentType,
+                    object->contentType[0] ? "\r\n" : "",
+                    (long long)ranges[i].first, (long long)ranges[i].last, (long long)object->length);
+            contentLength += partLength[i] + ranges[i].last - ranges[i].first + 1;
+        }
+        trailerLength = snprintf(trailer, sizeof(trailer), "\r\n--%s--\r\n", boundary);
+        contentLength += trailerLength;
+        snprintf(contentType, sizeof(contentType), "multipart/byteranges; boundary=%s", boundary);
+        headerLength = snprintf(header, sizeof(header), "HTTP/1.1 206 Partial Content\r\n");
+    }
+    headerLength += snprintf(header + headerLength, sizeof(header) - headerLength,
+            "%s%s%sContent-Length: %lld\r\nAccept-Ranges: bytes\r\n%sConnection: close\r\n\r\n",
+            contentType[0] ? "Content-Type: " : "", contentType, contentType[0] ? "\r\n" : "",
+            contentLength, validators);
+
+    if (sendAll(fd, header, headerLength, MSG_MORE) == -1)
+    {
+        return -1;
+    }
+    if (count == 1)
+    {
+        return (sendRange(fd, object, &ranges[0]) == -1) ? -1 : headerLength + contentLength;
+    }
+    for (i = 0; i < count; i++)
+    {
+        if (sendAll(fd, parts[i], partLength[i], MSG_MORE) == -1 || sendRange(fd, object, &ranges[i]) == -1)
+        {
+            return -1;
+        }
+    }
+    if (sendAll(fd, trailer, trailerLength, 0) == -1)
+    {
+        return -1;
+    }
+    return headerLength + contentLength;
+}
@@ -0,0 +1,32 @@
+/*
+ * range.h - Byte-range responses from stored objects
+ *
+ * A Range field is parsed against the stored object's length into at most
+ * RANGE_MAX byte ranges. One range is answered with a plain 206 and a
+ * Content-Range; several with a multipart/byteranges body. Part headers
+ * are written with MSG_MORE and the bytes of each range with sendfile(2),
+ * so the body never passes through user space and the small headers
+ * share packets with the data that follows them.
+ */
+
+#ifndef __RANGE_H__
+#define __RANGE_H__
+
+#include <sys/types.h>
+#include "store.h"
+
+#define RANGE_MAX           16          /* ranges per request; more are not served from the store */
+#define RANGE_PART_MAX      (STORE_FIELD_MAX + 256)     /* one part header of a multipart body */
+
+typedef struct byteRange
+{
+    off_t first;
+    off_t last;                 /* inclusive */
+}
+byteRange_t;
+
+int range_parse(const char *value, off_t length, byteRange_t *ranges, int max);
+int range_current(const char *ifRange, const storeObject_t *object);
+long long range_send(int fd, const storeObject_t *object, const byteRange_t *ranges, int count);
+
+#endif /* __RANGE_H__ */
@@ -0,0 +1,280 @@
+/*
+ * ratelimit.c - Per-client token buckets
+ *
+ * Buckets live in a fixed table split into RATELIMIT_STRIPES stripes, each
+ * an open-addressed array behind its own mutex, so clients hashing to
+ * different stripes never contend and there is no global lock. A lookup
+ * probes RATELIMIT_PROBE slots of one stripe; a new client takes a free
+ * or idle slot among them, or else evicts the least recently seen one,
+ * which approximates LRU expiry without any background sweeping. An
+ * evicted client simply starts over with full buckets.
+ */
+
+#include "csapp.h"
+#include "stats.h"
+#include "ratelimit.h"
+
+typedef struct ratelimitEntry
+{
+    uint32_t key;               /* from clientKey */
+    int used;                   /* 0 if free */
+    uint64_t lastSeen;          /* stats_now() of the last refill */
+    double requestTokens;
+    double byteTokens;          /* may go negative: bytes owed */
+}
+ratelimitEntry_t;
+
+typedef struct ratelimitStripe
+{
+    pthread_mutex_t lock;
+    ratelimitEntry_t entries[RATELIMIT_STRIPE_SLOTS];
+}
+__attribute__((aligned(64))) ratelimitStripe_t;
+
+static ratelimitStripe_t *stripes;
+static double requestRate, requestBurst;
+static double byteRate, byteBurst;
+static uint32_t prefixMask = 0xffffffff;
+
+
+/* parseRate
+
+DESCRIPTION
+Parse "rate[:burst]"; the burst defaults to one second's worth and is at
+least 1. An empty spec turns the bucket off.
+
+RETURN VALUE
+0 on success, -1 if the rate is not positive.
+*/
+
+static int parseRate(const char *spec, double *rate, double *burst)
+{
+    const char *colon;
+
+    if (spec[0] == '\0')
+    {
+        *rate = *burst = 0.0;
+        return 0;
+    }
+    if ((*rate = atof(spec)) <= 0.0)
+    {
+        return -1;
+    }
+    *burst = ((colon = strchr(spec, ':')) != NULL) ? atof(colon + 1) : *rate;
+    *burst = (*burst < 1.0) ? 1.0 : *burst;
+    return 0;
+}
+
+static int tableInit(void)
+{
+    ratelimitStripe_t *table;
+    int i;
+
+    if (stripes != NULL)
+    {
+        return 0;
+    }
+    if ((table = calloc(RATELIMIT_STRIPES, sizeof(ratelimitStripe_t))) == NULL)
+    {
+        return -1;
+    }
+    for (i = 0; i < RATELIMIT_STRIPES; i++)
+    {
+        pthread_mutex_init(&table[i].lock, NULL);
+    }
+    __atomic_store_n(&stripes, table, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* ratelimit_setRequests / ratelimit_setBandwidth
+
+DESCRIPTION
+Enable the request bucket ("requests per second[:burst]") or the
+bandwidth bucket ("bytes per second[:burst]"), or turn it off with "".
+Called again on a configuration reload; handlers racing with it may
+refill one bucket at a mix of the old and new rates, which is harmless.
+The table is kept once allocated.
+
+RETURN VALUE
+0 on success, -1 on a malformed specification.
+*/
+
+int ratelimit_setRequests(const char *spec)
+{
+    if (parseRate(spec, &requestRate, &requestBurst) == -1)
+    {
+        return -1;
+    }
+    return (requestRate > 0.0) ? tableInit() : 0;
+}
+
+int ratelimit_setBandwidth(const char *spec)
+{
+    if (parseRate(spec, &byteRate, &byteBurst) == -1)
+    {
+        return -1;
+    }
+    return (byteRate > 0.0) ? tableInit() : 0;
+}
+
+/* ratelimit_setPrefix
+
+DESCRIPTION
+Share buckets among all clients with the same leading address bits (1-32).
+*/
+
+void ratelimit_setPrefix(int bits)
+{
+    if (bits >= 1 && bits <= 32)
+    {
+        prefixMask = (bits == 32) ? 0xffffffff : ~(0xffffffffu >> bits);
+    }
+}
+
+int ratelimit_enabled(void)
+{
+    return stripes != NULL;
+}
+
+/* clientKey
+
+RETURN VALUE
+The bucket key of client: the masked IPv4 address in host order, or the
+leading 64 bits of an IPv6 address folded to 32.
+*/
+
+static uint32_t clientKey(const struct sockaddr *client)
+{
+    const uint8_t *bytes;
+    uint32_t high, low;
+
+    if (client->sa_family == AF_INET6)
+    {
+        bytes = ((const struct sockaddr_in6*)client)->sin6_addr.s6_addr;
+        memcpy(&high, bytes, sizeof(high));
+        memcpy(&low, bytes + 4, sizeof(low));
+        return high ^ (low * 2654435761u);
+    }
+    return ntohl(((const struct sockaddr_in*)client)->sin_addr.s_addr) & prefixMask;
+}
+
+/* findEntry
+
+DESCRIPTION
+Find or claim the entry of client and refill its buckets up to now.
+Returns with the entry's stripe locked; *stripeOut is set for unlocking.
+*/
+
+static ratelimitEntry_t *findEntry(const struct sockaddr *client, uint64_t now, ratelimitStripe_t **stripeOut)
+{
+    uint32_t key = clientKey(client);
+    uint32_t hash = key * 2654435761u;
+    ratelimitStripe_t *stripe = &stripes[(hash >> 24) % RATELIMIT_STRIPES];
+    ratelimitEntry_t *entry, *victim = NULL;
+    double elapsed;
+    int i;
+
+    pthread_mutex_lock(&stripe->lock);
+    *stripeOut = stripe;
+    for (i = 0; i < RATELIMIT_PROBE; i++)
+    {
+        entry = &stripe->entries[(hash + i) % RATELIMIT_STRIPE_SLOTS];
+        if (entry->used && entry->key == key)
+        {
+            break;
+        }
+        if (victim == NULL || victim->used)
+        {
+            if (!entry->used || now - entry->lastSeen > RATELIMIT_IDLE)
+            {
+                entry->used = 0;
+                victim = entry;
+            }
+            else if (victim == NULL || entry->lastSeen < victim->lastSeen)
+            {
+                victim = entry;
+            }
+        }
+    }
+
+    if (i == RATELIMIT_PROBE)
+    {
+        entry = victim;
+        entry->key = key;
+        entry->used = 1;
+        entry->lastSeen = now;
+        entry->requestTokens = requestBurst;
+        entry->byteTokens = byteBurst;
+        return entry;
+    }
+
+    elapsed = (now - entry->lastSeen) / 1e6;
+    entry->lastSeen = now;
+    entry->requestTokens += elapsed * requestRate;
+    entry->requestTokens = (entry->requestTokens > requestBurst) ? requestBurst : entry->requestTokens;
+    entry->byteTokens += elapsed * byteRate;
+    entry->byteTokens = (entry->byteTokens > byteBurst) ? byteBurst : entry->byteTokens;
+    return entry;
+}
+
+/* ratelimit_admit
+
+DESCRIPTION
+Take one request token from client's bucket.
+
+ARGUMENTS
+uint64_t *retryAfter
+    When the client is refused, set to the microseconds until it would be admitted.
+
+RETURN VALUE
+1 if the client is admitted, 0 if it is over its rate.
+*/
+
+int ratelimit_admit(const struct sockaddr *client, uint64_t *retryAfter)
+{
+    ratelimitStripe_t *stripe;
+    ratelimitEntry_t *entry;
+    double wait = 0.0;
+
+    if (stripes == NULL)
+    {
+        return 1;
+    }
+    entry = findEntry(client, stats_now(), &stripe);
+    if (requestRate > 0.0 && entry->requestTokens < 1.0)
+    {
+        wait = (1.0 - entry->requestTokens) / requestRate;
+    }
+    if (byteRate > 0.0 && entry->byteTokens < 0.0 && -entry->byteTokens / byteRate > wait)
+    {
+        wait = -entry->byteTokens / byteRate;
+    }
+    if (wait == 0.0 && requestRate > 0.0)
+    {
+        entry->requestTokens -= 1.0;
+    }
+    pthread_mutex_unlock(&stripe->lock);
+
+    *retryAfter = (uint64_t)(wait * 1e6);
+    return wait == 0.0;
+}
+
+/* ratelimit_charge
+
+DESCRIPTION
+Charge bytes sent to client against its bandwidth bucket.
+*/
+
+void ratelimit_charge(const struct sockaddr *client, uint64_t bytes)
+{
+    ratelimitStripe_t *stripe;
+    ratelimitEntry_t *entry;
+
+    if (__atomic_load_n(&stripes, __ATOMIC_ACQUIRE) == NULL || byteRate <= 0.0)
+    {
+        return;
+    }
+    entry = findEntry(client, stats_now(), &stripe);
+    entry->byteTokens -= (double)bytes;
+    pthread_mutex_unlock(&stripe->lock);
+}
@@ -0,0 +1,33 @@
+/*
+ * ratelimit.h - Per-client token buckets
+ *
+ * Each client address, or each subnet when a prefix length below 32 is
+ * configured, has a request bucket refilled at 'rate' requests per second
+ * up to 'burst', and a bandwidth bucket refilled at 'bytes per second'.
+ * A connection is admitted if it can take one request token and the
+ * bandwidth bucket is not in debt; response bytes are charged to the
+ * bandwidth bucket afterwards, so a client that overdraws it is refused
+ * until it has paid the debt back. IPv6 clients are limited per /64, the
+ * block usually assigned to a single subscriber.
+ */
+
+#ifndef __RATELIMIT_H__
+#define __RATELIMIT_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+#define RATELIMIT_STRIPES       256                 /* independently locked parts of the table */
+#define RATELIMIT_STRIPE_SLOTS  256
+#define RATELIMIT_PROBE         8                   /* slots examined per lookup */
+#define RATELIMIT_IDLE          (60*1000*1000)      /* an entry idle this long is free */
+
+int ratelimit_setRequests(const char *spec);
+int ratelimit_setBandwidth(const char *spec);
+void ratelimit_setPrefix(int bits);
+int ratelimit_enabled(void);
+int ratelimit_admit(const struct sockaddr *client, uint64_t *retryAfter);
+void ratelimit_charge(const struct sockaddr *client, uint64_t bytes);
+
+#endif /* __RATELIMIT_H__ */
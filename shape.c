@@ -0,0 +1,170 @@
+/*
+ * shape.c - Egress bandwidth shaping for responses
+ *
+ * Both budgets are generic cell rate algorithms: instead of a token count
+ * each keeps the time the next byte may be sent, and sending n bytes moves
+ * that time n/rate seconds ahead. The aggregate one is a single atomic
+ * word advanced with compare-and-swap, so shaping takes no lock. Where the
+ * kernel supports SO_MAX_PACING_RATE, bulk connections are also paced by
+ * TCP itself, which smooths out the bursts between quanta.
+ */
+
+#include "csapp.h"
+#include "stats.h"
+#include "coro.h"
+#include "shape.h"
+
+static uint64_t connectionRate;     /* bytes per second, 0 for unlimited */
+static uint64_t aggregateRate;
+static uint64_t aggregateNext;
+
+
+static int parseRate(const char *spec, uint64_t *rate)
+{
+    long long value = atoll(spec);
+
+    if (spec[0] == '\0')
+    {
+        *rate = 0;
+        return 0;
+    }
+    if (value <= 0)
+    {
+        return -1;
+    }
+    *rate = value;
+    return 0;
+}
+
+/* shape_setConnectionRate / shape_setAggregateRate
+
+DESCRIPTION
+Set the per-connection or the aggregate egress rate in bytes per second,
+or turn it off with "".
+
+RETURN VALUE
+0 on success, -1 if the rate is not positive.
+*/
+
+int shape_setConnectionRate(const char *spec)
+{
+    return parseRate(spec, &connectionRate);
+}
+
+int shape_setAggregateRate(const char *spec)
+{
+    return parseRate(spec, &aggregateRate);
+}
+
+int shape_enabled(void)
+{
+    return connectionRate != 0 || aggregateRate != 0;
+}
+
+void shape_begin(shaper_t *shaper, int fd)
+{
+    memset(shaper, 0, sizeof(*shaper));
+    shaper->fd = fd;
+}
+
+/* becomeBulk
+
+DESCRIPTION
+Move a response to the bulk class, handing per-connection pacing to the kernel where possible.
+*/
+
+static void becomeBulk(shaper_t *shaper)
+{
+    shaper->bulk = 1;
+#ifdef SO_MAX_PACING_RATE
+    if (connectionRate != 0)
+    {
+        unsigned int rate = (connectionRate > 0xffffffffu) ? 0xffffffffu : (unsigned int)connectionRate;
+
+        setsockopt(shaper->fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate));
+    }
+#endif
+}
+
+/* shape_declare
+
+DESCRIPTION
+Classify a response by its declared length, -1 if unknown.
+*/
+
+void shape_declare(shaper_t *shaper, long long contentLength)
+{
+    if (!shaper->bulk && contentLength > SHAPE_BULK_THRESHOLD)
+    {
+        becomeBulk(shaper);
+    }
+}
+
+/* reserve
+
+DESCRIPTION
+Advance a cell rate budget by cost microseconds.
+
+RETURN VALUE
+The time the reserved bytes may be sent.
+*/
+
+static uint64_t reserve(uint64_t *next, uint64_t now, uint64_t cost)
+{
+    uint64_t start;
+
+    start = (*next + SHAPE_BURST > now) ? *next : now - SHAPE_BURST;
+    *next = start + cost;
+    return start;
+}
+
+/* shape_pace
+
+DESCRIPTION
+Account for bytes about to be written to the shaper's connection, sleeping
+first if they are bulk and over budget. Callers pass at most SHAPE_QUANTUM
+bytes at a time so pacing stays smooth.
+*/
+
+void shape_pace(shaper_t *shaper, size_t bytes)
+{
+    uint64_t now = stats_now();
+    uint64_t start = now, current, next, aggregateStart;
+
+    shaper->sent += bytes;
+    if (!shaper->bulk && shaper->sent > SHAPE_BULK_THRESHOLD)
+    {
+        becomeBulk(shaper);
+    }
+
+    if (shaper->bulk && connectionRate != 0)
+    {
+        start = reserve(&shaper->nextSend, now, bytes * 1000000 / connectionRate);
+    }
+
+    if (aggregateRate != 0)
+    {
+        current = __atomic_load_n(&aggregateNext, __ATOMIC_RELAXED);
+        do
+        {
+            next = current;
+            aggregateStart = reserve(&next, now, bytes * 1000000 / aggregateRate);
+            if (!shaper->bulk && next > now + SHAPE_MAX_DEBT)
+            {
+                /* interactive traffic borrows, but only so far, and never cancels what bulk reserved */
+                next = (current > now + SHAPE_MAX_DEBT) ? current : now + SHAPE_MAX_DEBT;
+            }
+        }
+        while (!__atomic_compare_exchange_n(&aggregateNext, &current, next, 1,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        if (shaper->bulk && aggregateStart > start)
+        {
+            start = aggregateStart;
+        }
+    }
+
+    if (shaper->bulk && start > now)
+    {
+        coro_sleep(start - now);
+    }
+}
@@ -0,0 +1,39 @@
+/*
+ * shape.h - Egress bandwidth shaping for responses
+ *
+ * Responses are paced per connection and against an aggregate egress
+ * rate. A response is interactive until it is known to be larger than
+ * SHAPE_BULK_THRESHOLD, by its Content-Length or by the bytes sent so far;
+ * from then on it is bulk. Interactive bytes are never delayed, but they
+ * are charged to the aggregate budget, so bulk transfers yield to them.
+ * Bulk bytes wait for both the connection's and the aggregate budget.
+ */
+
+#ifndef __SHAPE_H__
+#define __SHAPE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHAPE_BULK_THRESHOLD    (256*1024)          /* bytes */
+#define SHAPE_QUANTUM           (16*1024)           /* bytes written per pacing decision */
+#define SHAPE_BURST             (20*1000)           /* microseconds of idle credit */
+#define SHAPE_MAX_DEBT          (1000*1000)         /* microseconds interactive traffic may borrow */
+
+typedef struct shaper
+{
+    int fd;
+    int bulk;
+    uint64_t sent;
+    uint64_t nextSend;          /* GCRA: earliest stats_now() the next byte may leave */
+}
+shaper_t;
+
+int shape_setConnectionRate(const char *spec);
+int shape_setAggregateRate(const char *spec);
+int shape_enabled(void);
+void shape_begin(shaper_t *shaper, int fd);
+void shape_declare(shaper_t *shaper, long long contentLength);
+void shape_pace(shaper_t *shaper, size_t bytes);
+
+#endif /* __SHAPE_H__ */
@@ -0,0 +1,422 @@
+/*
+ * shmcache.c - Response cache in shared memory
+ *
+ * The class descriptors below are process-local but identical in every
+ * worker, because they are filled in before fork(2) and the mapping sits
+ * at the same address in all children. Only sets and blocks are shared.
+ */
+
+#include "csapp.h"
+#include "diag.h"
+#include "stats.h"
+#include "shmcache.h"
+
+typedef enum entryState
+{
+    ENTRY_EMPTY,
+    ENTRY_FILLING,              /* owned by the worker storing it */
+    ENTRY_READY
+}
+entryState_t;
+
+typedef struct cacheEntry
+{
+    uint64_t hash;
+    uint64_t expires;
+    uint64_t lastUsed;          /* last append while ENTRY_FILLING */
+    uint64_t generation;        /* counts reservations, so a fill taken over can tell */
+    uint32_t keyLength;
+    uint32_t length;
+    int32_t pins;
+    int32_t state;
+}
+cacheEntry_t;
+
+typedef struct cacheSet
+{
+    pthread_mutex_t lock;
+    cacheEntry_t ways[SHMCACHE_WAYS];
+}
+__attribute__((aligned(64))) cacheSet_t;
+
+typedef struct cacheClass
+{
+    size_t blockSize;
+    uint32_t setCount;
+    cacheSet_t *sets;
+    char *blocks;               /* setCount * SHMCACHE_WAYS blocks of blockSize */
+}
+cacheClass_t;
+
+static cacheClass_t classes[SHMCACHE_CLASSES];
+static int enabled;
+
+
+/* shmcache_init
+
+DESCRIPTION
+Map about budget bytes of shared memory, split evenly between the size
+classes, and initialize every set. Must be called before forking workers.
+
+RETURN VALUE
+0 on success, -1 if the mapping or the locks cannot be set up.
+*/
+
+int shmcache_init(size_t budget)
+{
+    pthread_mutexattr_t attr;
+    size_t total = 0, offset = 0;
+    char *region;
+    uint32_t i;
+    int c;
+
+    for (c = 0; c < SHMCACHE_CLASSES; c++)
+    {
+        classes[c].blockSize = (size_t)SHMCACHE_MIN_BLOCK << (2 * c);
+        classes[c].setCount = budget / SHMCACHE_CLASSES / (classes[c].blockSize * SHMCACHE_WAYS);
+        classes[c].setCount = classes[c].setCount ? classes[c].setCount : 1;
+        total += classes[c].setCount * (sizeof(cacheSet_t) + SHMCACHE_WAYS * classes[c].blockSize);
+    }
+
+    region = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED)
+    {
+        DIAG_ERRNO(DIAG_LEVEL_ERROR, "cache mmap");
+        return -1;
+    }
+
+    pthread_mutexattr_init(&attr);
+    if (pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) != 0
+            || pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) != 0)
+    {
+        DIAG_ERROR("process-shared robust mutexes are not supported");
+        munmap(region, total);
+        return -1;
+    }
+    for (c = 0; c < SHMCACHE_CLASSES; c++)
+    {
+        classes[c].sets = (cacheSet_t*)(region + offset);
+        offset += classes[c].setCount * sizeof(cacheSet_t);
+        for (i = 0; i < classes[c].setCount; i++)
+        {
+            pthread_mutex_init(&classes[c].sets[i].lock, &attr);
+        }
+    }
+    for (c = 0; c < SHMCACHE_CLASSES; c++)
+    {
+        classes[c].blocks = region + offset;
+        offset += classes[c].setCount * SHMCACHE_WAYS * classes[c].blockSize;
+    }
+    pthread_mutexattr_destroy(&attr);
+
+    enabled = 1;
+    DIAG_INFO("response cache: %zu MiB shared", total >> 20);
+    return 0;
+}
+
+int shmcache_enabled(void)
+{
+    return enabled;
+}
+
+static uint64_t hashKey(const char *key, size_t length)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < length; i++)
+    {
+        hash = (hash ^ (unsigned char)key[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* lockSet
+
+DESCRIPTION
+Lock a set, taking over the lock if its previous owner died holding it.
+Entries are only ever left with stale bookkeeping, never half-linked, so
+the set is usable as it is.
+*/
+
+static void lockSet(cacheSet_t *set)
+{
+    if (pthread_mutex_lock(&set->lock) == EOWNERDEAD)
+    {
+        DIAG_WARN("cache lock recovered from a dead worker");
+        pthread_mutex_consistent(&set->lock);
+    }
+}
+
+static char *blockOf(cacheClass_t *class, cacheSet_t *set, cacheEntry_t *entry)
+{
+    size_t index = (size_t)(set - class->sets) * SHMCACHE_WAYS + (entry - set->ways);
+
+    return class->blocks + index * class->blockSize;
+}
+
+/* shmcache_lookup
+
+DESCRIPTION
+Find a fresh response for key and pin it.
+
+RETURN VALUE
+1 on a hit, with handle->data and handle->length describing the response;
+it stays valid until shmcache_release. 0 on a miss.
+*/
+
+int shmcache_lookup(const char *key, shmcacheHandle_t *handle)
+{
+    size_t keyLength = strlen(key);
+    uint64_t hash = hashKey(key, keyLength);
+    uint64_t now = stats_now();
+    cacheEntry_t *entry;
+    cacheSet_t *set;
+    char *block;
+    int c, w;
+
+    for (c = 0; c < SHMCACHE_CLASSES; c++)
+    {
+        set = &classes[c].sets[hash % classes[c].setCount];
+        lockSet(set);
+        for (w = 0; w < SHMCACHE_WAYS; w++)
+        {
+            entry = &set->ways[w];
+            if (entry->state != ENTRY_READY || entry->hash != hash
+                    || entry->keyLength != keyLength || entry->expires <= now)
+            {
+                continue;
+            }
+            block = blockOf(&classes[c], set, entry);
+            if (memcmp(block, key, keyLength) != 0)
+            {
+                continue;
+            }
+            entry->pins++;
+            entry->lastUsed = now;
+            pthread_mutex_unlock(&set->lock);
+
+            handle->set = set;
+            handle->entry = entry;
+            handle->data = block + keyLength;
+            handle->length = entry->length;
+            return 1;
+        }
+        pthread_mutex_unlock(&set->lock);
+    }
+    return 0;
+}
+
+void shmcache_release(shmcacheHandle_t *handle)
+{
+    cacheSet_t *set = handle->set;
+
+    lockSet(set);
+    ((cacheEntry_t*)handle->entry)->pins--;
+    pthread_mutex_unlock(&set->lock);
+}
+
+/* victimRank
+
+DESCRIPTION
+How willing we are to replace entry with a new object: higher is better,
+0 means it must be kept. Empty, then expired, then abandoned fills, then
+the least recently used fresh entry.
+*/
+
+static uint64_t victimRank(cacheEntry_t *entry, uint64_t now)
+{
+    if (entry->state == ENTRY_EMPTY)
+    {
+        return UINT64_MAX;
+    }
+    if (entry->pins > 0)
+    {
+        return 0;
+    }
+    if (entry->state == ENTRY_FILLING)
+    {
+        return (now - entry->lastUsed > SHMCACHE_STALE_FILL) ? UINT64_MAX - 2 : 0;
+    }
+    if (entry->expires <= now)
+    {
+        return UINT64_MAX - 1;
+    }
+    return UINT64_MAX - 3 - entry->lastUsed;
+}
+
+/* shmcache_reserve
+
+DESCRIPTION
+Claim an entry for a response of length bytes under key, to be filled with
+shmcache_append and published with shmcache_commit.
+
+RETURN VALUE
+0 on success, -1 if the response is too large, is already cached, or every
+candidate entry is in use.
+*/
+
+int shmcache_reserve(const char *key, size_t length, shmcacheHandle_t *handle)
+{
+    size_t keyLength = strlen(key);
+    uint64_t hash = hashKey(key, keyLength);
+    uint64_t now = stats_now();
+    uint64_t rank, bestRank = 0;
+    cacheEntry_t *entry, *victim = NULL;
+    cacheClass_t *class;
+    cacheSet_t *set;
+    int c, w;
+
+    for (c = 0; c < SHMCACHE_CLASSES && classes[c].blockSize < keyLength + length; c++)
+    {
+    }
+    if (c == SHMCACHE_CLASSES)
+    {
+        return -1;
+    }
+    class = &classes[c];
+    set = &class->sets[hash % class->setCount];
+
+    lockSet(set);
+    for (w = 0; w < SHMCACHE_WAYS; w++)
+    {
+        entry = &set->ways[w];
+        if (entry->hash == hash
+                && ((entry->state == ENTRY_READY && entry->expires > now)
+                    || (entry->state == ENTRY_FILLING && now - entry->lastUsed <= SHMCACHE_STALE_FILL)))
+        {
+            /* cached or being cached by someone else */
+            pthread_mutex_unlock(&set->lock);
+            return -1;
+        }
+        if ((rank = victimRank(entry, now)) > bestRank)
+        {
+            bestRank = rank;
+            victim = entry;
+        }
+    }
+    if (victim == NULL)
+    {
+        pthread_mutex_unlock(&set->lock);
+        return -1;
+    }
+    victim->state = ENTRY_FILLING;
+    victim->hash = hash;
+    victim->keyLength = keyLength;
+    victim->length = length;
+    victim->expires = UINT64_MAX;
+    victim->lastUsed = now;
+    handle->generation = __atomic_add_fetch(&victim->generation, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&set->lock);
+
+    handle->set = set;
+    handle->entry = victim;
+    handle->data = blockOf(class, set, victim);
+    memcpy(handle->data, key, keyLength);
+    handle->data += keyLength;
+    handle->length = length;
+    handle->filled = 0;
+    return 0;
+}
+
+/* shmcache_append
+
+DESCRIPTION
+Copy the next count bytes of a reserved response, keeping the fill from
+looking abandoned. Bytes beyond the reserved length are dropped and make
+shmcache_commit discard the object; so is everything once another worker
+has taken the entry over.
+*/
+
+void shmcache_append(shmcacheHandle_t *handle, const void *buf, size_t count)
+{
+    cacheEntry_t *entry = handle->entry;
+
+    if (handle->filled + count > handle->length
+            || __atomic_load_n(&entry->generation, __ATOMIC_ACQUIRE) != handle->generation)
+    {
+        handle->filled = handle->length + 1;
+        return;
+    }
+    __atomic_store_n(&entry->lastUsed, stats_now(), __ATOMIC_RELAXED);
+    memcpy(handle->data + handle->filled, buf, count);
+    handle->filled += count;
+}
+
+/* shmcache_commit
+
+DESCRIPTION
+Publish a reserved response for ttl microseconds if exactly its reserved
+length was appended, and free the entry otherwise. A ttl of 0 abandons it.
+An entry that another worker has since reserved is left to that worker.
+
+RETURN VALUE
+0 if the response was published, -1 if it was discarded.
+*/
+
+int shmcache_commit(shmcacheHandle_t *handle, uint64_t ttl)
+{
+    cacheSet_t *set = handle->set;
+    cacheEntry_t *entry = handle->entry;
+    int published = (ttl != 0 && handle->filled == handle->length);
+
+    lockSet(set);
+    if (entry->generation != handle->generation)
+    {
+        published = 0;
+    }
+    else if (published)
+    {
+        entry->expires = stats_now() + ttl;
+        entry->state = ENTRY_READY;
+    }
+    else
+    {
+        entry->state = ENTRY_EMPTY;
+    }
+    pthread_mutex_unlock(&set->lock);
+    return published ? 0 : -1;
+}
+
+/* shmcache_report
+
+DESCRIPTION
+Render the number and size of fresh objects per size class as plain text into buf.
+
+RETURN VALUE
+Length of the rendered text.
+*/
+
+int shmcache_report(char *buf, size_t size)
+{
+    uint64_t now = stats_now();
+    size_t length = 0;
+    uint64_t objects, bytes;
+    uint32_t i;
+    int c, w, n;
+
+    for (c = 0; c < SHMCACHE_CLASSES && enabled && length < size; c++)
+    {
+        objects = bytes = 0;
+        for (i = 0; i < classes[c].setCount; i++)
+        {
+            cacheSet_t *set = &classes[c].sets[i];
+
+            lockSet(set);
+            for (w = 0; w < SHMCACHE_WAYS; w++)
+            {
+                if (set->ways[w].state == ENTRY_READY && set->ways[w].expires > now)
+                {
+                    objects++;
+                    bytes += set->ways[w].length;
+                }
+            }
+            pthread_mutex_unlock(&set->lock);
+        }
+        n = snprintf(buf + length, size - length, "cache class=%zuK slots=%u objects=%llu bytes=%llu\n",
+                classes[c].blockSize >> 10, classes[c].setCount * SHMCACHE_WAYS,
+                (unsigned long long)objects, (unsigned long long)bytes);
+        length += (n > 0) ? (size_t)n : 0;
+    }
+    return (length < size) ? (int)length : (int)size - 1;
+}
@@ -0,0 +1,50 @@
+/*
+ * shmcache.h - Response cache in shared memory
+ *
+ * The cache is one anonymous shared mapping created before the workers
+ * are forked, so every worker process sees the same objects. Objects are
+ * whole responses (header and body) keyed by absolute URI. Storage is
+ * split into SHMCACHE_CLASSES size classes of fixed-size blocks, each
+ * class a set-associative table of SHMCACHE_WAYS entries per set; an
+ * entry owns one block, so inserting never has to find free space
+ * elsewhere. Each set has a process-shared robust mutex, so a worker
+ * dying with a lock held does not wedge the others.
+ *
+ * Readers pin an entry and send straight from the mapping without holding
+ * the lock; pinned and half-filled entries are never evicted.
+ */
+
+#ifndef __SHMCACHE_H__
+#define __SHMCACHE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHMCACHE_CLASSES        5
+#define SHMCACHE_MIN_BLOCK      (4*1024)            /* blocks grow 4x per class: 4K..1M */
+#define SHMCACHE_MAX_OBJECT     ((size_t)SHMCACHE_MIN_BLOCK << (2 * (SHMCACHE_CLASSES - 1)))
+#define SHMCACHE_WAYS           8
+#define SHMCACHE_DEFAULT_TTL    (60ULL*1000*1000)   /* microseconds, without max-age */
+#define SHMCACHE_STALE_FILL     (60ULL*1000*1000)   /* a fill idle this long was abandoned */
+
+typedef struct shmcacheHandle
+{
+    void *set;
+    void *entry;
+    char *data;                 /* response bytes */
+    size_t length;              /* response length */
+    size_t filled;              /* bytes appended so far, while filling */
+    uint64_t generation;        /* of the entry when reserved */
+}
+shmcacheHandle_t;
+
+int shmcache_init(size_t budget);
+int shmcache_enabled(void);
+int shmcache_lookup(const char *key, shmcacheHandle_t *handle);
+void shmcache_release(shmcacheHandle_t *handle);
+int shmcache_reserve(const char *key, size_t length, shmcacheHandle_t *handle);
+void shmcache_append(shmcacheHandle_t *handle, const void *buf, size_t count);
+int shmcache_commit(shmcacheHandle_t *handle, uint64_t ttl);
+int shmcache_report(char *buf, size_t size);
+
+#endif /* __SHMCACHE_H__ */
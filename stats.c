@@ -0,0 +1,323 @@
+/*
+ * stats.c - Request timing histograms and counters for the proxy
+ *
+ * Each thread is bound to a shard on first use. All updates are relaxed
+ * atomic operations on that shard, so threads sharing a shard never block
+ * each other and the common case touches only thread-private cache lines.
+ * stats_merge and stats_report fold the shards together on demand.
+ */
+
+#include "csapp.h"
+#include "stats.h"
+
+typedef struct statsShard
+{
+    statsHistogram_t phases[STATS_PHASE_COUNT];
+    uint64_t counters[STATS_COUNTER_COUNT];
+    uint64_t opened;
+    uint64_t closed;
+}
+__attribute__((aligned(64))) statsShard_t;
+
+static const char *phaseNames[STATS_PHASE_COUNT] =
+{
+    "header", "dns", "connect", "ttfb", "transfer", "total"
+};
+
+static const char *counterNames[STATS_COUNTER_COUNT] =
+{
+    "connections_total", "requests_total", "requests_failed", "bytes_out",
+    "tunnels_total", "tunnel_bytes_up", "requests_fast_failed",
+    "hedges_total", "hedges_won",
+    "origin_queue_timeouts", "connections_shed",
+    "connections_rate_limited",
+    "cache_hits",
+    "cache_misses",
+    "cache_stores",
+    "accept_wakeups",
+    "accept_wakeups_empty",
+    "responses_compressed",
+    "compress_bytes_in",
+    "compress_bytes_out",
+    "range_hits",
+    "range_misses",
+    "store_fetches",
+    "store_added",
+    "prefetch_queued",
+    "prefetch_dropped",
+    "prefetch_stored",
+    "budget_pauses"
+};
+
+static statsShard_t shards[STATS_SHARDS];
+static unsigned int nextShard;
+static uint64_t startTime;
+static __thread statsShard_t *localShard;
+
+
+/* localShardGet
+
+DESCRIPTION
+Return the shard of the calling thread, binding one round-robin on first use.
+*/
+
+static statsShard_t *localShardGet(void)
+{
+    if (localShard == NULL)
+    {
+        localShard = &shards[__atomic_fetch_add(&nextShard, 1, __ATOMIC_RELAXED) % STATS_SHARDS];
+    }
+    return localShard;
+}
+
+/* bucketIndex / bucketValue
+
+DESCRIPTION
+Map a value to its histogram bucket, and a bucket back to the midpoint of the
+range of values it covers.
+*/
+
+static int bucketIndex(uint64_t value)
+{
+    int exponent;
+
+    if (value < STATS_SUB_COUNT)
+    {
+        return (int)value;
+    }
+    exponent = 63 - __builtin_clzll(value);
+    if (exponent > STATS_MAX_EXPONENT)
+    {
+        return STATS_BUCKETS - 1;
+    }
+    return (exponent - STATS_SUB_BITS + 1) * STATS_SUB_COUNT
+        + (int)((value >> (exponent - STATS_SUB_BITS)) & (STATS_SUB_COUNT - 1));
+}
+
+static uint64_t bucketValue(int index)
+{
+    int exponent;
+    uint64_t lower;
+
+    if (index < STATS_SUB_COUNT)
+    {
+        return index;
+    }
+    exponent = index / STATS_SUB_COUNT + STATS_SUB_BITS - 1;
+    lower = (uint64_t)(STATS_SUB_COUNT + index % STATS_SUB_COUNT) << (exponent - STATS_SUB_BITS);
+    return lower + ((1ULL << (exponent - STATS_SUB_BITS)) >> 1);
+}
+
+/* stats_init
+
+DESCRIPTION
+Remember the start time for the uptime report. Shards are zero-initialized statically.
+*/
+
+void stats_init(void)
+{
+    startTime = stats_now();
+}
+
+/* stats_now
+
+RETURN VALUE
+Monotonic clock in microseconds.
+*/
+
+uint64_t stats_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/* stats_recordPhase
+
+DESCRIPTION
+Add one latency sample (microseconds) to the histogram of phase.
+*/
+
+void stats_recordPhase(statsPhase_t phase, uint64_t micros)
+{
+    statsHistogram_t *histogram = &localShardGet()->phases[phase];
+    uint64_t max;
+
+    __atomic_fetch_add(&histogram->buckets[bucketIndex(micros)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->sum, micros, __ATOMIC_RELAXED);
+
+    max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    while (micros > max
+            && !__atomic_compare_exchange_n(&histogram->max, &max, micros, 1,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        /* max reloaded by the failed exchange */
+    }
+}
+
+void stats_add(statsCounter_t counter, uint64_t value)
+{
+    __atomic_fetch_add(&localShardGet()->counters[counter], value, __ATOMIC_RELAXED);
+}
+
+/* stats_connectionOpened / stats_connectionClosed
+
+DESCRIPTION
+Track active client connections as the difference of two per-shard counters,
+so no single cache line is shared by every connection.
+*/
+
+void stats_connectionOpened(void)
+{
+    statsShard_t *shard = localShardGet();
+
+    __atomic_fetch_add(&shard->opened, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&shard->counters[STATS_CONNECTIONS], 1, __ATOMIC_RELAXED);
+}
+
+void stats_connectionClosed(void)
+{
+    __atomic_fetch_add(&localShardGet()->closed, 1, __ATOMIC_RELAXED);
+}
+
+/* stats_merge
+
+DESCRIPTION
+Sum the histograms of phase over all shards into out.
+The result is a consistent-enough snapshot; concurrent updates may or may not be included.
+*/
+
+void stats_merge(statsPhase_t phase, statsHistogram_t *out)
+{
+    int i, j;
+    uint64_t max;
+
+    memset(out, 0, sizeof(*out));
+    for (i = 0; i < STATS_SHARDS; i++)
+    {
+        statsHistogram_t *histogram = &shards[i].phases[phase];
+
+        out->count += __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+        out->sum += __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED);
+        max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+        if (max > out->max)
+        {
+            out->max = max;
+        }
+        for (j = 0; j < STATS_BUCKETS; j++)
+        {
+            out->buckets[j] += __atomic_load_n(&histogram->buckets[j], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* stats_percentile
+
+DESCRIPTION
+Estimate a percentile (0-100) of a merged histogram.
+
+RETURN VALUE
+The bucket midpoint holding the requested rank, never more than the recorded max.
+0 is returned for an empty histogram.
+*/
+
+uint64_t stats_percentile(const statsHistogram_t *histogram, double percentile)
+{
+    uint64_t rank, seen;
+    uint64_t value;
+    int i;
+
+    if (histogram->count == 0)
+    {
+        return 0;
+    }
+    rank = (uint64_t)(percentile / 100.0 * histogram->count + 0.5);
+    if (rank < 1)
+    {
+        rank = 1;
+    }
+
+    seen = 0;
+    for (i = 0; i < STATS_BUCKETS; i++)
+    {
+        seen += histogram->buckets[i];
+        if (seen >= rank)
+        {
+            break;
+        }
+    }
+    value = bucketValue(i < STATS_BUCKETS ? i : STATS_BUCKETS - 1);
+    return value < histogram->max ? value : histogram->max;
+}
+
+/* stats_report
+
+DESCRIPTION
+Render all counters and phase percentiles as plain text into buf.
+
+RETURN VALUE
+Length of the rendered text, truncated to fit in size.
+*/
+
+int stats_report(char *buf, size_t size)
+{
+    statsHistogram_t *histogram;
+    uint64_t counters[STATS_COUNTER_COUNT] = {0};
+    uint64_t opened = 0, closed = 0;
+    size_t length = 0;
+    int i, j;
+
+    if ((histogram = malloc(sizeof(*histogram))) == NULL)
+    {
+        return snprintf(buf, size, "out of memory\n");
+    }
+
+    for (i = 0; i < STATS_SHARDS; i++)
+    {
+        for (j = 0; j < STATS_COUNTER_COUNT; j++)
+        {
+            counters[j] += __atomic_load_n(&shards[i].counters[j], __ATOMIC_RELAXED);
+        }
+        opened += __atomic_load_n(&shards[i].opened, __ATOMIC_RELAXED);
+        closed += __atomic_load_n(&shards[i].closed, __ATOMIC_RELAXED);
+    }
+
+#define APPEND(...) \
+    do { \
+        if (length < size) \
+        { \
+            int n = snprintf(buf + length, size - length, __VA_ARGS__); \
+            length += (n > 0) ? (size_t)n : 0; \
+        } \
+    } while (0)
+
+    APPEND("uptime_seconds %llu\n", (unsigned long long)((stats_now() - startTime) / 1000000));
+    APPEND("connections_active %lld\n", (long long)(opened - closed));
+    for (j = 0; j < STATS_COUNTER_COUNT; j++)
+    {
+        APPEND("%s %llu\n", counterNames[j], (unsigned long long)counters[j]);
+    }
+
+    APPEND("\n%-10s %10s %10s %10s %10s %10s %10s %10s\n",
+            "phase_us", "count", "mean", "p50", "p90", "p99", "p999", "max");
+    for (i = 0; i < STATS_PHASE_COUNT; i++)
+    {
+        stats_merge(i, histogram);
+        APPEND("%-10s %10llu %10llu %10llu %10llu %10llu %10llu %10llu\n",
+                phaseNames[i],
+                (unsigned long long)histogram->count,
+                (unsigned long long)(histogram->count ? histogram->sum / histogram->count : 0),
+                (unsigned long long)stats_percentile(histogram, 50.0),
+                (unsigned long long)stats_percentile(histogram, 90.0),
+                (unsigned long long)stats_percentile(histogram, 99.0),
+                (unsigned long long)stats_percentile(histogram, 99.9),
+                (unsigned long long)histogram->max);
+    }
+
+#undef APPEND
+
+    free(histogram);
+    return (length < size) ? (int)length : (int)size - 1;
+}
@@ -0,0 +1,97 @@
+/*
+ * stats.h - Request timing histograms and counters for the proxy
+ *
+ * Every handler thread records phase latencies into one of STATS_SHARDS
+ * shards with relaxed atomic adds, so the request path never takes a lock.
+ * Shards are merged only when a report is rendered.
+ */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* requests for http://STATS_HOST/ are answered by the proxy itself */
+#define STATS_HOST          ("proxy.stats")
+
+/* number of independent shards, threads are spread over them */
+#define STATS_SHARDS        16
+
+/*
+ * Log-bucketed histogram layout (HDR style).
+ * Values below 2^STATS_SUB_BITS are exact, above that every power of two
+ * is split into 2^STATS_SUB_BITS linear sub-buckets (~6% relative error).
+ * Values are microseconds, clamped to 2^(STATS_MAX_EXPONENT+1)-1.
+ */
+#define STATS_SUB_BITS      4
+#define STATS_SUB_COUNT     (1 << STATS_SUB_BITS)
+#define STATS_MAX_EXPONENT  36
+#define STATS_BUCKETS       ((STATS_MAX_EXPONENT - STATS_SUB_BITS + 2) * STATS_SUB_COUNT)
+
+typedef enum statsPhase
+{
+    STATS_PHASE_HEADER,         /* accept to end of request header */
+    STATS_PHASE_DNS,            /* getaddrinfo */
+    STATS_PHASE_CONNECT,        /* connect(2) to end server */
+    STATS_PHASE_TTFB,           /* connected to first response byte */
+    STATS_PHASE_TRANSFER,       /* first to last response byte */
+    STATS_PHASE_TOTAL,          /* whole request */
+    STATS_PHASE_COUNT
+}
+statsPhase_t;
+
+typedef enum statsCounter
+{
+    STATS_CONNECTIONS,          /* accepted client connections */
+    STATS_REQUESTS,             /* requests completed successfully */
+    STATS_FAILURES,             /* requests aborted on error */
+    STATS_BYTES_OUT,            /* response bytes sent to clients */
+    STATS_TUNNELS,              /* CONNECT tunnels completed */
+    STATS_TUNNEL_BYTES_UP,      /* tunneled bytes from clients to servers */
+    STATS_FAST_FAILS,           /* requests refused without contacting the upstream */
+    STATS_HEDGES,               /* second attempts sent for slow requests */
+    STATS_HEDGES_WON,           /* second attempts that answered first */
+    STATS_QUEUE_TIMEOUTS,       /* requests refused after waiting for an origin slot */
+    STATS_SHED,                 /* connections refused by admission control */
+    STATS_RATE_LIMITED,         /* connections refused for exceeding the client's rate */
+    STATS_CACHE_HITS,           /* responses served from the shared cache */
+    STATS_CACHE_MISSES,         /* cacheable requests forwarded upstream */
+    STATS_CACHE_STORES,         /* responses added to the shared cache */
+    STATS_ACCEPT_WAKEUPS,       /* listening sockets found readable */
+    STATS_ACCEPT_EMPTY,         /* ... with no connection left to accept */
+    STATS_COMPRESSED,           /* responses compressed for the client */
+    STATS_COMPRESS_BYTES_IN,    /* ... body bytes before compression */
+    STATS_COMPRESS_BYTES_OUT,   /* ... and after, including chunk framing */
+    STATS_RANGE_HITS,           /* range requests answered from the object store */
+    STATS_RANGE_MISSES,         /* range requests forwarded for want of a stored object */
+    STATS_STORE_FETCHES,        /* whole objects fetched in the background */
+    STATS_STORE_ADDED,          /* ... and added to the store */
+    STATS_PREFETCH_QUEUED,      /* page subresources queued for prefetching */
+    STATS_PREFETCH_DROPPED,     /* ... dropped because the queue was full */
+    STATS_PREFETCH_STORED,      /* ... fetched and added to the shared cache */
+    STATS_BUDGET_PAUSES,        /* reads held back while the memory budget was exhausted */
+    STATS_COUNTER_COUNT
+}
+statsCounter_t;
+
+typedef struct statsHistogram
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[STATS_BUCKETS];
+}
+statsHistogram_t;
+
+void stats_init(void);
+uint64_t stats_now(void);
+void stats_recordPhase(statsPhase_t phase, uint64_t micros);
+void stats_add(statsCounter_t counter, uint64_t value);
+void stats_connectionOpened(void);
+void stats_connectionClosed(void);
+void stats_merge(statsPhase_t phase, statsHistogram_t *out);
+uint64_t stats_percentile(const statsHistogram_t *histogram, double percentile);
+int stats_report(char *buf, size_t size);
+
+#endif /* __STATS_H__ */
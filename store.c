@@ -0,0 +1,405 @@
+/*
+ * store.c - On-disk store of whole large objects
+ *
+ * Expiry is kept in wall-clock seconds rather than stats_now() time, since
+ * objects outlive the process that stored them.
+ */
+
+#include "csapp.h"
+#include "diag.h"
+#include "stats.h"
+#include "store.h"
+#include <dirent.h>
+#include <time.h>
+
+#define STORE_MAGIC     "PXSTORE1"
+
+typedef struct storeRecord
+{
+    char magic[8];
+    uint64_t expires;           /* time(2) seconds */
+    uint64_t length;            /* of the body */
+    char key[STORE_KEY_MAX];
+    char contentType[STORE_FIELD_MAX];
+    char etag[STORE_FIELD_MAX];
+    char lastModified[STORE_FIELD_MAX];
+}
+storeRecord_t;
+
+typedef char recordFits_t[(sizeof(storeRecord_t) <= STORE_BODY_OFFSET) ? 1 : -1];
+
+typedef struct storeReject
+{
+    uint64_t hash;
+    uint64_t until;             /* stats_now() time */
+}
+storeReject_t;
+
+typedef struct storeEntry
+{
+    time_t used;
+    off_t size;
+    char name[20];
+}
+storeEntry_t;
+
+static char storeDir[STORE_PATH_MAX - 32];
+static uint64_t storeLimit;
+static int enabled;
+static int fetching;            /* writers open in this process */
+static pthread_mutex_t trimLock = PTHREAD_MUTEX_INITIALIZER;
+static storeReject_t rejects[STORE_REJECT_SLOTS];
+static pthread_mutex_t rejectLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void trim(void);
+
+/* store_init
+
+DESCRIPTION
+Use dir, created if missing, for objects up to limit bytes in all.
+
+RETURN VALUE
+0 on success, -1 if the directory cannot be used, with errno set.
+*/
+
+int store_init(const char *dir, uint64_t limit)
+{
+    if (strlen(dir) >= sizeof(storeDir))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if ((mkdir(dir, 0700) == -1 && errno != EEXIST) || access(dir, R_OK | W_OK | X_OK) == -1)
+    {
+        return -1;
+    }
+    strcpy(storeDir, dir);
+    storeLimit = (limit != 0) ? limit : STORE_DEFAULT_LIMIT;
+    enabled = 1;
+    trim();
+    return 0;
+}
+
+int store_enabled(void)
+{
+    return enabled;
+}
+
+static uint64_t hashKey(const char *key)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (; *key != '\0'; key++)
+    {
+        hash = (hash ^ (unsigned char)*key) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void objectPath(const char *key, char *path)
+{
+    snprintf(path, STORE_PATH_MAX, "%s/%016llx", storeDir, (unsigned long long)hashKey(key));
+}
+
+/* store_reject
+
+DESCRIPTION
+Remember that the response for key cannot be stored, so that store_begin
+refuses it for STORE_REJECT_TTL. A newer rejection may displace an older
+one that shares its slot.
+*/
+
+void store_reject(const char *key)
+{
+    uint64_t hash = hashKey(key);
+    storeReject_t *slot = &rejects[hash & (STORE_REJECT_SLOTS - 1)];
+
+    pthread_mutex_lock(&rejectLock);
+    slot->hash = hash;
+    slot->until = stats_now() + STORE_REJECT_TTL;
+    pthread_mutex_unlock(&rejectLock);
+}
+
+static int rejected(const char *key)
+{
+    uint64_t hash = hashKey(key);
+    storeReject_t *slot = &rejects[hash & (STORE_REJECT_SLOTS - 1)];
+    int result;
+
+    pthread_mutex_lock(&rejectLock);
+    result = slot->hash == hash && slot->until > stats_now();
+    pthread_mutex_unlock(&rejectLock);
+    return result;
+}
+
+/* store_open
+
+DESCRIPTION
+Find the complete, unexpired object stored under key and open it; the hit
+makes it the most recently used.
+
+RETURN VALUE
+1 if found, with object filled in; release it with store_close. 0 if not.
+*/
+
+int store_open(const char *key, storeObject_t *object)
+{
+    char path[STORE_PATH_MAX];
+    storeRecord_t record;
+    struct stat status;
+
+    objectPath(key, path);
+    if ((object->fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+    {
+        return 0;
+    }
+    if (pread(object->fd, &record, sizeof(record), 0) != sizeof(record)
+            || memcmp(record.magic, STORE_MAGIC, sizeof(record.magic)) != 0
+            || strncmp(record.key, key, sizeof(record.key)) != 0
+            || record.expires <= (uint64_t)time(NULL)
+            || fstat(object->fd, &status) == -1
+            || (uint64_t)status.st_size != STORE_BODY_OFFSET + record.length)
+    {
+        close(object->fd);
+        object->fd = -1;
+        return 0;
+    }
+    futimens(object->fd, NULL);
+
+    object->offset = STORE_BODY_OFFSET;
+    object->length = record.length;
+    memcpy(object->contentType, record.contentType, sizeof(object->contentType));
+    memcpy(object->etag, record.etag, sizeof(object->etag));
+    memcpy(object->lastModified, record.lastModified, sizeof(object->lastModified));
+    object->contentType[sizeof(object->contentType) - 1] = '\0';
+    object->etag[sizeof(object->etag) - 1] = '\0';
+    object->lastModified[sizeof(object->lastModified) - 1] = '\0';
+    return 1;
+}
+
+void store_close(storeObject_t *object)
+{
+    if (object->fd != -1)
+    {
+        close(object->fd);
+        object->fd = -1;
+    }
+}
+
+/* store_begin
+
+DESCRIPTION
+Start writing the object for key. The body is then appended with
+store_write, and the writer ended with store_commit or store_abort.
+
+RETURN VALUE
+0 on success. -1 if the object is already being fetched (by any worker),
+this process has STORE_FETCH_MAX fetches running, the key is too long or
+the file cannot be created.
+*/
+
+int store_begin(const char *key, storeWriter_t *writer)
+{
+    char partPath[STORE_PATH_MAX + 8];
+    struct stat status;
+    int attempt;
+
+    if (strlen(key) >= sizeof(writer->key) || rejected(key))
+    {
+        return -1;
+    }
+    if (__atomic_add_fetch(&fetching, 1, __ATOMIC_RELAXED) > STORE_FETCH_MAX)
+    {
+        __atomic_sub_fetch(&fetching, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    strcpy(writer->key, key);
+    objectPath(key, writer->path);
+    snprintf(partPath, sizeof(partPath), "%s.part", writer->path);
+
+    /* a fetch that has not written for a while died with its process */
+    for (attempt = 0; attempt < 2; attempt++)
+    {
+        writer->fd = open(partPath, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (writer->fd != -1 || errno != EEXIST || stat(partPath, &status) == -1
+                || time(NULL) - status.st_mtime < STORE_STALE_FETCH)
+        {
+            break;
+        }
+        unlink(partPath);
+    }
+    if (writer->fd == -1 || lseek(writer->fd, STORE_BODY_OFFSET, SEEK_SET) == -1)
+    {
+        if (writer->fd != -1)
+        {
+            close(writer->fd);
+            unlink(partPath);
+        }
+        else if (errno != EEXIST)
+        {
+            DIAG_ERRNO(DIAG_LEVEL_WARN, partPath);
+        }
+        __atomic_sub_fetch(&fetching, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    writer->written = 0;
+    return 0;
+}
+
+/* store_write
+
+DESCRIPTION
+Append the first length bytes of chain to the object, consuming them.
+
+RETURN VALUE
+0 on success, -1 if the file could not be written.
+*/
+
+int store_write(storeWriter_t *writer, iobuf_t *chain, size_t length)
+{
+    length = (length < iobuf_length(chain)) ? length : iobuf_length(chain);
+    if (iobuf_write(chain, writer->fd, length) == -1)
+    {
+        DIAG_ERRNO(DIAG_LEVEL_WARN, writer->path);
+        return -1;
+    }
+    writer->written += length;
+    return 0;
+}
+
+/* store_commit
+
+DESCRIPTION
+Finish the object with the length and fields in object, keep it for ttl
+microseconds, and make it visible to store_open. Evicts the least
+recently used objects if the store is now over its limit.
+
+RETURN VALUE
+0 on success, -1 if the body is short or the object could not be saved;
+the writer is ended either way.
+*/
+
+int store_commit(storeWriter_t *writer, const storeObject_t *object, uint64_t ttl)
+{
+    char partPath[STORE_PATH_MAX + 8];
+    storeRecord_t record;
+    int result = -1;
+
+    snprintf(partPath, sizeof(partPath), "%s.part", writer->path);
+    memset(&record, 0, sizeof(record));
+    memcpy(record.magic, STORE_MAGIC, sizeof(record.magic));
+    record.expires = (uint64_t)time(NULL) + ttl / 1000000;
+    record.length = object->length;
+    strcpy(record.key, writer->key);
+    snprintf(record.contentType, sizeof(record.contentType), "%s", object->contentType);
+    snprintf(record.etag, sizeof(record.etag), "%s", object->etag);
+    snprintf(record.lastModified, sizeof(record.lastModified), "%s", object->lastModified);
+
+    if (writer->written == object->length
+            && pwrite(writer->fd, &record, sizeof(record), 0) == sizeof(record))
+    {
+        result = 0;
+    }
+    if (close(writer->fd) == -1 || (result == 0 && rename(partPath, writer->path) == -1))
+    {
+        DIAG_ERRNO(DIAG_LEVEL_WARN, writer->path);
+        result = -1;
+    }
+    if (result == -1)
+    {
+        unlink(partPath);
+    }
+    __atomic_sub_fetch(&fetching, 1, __ATOMIC_RELAXED);
+
+    if (result == 0)
+    {
+        stats_add(STATS_STORE_ADDED, 1);
+        trim();
+    }
+    return result;
+}
+
+void store_abort(storeWriter_t *writer)
+{
+    char partPath[STORE_PATH_MAX + 8];
+
+    snprintf(partPath, sizeof(partPath), "%s.part", writer->path);
+    close(writer->fd);
+    unlink(partPath);
+    __atomic_sub_fetch(&fetching, 1, __ATOMIC_RELAXED);
+}
+
+static int compareUsed(const void *a, const void *b)
+{
+    time_t usedA = ((const storeEntry_t*)a)->used;
+    time_t usedB = ((const storeEntry_t*)b)->used;
+
+    return (usedA > usedB) - (usedA < usedB);
+}
+
+/* trim
+
+DESCRIPTION
+Remove the least recently used objects until the store is within its
+limit. Runs after each new object, so a scan of the directory is cheap
+next to the fetch that preceded it. Workers trimming at the same time
+may remove an object twice; the second unlink(2) just fails.
+*/
+
+static void trim(void)
+{
+    storeEntry_t *entries = NULL, *grown;
+    char path[STORE_PATH_MAX];
+    struct dirent *dirent;
+    struct stat status;
+    size_t count = 0, capacity = 0, i;
+    uint64_t total = 0;
+    DIR *dir;
+
+    pthread_mutex_lock(&trimLock);
+    if ((dir = opendir(storeDir)) == NULL)
+    {
+        pthread_mutex_unlock(&trimLock);
+        return;
+    }
+    while ((dirent = readdir(dir)) != NULL)
+    {
+        if (strlen(dirent->d_name) != 16 || strspn(dirent->d_name, "0123456789abcdef") != 16
+                || fstatat(dirfd(dir), dirent->d_name, &status, 0) == -1)
+        {
+            continue;
+        }
+        if (count == capacity)
+        {
+            capacity = capacity ? 2 * capacity : 64;
+            if ((grown = realloc(entries, capacity * sizeof(storeEntry_t))) == NULL)
+            {
+                break;
+            }
+            entries = grown;
+        }
+        entries[count].used = status.st_mtime;
+        entries[count].size = status.st_size;
+        strcpy(entries[count].name, dirent->d_name);
+        total += status.st_size;
+        count++;
+    }
+    closedir(dir);
+
+    if (total > storeLimit)
+    {
+        qsort(entries, count, sizeof(storeEntry_t), compareUsed);
+        for (i = 0; i < count && total > storeLimit; i++)
+        {
+            snprintf(path, sizeof(path), "%s/%s", storeDir, entries[i].name);
+            if (unlink(path) == 0)
+            {
+                DIAG_INFO("evicted %s from the object store", entries[i].name);
+            }
+            total -= entries[i].size;
+        }
+    }
+    free(entries);
+    pthread_mutex_unlock(&trimLock);
+}
@@ -0,0 +1,74 @@
+/*
+ * store.h - On-disk store of whole large objects
+ *
+ * Range requests for large objects are answered from complete copies kept
+ * in a directory, one file per object named by a hash of its absolute URI.
+ * A file starts with a fixed record (the URI, expiry, length and the
+ * fields a 206 needs), and the body follows at STORE_BODY_OFFSET so it can
+ * be sent with sendfile(2) straight from the page cache.
+ *
+ * The directory is the only shared state, so prefork workers see each
+ * other's objects without any locking: an object is written to a ".part"
+ * file created with O_EXCL, which also keeps a second fetch of the same
+ * object from starting anywhere, and is renamed into place when complete.
+ * Readers keep the file open, so replacing or evicting an object never
+ * disturbs a response being sent from it. Hits touch the file's mtime, and
+ * the oldest objects are removed when the directory grows past its limit.
+ *
+ * A URI whose response turned out not to be storable is remembered by each
+ * process for STORE_REJECT_TTL, so range requests for it do not start a
+ * full fetch every time.
+ */
+
+#ifndef __STORE_H__
+#define __STORE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "iobuf.h"
+
+#define STORE_MIN_SIZE          (1024*1024)         /* bytes; smaller bodies are not stored */
+#define STORE_DEFAULT_LIMIT     (1024ULL*1024*1024) /* bytes of objects, without store_mb */
+#define STORE_BODY_OFFSET       4096                /* the record fits before the body */
+#define STORE_KEY_MAX           2048                /* longer URIs are not stored */
+#define STORE_FIELD_MAX         256
+#define STORE_PATH_MAX          512
+#define STORE_FETCH_MAX         8                   /* fetches running at once per process */
+#define STORE_STALE_FETCH       60                  /* seconds; a .part file this idle was abandoned */
+#define STORE_REJECT_SLOTS      1024                /* remembered unstorable URIs, power of two */
+#define STORE_REJECT_TTL        (5*60*1000*1000)    /* microseconds */
+
+/* a stored object, open for reading */
+typedef struct storeObject
+{
+    int fd;
+    off_t offset;               /* of the body in the file */
+    off_t length;               /* of the body */
+    char contentType[STORE_FIELD_MAX];
+    char etag[STORE_FIELD_MAX];
+    char lastModified[STORE_FIELD_MAX];
+}
+storeObject_t;
+
+/* an object being written */
+typedef struct storeWriter
+{
+    int fd;
+    off_t written;
+    char key[STORE_KEY_MAX];
+    char path[STORE_PATH_MAX];
+}
+storeWriter_t;
+
+int store_init(const char *dir, uint64_t limit);
+int store_enabled(void);
+int store_open(const char *key, storeObject_t *object);
+void store_close(storeObject_t *object);
+int store_begin(const char *key, storeWriter_t *writer);
+int store_write(storeWriter_t *writer, iobuf_t *chain, size_t length);
+int store_commit(storeWriter_t *writer, const storeObject_t *object, uint64_t ttl);
+void store_abort(storeWriter_t *writer);
+void store_reject(const char *key);
+
+#endif /* __STORE_H__ */
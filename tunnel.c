@@ -0,0 +1,270 @@
+/*
+ * tunnel.c - Full-duplex byte tunnel for CONNECT requests
+ *
+ * Both directions are driven from one poll(2) loop on non-blocking sockets.
+ * On Linux the bytes move socket -> pipe -> socket with splice(2) and never
+ * enter user space; elsewhere, or when splice refuses the descriptors, each
+ * direction falls back to read(2)/write(2) through a private buffer.
+ * When one side finishes sending, the other side's write half is shut down
+ * once everything pending has been delivered, so half-closed connections
+ * behave as they would end to end.
+ */
+
+#define _GNU_SOURCE
+#include "csapp.h"
+#include "diag.h"
+#include "stats.h"
+#include "budget.h"
+#include "coro.h"
+#include "tunnel.h"
+#include <poll.h>
+
+typedef struct direction
+{
+    int from;
+    int to;
+    int pipeFD[2];              /* splice mode, -1 in copy mode */
+    char *buf;                  /* copy mode */
+    size_t head;                /* copy mode: start of pending data in buf */
+    size_t pending;             /* bytes read but not yet written */
+    int eof;                    /* 'from' has no more data */
+    int closed;                 /* write half of 'to' has been shut down */
+    uint64_t bytes;
+}
+direction_t;
+
+
+/* the copy-mode buffer, charged to the memory budget */
+static int allocateBuffer(direction_t *d)
+{
+    if ((d->buf = malloc(TUNNEL_CHUNK)) == NULL)
+    {
+        return -1;
+    }
+    budget_charge(TUNNEL_CHUNK);
+    return 0;
+}
+
+static int directionInit(direction_t *d, int from, int to)
+{
+    memset(d, 0, sizeof(*d));
+    d->from = from;
+    d->to = to;
+    d->pipeFD[0] = d->pipeFD[1] = -1;
+#ifdef __linux__
+    if (pipe2(d->pipeFD, O_NONBLOCK | O_CLOEXEC) == 0)
+    {
+        return 0;
+    }
+    d->pipeFD[0] = d->pipeFD[1] = -1;
+#endif
+    return allocateBuffer(d);
+}
+
+static void directionFree(direction_t *d)
+{
+    if (d->pipeFD[0] != -1)
+    {
+        close(d->pipeFD[0]);
+        close(d->pipeFD[1]);
+    }
+    if (d->buf != NULL)
+    {
+        free(d->buf);
+        budget_credit(TUNNEL_CHUNK);
+    }
+}
+
+/* canFill
+
+DESCRIPTION
+Whether the direction has room for more input. The copy buffer is only refilled
+once it has been written out completely.
+*/
+
+static int canFill(const direction_t *d)
+{
+    if (d->eof)
+    {
+        return 0;
+    }
+    return (d->pipeFD[0] != -1) ? d->pending < TUNNEL_CHUNK : d->pending == 0;
+}
+
+/* fill / drain
+
+DESCRIPTION
+Move bytes from 'from' into the pipe or buffer, and from there to 'to'.
+
+RETURN VALUE
+0 on progress or when the operation would block, -1 on a hard error.
+*/
+
+static int fill(direction_t *d)
+{
+    ssize_t n;
+
+#ifdef __linux__
+    if (d->pipeFD[0] != -1)
+    {
+        n = splice(d->from, NULL, d->pipeFD[1], NULL, TUNNEL_CHUNK - d->pending,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == -1 && errno == EINVAL && d->pending == 0)
+        {
+            /* descriptors splice cannot handle: continue in copy mode */
+            close(d->pipeFD[0]);
+            close(d->pipeFD[1]);
+            d->pipeFD[0] = d->pipeFD[1] = -1;
+            if (allocateBuffer(d) == -1)
+            {
+                return -1;
+            }
+            return fill(d);
+        }
+    }
+    else
+#endif
+    {
+        d->head = 0;
+        n = read(d->from, d->buf, TUNNEL_CHUNK);
+    }
+
+    if (n == -1)
+    {
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    }
+    if (n == 0)
+    {
+        d->eof = 1;
+    }
+    d->pending += n;
+    return 0;
+}
+
+static int drain(direction_t *d)
+{
+    ssize_t n;
+
+#ifdef __linux__
+    if (d->pipeFD[0] != -1)
+    {
+        n = splice(d->pipeFD[0], NULL, d->to, NULL, d->pending,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    }
+    else
+#endif
+    {
+        n = write(d->to, d->buf + d->head, d->pending);
+    }
+
+    if (n == -1)
+    {
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    }
+    d->head += n;
+    d->pending -= n;
+    d->bytes += n;
+    return 0;
+}
+
+static void setNonblocking(int fd)
+{
+    int flags;
+
+    if ((flags = fcntl(fd, F_GETFL)) != -1)
+    {
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    }
+}
+
+/* tunnel_run
+
+DESCRIPTION
+Relay bytes between clientFD and serverFD in both directions until both
+have finished sending, an error occurs, or the tunnel stays idle for
+TUNNEL_IDLE_TIMEOUT. Both descriptors are left non-blocking.
+
+ARGUMENTS
+tunnelResult_t *result
+    Filled with the bytes moved each way and the tunnel's lifetime, also on failure.
+
+RETURN VALUE
+0 when both directions completed, -1 on error or timeout.
+*/
+
+int tunnel_run(int clientFD, int serverFD, tunnelResult_t *result)
+{
+    direction_t up, down;
+    struct pollfd fds[2];
+    uint64_t start = stats_now();
+    int status = 0;
+    int ready;
+
+    memset(result, 0, sizeof(*result));
+    if (directionInit(&up, clientFD, serverFD) == -1)
+    {
+        return -1;
+    }
+    if (directionInit(&down, serverFD, clientFD) == -1)
+    {
+        directionFree(&up);
+        return -1;
+    }
+    setNonblocking(clientFD);
+    setNonblocking(serverFD);
+
+    while (!(up.closed && down.closed))
+    {
+        fds[0].events = (canFill(&up) ? POLLIN : 0) | (down.pending ? POLLOUT : 0);
+        fds[1].events = (canFill(&down) ? POLLIN : 0) | (up.pending ? POLLOUT : 0);
+
+        /* leave out a side with nothing to wait for, or its POLLHUP/POLLERR would spin the loop */
+        fds[0].fd = fds[0].events ? clientFD : -1;
+        fds[1].fd = fds[1].events ? serverFD : -1;
+
+        if ((ready = coro_poll(fds, 2, TUNNEL_IDLE_TIMEOUT)) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            status = -1;
+            break;
+        }
+        if (ready == 0)
+        {
+            errno = ETIMEDOUT;
+            status = -1;
+            break;
+        }
+
+        if (((fds[0].revents & (POLLIN | POLLHUP | POLLERR)) && canFill(&up) && fill(&up) == -1)
+                || ((fds[1].revents & (POLLIN | POLLHUP | POLLERR)) && canFill(&down) && fill(&down) == -1)
+                || ((fds[1].revents & (POLLOUT | POLLHUP | POLLERR)) && up.pending && drain(&up) == -1)
+                || ((fds[0].revents & (POLLOUT | POLLHUP | POLLERR)) && down.pending && drain(&down) == -1))
+        {
+            status = -1;
+            break;
+        }
+
+        /* propagate half-close once everything sent before it is delivered */
+        if (up.eof && up.pending == 0 && !up.closed)
+        {
+            shutdown(serverFD, SHUT_WR);
+            up.closed = 1;
+        }
+        if (down.eof && down.pending == 0 && !down.closed)
+        {
+            shutdown(clientFD, SHUT_WR);
+            down.closed = 1;
+        }
+    }
+
+    result->upBytes = up.bytes;
+    result->downBytes = down.bytes;
+    result->duration = stats_now() - start;
+    result->zeroCopy = (up.pipeFD[0] != -1 && down.pipeFD[0] != -1);
+    directionFree(&up);
+    directionFree(&down);
+    return status;
+}
@@ -0,0 +1,24 @@
+/*
+ * tunnel.h - Full-duplex byte tunnel for CONNECT requests
+ */
+
+#ifndef __TUNNEL_H__
+#define __TUNNEL_H__
+
+#include <stdint.h>
+
+#define TUNNEL_IDLE_TIMEOUT     (5*60*1000)     /* milliseconds without traffic */
+#define TUNNEL_CHUNK            (64*1024)       /* bytes in flight per direction */
+
+typedef struct tunnelResult
+{
+    uint64_t upBytes;           /* client to server */
+    uint64_t downBytes;         /* server to client */
+    uint64_t duration;          /* microseconds */
+    int zeroCopy;               /* 1 if splice(2) was used */
+}
+tunnelResult_t;
+
+int tunnel_run(int clientFD, int serverFD, tunnelResult_t *result);
+
+#endif /* __TUNNEL_H__ */
@@ -0,0 +1,278 @@
+/*
+ * upgrade.c - Process control signals and zero-downtime binary upgrade
+ *
+ * The new process is a child of the old one until the old one exits. It
+ * is started with the command line the old one was started with, so a
+ * deploy replaces the binary on disk and sends SIGUSR2; if the new binary
+ * fails to start or to report ready, the old one simply keeps serving.
+ */
+
+#define _GNU_SOURCE
+#include "csapp.h"
+#include "diag.h"
+#include "stats.h"
+#include "admission.h"
+#include "upgrade.h"
+#include <poll.h>
+#include <sys/signalfd.h>
+
+extern char **environ;
+
+static char **commandLine;
+static int signalFD = -1;
+static int channelFD = -1;          /* to the old process, until upgrade_ready */
+
+
+/* upgrade_init
+
+DESCRIPTION
+Remember the command line for a later upgrade and block the control
+signals, which are then read with upgrade_nextSignal. Must be called before
+any thread is created, so that every thread inherits the mask.
+
+RETURN VALUE
+0 on success, -1 if the signalfd cannot be created.
+*/
+
+int upgrade_init(char **argv)
+{
+    sigset_t signals;
+    int argc, i;
+
+    /* getopt may permute argv, so keep the original order */
+    for (argc = 0; argv[argc] != NULL; argc++)
+    {
+    }
+    if ((commandLine = calloc(argc + 1, sizeof(char*))) == NULL)
+    {
+        return -1;
+    }
+    for (i = 0; i < argc; i++)
+    {
+        commandLine[i] = argv[i];
+    }
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGQUIT);
+    sigaddset(&signals, SIGUSR2);
+    sigaddset(&signals, SIGCHLD);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    if ((signalFD = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC)) == -1)
+    {
+        DIAG_ERRNO(DIAG_LEVEL_ERROR, "signalfd");
+        return -1;
+    }
+    return 0;
+}
+
+int upgrade_signalFD(void)
+{
+    return signalFD;
+}
+
+/* upgrade_nextSignal
+
+RETURN VALUE
+The next pending control signal, 0 if there is none.
+*/
+
+int upgrade_nextSignal(void)
+{
+    struct signalfd_siginfo info;
+
+    if (read(signalFD, &info, sizeof(info)) != sizeof(info))
+    {
+        return 0;
+    }
+    return info.ssi_signo;
+}
+
+/* upgrade_inherit
+
+DESCRIPTION
+In a process started by upgrade_handoff, receive up to max listening
+sockets from the old process into fds.
+
+RETURN VALUE
+The number of sockets inherited, 0 if this is a fresh start, -1 if the
+handoff failed.
+*/
+
+int upgrade_inherit(int *fds, int max)
+{
+    char byte, control[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+    int count;
+    struct msghdr message;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    const char *env;
+
+    if ((env = getenv(UPGRADE_ENV)) == NULL)
+    {
+        return 0;
+    }
+    channelFD = atoi(env);
+    unsetenv(UPGRADE_ENV);
+    fcntl(channelFD, F_SETFD, FD_CLOEXEC);
+
+    memset(&message, 0, sizeof(message));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    if (recvmsg(channelFD, &message, 0) != 1 || (cmsg = CMSG_FIRSTHDR(&message)) == NULL
+            || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+    {
+        DIAG_ERROR("no listening socket received from the old process");
+        close(channelFD);
+        channelFD = -1;
+        return -1;
+    }
+    count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    count = (count < max) ? count : max;
+    memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+    DIAG_NOTICE("%d listening sockets inherited from process %d", count, (int)getppid());
+    return count;
+}
+
+/* upgrade_ready
+
+DESCRIPTION
+Tell the old process, if there is one, that this process is accepting, so
+it can stop and drain.
+*/
+
+void upgrade_ready(void)
+{
+    if (channelFD == -1)
+    {
+        return;
+    }
+    if (write(channelFD, "R", 1) != 1)
+    {
+        DIAG_ERRNO(DIAG_LEVEL_WARN, "upgrade ready");
+    }
+    close(channelFD);
+    channelFD = -1;
+}
+
+/* upgrade_handoff
+
+DESCRIPTION
+Start the binary again with the original command line, pass it the count
+listening sockets in fds and wait for it to report ready.
+
+RETURN VALUE
+0 when the new process has taken over accepting, -1 when it could not be
+started or did not become ready; it is terminated in that case.
+*/
+
+int upgrade_handoff(const int *fds, int count)
+{
+    char byte = 'L', control[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)], env[32];
+    struct msghdr message;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    struct pollfd ready;
+    sigset_t signals;
+    char **childEnv;
+    int channel[2], envCount;
+    pid_t pid;
+
+    if (count > UPGRADE_MAX_FDS)
+    {
+        DIAG_ERROR("cannot hand over more than %d listening sockets", UPGRADE_MAX_FDS);
+        return -1;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, channel) == -1)
+    {
+        DIAG_ERRNO(DIAG_LEVEL_ERROR, "upgrade socketpair");
+        return -1;
+    }
+
+    /* everything the child needs is prepared here: other threads may hold allocator locks at fork */
+    for (envCount = 0; environ[envCount] != NULL; envCount++)
+    {
+    }
+    if ((childEnv = calloc(envCount + 2, sizeof(char*))) == NULL)
+    {
+        close(channel[0]);
+        close(channel[1]);
+        return -1;
+    }
+    memcpy(childEnv, environ, envCount * sizeof(char*));
+    snprintf(env, sizeof(env), UPGRADE_ENV "=%d", channel[1]);
+    childEnv[envCount] = env;
+    sigemptyset(&signals);
+
+    diag_flush();
+    if ((pid = fork()) == 0)
+    {
+        fcntl(channel[1], F_SETFD, 0);
+        pthread_sigmask(SIG_SETMASK, &signals, NULL);
+        execvpe(commandLine[0], commandLine, childEnv);
+        _exit(127);
+    }
+    free(childEnv);
+    close(channel[1]);
+    if (pid == -1)
+    {
+        DIAG_ERRNO(DIAG_LEVEL_ERROR, "upgrade fork");
+        close(channel[0]);
+        return -1;
+    }
+
+    memset(&message, 0, sizeof(message));
+    memset(control, 0, sizeof(control));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+    cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+
+    ready.fd = channel[0];
+    ready.events = POLLIN;
+    if (sendmsg(channel[0], &message, 0) != 1
+            || poll(&ready, 1, UPGRADE_READY_TIMEOUT) != 1
+            || read(channel[0], &byte, 1) != 1)
+    {
+        DIAG_ERROR("new process %d did not take over, still serving", (int)pid);
+        kill(pid, SIGKILL);
+        close(channel[0]);
+        return -1;
+    }
+    close(channel[0]);
+    DIAG_NOTICE("process %d took over the listening sockets", (int)pid);
+    return 0;
+}
+
+/* upgrade_drain
+
+DESCRIPTION
+Wait until no request is in flight or the stats_now() deadline passes.
+*/
+
+void upgrade_drain(uint64_t deadline)
+{
+    int inflight;
+
+    while ((inflight = admission_inflight()) > 0 && stats_now() < deadline)
+    {
+        usleep(50000);
+    }
+    if (inflight > 0)
+    {
+        DIAG_WARN("drain deadline passed with %d requests in flight", inflight);
+    }
+}
@@ -0,0 +1,34 @@
+/*
+ * upgrade.h - Process control signals and zero-downtime binary upgrade
+ *
+ * The control signals are blocked in every thread and read from a
+ * signalfd by whichever loop owns the process: the accept loop, or the
+ * master in prefork mode. SIGUSR2 upgrades: the running process execs its
+ * own command line again and passes the listening sockets to the new
+ * process over a Unix socket with SCM_RIGHTS. Once the new process reports
+ * that it is ready, the old one stops accepting, lets requests in flight
+ * finish for up to UPGRADE_DRAIN_DEADLINE and exits. The sockets never
+ * close, so clients see neither refusals nor a gap in accepting. SIGQUIT
+ * drains and exits the same way without a successor; SIGTERM and SIGINT
+ * exit at once. SIGHUP reloads the configuration.
+ */
+
+#ifndef __UPGRADE_H__
+#define __UPGRADE_H__
+
+#include <stdint.h>
+
+#define UPGRADE_ENV             "PROXY_UPGRADE_FD"  /* names the handoff socket in the new process */
+#define UPGRADE_READY_TIMEOUT   (10*1000)           /* milliseconds the new process has to get ready */
+#define UPGRADE_DRAIN_DEADLINE  (30*1000*1000)      /* microseconds in-flight requests get to finish */
+#define UPGRADE_MAX_FDS         16                  /* listening sockets passed at once */
+
+int upgrade_init(char **argv);
+int upgrade_signalFD(void);
+int upgrade_nextSignal(void);
+int upgrade_inherit(int *fds, int max);
+void upgrade_ready(void);
+int upgrade_handoff(const int *fds, int count);
+void upgrade_drain(uint64_t deadline);
+
+#endif /* __UPGRADE_H__ */